@@ -130,10 +130,16 @@ bool CAlert::RelayTo(CNode* pnode) const
     // don't relay to nodes which haven't sent their version message
     if (pnode->nVersion == 0)
         return false;
+    std::string strSubVer;
+    {
+        LOCK(pnode->cs_SubVer);
+        strSubVer = pnode->strSubVer;
+    }
+    LOCK(cs_mapAlerts);
     // returns true if wasn't already contained in the set
     if (pnode->setKnown.insert(GetHash()).second)
     {
-        if (AppliesTo(pnode->nVersion, pnode->strSubVer) ||
+        if (AppliesTo(pnode->nVersion, strSubVer) ||
             AppliesToMe() ||
             GetAdjustedTime() < nRelayUntil)
         {
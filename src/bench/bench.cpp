@@ -0,0 +1,86 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "tinyformat.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+namespace benchmark {
+
+State::State(const string& nameIn, int64_t nMaxElapsedIn) :
+    name(nameIn), nMaxElapsed(nMaxElapsedIn), nBeginTime(0), nLastTime(0),
+    nMinTime(numeric_limits<int64_t>::max()), nMaxTime(0), nCount(0), nTimeCheckCount(1), nItems(0)
+{
+}
+
+bool State::KeepRunning()
+{
+    int64_t nNow;
+    if (nCount == 0) {
+        nBeginTime = nNow = GetTimeMicros();
+    } else {
+        // Fast benchmarks only look at the clock every so often, so that
+        // reading it doesn't make up most of what is measured
+        if ((nCount + 1) % nTimeCheckCount != 0) {
+            ++nCount;
+            return true;
+        }
+        nNow = GetTimeMicros();
+        int64_t nElapsedOne = (nNow - nLastTime) / nTimeCheckCount;
+        nMinTime = min(nMinTime, nElapsedOne);
+        nMaxTime = max(nMaxTime, nElapsedOne);
+        if ((nNow - nLastTime) * 16 < nMaxElapsed)
+            nTimeCheckCount *= 2;
+    }
+    nLastTime = nNow;
+    ++nCount;
+
+    if (nNow - nBeginTime < nMaxElapsed)
+        return true;
+
+    // The last iteration was not run
+    --nCount;
+    double dAverage = (double)(nNow - nBeginTime) / max(nCount, (uint64_t)1);
+    if (nCount <= 1)
+        nMinTime = nMaxTime = nNow - nBeginTime;
+    string strItems = nItems ? strprintf(",%.0f", nItems * 1000000.0 / max(dAverage, 0.001)) : ",";
+    cout << strprintf("%s,%u,%.3f,%.3f,%.3f%s", name, nCount, 0.001 * nMinTime, 0.001 * nMaxTime, 0.001 * dAverage, strItems) << endl;
+    return false;
+}
+
+map<string, BenchFunction>& BenchRunner::Benchmarks()
+{
+    // Not a static member: benchmarks register from the constructors of
+    // globals in other translation units
+    static map<string, BenchFunction> benchmarks;
+    return benchmarks;
+}
+
+BenchRunner::BenchRunner(const string& name, BenchFunction func)
+{
+    Benchmarks().insert(make_pair(name, func));
+}
+
+void BenchRunner::RunAll(const string& strFilter, int64_t nMicros)
+{
+    cout << "#Benchmark,count,min(ms),max(ms),average(ms),items/s" << endl;
+    typedef pair<const string, BenchFunction> BenchPair;
+    BOOST_FOREACH(BenchPair& bench, Benchmarks()) {
+        if (bench.first.find(strFilter) == string::npos)
+            continue;
+        State state(bench.first, nMicros);
+        bench.second(state);
+    }
+}
+
+}
@@ -0,0 +1,74 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_BENCH_H
+#define BITCOIN_BENCH_BENCH_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+#include <boost/function.hpp>
+#include <boost/preprocessor/cat.hpp>
+#include <boost/preprocessor/stringize.hpp>
+
+/**
+ * Microbenchmarks, run by bench_lycancoin. A benchmark is a function taking
+ * a State, registered with BENCHMARK(function), that does its work in a
+ * loop while state.KeepRunning():
+ *
+ *     static void CODE_TO_TIME(benchmark::State& state)
+ *     {
+ *         ... set up, not timed ...
+ *         while (state.KeepRunning()) {
+ *             ... code to time ...
+ *         }
+ *     }
+ *     BENCHMARK(CODE_TO_TIME);
+ *
+ * Each is run for about a second and reported as the time per iteration.
+ * For throughput, SetItemsPerIteration() makes it report items per second.
+ */
+namespace benchmark {
+
+class State
+{
+private:
+    std::string name;
+    int64_t nMaxElapsed;
+    int64_t nBeginTime;
+    int64_t nLastTime;
+    int64_t nMinTime;
+    int64_t nMaxTime;
+    uint64_t nCount;
+    uint64_t nTimeCheckCount; // Iterations between looking at the clock
+    uint64_t nItems;
+
+public:
+    State(const std::string& nameIn, int64_t nMaxElapsedIn);
+
+    void SetItemsPerIteration(uint64_t nItemsIn) { nItems = nItemsIn; }
+    bool KeepRunning();
+};
+
+typedef boost::function<void(State&)> BenchFunction;
+
+class BenchRunner
+{
+private:
+    static std::map<std::string, BenchFunction>& Benchmarks();
+
+public:
+    BenchRunner(const std::string& name, BenchFunction func);
+
+    // Run every benchmark whose name contains strFilter, each for about nMicros
+    static void RunAll(const std::string& strFilter, int64_t nMicros);
+};
+
+}
+
+#define BENCHMARK(n) \
+    benchmark::BenchRunner BOOST_PP_CAT(bench_, BOOST_PP_CAT(__LINE__, n))(BOOST_PP_STRINGIZE(n), n);
+
+#endif // BITCOIN_BENCH_BENCH_H
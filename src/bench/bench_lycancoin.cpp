@@ -0,0 +1,23 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "util.h"
+
+#include <stdlib.h>
+#include <string>
+
+int main(int argc, char** argv)
+{
+    SetupEnvironment();
+    fPrintToDebugLog = false; // don't want to write to debug.log file
+
+    // bench_lycancoin [filter [seconds]]: run the benchmarks whose names
+    // contain filter, each for about that many seconds
+    std::string strFilter = argc > 1 ? argv[1] : "";
+    double dSeconds = argc > 2 ? atof(argv[2]) : 1.0;
+    benchmark::BenchRunner::RunAll(strFilter, (int64_t)(dSeconds * 1000000));
+    return 0;
+}
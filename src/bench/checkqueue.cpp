@@ -0,0 +1,62 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "checkqueue.h"
+
+#include <assert.h>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+/** Checks per run, added this many per transaction, as ConnectBlock does */
+static const unsigned int BENCH_CHECKS = 3000;
+static const unsigned int BENCH_CHECKS_PER_TX = 3;
+
+// Does nothing, so only the queue's own overhead is measured
+struct CTrivialCheck
+{
+    bool operator()() { return true; }
+    void swap(CTrivialCheck& check) {}
+};
+
+static void RunWorker(CCheckQueue<CTrivialCheck>* pqueue)
+{
+    pqueue->Thread();
+}
+
+// Runs of BENCH_CHECKS checks on the master and nThreads worker threads
+static void CheckQueueTrivial(benchmark::State& state, unsigned int nThreads)
+{
+    CCheckQueue<CTrivialCheck> queue(128);
+    boost::thread_group threads;
+    for (unsigned int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&RunWorker, &queue));
+
+    state.SetItemsPerIteration(BENCH_CHECKS);
+    while (state.KeepRunning()) {
+        CCheckQueueControl<CTrivialCheck> control(&queue);
+        for (unsigned int i = 0; i < BENCH_CHECKS; i += BENCH_CHECKS_PER_TX) {
+            std::vector<CTrivialCheck> vChecks(BENCH_CHECKS_PER_TX);
+            control.Add(vChecks);
+        }
+        bool fOk = control.Wait();
+        assert(fOk);
+    }
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+static void CheckQueueTrivial0Workers(benchmark::State& state) { CheckQueueTrivial(state, 0); }
+static void CheckQueueTrivial1Worker(benchmark::State& state) { CheckQueueTrivial(state, 1); }
+static void CheckQueueTrivial3Workers(benchmark::State& state) { CheckQueueTrivial(state, 3); }
+static void CheckQueueTrivial7Workers(benchmark::State& state) { CheckQueueTrivial(state, 7); }
+
+BENCHMARK(CheckQueueTrivial0Workers);
+BENCHMARK(CheckQueueTrivial1Worker);
+BENCHMARK(CheckQueueTrivial3Workers);
+BENCHMARK(CheckQueueTrivial7Workers);
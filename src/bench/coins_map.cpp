@@ -0,0 +1,78 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "coins.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <assert.h>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+/** The map CCoinsMap was before it was a flatmap */
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsUnorderedMap;
+
+/** Transactions the coins map benchmarks insert, find and erase per iteration */
+static const unsigned int BENCH_COINS = 10000;
+
+static std::vector<uint256> RandomTxids(unsigned int n)
+{
+    std::vector<uint256> txids(n);
+    for (unsigned int i = 0; i < n; i++)
+        txids[i] = GetRandHash();
+    return txids;
+}
+
+// Fill an empty map, look every entry up out of insertion order, then
+// erase them all while iterating, as a cache flush does
+template<typename Map>
+static void CoinsMapInsertFindErase(benchmark::State& state)
+{
+    std::vector<uint256> txids = RandomTxids(BENCH_COINS);
+    state.SetItemsPerIteration(BENCH_COINS);
+    while (state.KeepRunning()) {
+        Map map;
+        for (unsigned int i = 0; i < BENCH_COINS; i++)
+            map.insert(std::make_pair(txids[i], CCoinsCacheEntry()));
+        unsigned int nFound = 0;
+        for (unsigned int i = 0; i < BENCH_COINS; i++)
+            nFound += map.find(txids[(i * 7) % BENCH_COINS]) != map.end();
+        assert(nFound == BENCH_COINS);
+        for (typename Map::iterator it = map.begin(); it != map.end();)
+            map.erase(it++);
+    }
+}
+
+// Lookups in a map ten times the size, half of them for missing entries
+template<typename Map>
+static void CoinsMapFind(benchmark::State& state)
+{
+    std::vector<uint256> txids = RandomTxids(BENCH_COINS * 10);
+    std::vector<uint256> lookups = RandomTxids(BENCH_COINS);
+    for (unsigned int i = 0; i < BENCH_COINS; i += 2)
+        lookups[i] = txids[i * 7];
+    Map map;
+    for (unsigned int i = 0; i < txids.size(); i++)
+        map.insert(std::make_pair(txids[i], CCoinsCacheEntry()));
+    state.SetItemsPerIteration(BENCH_COINS);
+    while (state.KeepRunning()) {
+        unsigned int nFound = 0;
+        for (unsigned int i = 0; i < BENCH_COINS; i++)
+            nFound += map.find(lookups[i]) != map.end();
+        assert(nFound == BENCH_COINS / 2);
+    }
+}
+
+static void CoinsMapFlatInsertFindErase(benchmark::State& state) { CoinsMapInsertFindErase<CCoinsMap>(state); }
+static void CoinsMapUnorderedInsertFindErase(benchmark::State& state) { CoinsMapInsertFindErase<CCoinsUnorderedMap>(state); }
+static void CoinsMapFlatFind(benchmark::State& state) { CoinsMapFind<CCoinsMap>(state); }
+static void CoinsMapUnorderedFind(benchmark::State& state) { CoinsMapFind<CCoinsUnorderedMap>(state); }
+
+BENCHMARK(CoinsMapFlatInsertFindErase);
+BENCHMARK(CoinsMapUnorderedInsertFindErase);
+BENCHMARK(CoinsMapFlatFind);
+BENCHMARK(CoinsMapUnorderedFind);
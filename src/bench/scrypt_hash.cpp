@@ -0,0 +1,58 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "scrypt.h"
+
+#include <vector>
+
+// An 80-byte block header to hash, varied per input so no two are alike
+static std::vector<std::vector<char> > HeaderInputs(unsigned int n)
+{
+    std::vector<std::vector<char> > inputs(n, std::vector<char>(80, 0x5a));
+    for (unsigned int i = 0; i < n; i++)
+        inputs[i][76] = (char)i;
+    return inputs;
+}
+
+// One hash at a time, as CBlockHeader::GetPoWHash does
+static void ScryptSingle(benchmark::State& state)
+{
+    std::vector<std::vector<char> > inputs = HeaderInputs(1);
+    char output[32];
+    std::vector<char> scratchpad(SCRYPT_SCRATCHPAD_SIZE);
+    state.SetItemsPerIteration(1);
+    while (state.KeepRunning())
+        scrypt_1024_1_1_256_sp(&inputs[0][0], output, &scratchpad[0]);
+}
+
+// SCRYPT_MULTI_WAYS hashes at a time with the given kernel
+static void ScryptMulti(benchmark::State& state, const char* impl)
+{
+    std::vector<std::vector<char> > inputs = HeaderInputs(SCRYPT_MULTI_WAYS);
+    std::vector<std::vector<char> > outputs(SCRYPT_MULTI_WAYS, std::vector<char>(32));
+    const char* pinputs[SCRYPT_MULTI_WAYS];
+    char* poutputs[SCRYPT_MULTI_WAYS];
+    for (unsigned int i = 0; i < SCRYPT_MULTI_WAYS; i++) {
+        pinputs[i] = &inputs[i][0];
+        poutputs[i] = &outputs[i][0];
+    }
+    std::vector<char> scratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+    // A kernel the CPU lacks reports nothing
+    if (!scrypt_1024_1_1_256_multi_sp_impl(impl, pinputs, poutputs, SCRYPT_MULTI_WAYS, &scratchpad[0]))
+        return;
+    state.SetItemsPerIteration(SCRYPT_MULTI_WAYS);
+    while (state.KeepRunning())
+        scrypt_1024_1_1_256_multi_sp_impl(impl, pinputs, poutputs, SCRYPT_MULTI_WAYS, &scratchpad[0]);
+}
+
+static void ScryptMultiGeneric(benchmark::State& state) { ScryptMulti(state, "generic"); }
+static void ScryptMultiAVX2(benchmark::State& state) { ScryptMulti(state, "avx2"); }
+static void ScryptMultiAVX512(benchmark::State& state) { ScryptMulti(state, "avx512"); }
+
+BENCHMARK(ScryptSingle);
+BENCHMARK(ScryptMultiGeneric);
+BENCHMARK(ScryptMultiAVX2);
+BENCHMARK(ScryptMultiAVX512);
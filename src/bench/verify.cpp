@@ -0,0 +1,66 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "ecwrapper.h"
+#include "key.h"
+#include "pubkey.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <assert.h>
+#include <vector>
+
+/** Signatures the verification benchmarks go through in turn */
+static const unsigned int BENCH_SIGNATURES = 100;
+
+struct CBenchSignatures
+{
+    CPubKey pubkey;
+    std::vector<uint256> vHash;
+    std::vector<std::vector<unsigned char> > vSig;
+
+    CBenchSignatures() : vHash(BENCH_SIGNATURES), vSig(BENCH_SIGNATURES)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        pubkey = key.GetPubKey();
+        for (unsigned int i = 0; i < BENCH_SIGNATURES; i++) {
+            vHash[i] = GetRandHash();
+            bool fSigned = key.Sign(vHash[i], vSig[i]);
+            assert(fSigned);
+        }
+    }
+};
+
+// CPubKey::Verify, through libsecp256k1
+static void ECDSAVerify(benchmark::State& state)
+{
+    CBenchSignatures sigs;
+    unsigned int i = 0;
+    state.SetItemsPerIteration(1);
+    while (state.KeepRunning()) {
+        bool fValid = sigs.pubkey.Verify(sigs.vHash[i], sigs.vSig[i]);
+        assert(fValid);
+        i = (i + 1) % BENCH_SIGNATURES;
+    }
+}
+
+// The same through OpenSSL, as verification was done before
+static void ECDSAVerifyOpenSSL(benchmark::State& state)
+{
+    CBenchSignatures sigs;
+    unsigned int i = 0;
+    state.SetItemsPerIteration(1);
+    while (state.KeepRunning()) {
+        CECKey eckey;
+        bool fValid = eckey.SetPubKey(sigs.pubkey.begin(), sigs.pubkey.size()) && eckey.Verify(sigs.vHash[i], sigs.vSig[i]);
+        assert(fValid);
+        i = (i + 1) % BENCH_SIGNATURES;
+    }
+}
+
+BENCHMARK(ECDSAVerify);
+BENCHMARK(ECDSAVerifyOpenSSL);
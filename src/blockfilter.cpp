@@ -0,0 +1,222 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "crypto/common.h"
+#include "hash.h"
+#include "primitives/block.h"
+#include "script/standard.h"
+#include "undo.h"
+
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+
+namespace {
+
+/** Bits packed most significant first */
+class CBitWriter
+{
+private:
+    std::vector<unsigned char>& vch;
+    unsigned char chBuffer;
+    int nBits; // in chBuffer
+
+public:
+    CBitWriter(std::vector<unsigned char>& vchIn) : vch(vchIn), chBuffer(0), nBits(0) {}
+
+    void Write(uint64_t data, int nCount)
+    {
+        while (nCount > 0) {
+            int nChunk = std::min(8 - nBits, nCount);
+            unsigned char chBits = (data >> (nCount - nChunk)) & ((1 << nChunk) - 1);
+            chBuffer |= chBits << (8 - nBits - nChunk);
+            nBits += nChunk;
+            nCount -= nChunk;
+            if (nBits == 8) {
+                vch.push_back(chBuffer);
+                chBuffer = 0;
+                nBits = 0;
+            }
+        }
+    }
+
+    void Flush()
+    {
+        if (nBits > 0)
+            vch.push_back(chBuffer);
+        chBuffer = 0;
+        nBits = 0;
+    }
+};
+
+/** Reads what CBitWriter wrote; reading past the end gives zero bits and sets fOverrun */
+class CBitReader
+{
+private:
+    const std::vector<unsigned char>& vch;
+    size_t nPos;
+    int nBits; // left in vch[nPos]
+
+public:
+    bool fOverrun;
+
+    CBitReader(const std::vector<unsigned char>& vchIn) : vch(vchIn), nPos(0), nBits(8), fOverrun(false) {}
+
+    uint64_t Read(int nCount)
+    {
+        uint64_t data = 0;
+        while (nCount > 0) {
+            if (nPos >= vch.size()) {
+                fOverrun = true;
+                return data << nCount;
+            }
+            int nChunk = std::min(nBits, nCount);
+            unsigned char chBits = (vch[nPos] >> (nBits - nChunk)) & ((1 << nChunk) - 1);
+            data = (data << nChunk) | chBits;
+            nBits -= nChunk;
+            nCount -= nChunk;
+            if (nBits == 0) {
+                nPos++;
+                nBits = 8;
+            }
+        }
+        return data;
+    }
+};
+
+void GolombRiceEncode(CBitWriter& writer, int nP, uint64_t x)
+{
+    // Quotient in unary, as that many ones and a zero
+    uint64_t q = x >> nP;
+    while (q > 0) {
+        int nOnes = std::min(q, (uint64_t)64);
+        writer.Write(~(uint64_t)0, nOnes);
+        q -= nOnes;
+    }
+    writer.Write(0, 1);
+    writer.Write(x, nP);
+}
+
+uint64_t GolombRiceDecode(CBitReader& reader, int nP)
+{
+    uint64_t q = 0;
+    while (reader.Read(1) == 1)
+        q++;
+    uint64_t r = reader.Read(nP);
+    return (q << nP) + r;
+}
+
+/** floor(x * n / 2^64), spreading a 64-bit hash evenly over [0, n) without a division */
+uint64_t MapIntoRange(uint64_t x, uint64_t n)
+{
+    uint64_t x_hi = x >> 32, x_lo = x & 0xFFFFFFFF;
+    uint64_t n_hi = n >> 32, n_lo = n & 0xFFFFFFFF;
+    uint64_t ac = x_hi * n_hi;
+    uint64_t ad = x_hi * n_lo;
+    uint64_t bc = x_lo * n_hi;
+    uint64_t bd = x_lo * n_lo;
+    uint64_t mid = (bd >> 32) + (bc & 0xFFFFFFFF) + (ad & 0xFFFFFFFF);
+    return ac + (bc >> 32) + (ad >> 32) + (mid >> 32);
+}
+
+/** The script, and for a bare multisig the pay-to-pubkey script of each of its keys */
+void AddScriptElements(const CScript& script, CBlockFilter::ElementSet& elements)
+{
+    elements.insert(CBlockFilter::Element(script.begin(), script.end()));
+
+    // A wallet can't list the bare multisig scripts it owns, only its keys
+    txnouttype type;
+    std::vector<std::vector<unsigned char> > vSolutions;
+    if (!Solver(script, type, vSolutions) || type != TX_MULTISIG)
+        return;
+    for (unsigned int i = 1; i + 1 < vSolutions.size(); i++) {
+        CScript scriptPubKey = CScript() << vSolutions[i] << OP_CHECKSIG;
+        elements.insert(CBlockFilter::Element(scriptPubKey.begin(), scriptPubKey.end()));
+    }
+}
+
+} // anon namespace
+
+uint64_t CBlockFilter::HashToRange(const Element& element) const
+{
+    uint64_t nRange = (uint64_t)nElements * M;
+    uint64_t nHash = CSipHasher(ReadLE64(hashBlock.begin()), ReadLE64(hashBlock.begin() + 8))
+                         .Write(element.empty() ? NULL : &element[0], element.size())
+                         .Finalize();
+    return MapIntoRange(nHash, nRange);
+}
+
+CBlockFilter::CBlockFilter(const uint256& hashBlockIn, const ElementSet& elements) : hashBlock(hashBlockIn), nElements(elements.size())
+{
+    std::vector<uint64_t> vHashes;
+    vHashes.reserve(elements.size());
+    BOOST_FOREACH(const Element& element, elements)
+        vHashes.push_back(HashToRange(element));
+    std::sort(vHashes.begin(), vHashes.end());
+
+    CBitWriter writer(vData);
+    uint64_t nLast = 0;
+    BOOST_FOREACH(uint64_t nHash, vHashes) {
+        GolombRiceEncode(writer, P, nHash - nLast);
+        nLast = nHash;
+    }
+    writer.Flush();
+}
+
+CBlockFilter::CBlockFilter(const CBlock& block, const CBlockUndo& blockundo)
+{
+    ElementSet elements;
+    GetElements(block, blockundo, elements);
+    *this = CBlockFilter(block.GetHash(), elements);
+}
+
+void CBlockFilter::GetElements(const CBlock& block, const CBlockUndo& blockundo, ElementSet& elements)
+{
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        BOOST_FOREACH(const CTxOut& txout, tx.vout) {
+            const CScript& script = txout.scriptPubKey;
+            if (script.empty() || script.IsUnspendable())
+                continue;
+            AddScriptElements(script, elements);
+        }
+    }
+    BOOST_FOREACH(const CTxUndo& txundo, blockundo.vtxundo) {
+        BOOST_FOREACH(const CTxInUndo& txinundo, txundo.vprevout) {
+            const CScript& script = txinundo.txout.scriptPubKey;
+            if (script.empty())
+                continue;
+            AddScriptElements(script, elements);
+        }
+    }
+}
+
+bool CBlockFilter::MatchAny(const ElementSet& elements) const
+{
+    if (nElements == 0 || elements.empty())
+        return false;
+
+    std::vector<uint64_t> vQuery;
+    vQuery.reserve(elements.size());
+    BOOST_FOREACH(const Element& element, elements)
+        vQuery.push_back(HashToRange(element));
+    std::sort(vQuery.begin(), vQuery.end());
+
+    // Walk the filter's sorted hashes and the query's side by side
+    CBitReader reader(vData);
+    std::vector<uint64_t>::const_iterator it = vQuery.begin();
+    uint64_t nValue = 0;
+    for (uint32_t i = 0; i < nElements; i++) {
+        nValue += GolombRiceDecode(reader, P);
+        if (reader.fOverrun)
+            return true;
+        while (*it < nValue)
+            if (++it == vQuery.end())
+                return false;
+        if (*it == nValue)
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,79 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTER_H
+#define BITCOIN_BLOCKFILTER_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <set>
+#include <vector>
+
+class CBlock;
+class CBlockUndo;
+
+/**
+ * Compact summary of the scripts a block touches, for telling cheaply that
+ * a block is of no interest without reading it.
+ *
+ * The elements are the scriptPubKeys of the block's outputs and of the
+ * outputs its inputs spend, so a wallet finds both its payments and its
+ * spends by testing its own scripts. A bare multisig script also adds a
+ * pay-to-pubkey script for each of its keys, as IsMine() takes it for ours
+ * when we hold all of its keys, with or without its redeem script. Every element is hashed with SipHash,
+ * keyed by the block hash, into [0, N * M) and the sorted hashes are stored
+ * as Golomb-Rice coded differences with P bits of remainder: about P + 1.5
+ * bits per element, with a false positive rate of 1/M per queried element.
+ */
+class CBlockFilter
+{
+public:
+    typedef std::vector<unsigned char> Element;
+    typedef std::set<Element> ElementSet;
+
+    static const int P = 19;
+    static const uint32_t M = 784931;
+    //! Bumped whenever the elements change; stored filters of another
+    //! version are thrown away and built again
+    static const int VERSION = 2;
+
+    //! The block the element hashes are keyed with; not serialized, it is
+    //! what the filter is stored under.
+    uint256 hashBlock;
+
+private:
+    uint32_t nElements;
+    std::vector<unsigned char> vData;
+
+    uint64_t HashToRange(const Element& element) const;
+
+public:
+    CBlockFilter() : nElements(0) {}
+    CBlockFilter(const uint256& hashBlockIn, const ElementSet& elements);
+    /** Filter of a block, given the outputs it spends as its undo data */
+    CBlockFilter(const CBlock& block, const CBlockUndo& blockundo);
+
+    static void GetElements(const CBlock& block, const CBlockUndo& blockundo, ElementSet& elements);
+
+    /**
+     * Whether any of the elements may be in the filter. False positives are
+     * possible, false negatives are not; a truncated filter matches
+     * whatever hashes past the point where it ends.
+     */
+    bool MatchAny(const ElementSet& elements) const;
+
+    uint32_t GetSize() const { return nElements; }
+    const std::vector<unsigned char>& GetEncoded() const { return vData; }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(VARINT(nElements));
+        READWRITE(vData);
+    }
+};
+
+#endif // BITCOIN_BLOCKFILTER_H
@@ -145,6 +145,10 @@ public:
     // (memory only) Sequencial id assigned to distinguish order in which blocks are received.
     uint32_t nSequenceId;
 
+    // (memory only) Kimoto Gravity Well target for the block after this one, 0 until computed.
+    // Deterministic, so a concurrent recomputation can only store the same value.
+    mutable unsigned int nKGWNextBits;
+
     void SetNull()
     {
         phashBlock = NULL;
@@ -159,6 +163,7 @@ public:
         nChainTx = 0;
         nStatus = 0;
         nSequenceId = 0;
+        nKGWNextBits = 0;
 
         nVersion       = 0;
         hashMerkleRoot = uint256();
@@ -5,9 +5,15 @@
 #ifndef CHECKQUEUE_H
 #define CHECKQUEUE_H
 
+#include "utiltime.h"
+
 #include <algorithm>
+#include <assert.h>
+#include <deque>
+#include <stdint.h>
 #include <vector>
 
+#include <boost/atomic.hpp>
 #include <boost/foreach.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
@@ -16,6 +22,31 @@
 template <typename T>
 class CCheckQueueControl;
 
+/** Verification counters of a CCheckQueue. Worker 0 is the master thread. */
+struct CCheckQueueStats
+{
+    unsigned int nWorkers;
+    unsigned int nBatchSize;
+
+    // Totals over all runs (one run per CCheckQueueControl that added checks)
+    uint64_t nRuns;
+    uint64_t nChecks;
+    uint64_t nBatches;
+    uint64_t nStolen;
+    int64_t nWallMicros;
+    std::vector<int64_t> vIdleMicros;
+
+    // The most recent run
+    uint64_t nLastChecks;
+    uint64_t nLastBatches;
+    uint64_t nLastStolen;
+    int64_t nLastWallMicros;
+    std::vector<int64_t> vLastIdleMicros;
+
+    CCheckQueueStats() : nWorkers(0), nBatchSize(0), nRuns(0), nChecks(0), nBatches(0), nStolen(0), nWallMicros(0),
+                         nLastChecks(0), nLastBatches(0), nLastStolen(0), nLastWallMicros(0) {}
+};
+
 /** Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
@@ -24,12 +55,42 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every thread owns a deque of pending checks. The master deals added
+  * checks out over the deques in nBatchSize chunks; a thread takes work
+  * from the back of its own deque and, once that is empty, steals from the
+  * front of another's. Each deque has its own lock, and the outstanding
+  * and queued counts are atomics, so the shared mutex is only taken to go
+  * to sleep or to wake sleepers up.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    // Mutex to protect the inner state
+    struct CWorkerCounters
+    {
+        uint64_t nChecks;
+        uint64_t nBatches;
+        uint64_t nStolen;
+        int64_t nBusyMicros;
+
+        CWorkerCounters() : nChecks(0), nBatches(0), nStolen(0), nBusyMicros(0) {}
+    };
+
+    struct CWorker
+    {
+        boost::mutex mutex;
+        std::deque<T> queue;
+        CWorkerCounters counters; // guarded by mutex
+    };
+
+    // Per-thread deques; slot 0 belongs to the master.
+    std::vector<CWorker*> vWorkers;
+
+    // Number of slots handed out, including the master's.
+    boost::atomic<unsigned int> nWorkers;
+
+    // Mutex to sleep on; protects nothing but the wake-up conditions.
     boost::mutex mutex;
 
     // Worker threads block on this when out of work
@@ -38,130 +99,237 @@ private:
     // Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    // The queue of elements to be processed.
-    // As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
-
-    // The number of workers (including the master) that are idle.
-    int nIdle;
-
-    // The total number of workers (including the master).
-    int nTotal;
-
     // The temporary evaluation result.
-    bool fAllOk;
+    boost::atomic<bool> fAllOk;
 
     // Number of verifications that haven't completed yet.
-    // This includes elements that are not anymore in queue, but still in
+    // This includes elements that are not anymore in a deque, but still in
     // worker's own batches.
-    unsigned int nTodo;
+    boost::atomic<unsigned int> nTodo;
 
-    // Whether we're shutting down.
-    bool fQuit;
+    // Number of verifications still sitting in the deques. Changed under the
+    // lock of the deque concerned, so it never counts fewer than they hold.
+    boost::atomic<unsigned int> nQueued;
 
     // The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    // Slot the next added chunk goes to.
+    unsigned int nNextWorker;
+
+    // Run timing and counters, guarded by csStats.
+    boost::mutex csStats;
+    int64_t nRunStart;
+    std::vector<CWorkerCounters> vRunStart;
+    CCheckQueueStats stats;
+
+    // Move up to nBatchSize checks into vChecks, own deque first. Returns how many were stolen.
+    unsigned int Take(unsigned int nSelf, std::vector<T>& vChecks)
+    {
+        unsigned int nSlots = nWorkers;
+        for (unsigned int n = 0; n < nSlots; n++) {
+            CWorker& worker = *vWorkers[(nSelf + n) % nSlots];
+            boost::unique_lock<boost::mutex> lock(worker.mutex);
+            if (worker.queue.empty())
+                continue;
+            // Take half of what is there, so the rest stays available to
+            // other threads and batches shrink as the run nears its end.
+            unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)worker.queue.size() / 2));
+            vChecks.resize(nNow);
+            for (unsigned int i = 0; i < nNow; i++) {
+                if (n == 0) {
+                    vChecks[i].swap(worker.queue.back());
+                    worker.queue.pop_back();
+                } else {
+                    vChecks[i].swap(worker.queue.front());
+                    worker.queue.pop_front();
+                }
+            }
+            assert(nQueued >= nNow);
+            nQueued -= nNow;
+            return n == 0 ? 0 : nNow;
+        }
+        return 0;
+    }
+
     // Internal function that does bulk of the verification work.
-    bool Loop(bool fMaster = false)
+    bool Loop(unsigned int nSelf, bool fMaster = false)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
+        CWorker& self = *vWorkers[nSelf];
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
         do {
-            {
+            unsigned int nStolen = Take(nSelf, vChecks);
+            if (vChecks.empty()) {
                 boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master he or she can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
+                if (fMaster) {
+                    // Only the master adds work, so once the deques are empty
+                    // all that is left is waiting for batches in flight.
+                    while (nTodo != 0 && nQueued == 0)
+                        condMaster.wait(lock);
+                    if (nTodo == 0) {
                         bool fRet = fAllOk;
                         // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
+                        fAllOk = true;
                         return fRet;
                     }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
+                } else {
+                    while (nQueued == 0)
+                        condWorker.wait(lock);
                 }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                continue;
             }
-            // execute work
+
+            // execute work, unless an earlier check already failed
+            int64_t nStart = GetTimeMicros();
+            bool fOk = fAllOk;
             BOOST_FOREACH (T& check, vChecks)
                 if (fOk)
                     fOk = check();
+            if (!fOk)
+                fAllOk = false;
+            unsigned int nNow = vChecks.size();
             vChecks.clear();
+            {
+                boost::unique_lock<boost::mutex> lock(self.mutex);
+                self.counters.nChecks += nNow;
+                self.counters.nBatches++;
+                self.counters.nStolen += nStolen;
+                self.counters.nBusyMicros += GetTimeMicros() - nStart;
+            }
+            if (nTodo.fetch_sub(nNow) == nNow && !fMaster) {
+                // We processed the last element; inform the master he or she can exit and return the result
+                boost::unique_lock<boost::mutex> lock(mutex);
+                condMaster.notify_one();
+            }
         } while (true);
     }
 
+    void SnapshotWorkers(std::vector<CWorkerCounters>& vSnapshot)
+    {
+        unsigned int nSlots = nWorkers;
+        vSnapshot.resize(nSlots);
+        for (unsigned int i = 0; i < nSlots; i++) {
+            boost::unique_lock<boost::mutex> lock(vWorkers[i]->mutex);
+            vSnapshot[i] = vWorkers[i]->counters;
+        }
+    }
+
+    // Called when a control is set up on this queue.
+    void BeginRun()
+    {
+        boost::unique_lock<boost::mutex> lock(csStats);
+        SnapshotWorkers(vRunStart);
+        nRunStart = GetTimeMicros();
+    }
+
+    // Called by the master once a run has finished.
+    void EndRun()
+    {
+        boost::unique_lock<boost::mutex> lock(csStats);
+        int64_t nWall = GetTimeMicros() - nRunStart;
+        std::vector<CWorkerCounters> vNow;
+        SnapshotWorkers(vNow);
+        uint64_t nChecks = 0, nBatches = 0, nStolen = 0;
+        std::vector<int64_t> vIdle(vNow.size(), nWall);
+        for (unsigned int i = 0; i < vNow.size(); i++) {
+            // Threads that registered during the run have no starting snapshot
+            CWorkerCounters start = i < vRunStart.size() ? vRunStart[i] : CWorkerCounters();
+            nChecks += vNow[i].nChecks - start.nChecks;
+            nBatches += vNow[i].nBatches - start.nBatches;
+            nStolen += vNow[i].nStolen - start.nStolen;
+            vIdle[i] = std::max((int64_t)0, nWall - (vNow[i].nBusyMicros - start.nBusyMicros));
+        }
+        if (nChecks == 0)
+            return;
+        stats.nRuns++;
+        stats.nChecks += nChecks;
+        stats.nBatches += nBatches;
+        stats.nStolen += nStolen;
+        stats.nWallMicros += nWall;
+        stats.vIdleMicros.resize(vIdle.size(), 0);
+        for (unsigned int i = 0; i < vIdle.size(); i++)
+            stats.vIdleMicros[i] += vIdle[i];
+        stats.nLastChecks = nChecks;
+        stats.nLastBatches = nBatches;
+        stats.nLastStolen = nStolen;
+        stats.nLastWallMicros = nWall;
+        stats.vLastIdleMicros.swap(vIdle);
+    }
+
+    friend class CCheckQueueControl<T>;
+
 public:
-    // Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    // Create a new check queue, with room for up to nMaxWorkers threads including the master.
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nMaxWorkers = 64) : nWorkers(1), fAllOk(true), nTodo(0), nQueued(0), nBatchSize(nBatchSizeIn), nNextWorker(0), nRunStart(0)
+    {
+        for (unsigned int i = 0; i < nMaxWorkers; i++)
+            vWorkers.push_back(new CWorker());
+    }
 
     // Worker thread
     void Thread()
     {
-        Loop();
+        unsigned int nSelf = nWorkers.fetch_add(1);
+        assert(nSelf < vWorkers.size());
+        Loop(nSelf);
     }
 
     // Wait until execution finishes, and return whether all evaluations where succesful.
     bool Wait()
     {
-        return Loop(true);
+        bool fRet = Loop(0, true);
+        EndRun();
+        return fRet;
     }
 
     // Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
+        unsigned int nSlots = nWorkers;
+        unsigned int nChunks = 0;
         nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        for (unsigned int nPos = 0; nPos < vChecks.size(); nPos += nBatchSize, nChunks++) {
+            unsigned int nEnd = std::min((unsigned int)vChecks.size(), nPos + nBatchSize);
+            CWorker& worker = *vWorkers[nNextWorker++ % nSlots];
+            {
+                boost::unique_lock<boost::mutex> lock(worker.mutex);
+                for (unsigned int i = nPos; i < nEnd; i++) {
+                    worker.queue.push_back(T());
+                    vChecks[i].swap(worker.queue.back());
+                }
+                nQueued += nEnd - nPos;
+            }
+        }
+        // Wake a thread per chunk; they steal from each other from there on.
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nChunks >= nSlots - 1)
             condWorker.notify_all();
+        else
+            for (unsigned int i = 0; i < nChunks; i++)
+                condWorker.notify_one();
     }
 
     ~CCheckQueue()
     {
+        BOOST_FOREACH (CWorker* pworker, vWorkers)
+            delete pworker;
     }
 
     bool IsIdle()
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return nTodo == 0 && nQueued == 0 && fAllOk;
+    }
+
+    void GetStats(CCheckQueueStats& statsOut)
+    {
+        boost::unique_lock<boost::mutex> lock(csStats);
+        statsOut = stats;
+        statsOut.nWorkers = nWorkers;
+        statsOut.nBatchSize = nBatchSize;
+        statsOut.vIdleMicros.resize(statsOut.nWorkers, 0);
     }
 };
 
@@ -182,6 +350,7 @@ public:
         if (pqueue != NULL) {
             bool isIdle = pqueue->IsIdle();
             assert(isIdle);
+            pqueue->BeginRun();
         }
     }
 
@@ -207,4 +376,4 @@ public:
     }
 };
 
-#endif // CHECKQUEUE_H
\ No newline at end of file
+#endif // CHECKQUEUE_H
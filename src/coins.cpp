@@ -4,6 +4,8 @@
 
 #include "coins.h"
 
+#include "clientversion.h"
+#include "hash.h"
 #include "random.h"
 
 #include <assert.h>
@@ -38,10 +40,118 @@ bool CCoins::Spend(uint32_t nPos)
     return true;
 }
 
+namespace {
+
+uint256 SetElementHash(const uint256 &txid, const CCoins &coins, uint32_t n)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txid << n << coins.nHeight << coins.fCoinBase << coins.vout[n];
+    return ss.GetHash();
+}
+
+} // anon namespace
+
+void CCoinsSetInfo::Fold() const
+{
+    for (std::vector<uint256>::const_iterator it = vAdded.begin(); it != vAdded.end(); it++)
+        muhash.Insert(*it);
+    for (std::vector<uint256>::const_iterator it = vRemoved.begin(); it != vRemoved.end(); it++)
+        muhash.Remove(*it);
+    std::vector<uint256>().swap(vAdded);
+    std::vector<uint256>().swap(vRemoved);
+}
+
+void CCoinsSetInfo::SetNull()
+{
+    nTransactions = 0;
+    nTransactionOutputs = 0;
+    nSerializedSize = 0;
+    nTotalAmount = 0;
+    muhash = CMuHash3072();
+    std::vector<uint256>().swap(vAdded);
+    std::vector<uint256>().swap(vRemoved);
+}
+
+bool CCoinsSetInfo::IsNull() const
+{
+    if (nTransactions != 0 || nTransactionOutputs != 0 || nSerializedSize != 0 || nTotalAmount != 0)
+        return false;
+    Fold();
+    return muhash.IsEmpty();
+}
+
+void CCoinsSetInfo::AddOutput(const uint256 &txid, const CCoins &coins, uint32_t n)
+{
+    nTransactionOutputs++;
+    nTotalAmount += coins.vout[n].nValue;
+    vAdded.push_back(SetElementHash(txid, coins, n));
+    if (vAdded.size() >= MAX_PENDING)
+        Fold();
+}
+
+void CCoinsSetInfo::RemoveOutput(const uint256 &txid, const CCoins &coins, uint32_t n)
+{
+    nTransactionOutputs--;
+    nTotalAmount -= coins.vout[n].nValue;
+    vRemoved.push_back(SetElementHash(txid, coins, n));
+    if (vRemoved.size() >= MAX_PENDING)
+        Fold();
+}
+
+void CCoinsSetInfo::AddTransaction(const CCoins &coins)
+{
+    if (coins.IsPruned())
+        return;
+    nTransactions++;
+    nSerializedSize += 32 + ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
+}
+
+void CCoinsSetInfo::RemoveTransaction(const CCoins &coins)
+{
+    if (coins.IsPruned())
+        return;
+    nTransactions--;
+    nSerializedSize -= 32 + ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
+}
+
+void CCoinsSetInfo::AddCoins(const uint256 &txid, const CCoins &coins)
+{
+    AddTransaction(coins);
+    for (unsigned int i = 0; i < coins.vout.size(); i++)
+        if (!coins.vout[i].IsNull())
+            AddOutput(txid, coins, i);
+}
+
+void CCoinsSetInfo::RemoveCoins(const uint256 &txid, const CCoins &coins)
+{
+    RemoveTransaction(coins);
+    for (unsigned int i = 0; i < coins.vout.size(); i++)
+        if (!coins.vout[i].IsNull())
+            RemoveOutput(txid, coins, i);
+}
+
+void CCoinsSetInfo::Add(const CCoinsSetInfo &delta)
+{
+    nTransactions += delta.nTransactions;
+    nTransactionOutputs += delta.nTransactionOutputs;
+    nSerializedSize += delta.nSerializedSize;
+    nTotalAmount += delta.nTotalAmount;
+    Fold();
+    delta.Fold();
+    muhash *= delta.muhash;
+}
+
+uint256 CCoinsSetInfo::GetHash() const
+{
+    Fold();
+    return muhash.GetHash();
+}
+
 bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) const { return false; }
 bool CCoinsView::HaveCoins(const uint256 &txid) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(); }
-bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return false; }
+bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsSetInfo &delta) { return false; }
+bool CCoinsView::GetSetInfo(CCoinsSetInfo &info) const { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) const { return false; }
 
 
@@ -50,32 +160,42 @@ bool CCoinsViewBacked::GetCoins(const uint256 &txid, CCoins &coins) const { retu
 bool CCoinsViewBacked::HaveCoins(const uint256 &txid) const { return base->HaveCoins(txid); }
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
+const CCoinsView* CCoinsViewBacked::GetBackend() const { return base; }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsSetInfo &delta) { return base->BatchWrite(mapCoins, hashBlock, delta); }
+bool CCoinsViewBacked::GetSetInfo(CCoinsSetInfo &info) const { return base->GetSetInfo(info); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) const { return base->GetStats(stats); }
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0) { }
 
 CCoinsViewCache::~CCoinsViewCache()
 {
     assert(!hasModifier);
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() const {
+    return cacheCoins.DynamicMemoryUsage() + cachedCoinsUsage;
+}
+
 CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const {
     CCoinsMap::iterator it = cacheCoins.find(txid);
-    if (it != cacheCoins.end())
+    if (it != cacheCoins.end()) {
+        it->second.flags |= CCoinsCacheEntry::RECENT;
         return it;
+    }
     CCoins tmp;
     if (!base->GetCoins(txid, tmp))
         return cacheCoins.end();
     CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
     tmp.swap(ret->second.coins);
+    ret->second.flags = CCoinsCacheEntry::RECENT;
     if (ret->second.coins.IsPruned()) {
         // The parent only has an empty entry for this txid; we can consider our
         // version as fresh.
-        ret->second.flags = CCoinsCacheEntry::FRESH;
+        ret->second.flags |= CCoinsCacheEntry::FRESH;
     }
+    cachedCoinsUsage += ret->second.coins.DynamicMemoryUsage();
     return ret;
 }
 
@@ -91,6 +211,7 @@ bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) const {
 CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
     assert(!hasModifier);
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    size_t cachedCoinUsage = 0;
     if (ret.second) {
         if (!base->GetCoins(txid, ret.first->second.coins)) {
             // The parent view does not have this entry; mark it as fresh.
@@ -100,10 +221,12 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
             // The parent view only has a pruned entry for this; mark it as fresh.
             ret.first->second.flags = CCoinsCacheEntry::FRESH;
         }
+    } else {
+        cachedCoinUsage = ret.first->second.coins.DynamicMemoryUsage();
     }
     // Assume that whenever ModifyCoins is called, the entry will be modified.
-    ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
-    return CCoinsModifier(*this, ret.first);
+    ret.first->second.flags |= CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::RECENT;
+    return CCoinsModifier(*this, ret.first, cachedCoinUsage);
 }
 
 const CCoins* CCoinsViewCache::AccessCoins(const uint256 &txid) const {
@@ -115,6 +238,26 @@ const CCoins* CCoinsViewCache::AccessCoins(const uint256 &txid) const {
     }
 }
 
+bool CCoinsViewCache::HaveCoinsInCache(const uint256 &txid) const {
+    return cacheCoins.count(txid) != 0;
+}
+
+void CCoinsViewCache::AddPrefetched(const uint256 &txid, CCoins &coins, bool fFound) {
+    assert(!hasModifier);
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    if (!ret.second)
+        return;
+    CCoinsCacheEntry& entry = ret.first->second;
+    if (fFound)
+        coins.swap(entry.coins);
+    entry.flags = CCoinsCacheEntry::RECENT;
+    if (entry.coins.IsPruned()) {
+        // Same as FetchCoins: the parent has no (unspent) entry for this txid.
+        entry.flags |= CCoinsCacheEntry::FRESH;
+    }
+    cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
+}
+
 bool CCoinsViewCache::HaveCoins(const uint256 &txid) const {
     CCoinsMap::const_iterator it = FetchCoins(txid);
     // We're using vtx.empty() instead of IsPruned here for performance reasons,
@@ -134,7 +277,7 @@ void CCoinsViewCache::SetBestBlock(const uint256 &hashBlockIn) {
     hashBlock = hashBlockIn;
 }
 
-bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn) {
+bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn, const CCoinsSetInfo &delta) {
 	 assert(!hasModifier);
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) { // Ignore non-dirty entries (optimization).
@@ -148,18 +291,22 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     assert(it->second.flags & CCoinsCacheEntry::FRESH);
                     CCoinsCacheEntry& entry = cacheCoins[it->first];
                     entry.coins.swap(it->second.coins);
-                    entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+                    cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
+                    entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH | CCoinsCacheEntry::RECENT;
                 }
             } else {
                 if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
                     // The grandparent does not have an entry, and the child is
                     // modified and being pruned. This means we can just delete
                     // it from the parent.
+                    cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
                     cacheCoins.erase(itUs);
                 } else {
                     // A normal modification.
+                    cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
                     itUs->second.coins.swap(it->second.coins);
-                    itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                    cachedCoinsUsage += itUs->second.coins.DynamicMemoryUsage();
+                    itUs->second.flags |= CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::RECENT;
                 }
             }
         }
@@ -167,12 +314,79 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
         mapCoins.erase(itOld);
     }
     hashBlock = hashBlockIn;
+    setInfoDelta.Add(delta);
+    return true;
+}
+
+bool CCoinsViewCache::GetSetInfo(CCoinsSetInfo &info) const {
+    if (!base->GetSetInfo(info))
+        return false;
+    info.Add(setInfoDelta);
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
-    bool fOk = base->BatchWrite(cacheCoins, hashBlock);
+    bool fOk = base->BatchWrite(cacheCoins, hashBlock, setInfoDelta);
     cacheCoins.clear();
+    cachedCoinsUsage = 0;
+    setInfoDelta.SetNull();
+    return fOk;
+}
+
+bool CCoinsViewCache::PartialFlush(size_t nTargetUsage) {
+    assert(!hasModifier);
+    // One walk over the cache: dirty entries go into the batch for the base
+    // (the base consumes its map, so copied if they stay cached, moved if not)
+    // and pruned entries, and while over the target entries unused since the
+    // previous partial flush, are erased in place.
+    CCoinsMap mapBatch;
+    bool fEvicted = false;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        CCoinsMap::iterator itOld = it++;
+        CCoinsCacheEntry& entry = itOld->second;
+        bool fDirty = (entry.flags & CCoinsCacheEntry::DIRTY) != 0;
+        bool fKeep = !entry.coins.IsPruned();
+        if (fKeep && !(entry.flags & CCoinsCacheEntry::RECENT) &&
+            cachedCoinsUsage + cacheCoins.size() * CCoinsMap::EntryUsage() > nTargetUsage) {
+            fKeep = false;
+            fEvicted = true;
+        }
+        if (fKeep) {
+            if (fDirty)
+                mapBatch.insert(*itOld);
+            entry.flags = 0;
+            continue;
+        }
+        cachedCoinsUsage -= entry.coins.DynamicMemoryUsage();
+        if (fDirty) {
+            CCoinsCacheEntry& entryBatch = mapBatch[itOld->first];
+            entryBatch.coins.swap(entry.coins);
+            entryBatch.flags = entry.flags;
+        }
+        cacheCoins.erase(itOld);
+    }
+    bool fOk = base->BatchWrite(mapBatch, hashBlock, setInfoDelta);
+    setInfoDelta.SetNull();
+
+    // Recently used entries alone are over the target: evict any.
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        if (cachedCoinsUsage + cacheCoins.size() * CCoinsMap::EntryUsage() <= nTargetUsage)
+            break;
+        CCoinsMap::iterator itOld = it++;
+        cachedCoinsUsage -= itOld->second.coins.DynamicMemoryUsage();
+        cacheCoins.erase(itOld);
+        fEvicted = true;
+    }
+
+    // The table keeps the memory of erased entries for new ones. After an
+    // eviction that is more than the cache may hold, so move the survivors
+    // into a right-sized table to release it.
+    if (fEvicted) {
+        CCoinsMap mapKeep;
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++)
+            mapKeep[it->first].coins.swap(it->second.coins);
+        cacheCoins.swap(mapKeep);
+    }
     return fOk;
 }
 
@@ -230,7 +444,7 @@ double CCoinsViewCache::GetPriority(const CTransaction &tx, int nHeight) const
     return tx.ComputePriority(dResult);
 }
 
-CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_) : cache(cache_), it(it_) {
+CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage) : cache(cache_), it(it_), cachedCoinUsage(usage) {
     assert(!cache.hasModifier);
     cache.hasModifier = true;
 }
@@ -240,7 +454,11 @@ CCoinsModifier::~CCoinsModifier()
     assert(cache.hasModifier);
     cache.hasModifier = false;
     it->second.coins.Cleanup();
+    cache.cachedCoinsUsage -= cachedCoinUsage; // Subtract the old usage
     if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
         cache.cacheCoins.erase(it);
+    } else {
+        // If the coin still exists after the modification, add the new usage
+        cache.cachedCoinsUsage += it->second.coins.DynamicMemoryUsage();
     }
 }
\ No newline at end of file
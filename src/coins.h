@@ -6,6 +6,9 @@
 #define BITCOIN_COINS_H
 
 #include "compressor.h"
+#include "flatmap.h"
+#include "memusage.h"
+#include "muhash.h"
 #include "serialize.h"
 #include "uint256.h"
 
@@ -13,7 +16,6 @@
 #include <stdint.h>
 
 #include <boost/foreach.hpp>
-#include <boost/unordered_map.hpp>
 
 /** pruned version of CTransaction: only retains metadata and unspent transaction outputs
  *
@@ -250,6 +252,15 @@ public:
                 return false;
         return true;
     }
+
+    size_t DynamicMemoryUsage() const {
+        size_t ret = memusage::DynamicUsage(vout);
+        BOOST_FOREACH(const CTxOut &out, vout) {
+            const std::vector<unsigned char> *script = &out.scriptPubKey;
+            ret += memusage::DynamicUsage(*script);
+        }
+        return ret;
+    }
 };
 
 class CCoinsKeyHasher
@@ -259,9 +270,7 @@ private:
 
 public:
     CCoinsKeyHasher();
-    // This *must* return size_t. With Boost 1.46 on 32-bit systems the
-    // unordered_map will behave unpredictably if the custom hasher returns a
-    // uint64_t, resulting in failures when syncing the chain (#4634).
+    // This *must* return size_t: flatmap stores and masks it as one.
     size_t operator()(const uint256& key) const {
         return key.GetHash(salt);
     }
@@ -275,24 +284,86 @@ struct CCoinsCacheEntry
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
         FRESH = (1 << 1), // The parent view does not have this entry (or it is pruned).
+        RECENT = (1 << 2), // Used since the last PartialFlush(); such entries are evicted last.
     };
 
     CCoinsCacheEntry() : coins(), flags(0) {}
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+typedef flatmap<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+
+/**
+ * Running totals and an order-independent hash (see CMuHash3072) of a set of
+ * unspent outputs. Used both for a whole UTXO set and for the net changes a
+ * coins cache has not yet pushed to its base, so two of them can be added up.
+ * Counts and sizes are signed for the latter use.
+ *
+ * Each output is hashed together with its txid, index, height and coinbase
+ * flag. The transaction version is left out, as CCoins does not serialize
+ * negative ones faithfully. The element hashes are only multiplied into the
+ * set hash when it is needed, or when there are many of them, so a scratch
+ * cache that is thrown away (as when assembling a block) costs little.
+ */
+class CCoinsSetInfo
+{
+private:
+    mutable CMuHash3072 muhash;
+    mutable std::vector<uint256> vAdded;
+    mutable std::vector<uint256> vRemoved;
+
+    static const size_t MAX_PENDING = 65536;
+
+    // Multiply the pending element hashes into muhash
+    void Fold() const;
+
+public:
+    int64_t nTransactions;       // unpruned CCoins records
+    int64_t nTransactionOutputs; // unspent outputs
+    int64_t nSerializedSize;     // 32 bytes of txid plus the serialized CCoins, per record
+    CAmount nTotalAmount;
+
+    CCoinsSetInfo() { SetNull(); }
+
+    void SetNull();
+    bool IsNull() const;
+
+    // Output n of coins is added to/removed from the set
+    void AddOutput(const uint256 &txid, const CCoins &coins, uint32_t n);
+    void RemoveOutput(const uint256 &txid, const CCoins &coins, uint32_t n);
+    // coins becomes/stops being a record of the set; a pruned coins is no record
+    void AddTransaction(const CCoins &coins);
+    void RemoveTransaction(const CCoins &coins);
+    // Both of the above, for the record and all its unspent outputs
+    void AddCoins(const uint256 &txid, const CCoins &coins);
+    void RemoveCoins(const uint256 &txid, const CCoins &coins);
+
+    // Add the changes recorded in delta
+    void Add(const CCoinsSetInfo &delta);
+
+    // Digest of the set hash
+    uint256 GetHash() const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nTransactions);
+        READWRITE(nTransactionOutputs);
+        READWRITE(nSerializedSize);
+        READWRITE(nTotalAmount);
+        Fold();
+        READWRITE(muhash);
+    }
+};
 
 struct CCoinsStats
 {
     int nHeight;
     uint256 hashBlock;
-    uint64_t nTransactions;
-    uint64_t nTransactionOutputs;
-    uint64_t nSerializedSize;
+    CCoinsSetInfo info;
     uint256 hashSerialized;
-    CAmount nTotalAmount;
 
-    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
+    CCoinsStats() : nHeight(0) {}
 };
 
 
@@ -311,10 +382,16 @@ public:
     virtual uint256 GetBestBlock() const;
 
     // Do a bulk modification (multiple CCoins changes + BestBlock change).
-    // The passed mapCoins can be modified.
-    virtual bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    // The passed mapCoins can be modified. delta holds what the changes do to
+    // the set totals (see GetSetInfo).
+    virtual bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsSetInfo &delta);
+
+    // Retrieve the running totals of the unspent transaction output set. This
+    // is cheap, but only available once they are being tracked.
+    virtual bool GetSetInfo(CCoinsSetInfo &info) const;
 
-    // Calculate statistics about the unspent transaction output set
+    // Calculate statistics about the unspent transaction output set, by
+    // scanning the whole of it
     virtual bool GetStats(CCoinsStats &stats) const;
 
     // As we use CCoinsViews polymorphically, have a virtual destructor
@@ -334,7 +411,9 @@ public:
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    const CCoinsView* GetBackend() const;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsSetInfo &delta);
+    bool GetSetInfo(CCoinsSetInfo &info) const;
     bool GetStats(CCoinsStats &stats) const;
 };
 
@@ -348,7 +427,8 @@ class CCoinsModifier
 private:
     CCoinsViewCache& cache;
     CCoinsMap::iterator it;
-    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_);
+    size_t cachedCoinUsage; // Cached memory usage of the CCoins object before modification
+    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage);
 
 public:
     CCoins* operator->() { return &it->second.coins; }
@@ -369,6 +449,12 @@ protected:
     mutable uint256 hashBlock;
     mutable CCoinsMap cacheCoins;
 
+    /* Cached dynamic memory usage for the inner CCoins objects. */
+    mutable size_t cachedCoinsUsage;
+
+    /* Changes to the set totals not yet pushed to the base. */
+    CCoinsSetInfo setInfoDelta;
+
 public:
     CCoinsViewCache(CCoinsView *baseIn);
     ~CCoinsViewCache();
@@ -378,8 +464,9 @@ public:
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
     void SetBestBlock(const uint256 &hashBlock);
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
-    
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsSetInfo &delta);
+    bool GetSetInfo(CCoinsSetInfo &info) const;
+
     // Return a pointer to CCoins in the cache, or NULL if not found. This is
     // more efficient than GetCoins. Modifications to other cache entries are
     // allowed while accessing the returned pointer.
@@ -390,14 +477,35 @@ public:
     // allowed.
     CCoinsModifier ModifyCoins(const uint256 &txid);
 
+    // Return whether an entry for txid is cached, without consulting the base view.
+    bool HaveCoinsInCache(const uint256 &txid) const;
+
+    // Cache what the base view's GetCoins returned for txid (fFound, coins), as read
+    // ahead of time by another thread. Entries that are already cached are left alone;
+    // a txid the base view doesn't have is cached as a fresh, pruned entry.
+    void AddPrefetched(const uint256 &txid, CCoins &coins, bool fFound);
+
+    // Whoever modifies coins through this cache in a way that should show in the
+    // set totals (connecting and disconnecting blocks) records the changes here.
+    CCoinsSetInfo& GetSetInfoDelta() { return setInfoDelta; }
+
     // Push the modifications applied to this cache to its base.
     // Failure to call this method before destruction will cause the changes to be forgotten.
     // If false is returned, the state of this cache (and its backing view) will be undefined.
     bool Flush();
 
+    // Push the modifications applied to this cache to its base, like Flush(), but
+    // keep the entries cached (no longer dirty). Afterwards entries not used since
+    // the previous partial flush are evicted while the cache is above nTargetUsage
+    // bytes, then any others until it is below.
+    bool PartialFlush(size_t nTargetUsage);
+
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
+    // Calculate the size of the cache (in bytes)
+    size_t DynamicMemoryUsage() const;
+
     /** Amount of bitcoins coming in to a transaction
         Note that lightweight clients may not know anything besides the hash of previous transactions,
         so may not be able to calculate this.
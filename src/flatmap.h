@@ -0,0 +1,296 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_FLATMAP_H
+#define BITCOIN_FLATMAP_H
+
+#include "memusage.h"
+
+#include <assert.h>
+#include <new>
+#include <stdint.h>
+#include <stdlib.h>
+#include <utility>
+#include <vector>
+
+#include <boost/type_traits/aligned_storage.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+
+/**
+ * STL-like hash map with open addressing and pooled entries.
+ *
+ * Buckets are a flat, power-of-two sized array of (hash, entry pointer) pairs
+ * probed linearly; the entries themselves are constructed in fixed-size
+ * chunks with a free list, so there is no allocation per insert. Like
+ * boost::unordered_map, pointers and references to entries stay valid until
+ * the entry is erased, and erasing does not invalidate other iterators, so
+ * erase(it++) loops work. Inserting may rehash, which invalidates iterators
+ * except for dereferencing them and passing them to erase().
+ */
+template <typename K, typename V, typename H>
+class flatmap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const key_type, mapped_type> value_type;
+    typedef size_t size_type;
+
+private:
+    struct bucket
+    {
+        size_t nHash;
+        value_type* pentry; // NULL if empty, Deleted() if erased
+    };
+
+    union chunk_node
+    {
+        typename boost::aligned_storage<sizeof(value_type), boost::alignment_of<value_type>::value>::type data;
+        chunk_node* pnext;
+    };
+
+    static const size_type CHUNK_ENTRIES = 1024;
+    static const size_type MIN_BUCKETS = 16;
+
+    std::vector<bucket> vBuckets;
+    size_type nSize;
+    size_type nUsed; // live entries plus erased markers
+    std::vector<chunk_node*> vChunks;
+    chunk_node* pfree;
+    H hasher;
+
+    static value_type* Deleted() { static chunk_node node; return reinterpret_cast<value_type*>(&node); }
+    static bool IsLive(const bucket& b) { return b.pentry != NULL && b.pentry != Deleted(); }
+
+    value_type* Allocate(const value_type& x)
+    {
+        if (pfree == NULL) {
+            chunk_node* pchunk = static_cast<chunk_node*>(malloc(sizeof(chunk_node) * CHUNK_ENTRIES));
+            if (pchunk == NULL)
+                throw std::bad_alloc();
+            vChunks.push_back(pchunk);
+            for (size_type i = 0; i < CHUNK_ENTRIES; i++) {
+                pchunk[i].pnext = pfree;
+                pfree = &pchunk[i];
+            }
+        }
+        chunk_node* pnode = pfree;
+        value_type* pentry = reinterpret_cast<value_type*>(&pnode->data);
+        chunk_node* pnext = pnode->pnext;
+        new (pentry) value_type(x);
+        pfree = pnext;
+        return pentry;
+    }
+
+    void Release(value_type* pentry)
+    {
+        pentry->~value_type();
+        chunk_node* pnode = reinterpret_cast<chunk_node*>(pentry);
+        pnode->pnext = pfree;
+        pfree = pnode;
+    }
+
+    /** Bucket holding key, or the bucket it would be inserted at (an erased one if any was passed) */
+    size_type Probe(const key_type& k, size_t nHash) const
+    {
+        size_type nMask = vBuckets.size() - 1;
+        size_type nFirstDeleted = vBuckets.size();
+        for (size_type i = nHash & nMask; ; i = (i + 1) & nMask) {
+            const bucket& b = vBuckets[i];
+            if (b.pentry == NULL)
+                return nFirstDeleted < vBuckets.size() ? nFirstDeleted : i;
+            if (b.pentry == Deleted()) {
+                if (nFirstDeleted == vBuckets.size())
+                    nFirstDeleted = i;
+            } else if (b.nHash == nHash && b.pentry->first == k) {
+                return i;
+            }
+        }
+    }
+
+    void Rehash(size_type nBuckets)
+    {
+        std::vector<bucket> vOld;
+        vOld.swap(vBuckets);
+        bucket empty = {0, NULL};
+        vBuckets.assign(nBuckets, empty);
+        for (size_type i = 0; i < vOld.size(); i++) {
+            if (!IsLive(vOld[i]))
+                continue;
+            size_type j = vOld[i].nHash & (nBuckets - 1);
+            while (vBuckets[j].pentry != NULL)
+                j = (j + 1) & (nBuckets - 1);
+            vBuckets[j] = vOld[i];
+        }
+        nUsed = nSize;
+    }
+
+    /** Keep the table at most 3/4 full, counting erased markers */
+    void Reserve(size_type nNew)
+    {
+        if ((nUsed + nNew) * 4 < vBuckets.size() * 3)
+            return;
+        size_type nBuckets = MIN_BUCKETS;
+        while ((nSize + nNew) * 2 >= nBuckets)
+            nBuckets *= 2;
+        Rehash(nBuckets);
+    }
+
+public:
+    template <typename P, typename R>
+    class iterator_base
+    {
+    private:
+        P pmap;
+        size_type nBucket;
+        R* pentry;
+        friend class flatmap;
+
+        iterator_base(P pmapIn, size_type nBucketIn) : pmap(pmapIn), nBucket(nBucketIn), pentry(NULL)
+        {
+            Settle();
+        }
+        void Settle()
+        {
+            while (nBucket < pmap->vBuckets.size() && !IsLive(pmap->vBuckets[nBucket]))
+                nBucket++;
+            pentry = nBucket < pmap->vBuckets.size() ? pmap->vBuckets[nBucket].pentry : NULL;
+        }
+
+    public:
+        iterator_base() : pmap(NULL), nBucket(0), pentry(NULL) {}
+        template <typename P2, typename R2>
+        iterator_base(const iterator_base<P2, R2>& it) : pmap(it.pmap), nBucket(it.nBucket), pentry(it.pentry) {}
+
+        R& operator*() const { return *pentry; }
+        R* operator->() const { return pentry; }
+        iterator_base& operator++() { nBucket++; Settle(); return *this; }
+        iterator_base operator++(int) { iterator_base ret = *this; ++*this; return ret; }
+        template <typename P2, typename R2>
+        bool operator==(const iterator_base<P2, R2>& it) const { return pentry == it.pentry; }
+        template <typename P2, typename R2>
+        bool operator!=(const iterator_base<P2, R2>& it) const { return pentry != it.pentry; }
+
+        template <typename P2, typename R2> friend class iterator_base;
+    };
+
+    typedef iterator_base<flatmap*, value_type> iterator;
+    typedef iterator_base<const flatmap*, const value_type> const_iterator;
+
+    flatmap() : nSize(0), nUsed(0), pfree(NULL) {}
+    ~flatmap() { clear(); }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { iterator it; it.pmap = this; it.nBucket = vBuckets.size(); return it; }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { const_iterator it; it.pmap = this; it.nBucket = vBuckets.size(); return it; }
+    size_type size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator find(const key_type& k)
+    {
+        if (nSize == 0)
+            return end();
+        size_type i = Probe(k, hasher(k));
+        if (!IsLive(vBuckets[i]))
+            return end();
+        iterator it;
+        it.pmap = this;
+        it.nBucket = i;
+        it.pentry = vBuckets[i].pentry;
+        return it;
+    }
+    const_iterator find(const key_type& k) const { return const_cast<flatmap*>(this)->find(k); }
+    size_type count(const key_type& k) const { return find(k) != end(); }
+
+    std::pair<iterator, bool> insert(const value_type& x)
+    {
+        Reserve(1);
+        size_t nHash = hasher(x.first);
+        size_type i = Probe(x.first, nHash);
+        iterator it;
+        it.pmap = this;
+        it.nBucket = i;
+        if (IsLive(vBuckets[i])) {
+            it.pentry = vBuckets[i].pentry;
+            return std::make_pair(it, false);
+        }
+        it.pentry = Allocate(x);
+        if (vBuckets[i].pentry == NULL)
+            nUsed++;
+        vBuckets[i].nHash = nHash;
+        vBuckets[i].pentry = it.pentry;
+        nSize++;
+        return std::make_pair(it, true);
+    }
+
+    mapped_type& operator[](const key_type& k)
+    {
+        return insert(value_type(k, mapped_type())).first->second;
+    }
+
+    void erase(iterator it)
+    {
+        size_type i = it.nBucket;
+        if (i >= vBuckets.size() || vBuckets[i].pentry != it.pentry) {
+            // The table was rehashed since the iterator was obtained
+            i = Probe(it.pentry->first, hasher(it.pentry->first));
+            assert(vBuckets[i].pentry == it.pentry);
+        }
+        vBuckets[i].pentry = Deleted();
+        Release(it.pentry);
+        nSize--;
+    }
+
+    size_type erase(const key_type& k)
+    {
+        iterator it = find(k);
+        if (it == end())
+            return 0;
+        erase(it);
+        return 1;
+    }
+
+    /** Destroy all entries and give the bucket array and entry chunks back to the system */
+    void clear()
+    {
+        for (size_type i = 0; i < vBuckets.size(); i++) {
+            if (IsLive(vBuckets[i]))
+                vBuckets[i].pentry->~value_type();
+        }
+        std::vector<bucket>().swap(vBuckets);
+        for (size_type i = 0; i < vChunks.size(); i++)
+            free(vChunks[i]);
+        std::vector<chunk_node*>().swap(vChunks);
+        pfree = NULL;
+        nSize = 0;
+        nUsed = 0;
+    }
+
+    void swap(flatmap& other)
+    {
+        vBuckets.swap(other.vBuckets);
+        std::swap(nSize, other.nSize);
+        std::swap(nUsed, other.nUsed);
+        vChunks.swap(other.vChunks);
+        std::swap(pfree, other.pfree);
+        std::swap(hasher, other.hasher);
+    }
+
+    /** Approximate table memory per entry once a table is rebuilt, for sizing decisions */
+    static size_t EntryUsage() { return sizeof(chunk_node) + 2 * sizeof(bucket); }
+
+    /** Memory held by the table itself, not counting what the entries own */
+    size_t DynamicMemoryUsage() const
+    {
+        return memusage::DynamicUsage(vBuckets) + memusage::DynamicUsage(vChunks) +
+               vChunks.size() * memusage::MallocUsage(sizeof(chunk_node) * CHUNK_ENTRIES);
+    }
+
+private:
+    flatmap(const flatmap&);
+    flatmap& operator=(const flatmap&);
+};
+
+#endif // BITCOIN_FLATMAP_H
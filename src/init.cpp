@@ -14,13 +14,16 @@
 
 #include "addrman.h"
 #include "amount.h"
+#include "blockfilter.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
 #include "key.h"
 #include "main.h"
 #include "miner.h"
 #include "net.h"
+#include "pow.h"
 #include "rpcserver.h"
+#include "script/sigcache.h"
 #include "script/standard.h"
 #include "txdb.h"
 #include "ui_interface.h"
@@ -137,7 +140,6 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
 
 void Shutdown()
@@ -163,6 +165,9 @@ void Shutdown()
 #endif
     StopNode();
     UnregisterNodeSignals(GetNodeSignals());
+
+    if (fMempoolLoaded && GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        DumpMempool();
     
     if (fFeeEstimatesInitialized)
     {
@@ -188,6 +193,8 @@ void Shutdown()
         pcoinsdbview = NULL;
         delete pblocktree;
         pblocktree = NULL;
+        delete pblockfilterdb;
+        pblockfilterdb = NULL;
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -264,6 +271,8 @@ std::string HelpMessage(HelpMessageMode mode)
     string strUsage = HelpMessageGroup(_("Options:"));
     strUsage += HelpMessageOpt("-?", _("This help message"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt("-blockfilterindex", strprintf(_("Maintain an index of compact per-block filters of the scripts each block pays to and spends from, so wallet rescans only read the blocks that may concern them; "
+        "enabling it on an existing chain builds it in the background (default: %u)"), 0));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 288));
     strUsage += HelpMessageOpt("-checklevel=<n>", strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), 3));
@@ -277,9 +286,14 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file") + " " + _("on startup"));
+    strUsage += HelpMessageOpt("-loadtxoutset=<file>", _("Load the UTXO set from a snapshot written by dumptxoutset, into an empty chainstate (new data directory or -reindex), instead of connecting the blocks up to it. "
+        "The blocks up to the snapshot block must then be imported (-reindex, -loadblock or bootstrap.dat). Only use a snapshot you trust"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
+    strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));   
+    strUsage += HelpMessageOpt("-partialflush", strprintf(_("Keep recently used coins cached when writing the coins cache to disk, instead of emptying it (default: %u)"), 1));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), "lycancoind.pid"));
 #endif
@@ -288,6 +302,7 @@ std::string HelpMessage(HelpMessageMode mode)
             _("(default: 0 = disable pruning blocks,") + " " +
             strprintf(_(">%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
 strUsage += HelpMessageOpt("-reindex", _("Rebuild block chain index from current blk000??.dat files") + " " + _("on startup"));
+    strUsage += HelpMessageOpt("-reindexfilters", _("Rebuild the block filter index (-blockfilterindex) from scratch") + " " + _("on startup"));
 
 #ifndef WIN32
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
@@ -309,6 +324,7 @@ strUsage += HelpMessageOpt("-reindex", _("Rebuild block chain index from current
     strUsage += HelpMessageOpt("-maxconnections=<n>", strprintf(_("Maintain at most <n> connections to peers (default: %u)"), 125));
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), 5000));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000));
+    strUsage += HelpMessageOpt("-msghandlers=<n>", strprintf(_("Number of threads to process peer messages with (1 to %d, default: %d)"), MAX_MSGHANDLER_THREADS, DEFAULT_MSGHANDLER_THREADS));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), 1));
@@ -347,6 +363,8 @@ strUsage += HelpMessageOpt("-reindex", _("Rebuild block chain index from current
     strUsage += HelpMessageOpt("-upgradewallet", _("Upgrade wallet to latest format") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-wallet=<file>", _("Specify wallet file (within data directory)") + " " + strprintf(_("(default: %s)"), "wallet.dat"));
     strUsage += HelpMessageOpt("-walletbroadcast", _("Make the wallet broadcast transactions") + " " + strprintf(_("(default: %u)"), true));    
+    strUsage += HelpMessageOpt("-walletkeycheck=<n>", strprintf(_("How to check wallet keys stored without a checksum against their address (0-2, default: %u)"), DEFAULT_WALLET_KEY_CHECK) + " " +
+        _("0 = trust them, 1 = check them in the background after startup, 2 = check every key on startup, on -par threads"));
     strUsage += HelpMessageOpt("-walletnotify=<cmd>", _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)"));
     strUsage += HelpMessageOpt("-zapwallettxes=<mode>", _("Delete all wallet transactions and only recover those parts of the blockchain through -rescan on startup") +
         " " + _("(1 = keep tx meta data e.g. account owner and payment request information, 2 = drop tx meta data)"));
@@ -356,6 +374,11 @@ strUsage += HelpMessageOpt("-reindex", _("Rebuild block chain index from current
     strUsage += HelpMessageGroup(_("Debugging/Testing options:"));
     if (GetBoolArg("-help-debug", false))
     {
+#ifdef ENABLE_WALLET
+        strUsage += HelpMessageOpt("-checkbalances", strprintf(_("Check the wallet's running balance totals and unspent output index against a full scan of its transactions on every use (default: %u)"), 0));
+#endif
+        strUsage += HelpMessageOpt("-checkindexpow", strprintf(_("Verify the proof of work of every block index entry on startup, using the script verification threads (default: %u)"), 0));
+        strUsage += HelpMessageOpt("-checkkgw", strprintf(_("Verify every Kimoto Gravity Well retarget against the reference implementation (default: %u)"), 0));
         strUsage += HelpMessageOpt("-checkpoints", strprintf(_("Only accept block chain matching built-in checkpoints (default: %u)"), 1));
         strUsage += HelpMessageOpt("-dblogsize=<n>", strprintf(_("Flush database activity from memory pool to disk log every <n> megabytes (default: %u)"), 100));
         strUsage += HelpMessageOpt("-disablesafemode", strprintf(_("Disable safemode, override a real safe mode event (default: %u)"), 0));
@@ -380,8 +403,13 @@ strUsage += HelpMessageOpt("-reindex", _("Rebuild block chain index from current
     if (GetBoolArg("-help-debug", false))
     {
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf(_("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default: %u)"), 15));
+        strUsage += HelpMessageOpt("-limitancestorcount=<n>", strprintf(_("Do not accept transactions if number of in-mempool ancestors is <n> or more (default: %u)"), DEFAULT_ANCESTOR_LIMIT));
+        strUsage += HelpMessageOpt("-limitancestorsize=<n>", strprintf(_("Do not accept transactions whose size with all in-mempool ancestors exceeds <n> kilobytes (default: %u)"), DEFAULT_ANCESTOR_SIZE_LIMIT));
+        strUsage += HelpMessageOpt("-limitdescendantcount=<n>", strprintf(_("Do not accept transactions if any ancestor would have <n> or more in-mempool descendants (default: %u)"), DEFAULT_DESCENDANT_LIMIT));
+        strUsage += HelpMessageOpt("-limitdescendantsize=<n>", strprintf(_("Do not accept transactions if any ancestor would have more than <n> kilobytes of in-mempool descendants (default: %u)"), DEFAULT_DESCENDANT_SIZE_LIMIT));
         strUsage += HelpMessageOpt("-relaypriority", strprintf(_("Require high priority for relaying free or low-fee transactions (default: %u)"), 1));
-        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf(_("Limit size of signature cache to <n> entries (default: %u)"), 50000));
+        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf(_("Limit size of signature cache to <n> megabytes (0 to %d, default: %d)"), MAX_MAX_SIG_CACHE_SIZE, DEFAULT_MAX_SIG_CACHE_SIZE));
+        strUsage += HelpMessageOpt("-maxpowcachesize=<n>", strprintf(_("Limit size of proof-of-work hash cache to <n> entries (default: %u)"), DEFAULT_MAX_POW_CACHE_SIZE));
     }
     strUsage += HelpMessageOpt("-mintxfee=<amt>", strprintf(_("Fees (in LYC/Kb) smaller than this are considered zero fee for transaction creation (default: %s)"), FormatMoney(CWallet::minTxFee.GetFeePerK())) + "\n");
     strUsage += HelpMessageOpt("-minrelaytxfee=<amt>", strprintf(_("Fees (in LYC/Kb) smaller than this are considered zero fee for relaying (default: %s)"), FormatMoney(::minRelayTxFee.GetFeePerK())));
@@ -549,6 +577,19 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
             LogPrintf("Warning: Could not open blocks file %s\n", path.string());
         }
     }
+
+    if (IsTxOutSetSnapshotPending()) {
+        LogPrintf("Error: the imported blocks do not reach the UTXO snapshot block %s\n", pcoinsTip->GetBestBlock().ToString());
+        uiInterface.ThreadSafeMessageBox(_("Error: the imported blocks do not reach the UTXO snapshot block. Provide them with -loadblock, or restart with -reindex to sync without the snapshot."),
+            "", CClientUIInterface::MSG_ERROR);
+        StartShutdown();
+    }
+
+    // Re-admit the transactions saved at shutdown, now the chain they build on is there
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        LoadMempool();
+        fMempoolLoaded = !ShutdownRequested();
+    }
     
         if (GetBoolArg("-stopafterblockimport", false)) {
         LogPrintf("Stopping after block import\n");
@@ -722,6 +763,8 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (GetArg("-prune", 0)) {
         if (GetBoolArg("-txindex", false))
             return InitError(_("Prune mode is incompatible with -txindex."));
+        if (GetBoolArg("-blockfilterindex", false))
+            return InitError(_("Prune mode is incompatible with -blockfilterindex."));
 #ifdef ENABLE_WALLET
         if (!GetBoolArg("-disablewallet", false)) {
             if (SoftSetBoolArg("-disablewallet", true))
@@ -755,6 +798,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     // Checkmempool and checkblockindex default to true in regtest mode
     mempool.setSanityCheck(GetBoolArg("-checkmempool", chainparams.DefaultConsistencyChecks()));
     fCheckBlockIndex = GetBoolArg("-checkblockindex", chainparams.DefaultConsistencyChecks());
+    fCheckKGW = GetBoolArg("-checkkgw", false);
+    fCheckIndexPoW = GetBoolArg("-checkindexpow", false);
+    fPartialFlush = GetBoolArg("-partialflush", true);
     Checkpoints::fEnabled = GetBoolArg("-checkpoints", true);
     
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
@@ -845,6 +891,8 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     nTxConfirmTarget = GetArg("-txconfirmtarget", 1);    
     bSpendZeroConfChange = GetArg("-spendzeroconfchange", true);
+    fCheckBalances = GetBoolArg("-checkbalances", chainparams.DefaultConsistencyChecks());
+    nWalletKeyCheck = GetArg("-walletkeycheck", DEFAULT_WALLET_KEY_CHECK);
     fSendFreeTransactions = GetArg("-sendfreetransactions", false);
     
     std::string strWalletFile = GetArg("-wallet", "wallet.dat");
@@ -892,10 +940,15 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("Using at most %i connections (%i file descriptors available)\n", nMaxConnections, nFD);
     std::ostringstream strErrors;
 
+    InitPoWHashCache();
     if (nScriptCheckThreads) {
-        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+        LogPrintf("Using %u threads for script and header proof-of-work verification and coins prefetching\n", nScriptCheckThreads);
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadPoWCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadCoinsPrefetch);
     }
 
     /* Start the RPC server already.  It will be started in "warmup" mode
@@ -1037,6 +1090,7 @@ bool AppInit2(boost::thread_group& threadGroup)
 #if defined(USE_SSE2)
     scrypt_detect_sse2(cpuid_edx);
 #endif
+    LogPrintf("Using %u-way %s scrypt kernel for batch hashing\n", SCRYPT_MULTI_WAYS, scrypt_detect_multi());
 
     fReindex = GetBoolArg("-reindex", false);
    
@@ -1077,9 +1131,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
+    fBlockFilterIndex = GetBoolArg("-blockfilterindex", false);
+    size_t nBlockFilterDBCache = fBlockFilterIndex ? std::min(nTotalCache / 8, (size_t)(8 << 20)) : 0;
+    nTotalCache -= nBlockFilterDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache;
     
     bool fLoaded = false;
     while (!fLoaded) {
@@ -1096,8 +1153,22 @@ bool AppInit2(boost::thread_group& threadGroup)
                 delete pcoinsdbview;
                 delete pcoinscatcher;
                 delete pblocktree;
+                delete pblockfilterdb;
+                pblockfilterdb = NULL;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
+                if (fBlockFilterIndex) {
+                    bool fWipeFilters = fReindex || GetBoolArg("-reindexfilters", false);
+                    pblockfilterdb = new CBlockFilterDB(nBlockFilterDBCache, false, fWipeFilters);
+                    // Filters made from other elements could miss what a wallet now looks for
+                    int nFilterVersion = 0;
+                    if (!fWipeFilters && (!pblockfilterdb->ReadVersion(nFilterVersion) || nFilterVersion != CBlockFilter::VERSION)) {
+                        LogPrintf("Rebuilding the block filter index, version %d filters are stored\n", nFilterVersion);
+                        delete pblockfilterdb;
+                        pblockfilterdb = new CBlockFilterDB(nBlockFilterDBCache, false, true);
+                    }
+                    pblockfilterdb->WriteVersion(CBlockFilter::VERSION);
+                }
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
@@ -1109,6 +1180,33 @@ bool AppInit2(boost::thread_group& threadGroup)
                         DeleteAllBlockFiles();
                 }
 
+                if (pcoinsdbview->IsSnapshotLoadInterrupted()) {
+                    // The coins of a partly loaded snapshot are no chainstate
+                    strLoadError = _("Loading a UTXO set snapshot was interrupted, the chainstate is incomplete");
+                    break;
+                }
+
+                if (mapArgs.count("-loadtxoutset") && !pcoinsdbview->GetSnapshotBlock().IsNull()) {
+                    // Restarted with the option still set, after the snapshot was loaded
+                    LogPrintf("Chainstate was already loaded from a UTXO set snapshot, ignoring -loadtxoutset\n");
+                } else if (mapArgs.count("-loadtxoutset")) {
+                    uiInterface.InitMessage(_("Loading UTXO set snapshot..."));
+                    boost::filesystem::path pathSnapshot = GetArg("-loadtxoutset", "");
+                    CAutoFile filein(fopen(pathSnapshot.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+                    CTxOutSetSnapshotHeader header;
+                    if (filein.IsNull())
+                        return InitError(strprintf(_("Cannot open UTXO set snapshot %s"), pathSnapshot.string()));
+                    if (!pcoinsdbview->GetBestBlock().IsNull())
+                        return InitError(_("-loadtxoutset needs an empty chainstate: use it on a new data directory, or with -reindex"));
+                    if (!pcoinsdbview->LoadTxOutSet(filein, header))
+                        return InitError(_("Failed to load the UTXO set snapshot. Restart with -reindex before trying again."));
+                }
+
+                if (!pcoinsdbview->InitSetInfo()) {
+                    strLoadError = _("Error computing UTXO set statistics");
+                    break;
+                }
+
                 if (!LoadBlockIndex()) {
                     strLoadError = _("Error loading block database");
                     break;
@@ -1131,6 +1229,14 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
+                // Blocks connected while -blockfilterindex was off have no
+                // filter; have ThreadBlockFilterIndex go over the whole chain
+                bool fHadBlockFilterIndex = false;
+                pblocktree->ReadFlag("blockfilterindex", fHadBlockFilterIndex);
+                if (fBlockFilterIndex && !fHadBlockFilterIndex)
+                    pblockfilterdb->WriteBestBlock(CBlockLocator());
+                pblocktree->WriteFlag("blockfilterindex", fBlockFilterIndex);
+
                 // Check for changed -prune state.  What we are concerned about is a user who has pruned blocks
                 // in the past, but is now trying to run unpruned.
                 if (fHavePruned && !fPruneMode) {
@@ -1360,6 +1466,14 @@ bool AppInit2(boost::thread_group& threadGroup)
             vImportFiles.push_back(strFile);
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    if (fBlockFilterIndex)
+        threadGroup.create_thread(&ThreadBlockFilterIndex);
+    if (IsTxOutSetSnapshotPending()) {
+        uiInterface.InitMessage(_("Importing blocks up to the UTXO snapshot..."));
+        LogPrintf("Waiting for the blocks up to the UTXO snapshot block to be imported...\n");
+        while (!fRequestShutdown && chainActive.Tip() == NULL)
+            MilliSleep(10);
+    }
     if (chainActive.Tip() == NULL) {
         LogPrintf("Waiting for genesis block to be imported...\n");
         while (!fRequestShutdown && chainActive.Tip() == NULL)
@@ -1407,6 +1521,10 @@ bool AppInit2(boost::thread_group& threadGroup)
 
         // Run a thread to flush wallet periodically
         threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
+
+        // Check the keys LoadWallet didn't
+        if (!pwalletMain->mapKeysUnverified.empty())
+            threadGroup.create_thread(boost::bind(&ThreadVerifyWalletKeys, pwalletMain));
     }
 #endif
 
@@ -82,4 +82,37 @@ bool CBasicKeyStore::HaveWatchOnly() const
 {
     LOCK(cs_KeyStore);
     return (!setWatchOnly.empty());
-}
\ No newline at end of file
+}
+
+CKeyStoreSnapshot::CKeyStoreSnapshot(const CBasicKeyStore& keystore)
+{
+    // Virtual, so an encrypted wallet lists its encrypted keys too
+    keystore.GetKeys(setKeys);
+    BOOST_FOREACH(const CKeyID& keyid, setKeys) {
+        CPubKey pubkey;
+        if (keystore.GetPubKey(keyid, pubkey))
+            mapPubKeys[keyid] = pubkey;
+    }
+
+    LOCK(keystore.cs_KeyStore);
+    mapScripts = keystore.mapScripts;
+    setWatchOnly = keystore.setWatchOnly;
+}
+
+bool CKeyStoreSnapshot::GetPubKey(const CKeyID &address, CPubKey &vchPubKeyOut) const
+{
+    std::map<CKeyID, CPubKey>::const_iterator mi = mapPubKeys.find(address);
+    if (mi == mapPubKeys.end())
+        return false;
+    vchPubKeyOut = mi->second;
+    return true;
+}
+
+bool CKeyStoreSnapshot::GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const
+{
+    ScriptMap::const_iterator mi = mapScripts.find(hash);
+    if (mi == mapScripts.end())
+        return false;
+    redeemScriptOut = mi->second;
+    return true;
+}
@@ -53,6 +53,8 @@ typedef std::set<CScript> WatchOnlySet;
 /** Basic key store, that keeps keys in an address->secret map */
 class CBasicKeyStore : public CKeyStore
 {
+    friend class CKeyStoreSnapshot;
+
 protected:
     KeyMap mapKeys;
     ScriptMap mapScripts;
@@ -105,6 +107,41 @@ public:
     virtual bool HaveWatchOnly() const;
 };
 
+/**
+ * Copy of which keys, scripts and watch-only scripts a key store has, without
+ * the secrets. It never changes after construction, so IsMine() can run
+ * against it from several threads at once without taking cs_KeyStore.
+ */
+class CKeyStoreSnapshot : public CKeyStore
+{
+private:
+    std::set<CKeyID> setKeys;
+    std::map<CKeyID, CPubKey> mapPubKeys;
+    ScriptMap mapScripts;
+    WatchOnlySet setWatchOnly;
+
+public:
+    CKeyStoreSnapshot(const CBasicKeyStore& keystore);
+
+    bool GetPubKey(const CKeyID &address, CPubKey& vchPubKeyOut) const;
+    const ScriptMap& GetScripts() const { return mapScripts; }
+    const WatchOnlySet& GetWatchOnly() const { return setWatchOnly; }
+
+    bool AddKeyPubKey(const CKey &key, const CPubKey &pubkey) { return false; }
+    bool HaveKey(const CKeyID &address) const { return setKeys.count(address) > 0; }
+    bool GetKey(const CKeyID &address, CKey& keyOut) const { return false; }
+    void GetKeys(std::set<CKeyID> &setAddress) const { setAddress = setKeys; }
+
+    bool AddCScript(const CScript& redeemScript) { return false; }
+    bool HaveCScript(const CScriptID &hash) const { return mapScripts.count(hash) > 0; }
+    bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const;
+
+    bool AddWatchOnly(const CScript &dest) { return false; }
+    bool RemoveWatchOnly(const CScript &dest) { return false; }
+    bool HaveWatchOnly(const CScript &dest) const { return setWatchOnly.count(dest) > 0; }
+    bool HaveWatchOnly() const { return !setWatchOnly.empty(); }
+};
+
 typedef std::vector<unsigned char, secure_allocator<unsigned char> > CKeyingMaterial;
 typedef std::map<CKeyID, std::pair<CPubKey, std::vector<unsigned char> > > CryptedKeyMap;
 
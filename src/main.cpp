@@ -10,6 +10,7 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockfilter.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -31,8 +32,10 @@
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace boost;
@@ -57,12 +60,17 @@ CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
+boost::atomic<bool> fMempoolLoaded(false);
 bool fTxIndex = false;
+bool fBlockFilterIndex = false;
 bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
-unsigned int nCoinCacheSize = 5000;
+bool fCheckIndexPoW = false;
+size_t nCoinCacheUsage = 5000 * 300;
+size_t nCoinCacheUsagePeak = 0;
+bool fPartialFlush = true;
 uint64_t nPruneTarget = 0;
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying and mining) */
@@ -501,7 +509,9 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CBlockFilterDB *pblockfilterdb = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -864,6 +874,12 @@ CAmount GetMinFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree,
 
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fRejectAbsurdFee)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fRejectAbsurdFee);
+}
+
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectAbsurdFee)
 {
     AssertLockHeld(cs_main);    
     if (pfMissingInputs)
@@ -982,7 +998,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         CAmount nFees = nValueIn-nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height());
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -997,6 +1013,18 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
         }
 
+        // Once the pool has had to evict, pay more than what it gave up
+        if (fLimitFree) {
+            double dPriorityDelta = 0;
+            CAmount nModifiedFees = nFees;
+            pool.ApplyDeltas(hash, dPriorityDelta, nModifiedFees);
+            CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+            if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee)
+                return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                          hash.ToString(), nModifiedFees, mempoolRejectFee),
+                                 REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+        }
+
         // Continuously rate-limit free (really, very-low-fee)transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make others' transactions take longer to confirm.
@@ -1026,6 +1054,21 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                          hash.ToString(),
                          nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
+        // Keep unconfirmed chains short: every pool update and block template
+        // walks the relatives of the transactions involved
+        {
+            LOCK(pool.cs);
+            CTxMemPool::setEntries setAncestors;
+            std::string errString;
+            if (!pool.CalculateMemPoolAncestors(entry, setAncestors,
+                                                GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT),
+                                                GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000,
+                                                GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT),
+                                                GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000, errString))
+                return state.DoS(0, error("AcceptToMemoryPool : too long mempool chain %s, %s", hash.ToString(), errString),
+                                 REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true))
@@ -1049,6 +1092,11 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         
         // Store transaction in memory
         pool.addUnchecked(hash, entry);
+
+        // Trim the pool back to its limit, which may take this transaction out again
+        pool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+        if (!pool.exists(hash))
+            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
     }
 
     SyncWithWallets(tx, NULL);
@@ -1056,6 +1104,117 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return true;
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+bool LoadMempool()
+{
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        LogPrintf("%s: No mempool file at %s, starting with an empty mempool\n", __func__, path.string());
+        return false;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    uint64_t nAccepted = 0, nFailed = 0, nAlreadyThere = 0;
+    try {
+        uint64_t nVersion;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("%s: unknown mempool file version %d", __func__, nVersion);
+        uint64_t nTransactions;
+        filein >> nTransactions;
+        LogPrintf("Loading %u mempool transactions from disk...\n", nTransactions);
+
+        for (uint64_t i = 0; i < nTransactions; i++) {
+            CTransaction tx;
+            int64_t nTime;
+            double dPriorityDelta;
+            CAmount nFeeDelta;
+            filein >> tx >> nTime >> dPriorityDelta >> nFeeDelta;
+
+            if (dPriorityDelta != 0 || nFeeDelta != 0)
+                mempool.PrioritiseTransaction(tx.GetHash(), tx.GetHash().ToString(), dPriorityDelta, nFeeDelta);
+            {
+                // Take cs_main per transaction, so block processing and RPC carry on meanwhile
+                LOCK(cs_main);
+                CValidationState state;
+                if (mempool.exists(tx.GetHash()))
+                    nAlreadyThere++;
+                else if (AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime))
+                    nAccepted++;
+                else
+                    nFailed++;
+            }
+            if (ShutdownRequested())
+                return false;
+            if (nTransactions >= 10 && (i + 1) % (nTransactions / 10) == 0)
+                LogPrintf("Loading mempool: %d%%\n", (int)((i + 1) * 100 / nTransactions));
+        }
+
+        // Prioritisations of transactions that were not in the pool
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        filein >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+    } catch (const std::exception& e) {
+        return error("%s: failed to deserialize mempool data: %s", __func__, e.what());
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %u accepted, %u failed, %u already there, %dms\n",
+        nAccepted, nFailed, nAlreadyThere, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    // Copy the pool out, so it is not locked while the file is written
+    std::vector<CTxMemPoolEntry> vEntries;
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    {
+        LOCK(mempool.cs);
+        vEntries.reserve(mempool.mapTx.size());
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+            vEntries.push_back(it->second);
+        mapDeltas = mempool.mapDeltas;
+    }
+    int64_t nCopied = GetTimeMicros();
+
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    boost::filesystem::path pathTemp = GetDataDir() / "mempool.dat.new";
+    try {
+        CAutoFile fileout(fopen(pathTemp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (fileout.IsNull())
+            return error("%s: failed to open %s", __func__, pathTemp.string());
+
+        fileout << MEMPOOL_DUMP_VERSION;
+        fileout << (uint64_t)vEntries.size();
+        BOOST_FOREACH(const CTxMemPoolEntry& entry, vEntries) {
+            const uint256& hash = entry.GetTx().GetHash();
+            std::pair<double, CAmount> deltas(0.0, 0);
+            std::map<uint256, std::pair<double, CAmount> >::iterator itDeltas = mapDeltas.find(hash);
+            if (itDeltas != mapDeltas.end()) {
+                deltas = itDeltas->second;
+                mapDeltas.erase(itDeltas);
+            }
+            fileout << entry.GetTx() << entry.GetTime() << deltas.first << deltas.second;
+        }
+        fileout << mapDeltas;
+        FileCommit(fileout.Get());
+        fileout.fclose();
+        if (!RenameOver(pathTemp, path))
+            return error("%s: failed to rename %s", __func__, pathTemp.string());
+    } catch (const std::exception& e) {
+        return error("%s: failed to write mempool data: %s", __func__, e.what());
+    }
+
+    LogPrintf("Dumped %u mempool transactions: %.2fms to copy, %.2fms to write\n", (unsigned int)vEntries.size(),
+        0.001 * (nCopied - nStart), 0.001 * (GetTimeMicros() - nCopied));
+    return true;
+}
+
 // Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1148,7 +1307,7 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, bool fCheckPOW)
 {
     block.SetNull();
 
@@ -1166,7 +1325,7 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
     }
 
     // Check the header
-    if (!CheckProofOfWork(block.GetPoWHash(), block.nBits, Params().GetConsensus()))
+    if (fCheckPOW && !CheckProofOfWork(GetBlockPoWHash(block), block.nBits, Params().GetConsensus()))
         return error("ReadBlockFromDisk: Errors in block header at %s", pos.ToString());
 
     return true;
@@ -1174,11 +1333,17 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 {
-    if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
+    // A header only reaches BLOCK_VALID_TREE after passing CheckBlockHeader, and the
+    // hash comparison below ties the bytes on disk to that header, so scrypt would
+    // only recompute a result we already have.
+    bool fCheckPOW = !pindex->IsValid(BLOCK_VALID_TREE);
+    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), fCheckPOW))
         return false;
     if (block.GetHash() != pindex->GetBlockHash())
         return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): GetHash() doesn't match index for %s at %s",
                 pindex->ToString(), pindex->GetBlockPos().ToString());
+    if (!fCheckPOW)
+        PoWHashCacheSkipped();
     return true;
 }
 
@@ -1291,6 +1456,7 @@ void Misbehaving(NodeId pnode, int howmuch)
     if (howmuch == 0)
         return;
 
+    LOCK(cs_main);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -1342,6 +1508,8 @@ void static InvalidBlockFound(CBlockIndex *pindex, const CValidationState &state
 
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, CTxUndo &txundo, int nHeight)
 {
+    CCoinsSetInfo& delta = inputs.GetSetInfoDelta();
+
     // mark inputs spent
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
@@ -1353,7 +1521,10 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
                 assert(false);
             // mark an outpoint spent, and construct undo information
             txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
+            delta.RemoveTransaction(*coins);
+            delta.RemoveOutput(txin.prevout.hash, *coins, nPos);
             coins->Spend(nPos);
+            delta.AddTransaction(*coins);
             if (coins->vout.size() == 0) {
                 CTxInUndo& undo = txundo.vprevout.back();
                 undo.nHeight = coins->nHeight;
@@ -1363,8 +1534,12 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
         }
     }
 
-    // add outputs
-    inputs.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
+    // add outputs (replacing any unspent ones of an earlier transaction with the same txid)
+    uint256 hash = tx.GetHash();
+    CCoinsModifier outs = inputs.ModifyCoins(hash);
+    delta.RemoveCoins(hash, *outs);
+    outs->FromTx(tx, nHeight);
+    delta.AddCoins(hash, *outs);
 }
 
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, int nHeight)
@@ -1373,6 +1548,13 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
     UpdateCoins(tx, state, inputs, txundo, nHeight);
 }
 
+bool CPoWHashCheck::operator()() {
+    if (fVerify)
+        return CheckBlockHeadersPoW(vHeaders, Params().GetConsensus());
+    CacheBlockPoWHashes(vHeaders);
+    return true;
+}
+
 bool CScriptCheck::operator()() {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
     if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore), &error)) {
@@ -1551,12 +1733,14 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uin
 static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
+    CCoinsSetInfo& delta = view.GetSetInfoDelta();
 
     CCoinsModifier coins = view.ModifyCoins(out.hash);
     if (undo.nHeight != 0) {
         // undo data contains height: this is the last output of the prevout tx being spent
         if (!coins->IsPruned())
             fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
+        delta.RemoveCoins(out.hash, *coins);
         coins->Clear();
         coins->fCoinBase = undo.fCoinBase;
         coins->nHeight = undo.nHeight;
@@ -1565,11 +1749,16 @@ static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const CO
         if (coins->IsPruned())
             fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
     }
-    if (coins->IsAvailable(out.n))
+    delta.RemoveTransaction(*coins);
+    if (coins->IsAvailable(out.n)) {
         fClean = fClean && error("%s: undo data overwriting existing output", __func__);
+        delta.RemoveOutput(out.hash, *coins, out.n);
+    }
     if (coins->vout.size() < out.n+1)
         coins->vout.resize(out.n+1);
     coins->vout[out.n] = undo.txout;
+    delta.AddOutput(out.hash, *coins, out.n);
+    delta.AddTransaction(*coins);
 
     return fClean;
 }
@@ -1602,6 +1791,7 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
         // exactly.
         {
         CCoinsModifier outs = view.ModifyCoins(hash);
+        view.GetSetInfoDelta().RemoveCoins(hash, *outs);
         outs->ClearUnspendable();
 
         CCoins outsBlock(tx, pindex->nHeight);
@@ -1674,6 +1864,129 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+void GetScriptCheckQueueStats(CCheckQueueStats& stats)
+{
+    scriptcheckqueue.GetStats(stats);
+}
+
+static CCheckQueue<CPoWHashCheck> powcheckqueue(1);
+/** Held for the life of every CCheckQueueControl on powcheckqueue: the headers
+ *  handlers of several peers may get there at once, and a queue has one master */
+static CCriticalSection cs_powcheckqueue;
+
+void ThreadPoWCheck() {
+    RenameThread("lycancoin-powch");
+    powcheckqueue.Thread();
+}
+
+namespace {
+
+struct CCoinsPrefetchResult
+{
+    bool fFound;
+    CCoins coins;
+
+    CCoinsPrefetchResult() : fFound(false) {}
+};
+
+/** Closure reading a slice of txids from the coins database into their result slots */
+class CCoinsPrefetchCheck
+{
+private:
+    const CCoinsView* pbase;
+    const uint256* ptxid;
+    CCoinsPrefetchResult* presult;
+    unsigned int nCount;
+
+public:
+    CCoinsPrefetchCheck() : pbase(NULL), ptxid(NULL), presult(NULL), nCount(0) {}
+    CCoinsPrefetchCheck(const CCoinsView* pbaseIn, const uint256* ptxidIn, CCoinsPrefetchResult* presultIn, unsigned int nCountIn) :
+        pbase(pbaseIn), ptxid(ptxidIn), presult(presultIn), nCount(nCountIn) {}
+
+    bool operator()() {
+        for (unsigned int i = 0; i < nCount; i++)
+            presult[i].fFound = pbase->GetCoins(ptxid[i], presult[i].coins);
+        return true;
+    }
+
+    void swap(CCoinsPrefetchCheck &check) {
+        std::swap(pbase, check.pbase);
+        std::swap(ptxid, check.ptxid);
+        std::swap(presult, check.presult);
+        std::swap(nCount, check.nCount);
+    }
+};
+
+} // anon namespace
+
+static CCheckQueue<CCoinsPrefetchCheck> prefetchqueue(1);
+
+void ThreadCoinsPrefetch() {
+    RenameThread("lycancoin-prefetch");
+    prefetchqueue.Thread();
+}
+
+/**
+ * Read the coins spent and created by a run of blocks into pcoinsTip, with
+ * the database reads spread over the -par worker threads. Only txids that are
+ * not cached yet are read; ones the database doesn't have are cached as pruned
+ * entries, so ConnectBlock's BIP30 and output lookups don't go to disk either.
+ * Returns the number of txids read.
+ */
+static unsigned int PrefetchCoins(const std::vector<const CBlock*>& vBlocks)
+{
+    AssertLockHeld(cs_main);
+    std::set<uint256> setTxid;
+    BOOST_FOREACH(const CBlock* pblock, vBlocks) {
+        BOOST_FOREACH(const CTransaction& tx, pblock->vtx) {
+            if (!pcoinsTip->HaveCoinsInCache(tx.GetHash()))
+                setTxid.insert(tx.GetHash());
+            if (tx.IsCoinBase())
+                continue;
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                if (!pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
+                    setTxid.insert(txin.prevout.hash);
+            }
+        }
+    }
+    if (setTxid.empty())
+        return 0;
+
+    std::vector<uint256> vTxid(setTxid.begin(), setTxid.end());
+    std::vector<CCoinsPrefetchResult> vResult(vTxid.size());
+    {
+        CCheckQueueControl<CCoinsPrefetchCheck> control(&prefetchqueue);
+        std::vector<CCoinsPrefetchCheck> vChecks;
+        for (unsigned int i = 0; i < vTxid.size(); i += COINS_PREFETCH_BATCH) {
+            unsigned int nCount = std::min((unsigned int)vTxid.size() - i, COINS_PREFETCH_BATCH);
+            vChecks.push_back(CCoinsPrefetchCheck(pcoinsTip->GetBackend(), &vTxid[i], &vResult[i], nCount));
+        }
+        control.Add(vChecks);
+        control.Wait();
+    }
+    for (unsigned int i = 0; i < vTxid.size(); i++)
+        pcoinsTip->AddPrefetched(vTxid[i], vResult[i].coins, vResult[i].fFound);
+    return vTxid.size();
+}
+
+void CacheHeadersPoW(const std::vector<CBlockHeader>& vHeaders)
+{
+    if (!nScriptCheckThreads) {
+        CacheBlockPoWHashes(vHeaders);
+        return;
+    }
+
+    LOCK(cs_powcheckqueue);
+    CCheckQueueControl<CPoWHashCheck> control(&powcheckqueue);
+    std::vector<CPoWHashCheck> vChecks;
+    for (unsigned int i = 0; i < vHeaders.size(); i += SCRYPT_MULTI_WAYS) {
+        unsigned int nEnd = std::min((unsigned int)vHeaders.size(), i + SCRYPT_MULTI_WAYS);
+        vChecks.push_back(CPoWHashCheck(vHeaders.begin() + i, vHeaders.begin() + nEnd));
+    }
+    control.Add(vChecks);
+    control.Wait();
+}
+
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
@@ -1833,6 +2146,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort("Failed to write transaction index");
 
+    if (fBlockFilterIndex)
+        if (!pblockfilterdb->WriteFilter(CBlockFilter(block, blockundo)))
+            return state.Abort("Failed to write block filter");
+
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
     
@@ -1849,7 +2166,64 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     return true;
 }
-   
+
+/** Blocks between saves of how far ThreadBlockFilterIndex got */
+static const int BLOCK_FILTER_INDEX_SAVE_INTERVAL = 1000;
+
+void ThreadBlockFilterIndex()
+{
+    RenameThread("lycancoin-filterindex");
+    int64_t nStart = GetTimeMicros();
+    int64_t nLastLog = GetTime();
+    unsigned int nBuilt = 0;
+
+    // Filters of blocks connected since are written by ConnectBlock, so this
+    // only has to get to the tip once
+    CBlockIndex* pindex;
+    {
+        LOCK(cs_main);
+        CBlockLocator locator;
+        pindex = pblockfilterdb->ReadBestBlock(locator) ? FindForkInGlobalIndex(chainActive, locator) : chainActive.Genesis();
+    }
+    if (pindex)
+        LogPrintf("Block filter index: building from block %d\n", pindex->nHeight);
+    while (pindex) {
+        boost::this_thread::interruption_point();
+        if (!pblockfilterdb->HaveFilter(pindex->GetBlockHash())) {
+            CBlock block;
+            CBlockUndo blockundo;
+            CDiskBlockPos posUndo;
+            {
+                LOCK(cs_main);
+                posUndo = pindex->GetUndoPos();
+            }
+            if (ReadBlockFromDisk(block, pindex) && (!pindex->pprev || (!posUndo.IsNull() && UndoReadFromDisk(blockundo, posUndo, pindex->pprev->GetBlockHash())))) {
+                if (!pblockfilterdb->WriteFilter(CBlockFilter(block, blockundo))) {
+                    LogPrintf("Block filter index: failed to write the filter of block %d\n", pindex->nHeight);
+                    return;
+                }
+                nBuilt++;
+            } else {
+                // Rescans read the block instead
+                LogPrintf("Block filter index: no block or undo data for block %d, left without a filter\n", pindex->nHeight);
+            }
+        }
+
+        LOCK(cs_main);
+        CBlockIndex* pindexNext = chainActive.Next(pindex);
+        if (!pindexNext && !chainActive.Contains(pindex))
+            pindexNext = chainActive.Next(chainActive.FindFork(pindex));
+        if ((pindex->nHeight % BLOCK_FILTER_INDEX_SAVE_INTERVAL == 0 || !pindexNext) && chainActive.Contains(pindex))
+            pblockfilterdb->WriteBestBlock(chainActive.GetLocator(pindex));
+        if (GetTime() >= nLastLog + 60) {
+            nLastLog = GetTime();
+            LogPrintf("Block filter index: at block %d of %d, %u filters built\n", pindex->nHeight, chainActive.Height(), nBuilt);
+        }
+        pindex = pindexNext;
+    }
+    LogPrintf("Block filter index: %u filters built in %.2fs, up to date\n", nBuilt, (GetTimeMicros() - nStart) * 0.000001);
+}
+
 enum FlushStateMode {
     FLUSH_STATE_NONE,    
     FLUSH_STATE_IF_NEEDED,
@@ -1879,8 +2253,13 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
             }
         }
     }    
-    if ((mode == FLUSH_STATE_ALWAYS) ||
-        ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
+    size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+    nCoinCacheUsagePeak = std::max(nCoinCacheUsagePeak, cacheSize);
+    // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
+    bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCoinCacheUsage;
+    // The cache is over the limit, we have to write now.
+    bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+    if ((mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fCacheCritical ||
         (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000) ||
         fFlushForPrune) {
         // Typical CCoins structures on disk are around 100 bytes in size.
@@ -1911,8 +2290,17 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
             }
         }
         // Flush the chainstate (which may refer to block index entries).
-        if (!pcoinsTip->Flush())
+        // A partial flush keeps the recently used entries cached, and only
+        // evicts down to half the limit when the cache is large.
+        if (fPartialFlush) {
+            size_t nTarget = (fCacheLarge || fCacheCritical) ? nCoinCacheUsage / 2 : nCoinCacheUsage;
+            if (!pcoinsTip->PartialFlush(nTarget))
+                return state.Abort("Failed to write to coin database");
+            LogPrint("coindb", "%s: partial flush, coins cache %.1fMiB -> %.1fMiB\n", __func__,
+                cacheSize * (1.0 / (1<<20)), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1<<20)));
+        } else if (!pcoinsTip->Flush()) {
             return state.Abort("Failed to write to coin database");
+        }
         
         // Finally remove any pruned files
         if (fFlushForPrune) {
@@ -1951,10 +2339,10 @@ void static UpdateTip(CBlockIndex *pindexNew) {
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
     
-    LogPrintf("%s: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n", __func__,
+    LogPrintf("%s: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n", __func__,
       chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble())/log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-      Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+      Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1<<20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -2029,6 +2417,88 @@ static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
 static int64_t nTimePostConnect = 0;
 
+/** Blocks read ahead by PrefetchBlockCoins, oldest first; kept so they are not read twice */
+static std::deque<std::pair<CBlockIndex*, CBlock> > dequePrefetchedBlocks;
+/** Last block whose coins were prefetched */
+static CBlockIndex* pindexPrefetched = NULL;
+static uint64_t nPrefetchLookups = 0;
+static uint64_t nPrefetchHits = 0;
+static int64_t nTimePrefetch = 0;
+
+/**
+ * Make sure the coins touched by pindexConnect, and by up to
+ * COINS_PREFETCH_BLOCKS-1 blocks after it on the way to pindexMostWork, are in
+ * pcoinsTip. pblock is either NULL or the already loaded pindexMostWork.
+ * Returns the block for pindexConnect if it is loaded, or NULL.
+ */
+static CBlock* PrefetchBlockCoins(CBlockIndex* pindexConnect, CBlockIndex* pindexMostWork, CBlock* pblock)
+{
+    AssertLockHeld(cs_main);
+    // Drop blocks that were connected, or that are not on the way to pindexMostWork anymore.
+    while (!dequePrefetchedBlocks.empty() && dequePrefetchedBlocks.front().first->nHeight < pindexConnect->nHeight)
+        dequePrefetchedBlocks.pop_front();
+    if (!dequePrefetchedBlocks.empty() && dequePrefetchedBlocks.front().first != pindexConnect)
+        dequePrefetchedBlocks.clear();
+
+    bool fPrefetched = pindexPrefetched && pindexPrefetched->GetAncestor(pindexConnect->nHeight) == pindexConnect;
+    if (nScriptCheckThreads && !fPrefetched) {
+        int64_t nTimeStart = GetTimeMicros();
+        dequePrefetchedBlocks.clear();
+        std::vector<const CBlock*> vBlocks;
+        int nEndHeight = std::min(pindexConnect->nHeight + (int)COINS_PREFETCH_BLOCKS - 1, pindexMostWork->nHeight);
+        for (int nHeight = pindexConnect->nHeight; nHeight <= nEndHeight; nHeight++) {
+            CBlockIndex* pindex = pindexMostWork->GetAncestor(nHeight);
+            if (pindex == pindexMostWork && pblock) {
+                vBlocks.push_back(pblock);
+            } else {
+                if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+                    break;
+                dequePrefetchedBlocks.push_back(std::make_pair(pindex, CBlock()));
+                if (!ReadBlockFromDisk(dequePrefetchedBlocks.back().second, pindex)) {
+                    dequePrefetchedBlocks.pop_back();
+                    break;
+                }
+                vBlocks.push_back(&dequePrefetchedBlocks.back().second);
+            }
+            pindexPrefetched = pindex;
+        }
+        unsigned int nRead = PrefetchCoins(vBlocks);
+        int64_t nTime = GetTimeMicros() - nTimeStart; nTimePrefetch += nTime;
+        LogPrint("bench", "  - Prefetch coins of %u blocks: %u txids read in %.2fms [%.2fs]\n", (unsigned)vBlocks.size(), nRead, nTime * 0.001, nTimePrefetch * 0.000001);
+    }
+
+    if (pindexConnect == pindexMostWork && pblock)
+        return pblock;
+    if (!dequePrefetchedBlocks.empty() && dequePrefetchedBlocks.front().first == pindexConnect)
+        return &dequePrefetchedBlocks.front().second;
+    return NULL;
+}
+
+/**
+ * Log which share of the lookups ConnectBlock is about to do will be served
+ * from pcoinsTip without touching the database.
+ */
+static void LogPrefetchHitRate(const CBlock& block)
+{
+    if (!LogAcceptCategory("bench"))
+        return;
+    unsigned int nLookups = 0, nHits = 0;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        nLookups++;
+        nHits += pcoinsTip->HaveCoinsInCache(tx.GetHash());
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            nLookups++;
+            nHits += pcoinsTip->HaveCoinsInCache(txin.prevout.hash);
+        }
+    }
+    nPrefetchLookups += nLookups;
+    nPrefetchHits += nHits;
+    LogPrint("bench", "  - Coins cache hit rate: %.1f%% (%u/%u) [%.1f%%]\n", 100.0 * nHits / std::max(nLookups, 1U), nHits, nLookups,
+        100.0 * nPrefetchHits / std::max(nPrefetchLookups, (uint64_t)1));
+}
+
 // Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
 // corresponding to pindexNew, to bypass loading it again from disk.
 bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *pblock) {
@@ -2046,6 +2516,7 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    LogPrefetchHitRate(*pblock);
     {
         CCoinsViewCache view(pcoinsTip);
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
@@ -2158,6 +2629,43 @@ static void PruneBlockIndexCandidates() {
     assert(!setBlockIndexCandidates.empty());
 }
 
+/**
+ * Coins loaded from a UTXO snapshot (-loadtxoutset) are at the snapshot block
+ * while the active chain is still empty. Nothing can be connected on top until
+ * that block and all its ancestors are stored; then the active chain jumps
+ * straight to it, the snapshot standing in for connecting those blocks.
+ * Returns false while still waiting.
+ */
+static bool ActivateSnapshotChain()
+{
+    AssertLockHeld(cs_main);
+    if (chainActive.Tip() != NULL)
+        return true;
+    uint256 hashCoins = pcoinsTip->GetBestBlock();
+    if (hashCoins.IsNull())
+        return true;
+    BlockMap::iterator it = mapBlockIndex.find(hashCoins);
+    if (it == mapBlockIndex.end() || it->second->nChainTx == 0)
+        return false;
+
+    CBlockIndex* pindexSnapshot = it->second;
+    for (CBlockIndex* pindex = pindexSnapshot; pindex && !pindex->IsValid(BLOCK_VALID_SCRIPTS); pindex = pindex->pprev) {
+        pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
+        setDirtyBlockIndex.insert(pindex);
+    }
+    chainActive.SetTip(pindexSnapshot);
+    PruneBlockIndexCandidates();
+    LogPrintf("%s: active chain moved to UTXO snapshot block %s at height %d\n", __func__,
+        hashCoins.ToString(), pindexSnapshot->nHeight);
+    return true;
+}
+
+bool IsTxOutSetSnapshotPending()
+{
+    LOCK(cs_main);
+    return chainActive.Tip() == NULL && !pcoinsTip->GetBestBlock().IsNull();
+}
+
 // Try to make some progress towards making pindexMostWork the active block.
 // pblock is either NULL or a pointer to a CBlock corresponding to pindexMostWork.
 static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMostWork, CBlock *pblock) {
@@ -2190,7 +2698,7 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
 
     // Connect new blocks.
     BOOST_REVERSE_FOREACH(CBlockIndex *pindexConnect, vpindexToConnect) {
-        if (!ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL)) {
+        if (!ConnectTip(state, pindexConnect, PrefetchBlockCoins(pindexConnect, pindexMostWork, pblock))) {
             if (state.IsInvalid()) {
                 // The block violates a consensus rule.
                 if (!state.CorruptionPossible())
@@ -2235,6 +2743,8 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
         bool fInitialDownload;
         {
             LOCK(cs_main);
+            if (!ActivateSnapshotChain())
+                return true;
             pindexMostWork = FindMostWorkChain();
 
             // Whether we have anything to do at all.
@@ -2510,7 +3020,7 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW)
 {
     // Check proof of work matches claimed amount
-    if (fCheckPOW && !CheckProofOfWork(block.GetPoWHash(), block.nBits, Params().GetConsensus()))
+    if (fCheckPOW && !CheckProofOfWork(GetBlockPoWHash(block), block.nBits, Params().GetConsensus()))
         return state.DoS(50, error("CheckBlockHeader() : proof of work failed"),
                          REJECT_INVALID, "high-hash");
 
@@ -2525,7 +3035,10 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
 {
     // These are checks that are independent of context.
-    
+
+    if (block.fChecked)
+        return true;
+
     // Check that the header is valid (particularly PoW).  This is mostly
     // redundant with the call in AcceptBlockHeader.    
     if (!CheckBlockHeader(block, state, fCheckPOW))
@@ -2579,6 +3092,9 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
                          REJECT_INVALID, "bad-blk-sigops", true);
 
+    if (fCheckPOW && fCheckMerkleRoot)
+        block.fChecked = true;
+
     return true;
 }
 
@@ -3007,12 +3523,23 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
 
 bool static LoadBlockIndexDB()
 {
-    if (!pblocktree->LoadBlockIndexGuts())
-        return false;
+    int64_t nStart = GetTimeMicros();
+    {
+        // With zero -par worker threads the queue's master (this thread) runs every check in Wait().
+        LOCK(cs_powcheckqueue);
+        CCheckQueueControl<CPoWHashCheck> control(fCheckIndexPoW ? &powcheckqueue : NULL);
+        if (!pblocktree->LoadBlockIndexGuts(fCheckIndexPoW ? &control : NULL))
+            return false;
+        int64_t nTimeGuts = GetTimeMicros();
+        if (!control.Wait())
+            return error("%s: block index proof of work check failed", __func__);
+        LogPrintf("%s: deserialized and linked %u entries in %.2fms, proof of work check %s %.2fms\n", __func__,
+            mapBlockIndex.size(), 0.001 * (nTimeGuts - nStart), fCheckIndexPoW ? "waited" : "skipped", 0.001 * (GetTimeMicros() - nTimeGuts));
+    }
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainWork
+    int64_t nTimeStart = GetTimeMicros();
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
@@ -3021,6 +3548,9 @@ bool static LoadBlockIndexDB()
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    int64_t nTimeSort = GetTimeMicros();
+
+    // Calculate nChainWork
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
@@ -3043,12 +3573,20 @@ bool static LoadBlockIndexDB()
             setBlockIndexCandidates.insert(pindex);
         if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
             pindexBestInvalid = pindex;
-            
-        if (pindex->pprev)
-            pindex->BuildSkip();
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
     }
+    int64_t nTimeChainWork = GetTimeMicros();
+
+    // Build the skip list in height order, so every ancestor's pskip is already set
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    {
+        if (item.second->pprev)
+            item.second->BuildSkip();
+    }
+    int64_t nTimeSkip = GetTimeMicros();
+    LogPrintf("%s: sort %.2fms, chain work %.2fms, skip list %.2fms\n", __func__,
+        0.001 * (nTimeSort - nTimeStart), 0.001 * (nTimeChainWork - nTimeSort), 0.001 * (nTimeSkip - nTimeChainWork));
 
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
@@ -3137,6 +3675,16 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
         nCheckDepth = chainActive.Height();
     nCheckLevel = std::max(0, std::min(4, nCheckLevel));
     LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
+    // A UTXO snapshot must be of a block in the active chain. The blocks up to it
+    // were never connected here and have no undo data, so are not disconnected.
+    CBlockIndex* pindexSnapshot = NULL;
+    uint256 hashSnapshot = pcoinsdbview ? pcoinsdbview->GetSnapshotBlock() : uint256();
+    if (!hashSnapshot.IsNull()) {
+        BlockMap::iterator mi = mapBlockIndex.find(hashSnapshot);
+        if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second))
+            return error("VerifyDB() : *** UTXO snapshot block %s is not in the active chain", hashSnapshot.ToString());
+        pindexSnapshot = mi->second;
+    }
     CCoinsViewCache coins(coinsview);
     CBlockIndex* pindexState = chainActive.Tip();
     CBlockIndex* pindexFailure = NULL;
@@ -3165,7 +3713,7 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (nCheckLevel >= 3 && pindex == pindexState && pindex != pindexSnapshot && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -3278,6 +3826,214 @@ bool InitBlockIndex() {
 
 
 
+namespace {
+
+/** A block found by the import pipeline's reader */
+struct CImportedBlock
+{
+    CBlock block;
+    CDiskBlockPos pos;
+    bool fChecked; // CheckBlock ran on it, whatever the outcome
+
+    CImportedBlock() : fChecked(false) {}
+};
+
+/**
+ * Pipeline behind LoadExternalBlockFile. A reader thread locates and
+ * deserializes the blocks in the file, a pool of threads runs the context-free
+ * CheckBlock (merkle root, PoW, transactions) on them, and the thread that
+ * called LoadExternalBlockFile connects them in file order. At most
+ * IMPORT_PIPELINE_BLOCKS blocks are read but not yet connected at a time.
+ */
+class CBlockImportPipeline
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condRead;    // reader waits for room
+    boost::condition_variable condCheck;   // checkers wait for blocks
+    boost::condition_variable condConnect; // connector waits for the next block to be checked
+    std::deque<boost::shared_ptr<CImportedBlock> > dequeBlocks; // in file order
+    std::deque<boost::shared_ptr<CImportedBlock> > dequeToCheck;
+    bool fReadDone;
+    bool fQuit;
+    std::string strError;
+    boost::thread_group threads;
+    int nCheckThreads;
+
+    // Stage counters, guarded by mutex
+    uint64_t nBlocksRead;
+    uint64_t nBytesRead;
+    int64_t nReadMicros;
+    int64_t nReadStallMicros;
+    uint64_t nBlocksChecked;
+    int64_t nCheckMicros;
+    uint64_t nBlocksConnected;
+    int64_t nConnectMicros;
+    int64_t nConnectStallMicros;
+
+    void ThreadRead(FILE* fileIn, int nFile)
+    {
+        RenameThread("lycancoin-impread");
+        int64_t nStart = GetTimeMicros();
+        try {
+            // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+            CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+            uint64_t nRewind = blkdat.GetPos();
+            while (!blkdat.eof()) {
+                boost::this_thread::interruption_point();
+                blkdat.SetPos(nRewind);
+                nRewind++; // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                try {
+                    // locate a header
+                    unsigned char buf[MESSAGE_START_SIZE];
+                    blkdat.FindByte(Params().MessageStart()[0]);
+                    nRewind = blkdat.GetPos()+1;
+                    blkdat >> FLATDATA(buf);
+                    if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                        continue;
+                    // read size
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                        continue;
+                } catch (const std::exception&) {
+                    // no valid block header found; don't complain
+                    break;
+                }
+                try {
+                    // read block
+                    boost::shared_ptr<CImportedBlock> pimported(new CImportedBlock());
+                    uint64_t nBlockPos = blkdat.GetPos();
+                    pimported->pos = CDiskBlockPos(nFile, nBlockPos);
+                    blkdat.SetLimit(nBlockPos + nSize);
+                    blkdat.SetPos(nBlockPos);
+                    blkdat >> pimported->block;
+                    nRewind = blkdat.GetPos();
+
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    int64_t nStall = GetTimeMicros();
+                    while (!fQuit && dequeBlocks.size() >= IMPORT_PIPELINE_BLOCKS)
+                        condRead.wait(lock);
+                    nReadStallMicros += GetTimeMicros() - nStall;
+                    if (fQuit)
+                        break;
+                    dequeBlocks.push_back(pimported);
+                    dequeToCheck.push_back(pimported);
+                    nBlocksRead++;
+                    nBytesRead += nSize;
+                    condCheck.notify_one();
+                } catch (const std::exception& e) {
+                    LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+                }
+            }
+        } catch (const std::runtime_error& e) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            strError = e.what();
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nReadMicros = GetTimeMicros() - nStart - nReadStallMicros;
+        fReadDone = true;
+        condCheck.notify_all();
+        condConnect.notify_all();
+    }
+
+    void ThreadCheck()
+    {
+        RenameThread("lycancoin-impcheck");
+        while (true) {
+            boost::shared_ptr<CImportedBlock> pimported;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fQuit && !fReadDone && dequeToCheck.empty())
+                    condCheck.wait(lock);
+                if (fQuit || dequeToCheck.empty())
+                    return;
+                pimported = dequeToCheck.front();
+                dequeToCheck.pop_front();
+            }
+            // A failure is left for ProcessNewBlock to find again and report.
+            int64_t nStart = GetTimeMicros();
+            CValidationState state;
+            CheckBlock(pimported->block, state);
+            int64_t nTime = GetTimeMicros() - nStart;
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            pimported->fChecked = true;
+            nBlocksChecked++;
+            nCheckMicros += nTime;
+            if (pimported == dequeBlocks.front())
+                condConnect.notify_one();
+        }
+    }
+
+public:
+    CBlockImportPipeline(FILE* fileIn, int nFile) : fReadDone(false), fQuit(false),
+        nBlocksRead(0), nBytesRead(0), nReadMicros(0), nReadStallMicros(0), nBlocksChecked(0), nCheckMicros(0),
+        nBlocksConnected(0), nConnectMicros(0), nConnectStallMicros(0)
+    {
+        nCheckThreads = std::max(1, nScriptCheckThreads - 1);
+        threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadRead, this, fileIn, nFile));
+        for (int i = 0; i < nCheckThreads; i++)
+            threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadCheck, this));
+    }
+
+    ~CBlockImportPipeline()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+            condRead.notify_all();
+            condCheck.notify_all();
+        }
+        threads.interrupt_all();
+        boost::this_thread::disable_interruption di;
+        threads.join_all();
+    }
+
+    /** Wait for the next block in file order to be checked. Returns false once the file is exhausted. */
+    bool Next(boost::shared_ptr<CImportedBlock>& pimported)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        int64_t nStall = GetTimeMicros();
+        while (!(fReadDone && dequeBlocks.empty()) && (dequeBlocks.empty() || !dequeBlocks.front()->fChecked))
+            condConnect.wait(lock);
+        nConnectStallMicros += GetTimeMicros() - nStall;
+        if (dequeBlocks.empty())
+            return false;
+        pimported = dequeBlocks.front();
+        dequeBlocks.pop_front();
+        condRead.notify_one();
+        return true;
+    }
+
+    void AddConnectTime(int64_t nMicros)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nBlocksConnected++;
+        nConnectMicros += nMicros;
+    }
+
+    /** System error the reader ran into, if any; only meaningful once Next() returned false */
+    std::string GetError()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return strError;
+    }
+
+    void LogStats()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        LogPrintf("Block import: read %u blocks (%.1fMB) at %.0f blocks/s, %.2fs waiting for room; "
+                  "checked %u at %.0f blocks/s on %d threads; connected %u at %.0f blocks/s, %.2fs waiting for checked blocks\n",
+            nBlocksRead, nBytesRead * 0.000001, nBlocksRead * 1000000.0 / std::max(nReadMicros, (int64_t)1), nReadStallMicros * 0.000001,
+            nBlocksChecked, nBlocksChecked * 1000000.0 * nCheckThreads / std::max(nCheckMicros, (int64_t)1), nCheckThreads,
+            nBlocksConnected, nBlocksConnected * 1000000.0 / std::max(nConnectMicros, (int64_t)1), nConnectStallMicros * 0.000001);
+    }
+};
+
+} // anon namespace
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
     const CChainParams& chainparams = Params();    
@@ -3287,41 +4043,14 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
     
     int nLoaded = 0;
     try {
-    	  // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-	     CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
+        CBlockImportPipeline pipeline(fileIn, dbp ? dbp->nFile : -1);
+        boost::shared_ptr<CImportedBlock> pimported;
+        while (pipeline.Next(pimported)) {
             try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-					 if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
-            }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
+                int64_t nTimeStart = GetTimeMicros();
+                CBlock& block = pimported->block;
                 if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
+                    *dbp = pimported->pos;
 
                 // detect out of order blocks, and store them for later
                 uint256 hash = block.GetHash();
@@ -3343,7 +4072,7 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
                     LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
                 }
-                
+
                 // Recursively process earlier encountered successors of this block
                 deque<uint256> queue;
                 queue.push_back(hash);
@@ -3368,10 +4097,14 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                         mapBlocksUnknownParent.erase(it);
                     }
                 }
+                pipeline.AddConnectTime(GetTimeMicros() - nTimeStart);
             } catch (const std::exception& e) {
                 LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
         }
+        if (!pipeline.GetError().empty())
+            throw std::runtime_error(pipeline.GetError());
+        pipeline.LogStats();
     } catch (const std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
     }
@@ -3667,13 +4400,13 @@ static bool NodeRecentlyStarted()
     return (timediff < (2 * 60 * 60));
 }
 
+// Only the block lookups take cs_main: blocks are read from disk, and
+// transactions looked up in the relay map and mempool, without it.
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
-    
-    LOCK(cs_main);
 
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
@@ -3688,32 +4421,51 @@ void static ProcessGetData(CNode* pfrom)
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
                 bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                CDiskBlockPos pos;
+                bool fCheckPOW = true;
+                uint256 hashTip;
                 {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                    	   static const int nOneMonth = 30 * 24 * 60 * 60;
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a month older (both in time, and in
-                        // best equivalent proof of work) than the best header chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                            (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
-                            (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, Params().GetConsensus()) < nOneMonth);
-                        if (!send) {
-                            LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                        	   static const int nOneMonth = 30 * 24 * 60 * 60;
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a month older (both in time, and in
+                            // best equivalent proof of work) than the best header chain we know about.
+                            send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
+                                (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, Params().GetConsensus()) < nOneMonth);
+                            if (!send) {
+                                LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                            }
                         }
                     }
+                    // Pruned nodes may have deleted the block, so check whether
+                    // it's available before trying to send.
+                    send = send && (mi->second->nStatus & BLOCK_HAVE_DATA);
+                    if (send) {
+                        pos = mi->second->GetBlockPos();
+                        fCheckPOW = !mi->second->IsValid(BLOCK_VALID_TREE);
+                        hashTip = chainActive.Tip()->GetBlockHash();
+                    }
                 }
-                // Pruned nodes may have deleted the block, so check whether
-                // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                if (send)
                 {
                     // Send block from disk                    
                     CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
+                    if (!ReadBlockFromDisk(block, pos, fCheckPOW) || block.GetHash() != inv.hash) {
+                        // Without cs_main, the block may have been pruned away since
+                        if (!fPruneMode)
+                            assert(!"cannot load block from disk");
+                        LogPrint("net", "%s: block %s is no longer available for peer=%i\n", __func__, inv.hash.ToString(), pfrom->GetId());
+                        break;
+                    }
+                    if (!fCheckPOW)
+                        PoWHashCacheSkipped();
                     if (inv.type == MSG_BLOCK)
                         pfrom->PushMessage("block", block);
                     else // MSG_FILTERED_BLOCK)
@@ -3745,7 +4497,7 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        vInv.push_back(CInv(MSG_BLOCK, hashTip));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue.SetNull();
                     }
@@ -3843,8 +4595,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (!vRecv.empty())
             vRecv >> addrFrom >> nNonce;
         if (!vRecv.empty()) {
-            vRecv >> LIMITED_STRING(pfrom->strSubVer, 256);
-            pfrom->cleanSubVer = SanitizeString(pfrom->strSubVer);
+            std::string strSubVer;
+            vRecv >> LIMITED_STRING(strSubVer, 256);
+            LOCK(pfrom->cs_SubVer);
+            pfrom->strSubVer = strSubVer;
+            pfrom->cleanSubVer = SanitizeString(strSubVer);
         }
         if (!vRecv.empty())
             vRecv >> pfrom->nStartingHeight;
@@ -3874,7 +4629,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
 
         // Potentially mark this peer as a preferred download peer.
-        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        {
+            LOCK(cs_main);
+            UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        }
 
         // Change version
         pfrom->PushMessage("verack");
@@ -3986,9 +4744,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
                     // at a time so the addrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt.IsNull())
-                        hashSalt = GetRandHash();
+                    static const uint256 hashSalt = GetRandHash();
                     uint64_t hashAddr = addr.GetHash();
                     uint256 hashRand = ArithToUint256(UintToArith256(hashSalt) ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60)));
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
@@ -4029,6 +4785,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             Misbehaving(pfrom->GetId(), 20);
             return error("message inv size() = %u", vInv.size());
         }
+
+        BOOST_FOREACH(const CInv& inv, vInv)
+            pfrom->AddInventoryKnown(inv);
         
         LOCK(cs_main);
         
@@ -4039,7 +4798,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             const CInv &inv = vInv[nInv];
 
             boost::this_thread::interruption_point();
-            pfrom->AddInventoryKnown(inv);
 
             bool fAlreadyHave = AlreadyHave(inv);
             LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
@@ -4305,6 +5063,37 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Scrypt is the expensive part of accepting a header: do it for the whole
+        // batch in parallel before taking cs_main for the contextual checks. Only
+        // for the unknown headers the loop below would get to the PoW check of:
+        // up to the first one that doesn't link to the one before it, the first
+        // to a block we have. And only once the first of them has passed the
+        // cheap contextual checks (difficulty and timestamp) against its parent,
+        // so a batch of junk costs no scrypt hashes at all.
+        std::vector<CBlockHeader> vUnknown;
+        {
+            LOCK(cs_main);
+            for (unsigned int n = 0; n < headers.size(); n++) {
+                const CBlockHeader& header = headers[n];
+                if (n == 0 ? !mapBlockIndex.count(header.hashPrevBlock) : header.hashPrevBlock != headers[n - 1].GetHash())
+                    break;
+                if (!mapBlockIndex.count(header.GetHash()))
+                    vUnknown.push_back(header);
+            }
+            if (!vUnknown.empty()) {
+                // Every header before the first unknown one is in mapBlockIndex,
+                // so its parent is too.
+                const CBlockHeader& first = vUnknown[0];
+                CBlockIndex* pindexPrev = mapBlockIndex[first.hashPrevBlock];
+                if (first.nBits != GetNextWorkRequired(pindexPrev, &first, Params().GetConsensus()) ||
+                    first.GetBlockTime() <= pindexPrev->GetMedianTimePast() ||
+                    first.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+                    vUnknown.clear();
+            }
+        }
+        if (!vUnknown.empty())
+            CacheHeadersPoW(vUnknown);
+
         LOCK(cs_main);
 
         if (nCount == 0) {
@@ -4374,7 +5163,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     // getaddr message mitigates the attack.
     else if ((strCommand == "getaddr") && (pfrom->fInbound))
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_inventory);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -4492,12 +5284,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> alert;
 
         uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
+        bool fKnown;
+        {
+            LOCK(cs_mapAlerts);
+            fKnown = pfrom->setKnown.count(alertHash) > 0;
+        }
+        if (!fKnown)
         {
             if (alert.ProcessAlert(Params().AlertKey()))
             {
                 // Relay
-                pfrom->setKnown.insert(alertHash);
+                {
+                    LOCK(cs_mapAlerts);
+                    pfrom->setKnown.insert(alertHash);
+                }
                 {
                     LOCK(cs_vNodes);
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -4754,33 +5554,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
         }
 
-        TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
-        if (!lockMain)
-            return true;
-
-        // Address refresh broadcast
-        static int64_t nLastRebroadcast;
-        if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60))
-        {
-        	   LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                // Periodically clear addrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
-                    pnode->addrKnown.clear();
-
-                // Rebroadcast our address
-                AdvertizeLocal(pnode);
-            }
-            if (!vNodes.empty())
-                nLastRebroadcast = GetTime();
-        }
-
         //
         // Message: addr
         //
         if (fSendTrickle)
         {
+            LOCK(pto->cs_inventory);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
@@ -4802,49 +5581,6 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 pto->PushMessage("addr", vAddr);
         }
             
-        CNodeState &state = *State(pto->GetId());
-        if (state.fShouldBan) {
-            if (pto->fWhitelisted)
-                LogPrintf("Warning: not punishing whitelisted peer %s!\n", pto->addr.ToString());
-            else {
-                pto->fDisconnect = true;
-                if (pto->addr.IsLocal())
-                    LogPrintf("Warning: not banning local peer %s!\n", pto->addr.ToString());
-                else
-                {
-                    CNode::Ban(pto->addr);
-                }
-            }
-            state.fShouldBan = false;
-        }
-        
-        BOOST_FOREACH(const CBlockReject& reject, state.rejects)
-            pto->PushMessage("reject", (string)"block", reject.chRejectCode, reject.strRejectReason, reject.hashBlock);
-        state.rejects.clear();
-
-        // Start block sync
-        if (pindexBestHeader == NULL)
-            pindexBestHeader = chainActive.Tip();
-        bool fFetch = state.fPreferredDownload || (nPreferredDownload == 0 && !pto->fClient && !pto->fOneShot); // Download if this is a nice peer, or we have no nice peers and this one might do.
-        if (!state.fSyncStarted && !pto->fClient && !fImporting && !fReindex) {
-            // Only actively request headers from a single peer, unless we're close to today.
-            if ((nSyncStarted == 0 && fFetch) || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 24 * 60 * 60) {
-                state.fSyncStarted = true;
-                nSyncStarted++;
-                CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256());
-            }
-        }
-
-        // Resend wallet transactions that haven't gotten in a block yet
-        // Except during reindex, importing and IBD, when old wallet
-        // transactions become unconfirmed and spams other nodes.
-        if (!fReindex && !fImporting && !IsInitialBlockDownload())
-        {
-            GetMainSignals().Broadcast(nTimeBestReceived);
-        }
-
         //
         // Message: inventory
         //
@@ -4863,9 +5599,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 if (inv.type == MSG_TX && !fSendTrickle)
                 {
                     // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt.IsNull())
-                        hashSalt = GetRandHash();
+                    static const uint256 hashSalt = GetRandHash();
                     uint256 hashRand = ArithToUint256(UintToArith256(inv.hash) ^ UintToArith256(hashSalt));
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
                     bool fTrickleWait = ((UintToArith256(hashRand) & 3) != 0);
@@ -4893,6 +5627,73 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
 
+        TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
+        if (!lockMain)
+            return true;
+
+        // Address refresh broadcast
+        static int64_t nLastRebroadcast;
+        if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60))
+        {
+        	   LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+            {
+                // Periodically clear addrKnown to allow refresh broadcasts
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_inventory);
+                    pnode->addrKnown.clear();
+                }
+
+                // Rebroadcast our address
+                AdvertizeLocal(pnode);
+            }
+            if (!vNodes.empty())
+                nLastRebroadcast = GetTime();
+        }
+
+        CNodeState &state = *State(pto->GetId());
+        if (state.fShouldBan) {
+            if (pto->fWhitelisted)
+                LogPrintf("Warning: not punishing whitelisted peer %s!\n", pto->addr.ToString());
+            else {
+                pto->fDisconnect = true;
+                if (pto->addr.IsLocal())
+                    LogPrintf("Warning: not banning local peer %s!\n", pto->addr.ToString());
+                else
+                {
+                    CNode::Ban(pto->addr);
+                }
+            }
+            state.fShouldBan = false;
+        }
+        
+        BOOST_FOREACH(const CBlockReject& reject, state.rejects)
+            pto->PushMessage("reject", (string)"block", reject.chRejectCode, reject.strRejectReason, reject.hashBlock);
+        state.rejects.clear();
+
+        // Start block sync
+        if (pindexBestHeader == NULL)
+            pindexBestHeader = chainActive.Tip();
+        bool fFetch = state.fPreferredDownload || (nPreferredDownload == 0 && !pto->fClient && !pto->fOneShot); // Download if this is a nice peer, or we have no nice peers and this one might do.
+        if (!state.fSyncStarted && !pto->fClient && !fImporting && !fReindex) {
+            // Only actively request headers from a single peer, unless we're close to today.
+            if ((nSyncStarted == 0 && fFetch) || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 24 * 60 * 60) {
+                state.fSyncStarted = true;
+                nSyncStarted++;
+                CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+                LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
+                pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256());
+            }
+        }
+
+        // Resend wallet transactions that haven't gotten in a block yet
+        // Except during reindex, importing and IBD, when old wallet
+        // transactions become unconfirmed and spams other nodes.
+        if (!fReindex && !fImporting && !IsInitialBlockDownload())
+        {
+            GetMainSignals().Broadcast(nTimeBestReceived);
+        }
+
         // Detect whether we're stalling
         int64_t nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
@@ -40,6 +40,7 @@
 #include <utility>
 #include <vector>
 
+#include <boost/atomic.hpp>
 #include <boost/unordered_map.hpp>
 
 #include <cmath>
@@ -47,7 +48,10 @@
 class CCoinsDB;
 class CBlockIndex;
 class CBlockTreeDB;
+class CBlockFilterDB;
+class CCoinsViewDB;
 class CBloomFilter;
+struct CCheckQueueStats;
 class CInv;
 class CScriptCheck;
 class CValidationState;
@@ -73,6 +77,18 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxmempool, maximum megabytes of memory the mempool may use */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -limitancestorcount, maximum number of in-pool ancestors of a pool transaction, itself included */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of a pool transaction and its in-pool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, maximum number of in-pool descendants of a pool transaction, itself included */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of a pool transaction and its in-pool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -persistmempool, saving the mempool on shutdown and loading it on startup */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
 static const int FIX_RETARGET_HEIGHT = 24000; // First Fork
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
@@ -84,6 +100,12 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Number of blocks, starting at the one being connected, whose coins are read ahead into the cache */
+static const unsigned int COINS_PREFETCH_BLOCKS = 8;
+/** Number of coins database reads per prefetch work item */
+static const unsigned int COINS_PREFETCH_BATCH = 16;
+/** Maximum number of blocks read ahead of the one being connected when importing a block file */
+static const unsigned int IMPORT_PIPELINE_BLOCKS = 64;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -128,11 +150,18 @@ extern CWaitableCriticalSection csBestBlock;
 extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
+/** Whether mempool.dat has been loaded (or found missing), so that the pool may be written back over it */
+extern boost::atomic<bool> fMempoolLoaded;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
+extern bool fBlockFilterIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
-extern unsigned int nCoinCacheSize;
+extern bool fCheckIndexPoW;
+extern size_t nCoinCacheUsage;
+/** Largest coins cache memory usage seen since startup, in bytes */
+extern size_t nCoinCacheUsagePeak;
+extern bool fPartialFlush;
 extern CFeeRate minRelayTxFee;
 
 // Best header we've seen so far (used for getheaders queries' starting points).
@@ -199,6 +228,20 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Get the script check queue's verification counters */
+void GetScriptCheckQueueStats(CCheckQueueStats& stats);
+/** Run an instance of the header proof-of-work checking thread */
+void ThreadPoWCheck();
+/**
+ * Run scrypt over a batch of headers on the -par worker threads, so that the
+ * CheckBlockHeader calls made later under cs_main find their PoW hashes cached.
+ * Safe to call from several threads at once; must not be called with cs_main held.
+ */
+void CacheHeadersPoW(const std::vector<CBlockHeader>& vHeaders);
+/** Run an instance of the coins database prefetching thread */
+void ThreadCoinsPrefetch();
+/** Build block filters for the blocks of the active chain that have none, picking up where it left off */
+void ThreadBlockFilterIndex();
 bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock, bool fAllowSlow = false);
@@ -243,6 +286,13 @@ void PruneAndFlush();
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+/** (try to) add transaction to memory pool, as having entered it at nAcceptTime **/
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectAbsurdFee=false);
+/** Write the memory pool's transactions and prioritisations to mempool.dat */
+bool DumpMempool();
+/** Re-admit the transactions saved in mempool.dat into the memory pool */
+bool LoadMempool();
                         
 
 struct CNodeStateStats {
@@ -369,9 +419,30 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/** Closure computing the PoW hashes of a slice of headers, either into the
+ *  PoW hash cache or, with fVerify, checking them against their nBits */
+class CPoWHashCheck
+{
+private:
+    std::vector<CBlockHeader> vHeaders;
+    bool fVerify;
+
+public:
+    CPoWHashCheck(): fVerify(false) {}
+    CPoWHashCheck(std::vector<CBlockHeader>::const_iterator begin, std::vector<CBlockHeader>::const_iterator end, bool fVerifyIn = false) :
+        vHeaders(begin, end), fVerify(fVerifyIn) {}
+
+    bool operator()();
+
+    void swap(CPoWHashCheck &check) {
+        vHeaders.swap(check.vHeaders);
+        std::swap(fVerify, check.fVerify);
+    }
+};
+
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, bool fCheckPOW = true);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
 
 
@@ -546,9 +617,18 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the coin database under pcoinsTip (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Global variable that points to the block filter index, if -blockfilterindex */
+extern CBlockFilterDB *pblockfilterdb;
+
+/** Whether the coins were loaded from a UTXO snapshot (-loadtxoutset) whose block is not stored yet */
+bool IsTxOutSetSnapshotPending();
+
 #if defined(_M_IX86) || defined(__i386__) || defined(__i386) || defined(_M_X64) || defined(__x86_64__) || defined(_M_AMD64)
 extern unsigned int cpuid_edx;
 #endif
@@ -19,7 +19,6 @@
 #include "wallet/wallet.h"
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 
 #include <openssl/sha.h>
 
@@ -66,58 +65,148 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-//
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
-//
-class COrphan
-{
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
+// Once the block is this close to full, give up after this many transactions in a row do not fit
+static const unsigned int MAX_CONSECUTIVE_FAILURES = 1000;
+static const unsigned int BLOCK_FULL_MARGIN = 4000;
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+// Orders a package of pool transactions so that parents come before their spenders
+struct CompareTxIterByAncestorCount
+{
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
     {
+        if (a->second.GetCountWithAncestors() != b->second.GetCountWithAncestors())
+            return a->second.GetCountWithAncestors() < b->second.GetCountWithAncestors();
+        return a->first < b->first;
     }
 };
 
+static bool ParentsInBlock(CTxMemPool::txiter it, const CTxMemPool::setEntries& setInBlock)
+{
+    BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(it)) {
+        if (!setInBlock.count(parent))
+            return false;
+    }
+    return true;
+}
 
+// A pool entry's totals with its ancestors, less those already in the block
+struct CPackageScore
+{
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
+    CPackageScore() : nSizeWithAncestors(0), nModFeesWithAncestors(0) {}
+    explicit CPackageScore(const CTxMemPoolEntry& entry) :
+        nSizeWithAncestors(entry.GetSizeWithAncestors()), nModFeesWithAncestors(entry.GetModFeesWithAncestors()) {}
+};
+
+typedef std::map<CTxMemPool::txiter, CPackageScore, CompareIteratorByHash> CPackageScoreMap;
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+// Orders the entries of a CPackageScoreMap as CompareTxMemPoolEntryByAncestorFeeRate orders
+// the pool; an entry's score must not change while it is in a set ordered by this
+struct CompareModifiedByAncestorFeeRate
 {
-    bool byFee;
+    const CPackageScoreMap* pmapScore;
 
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
+    explicit CompareModifiedByAncestorFeeRate(const CPackageScoreMap& mapScore) : pmapScore(&mapScore) {}
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
     {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        }
-        else
-        {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        const CPackageScore& sa = pmapScore->find(a)->second;
+        const CPackageScore& sb = pmapScore->find(b)->second;
+        double f1 = (double)sa.nModFeesWithAncestors * sb.nSizeWithAncestors;
+        double f2 = (double)sb.nModFeesWithAncestors * sa.nSizeWithAncestors;
+        if (f1 == f2)
+            return a->first < b->first;
+        return f1 > f2;
     }
 };
 
+// Take a package just added to the block out of the scores of the descendants
+// of its transactions
+static void UpdatePackagesForAdded(const std::vector<CTxMemPool::txiter>& vAdded, const CTxMemPool::setEntries& setInBlock,
+                                   CPackageScoreMap& mapModified, std::set<CTxMemPool::txiter, CompareModifiedByAncestorFeeRate>& setModified)
+{
+    BOOST_FOREACH(CTxMemPool::txiter itAdded, vAdded) {
+        CTxMemPool::setEntries setDescendants;
+        mempool.CalculateDescendants(itAdded, setDescendants);
+        BOOST_FOREACH(CTxMemPool::txiter descendant, setDescendants) {
+            if (setInBlock.count(descendant))
+                continue;
+            CPackageScoreMap::iterator itScore = mapModified.find(descendant);
+            if (itScore == mapModified.end())
+                itScore = mapModified.insert(std::make_pair(descendant, CPackageScore(descendant->second))).first;
+            else
+                setModified.erase(descendant);
+            itScore->second.nSizeWithAncestors -= itAdded->second.GetTxSize();
+            itScore->second.nModFeesWithAncestors -= itAdded->second.GetModifiedFee();
+            setModified.insert(descendant);
+        }
+    }
+}
+
+//
+// Add a package of pool transactions, parents first, to the block being
+// assembled. Either all of them go in, or none does and view is untouched.
+//
+static bool AddPackageToBlock(const std::vector<CTxMemPool::txiter>& vPackage, CCoinsViewCache& view, int nHeight,
+                              unsigned int nBlockMaxSize, CBlockTemplate* pblocktemplate,
+                              uint64_t& nBlockSize, int& nBlockSigOps, CAmount& nFees)
+{
+    // Size limits and legacy limits on sigOps
+    uint64_t nPackageSize = 0;
+    unsigned int nPackageSigOps = 0;
+    BOOST_FOREACH(CTxMemPool::txiter it, vPackage) {
+        const CTransaction& tx = it->second.GetTx();
+        if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight))
+            return false;
+        nPackageSize += it->second.GetTxSize();
+        nPackageSigOps += GetLegacySigOpCount(tx);
+    }
+    if (nBlockSize + nPackageSize >= nBlockMaxSize || nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+
+    CCoinsViewCache viewPackage(&view);
+    std::vector<CAmount> vTxFees;
+    std::vector<int64_t> vTxSigOps;
+    BOOST_FOREACH(CTxMemPool::txiter it, vPackage) {
+        const CTransaction& tx = it->second.GetTx();
+        if (!viewPackage.HaveInputs(tx))
+            return false;
+
+        unsigned int nP2SHSigOps = GetP2SHSigOpCount(tx, viewPackage);
+        nPackageSigOps += nP2SHSigOps;
+        if (nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        CValidationState state;
+        if (!CheckInputs(tx, state, viewPackage, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+            return false;
+
+        vTxFees.push_back(viewPackage.GetValueIn(tx) - tx.GetValueOut());
+        vTxSigOps.push_back(GetLegacySigOpCount(tx) + nP2SHSigOps);
+        UpdateCoins(tx, state, viewPackage, nHeight);
+    }
+    viewPackage.Flush();
+
+    // Added
+    for (unsigned int i = 0; i < vPackage.size(); i++) {
+        pblocktemplate->block.vtx.push_back(vPackage[i]->second.GetTx());
+        pblocktemplate->vTxFees.push_back(vTxFees[i]);
+        pblocktemplate->vTxSigOps.push_back(vTxSigOps[i]);
+        nFees += vTxFees[i];
+    }
+    nBlockSize += nPackageSize;
+    nBlockSigOps += nPackageSigOps;
+    return true;
+}
+
 void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
 {
     pblock->nTime = std::max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
@@ -129,6 +218,8 @@ void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams,
 
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
 {
+    int64_t nTimeStart = GetTimeMicros();
+
     // Create new block
     auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
     if(!pblocktemplate.get())
@@ -176,186 +267,139 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         const int nHeight = pindexPrev->nHeight + 1;
         CCoinsViewCache view(pcoinsTip);
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
         bool fPrintPriority = GetBoolArg("-printpriority", false);
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
+        // Transactions are taken from the pool's own indexes, so the work done
+        // here grows with the block size, times the relatives each transaction
+        // may have in the pool (-limitancestorcount, -limitdescendantcount),
+        // rather than with the pool size.
+        uint64_t nBlockSize = 1000;
+        uint64_t nBlockTx = 0;
+        int nBlockSigOps = 100;
+        CTxMemPool::setEntries setInBlock;
+        // Pool transactions with ancestors in the block, scored on the ancestors
+        // that are not, kept up to date by both passes for the fee rate pass
+        CPackageScoreMap mapModified;
+        std::set<CTxMemPool::txiter, CompareModifiedByAncestorFeeRate> setModified((CompareModifiedByAncestorFeeRate(mapModified)));
+
+        // First the highest-priority transactions, included regardless of the
+        // fees they pay. Those spending other pool transactions wait until
+        // their parents are in, and then compete on their priority again.
         {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            CTxMemPool::setEntries setWaiting;
+            std::set<CTxMemPool::txiter, CompareTxMemPoolEntryByPriority> setReady;
+            std::set<CTxMemPool::txiter, CompareTxMemPoolEntryByPriority>::const_iterator mi = mempool.setByPriority.begin();
+            while (nBlockPrioritySize > 0 && (mi != mempool.setByPriority.end() || !setReady.empty()))
             {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
+                CTxMemPool::txiter it;
+                if (!setReady.empty() && (mi == mempool.setByPriority.end() || CompareTxMemPoolEntryByPriority()(*setReady.begin(), *mi))) {
+                    it = *setReady.begin();
+                    setReady.erase(setReady.begin());
+                } else {
+                    it = *mi++;
+                }
+                double dPriority = it->second.GetIndexPriority();
+                if (nBlockSize + it->second.GetTxSize() >= nBlockPrioritySize || !AllowFree(dPriority))
+                    break;
 
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
+                if (!ParentsInBlock(it, setInBlock)) {
+                    setWaiting.insert(it);
                     continue;
                 }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
 
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-            
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
+                std::vector<CTxMemPool::txiter> vPackage(1, it);
+                if (!AddPackageToBlock(vPackage, view, nHeight, nBlockMaxSize, pblocktemplate.get(), nBlockSize, nBlockSigOps, nFees))
+                    continue;
+                setInBlock.insert(it);
+                ++nBlockTx;
+                UpdatePackagesForAdded(vPackage, setInBlock, mapModified, setModified);
+                BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(it)) {
+                    if (setWaiting.count(child) && ParentsInBlock(child, setInBlock)) {
+                        setWaiting.erase(child);
+                        setReady.insert(child);
+                    }
+                }
 
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
+                if (fPrintPriority)
+                {
+                    LogPrintf("priority %.1f fee %s txid %s\n",
+                              dPriority, CFeeRate(it->second.GetModifiedFee(), it->second.GetTxSize()).ToString(), it->first.ToString());
+                }
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
         }
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
+        // Then by the fee rate of each transaction together with the ancestors
+        // not in the block yet, so a child paying well pulls its parents in.
+        // Those with ancestors in the block already are scored on the rest, in
+        // mapModified, and taken from there when they beat the pool's best.
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
+            CTxMemPool::setEntries setFailed;
+            unsigned int nConsecutiveFailed = 0;
+            std::set<CTxMemPool::txiter, CompareTxMemPoolEntryByAncestorFeeRate>::const_iterator mi = mempool.setByAncestorFeeRate.begin();
+            while (mi != mempool.setByAncestorFeeRate.end() || !setModified.empty())
             {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
+                if (mi != mempool.setByAncestorFeeRate.end() && (setInBlock.count(*mi) || setFailed.count(*mi) || mapModified.count(*mi))) {
+                    ++mi;
+                    continue;
+                }
 
-            UpdateCoins(tx, state, view, nHeight);
+                CTxMemPool::txiter it;
+                CPackageScore score;
+                bool fModified = mi == mempool.setByAncestorFeeRate.end();
+                if (!fModified && !setModified.empty()) {
+                    const CPackageScore& best = mapModified.find(*setModified.begin())->second;
+                    fModified = (double)best.nModFeesWithAncestors * (*mi)->second.GetSizeWithAncestors() >
+                                (double)(*mi)->second.GetModFeesWithAncestors() * best.nSizeWithAncestors;
+                }
+                if (fModified) {
+                    it = *setModified.begin();
+                    score = mapModified.find(it)->second;
+                    setModified.erase(setModified.begin());
+                    mapModified.erase(it);
+                } else {
+                    it = *mi++;
+                    score = CPackageScore(it->second);
+                }
 
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+                // Skip free transactions if we're past the minimum block size; the rest pay even less
+                CFeeRate feeRate(score.nModFeesWithAncestors, score.nSizeWithAncestors);
+                if (feeRate < ::minRelayTxFee && nBlockSize >= nBlockMinSize)
+                    break;
 
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                          dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
+                CTxMemPool::setEntries setAncestors;
+                mempool.CalculateMemPoolAncestors(it, setAncestors);
+                std::vector<CTxMemPool::txiter> vPackage(1, it);
+                BOOST_FOREACH(CTxMemPool::txiter ancestor, setAncestors) {
+                    if (!setInBlock.count(ancestor))
+                        vPackage.push_back(ancestor);
+                }
+                std::sort(vPackage.begin(), vPackage.end(), CompareTxIterByAncestorCount());
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
+                if (!AddPackageToBlock(vPackage, view, nHeight, nBlockMaxSize, pblocktemplate.get(), nBlockSize, nBlockSigOps, nFees)) {
+                    setFailed.insert(it);
+                    if (++nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockSize + BLOCK_FULL_MARGIN > nBlockMaxSize)
+                        break;
+                    continue;
+                }
+                nConsecutiveFailed = 0;
+                BOOST_FOREACH(CTxMemPool::txiter itAdded, vPackage) {
+                    setInBlock.insert(itAdded);
+                    ++nBlockTx;
+                    if (fPrintPriority)
                     {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
+                        LogPrintf("priority %.1f fee %s txid %s\n",
+                                  itAdded->second.GetIndexPriority(), feeRate.ToString(), itAdded->first.ToString());
                     }
                 }
+                UpdatePackagesForAdded(vPackage, setInBlock, mapModified, setModified);
             }
         }
 
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
         LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
+        LogPrint("bench", "CreateNewBlock(): %u transactions out of a mempool of %u assembled in %.2fms\n",
+                 nBlockTx, mempool.mapTx.size(), 0.001 * (GetTimeMicros() - nTimeStart));
 
         // Compute final coinbase transaction.
         txNew.vout[0].nValue = GetBlockValue(nHeight, nFees);
@@ -395,6 +439,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
 
     pblock->vtx[0] = txCoinbase;
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    pblock->fChecked = false;
 }
 
 
@@ -563,23 +608,43 @@ void static BitcoinMiner(CWallet *pwallet)
         //
         int64_t nStart = GetTime();
         arith_uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
-        uint256 thash;
+        // Consecutive nonces are hashed SCRYPT_MULTI_WAYS at a time
+        CBlockHeader vheader[SCRYPT_MULTI_WAYS];
+        uint256 vhash[SCRYPT_MULTI_WAYS];
+        const char* vinput[SCRYPT_MULTI_WAYS];
+        char* voutput[SCRYPT_MULTI_WAYS];
+        for (unsigned int i = 0; i < SCRYPT_MULTI_WAYS; i++) {
+            vinput[i] = BEGIN(vheader[i].nVersion);
+            voutput[i] = BEGIN(vhash[i]);
+        }
+        std::vector<char> vscratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE);
         while (true) {
         	   unsigned int nHashesDone = 0;
-            char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
+            bool fFound = false;
             while (true)
             {
-                scrypt_1024_1_1_256_sp(BEGIN(pblock->nVersion), BEGIN(thash), scratchpad);
-                if (UintToArith256(thash) <= hashTarget)
-                {
-                    // Found a solution
-                    SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pblock, *pwallet, reservekey);
-                    SetThreadPriority(THREAD_PRIORITY_LOWEST);
-                    break;
+                for (unsigned int i = 0; i < SCRYPT_MULTI_WAYS; i++) {
+                    vheader[i] = pblock->GetBlockHeader();
+                    vheader[i].nNonce += i;
+                }
+                scrypt_1024_1_1_256_multi_sp(vinput, voutput, SCRYPT_MULTI_WAYS, &vscratchpad[0]);
+                for (unsigned int i = 0; i < SCRYPT_MULTI_WAYS; i++) {
+                    if (UintToArith256(vhash[i]) <= hashTarget)
+                    {
+                        // Found a solution
+                        pblock->nNonce = vheader[i].nNonce;
+                        pblock->fChecked = false;
+                        SetThreadPriority(THREAD_PRIORITY_NORMAL);
+                        CheckWork(pblock, *pwallet, reservekey);
+                        SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                        fFound = true;
+                        break;
+                    }
                 }
-                pblock->nNonce += 1;
-                nHashesDone += 1;
+                if (fFound)
+                    break;
+                pblock->nNonce += SCRYPT_MULTI_WAYS;
+                nHashesDone += SCRYPT_MULTI_WAYS;
                 if ((pblock->nNonce & 0xFF) == 0)
                     break;
             }
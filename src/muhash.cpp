@@ -0,0 +1,172 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "muhash.h"
+
+#include "crypto/sha256.h"
+#include "crypto/sha512.h"
+
+#include <string.h>
+
+namespace {
+
+void CheckBN(bool fOk, const char* pszFunc)
+{
+    if (!fOk)
+        throw std::runtime_error(std::string(pszFunc) + " : OpenSSL bignum operation failed");
+}
+
+/** 2^3072 - 1103717, the largest 3072-bit safe prime, with its Montgomery context */
+class CMuHashModulus
+{
+public:
+    BIGNUM* pmod;
+    BN_MONT_CTX* pmont;
+
+    CMuHashModulus()
+    {
+        BN_CTX* pctx = BN_CTX_new();
+        pmod = BN_new();
+        pmont = BN_MONT_CTX_new();
+        bool fOk = pctx && pmod && pmont && BN_set_bit(pmod, 3072) && BN_sub_word(pmod, 1103717) &&
+                   BN_MONT_CTX_set(pmont, pmod, pctx);
+        BN_CTX_free(pctx);
+        CheckBN(fOk, __func__);
+    }
+    ~CMuHashModulus()
+    {
+        BN_MONT_CTX_free(pmont);
+        BN_free(pmod);
+    }
+};
+
+const CMuHashModulus& Modulus()
+{
+    static CMuHashModulus modulus;
+    return modulus;
+}
+
+/** RAII wrapper for a BN_CTX */
+class CBNCtx
+{
+public:
+    BN_CTX* pctx;
+
+    CBNCtx() : pctx(BN_CTX_new()) { CheckBN(pctx, __func__); }
+    ~CBNCtx() { BN_CTX_free(pctx); }
+};
+
+/**
+ * Multiply pacc by the number an element hash maps to. The hash is expanded to
+ * a 3072-bit x with SHA512 in counter mode, and the element is x/R, where R is
+ * the Montgomery radix: the accumulators are kept in Montgomery form, so that
+ * makes every change a single Montgomery multiplication by x.
+ */
+void MultiplyElement(BIGNUM* pacc, const uint256& hash)
+{
+    unsigned char pch[384];
+    for (unsigned char i = 0; i < 6; i++)
+        CSHA512().Write(hash.begin(), hash.size()).Write(&i, 1).Finalize(pch + 64 * i);
+
+    const CMuHashModulus& mod = Modulus();
+    CBNCtx ctx;
+    BN_CTX_start(ctx.pctx);
+    BIGNUM* pelem = BN_CTX_get(ctx.pctx);
+    bool fOk = pelem && BN_bin2bn(pch, sizeof(pch), pelem);
+    if (fOk && BN_cmp(pelem, mod.pmod) >= 0)
+        fOk = BN_sub(pelem, pelem, mod.pmod);
+    fOk = fOk && BN_mod_mul_montgomery(pacc, pacc, pelem, mod.pmont, ctx.pctx);
+    BN_CTX_end(ctx.pctx);
+    CheckBN(fOk, __func__);
+}
+
+/** Set pval to the Montgomery form of 1 */
+bool SetOne(BIGNUM* pval, BN_CTX* pctx)
+{
+    return BN_one(pval) && BN_to_montgomery(pval, pval, Modulus().pmont, pctx);
+}
+
+} // anon namespace
+
+CMuHash3072::CMuHash3072() : pnum(BN_new()), pden(BN_new())
+{
+    CBNCtx ctx;
+    CheckBN(pnum && pden && SetOne(pnum, ctx.pctx) && SetOne(pden, ctx.pctx), __func__);
+}
+
+CMuHash3072::CMuHash3072(const CMuHash3072& other) : pnum(BN_dup(other.pnum)), pden(BN_dup(other.pden))
+{
+    CheckBN(pnum && pden, __func__);
+}
+
+CMuHash3072& CMuHash3072::operator=(const CMuHash3072& other)
+{
+    CheckBN(BN_copy(pnum, other.pnum) && BN_copy(pden, other.pden), __func__);
+    return *this;
+}
+
+CMuHash3072::~CMuHash3072()
+{
+    BN_free(pnum);
+    BN_free(pden);
+}
+
+void CMuHash3072::Insert(const uint256& hash)
+{
+    MultiplyElement(pnum, hash);
+}
+
+void CMuHash3072::Remove(const uint256& hash)
+{
+    MultiplyElement(pden, hash);
+}
+
+CMuHash3072& CMuHash3072::operator*=(const CMuHash3072& other)
+{
+    CBNCtx ctx;
+    CheckBN(BN_mod_mul_montgomery(pnum, pnum, other.pnum, Modulus().pmont, ctx.pctx) &&
+            BN_mod_mul_montgomery(pden, pden, other.pden, Modulus().pmont, ctx.pctx), __func__);
+    return *this;
+}
+
+void CMuHash3072::Normalized(unsigned char* pch) const
+{
+    CBNCtx ctx;
+    BN_CTX_start(ctx.pctx);
+    BIGNUM* pinv = BN_CTX_get(ctx.pctx);
+    BIGNUM* pval = BN_CTX_get(ctx.pctx);
+    // (num R) / (den R) leaves the plain quotient
+    bool fOk = pinv && pval && BN_mod_inverse(pinv, pden, Modulus().pmod, ctx.pctx) &&
+               BN_mod_mul(pval, pnum, pinv, Modulus().pmod, ctx.pctx);
+    if (fOk) {
+        // Big endian, zero padded to the full width
+        memset(pch, 0, BYTES);
+        BN_bn2bin(pval, pch + BYTES - BN_num_bytes(pval));
+    }
+    BN_CTX_end(ctx.pctx);
+    CheckBN(fOk, __func__);
+}
+
+bool CMuHash3072::IsEmpty() const
+{
+    return BN_cmp(pnum, pden) == 0;
+}
+
+uint256 CMuHash3072::GetHash() const
+{
+    unsigned char pch[BYTES];
+    Normalized(pch);
+    uint256 hash;
+    CSHA256().Write(pch, BYTES).Finalize(hash.begin());
+    return hash;
+}
+
+void CMuHash3072::SetNormalized(const unsigned char* pch)
+{
+    CBNCtx ctx;
+    bool fOk = BN_bin2bn(pch, BYTES, pnum) && BN_cmp(pnum, Modulus().pmod) < 0 &&
+               BN_to_montgomery(pnum, pnum, Modulus().pmont, ctx.pctx) && SetOne(pden, ctx.pctx);
+    if (!fOk)
+        throw std::ios_base::failure("CMuHash3072::SetNormalized : invalid value");
+}
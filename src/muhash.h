@@ -0,0 +1,78 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MUHASH_H
+#define BITCOIN_MUHASH_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <ios>
+#include <stdexcept>
+
+#include <openssl/bn.h>
+
+/**
+ * Order-independent hash of a set of elements, given as their 256-bit hashes.
+ *
+ * Every element hash is expanded to a 3072-bit number, and the set hash is
+ * the product of those numbers modulo the prime 2^3072 - 1103717. Elements
+ * are added and removed in any order, and the hashes of two disjoint sets
+ * combine by multiplication, so the hash of a set that changes over time can
+ * be kept up to date with one modular multiplication per change. Removals
+ * are multiplied into a separate denominator, which is only divided out (one
+ * modular inversion) when the value is read or serialized.
+ */
+class CMuHash3072
+{
+private:
+    BIGNUM* pnum;
+    BIGNUM* pden;
+
+    static const unsigned int BYTES = 384;
+
+    void Normalized(unsigned char* pch) const;
+    void SetNormalized(const unsigned char* pch);
+
+public:
+    CMuHash3072();
+    CMuHash3072(const CMuHash3072& other);
+    CMuHash3072& operator=(const CMuHash3072& other);
+    ~CMuHash3072();
+
+    /** Add an element to the set */
+    void Insert(const uint256& hash);
+    /** Remove an element from the set (it need not have been added before) */
+    void Remove(const uint256& hash);
+    /** Combine with the changes in other */
+    CMuHash3072& operator*=(const CMuHash3072& other);
+
+    /** Whether this is the hash of the empty set */
+    bool IsEmpty() const;
+    /** 256-bit digest of the set hash */
+    uint256 GetHash() const;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return BYTES;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        unsigned char pch[BYTES];
+        Normalized(pch);
+        s.write((char*)pch, BYTES);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned char pch[BYTES];
+        s.read((char*)pch, BYTES);
+        SetNormalized(pch);
+    }
+};
+
+#endif // BITCOIN_MUHASH_H
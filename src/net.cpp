@@ -23,6 +23,14 @@
 #include <fcntl.h>
 #endif
 
+#include <time.h>
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -101,7 +109,31 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
-boost::condition_variable messageHandlerCondition;
+
+#ifdef USE_EPOLL
+// Peer and listen sockets, and hWakeEvent, polled by ThreadSocketHandler
+static int hEpoll = -1;
+static int hWakeEvent = -1;
+
+static void SetSocketEvents(CNode *pnode, int op, bool fSend)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (fSend ? EPOLLOUT : 0);
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, op, pnode->hSocket, &event) != 0)
+        LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(errno));
+}
+#endif
+
+void WakeSocketHandler()
+{
+#ifdef USE_EPOLL
+    uint64_t nSignal = 1;
+    if (write(hWakeEvent, &nSignal, sizeof(nSignal)) != sizeof(nSignal))
+        LogPrint("net", "socket wakeup failed\n");
+#endif
+}
 
 // Signals for message handling
 static CNodeSignals g_signals;
@@ -457,6 +489,9 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrint("net", "disconnecting peer=%d\n", id);
+#ifdef USE_EPOLL
+        epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, NULL);
+#endif
         CloseSocket(hSocket);
     }
     
@@ -551,7 +586,10 @@ void CNode::copyStats(CNodeStats &stats)
     X(nTimeOffset);
     X(addrName);
     X(nVersion);
-    X(cleanSubVer);
+    {
+        LOCK(cs_SubVer);
+        X(cleanSubVer);
+    }
     X(fInbound);
     X(nStartingHeight);
     X(nSendBytes);
@@ -610,7 +648,7 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            WakeMessageHandler();
         }
     }
 
@@ -714,80 +752,452 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+
+#ifdef USE_EPOLL
+    // Have the socket handler finish sending once the socket takes more
+    bool fPollSend = !pnode->vSendMsg.empty();
+    if (pnode->hSocket != INVALID_SOCKET && fPollSend != pnode->fPollSend)
+    {
+        SetSocketEvents(pnode, EPOLL_CTL_MOD, fPollSend);
+        pnode->fPollSend = fPollSend;
+    }
+#endif
 }
 
 static list<CNode*> vNodesDisconnected;
 
+/** Seconds between the -debug=bench reports of the socket handler's usage */
+static const int64_t SOCKET_HANDLER_USAGE_INTERVAL = 60;
+
+/**
+ * Counts the socket handler's wakeups and, where the platform can tell, its
+ * CPU time, and reports them with -debug=bench per connection: with most
+ * connections idle, that is what an idle connection costs.
+ */
+class CSocketHandlerUsage
+{
+private:
+    int64_t nStart;
+    int64_t nStartCPU;
+    uint64_t nWakeups;
+
+    static int64_t GetThreadCPUMicros()
+    {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+        struct timespec ts;
+        if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+            return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+        return -1;
+    }
+
+public:
+    CSocketHandlerUsage() : nStart(GetTimeMicros()), nStartCPU(GetThreadCPUMicros()), nWakeups(0) {}
+
+    void Wakeup()
+    {
+        nWakeups++;
+        int64_t nNow = GetTimeMicros();
+        if (nNow - nStart < SOCKET_HANDLER_USAGE_INTERVAL * 1000000)
+            return;
+        if (LogAcceptCategory("bench")) {
+            size_t nConnections;
+            {
+                LOCK(cs_vNodes);
+                nConnections = vNodes.size();
+            }
+            double dSeconds = 0.000001 * (nNow - nStart);
+            int64_t nCPU = GetThreadCPUMicros();
+            if (nCPU >= 0 && nStartCPU >= 0)
+                LogPrint("bench", "Socket handler: %.1f wakeups/s, %.2fus CPU per connection per second (%u connections)\n",
+                    nWakeups / dSeconds, (nCPU - nStartCPU) / dSeconds / std::max(nConnections, (size_t)1), nConnections);
+            else
+                LogPrint("bench", "Socket handler: %.1f wakeups/s (%u connections)\n", nWakeups / dSeconds, nConnections);
+        }
+        nStart = nNow;
+        nStartCPU = GetThreadCPUMicros();
+        nWakeups = 0;
+    }
+};
+
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
+{
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
+            {
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
+
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
+            }
+        }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+        {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
+            {
+                bool fDelete = false;
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
+                    {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
+                        {
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
+                        }
+                    }
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+static void AcceptConnection(const ListenSocket& hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);                
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+    }
+    else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+    {
+        CloseSocket(hSocket);
+    }
+    else if (CNode::IsBanned(addr) && !whitelisted)
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    }
+    else
+    {
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
+
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+    }
+}
+
+// requires LOCK(cs_vRecvMsg)
+// Returns whether the socket may have more data to read right away.
+static bool SocketRecvData(CNode *pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return pnode->hSocket != INVALID_SOCKET;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+        else if (nErr == WSAEINTR)
+            return true;
+    }
+    return false;
+}
+
+static void InactivityCheck(CNode *pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+static bool RecvFlooded(CNode *pnode)
+{
+    return !pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() &&
+           pnode->GetTotalRecvSize() > ReceiveFloodSize();
+}
+
+/**
+ * Readiness is edge-triggered: a socket is reported once when it turns
+ * readable or writable, and is then held in setRecvReady or setSendReady
+ * until it has been drained. Only those sockets are looked at when waking
+ * up, so idle peers cost nothing; a full sweep over all peers, for
+ * disconnects and timeouts, happens once a second or when woken up.
+ */
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    int64_t nLastSweep = 0;
+
+    BOOST_FOREACH(ListenSocket& hListenSocket, vhListenSocket)
+    {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = &hListenSocket;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+            LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(errno));
+    }
+
+    // Ready peers, each holding a reference until done with
+    set<CNode*> setRecvReady;
+    set<CNode*> setSendReady;
+    bool fSweep = true;
+    CSocketHandlerUsage usage;
     while (true)
     {
+        usage.Wakeup();
+        int64_t nTime = GetTime();
+        if (fSweep || nTime != nLastSweep)
+        {
+            DisconnectNodes(nPrevNodeCount);
+            if (nTime != nLastSweep)
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                    InactivityCheck(pnode);
+                nLastSweep = nTime;
+            }
+            fSweep = false;
+        }
+
+        // Don't wait while a peer has more to read, unless it is waiting on us
+        int nTimeout = 1000;
+        BOOST_FOREACH(CNode* pnode, setRecvReady)
+            if (!pnode->fSocketRetry)
+                nTimeout = 0;
+
+        struct epoll_event events[64];
+        int nEvents = epoll_wait(hEpoll, events, ARRAYLEN(events), nTimeout);
+        boost::this_thread::interruption_point();
+
+        if (nEvents < 0)
+        {
+            if (errno != EINTR)
+            {
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+                MilliSleep(50);
+            }
+            nEvents = 0;
+        }
+
         //
-        // Disconnect nodes
+        // Sort out the events
         //
+        vector<const ListenSocket*> vAccept;
         {
             LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            for (int i = 0; i < nEvents; i++)
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
+                void *ptr = events[i].data.ptr;
+                if (ptr == NULL)
                 {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
-
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
-
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                    uint64_t nSignals;
+                    if (read(hWakeEvent, &nSignals, sizeof(nSignals)) < 0 && errno != EAGAIN)
+                        LogPrintf("socket wakeup error %s\n", NetworkErrorString(errno));
+                    fSweep = true;
+                    continue;
+                }
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
+                bool fListen = false;
+                BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+                {
+                    if (ptr == &hListenSocket)
+                    {
+                        vAccept.push_back(&hListenSocket);
+                        fListen = true;
+                    }
                 }
+                if (fListen)
+                    continue;
+
+                // A node in vNodes, or with its socket still open; either way alive,
+                // as only this thread deletes nodes, after closing their sockets
+                CNode* pnode = (CNode*)ptr;
+                if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && setRecvReady.insert(pnode).second)
+                    pnode->AddRef();
+                if ((events[i].events & EPOLLOUT) && setSendReady.insert(pnode).second)
+                    pnode->AddRef();
             }
+        }
 
+        //
+        // Accept new connections
+        //
+        BOOST_FOREACH(const ListenSocket* phListenSocket, vAccept)
+            AcceptConnection(*phListenSocket);
 
+        //
+        // Service the ready sockets
+        //
+        vector<CNode*> vDone;
+        set<CNode*>::iterator it = setSendReady.begin();
+        while (it != setSendReady.end())
+        {
+            boost::this_thread::interruption_point();
 
+            CNode* pnode = *it;
+            if (pnode->hSocket != INVALID_SOCKET)
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (!lockSend)
+                {
+                    pnode->fSocketRetry = true;
+                    it++;
+                    continue;
+                }
+                // Sends until the queue is empty or the socket would block,
+                // in which case it is polled for writability again
+                SocketSendData(pnode);
+            }
+            vDone.push_back(pnode);
+            setSendReady.erase(it++);
         }
+        it = setRecvReady.begin();
+        while (it != setRecvReady.end())
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            boost::this_thread::interruption_point();
+
+            CNode* pnode = *it;
+            if (pnode->hSocket != INVALID_SOCKET)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                // As with select(), first drain the write buffer before receiving more,
+                // and leave received data with the message handler if there is enough
+                // already; the message handler wakes us up when it is done with the peer.
+                bool fMore = false;
                 {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
-                        {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
-                        }
-                    }
-                    if (fDelete)
+                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                    if (!lockRecv || pnode->nSendSize > 0 || RecvFlooded(pnode))
                     {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                        pnode->fSocketRetry = true;
+                        it++;
+                        continue;
                     }
+                    fMore = SocketRecvData(pnode);
+                }
+                if (fMore)
+                {
+                    it++;
+                    continue;
                 }
             }
+            vDone.push_back(pnode);
+            setRecvReady.erase(it++);
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+
+        if (!vDone.empty())
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vDone)
+            {
+                if (pnode->fDisconnect)
+                    fSweep = true;
+                pnode->Release();
+            }
         }
+    }
+}
+#else
+void ThreadSocketHandler()
+{
+    unsigned int nPrevNodeCount = 0;
+    CSocketHandlerUsage usage;
+    while (true)
+    {
+        usage.Wakeup();
+
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes(nPrevNodeCount);
 
         //
         // Find which sockets have data to receive
@@ -877,52 +1287,7 @@ void ThreadSocketHandler()
         BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
         {
             if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
-
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);                
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
-
-                if (hSocket == INVALID_SOCKET)
-                {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                }
-                else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-                {
-                    CloseSocket(hSocket);
-                }
-                else if (CNode::IsBanned(addr) && !whitelisted)
-                {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                }
-                else
-                {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
-            }
+                AcceptConnection(hListenSocket);
         }
         
         //
@@ -948,39 +1313,7 @@ void ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    SocketRecvData(pnode);
             }
 
             //
@@ -998,30 +1331,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1030,7 +1340,7 @@ void ThreadSocketHandler()
         }
     }
 }
-
+#endif
 
 
 
@@ -1443,70 +1753,139 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
     return true;
 }
 
-void ThreadMessageHandler()
+// The message handler threads share out rounds over the peers, taking one
+// peer at a time, so that a slow peer only holds up its own thread and no
+// peer is ever handled by two threads at once. A new round starts when a
+// round is done and there is new work, or every 100ms for SendMessages.
+static boost::mutex mutexMsgProc;
+static boost::condition_variable condMsgProc;
+static vector<CNode*> vNodesRound; // each holding a reference until taken
+static size_t nRoundNext = 0;
+static CNode* pnodeTrickle = NULL;
+static bool fMsgProcWake = false;
+static boost::system_time timeNextRound(boost::posix_time::min_date_time);
+
+void WakeMessageHandler()
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
-    
-    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
-    while (true)
     {
-        vector<CNode*> vNodesCopy;
+        boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+        fMsgProcWake = true;
+    }
+    condMsgProc.notify_one();
+}
+
+// Returns whether the peer has more to do right away
+static bool ProcessNode(CNode* pnode, bool fSendTrickle)
+{
+    if (pnode->fDisconnect)
+        return false;
+
+    bool fMore = false;
+
+    // Receive messages
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
-                pnode->AddRef();
+            if (!g_signals.ProcessMessages(pnode))
+                pnode->CloseSocketDisconnect();
+                
+            if (pnode->nSendSize < SendBufferSize())
+            {
+                if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                {
+                    fMore = true;
+                }
             }
         }
-            
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-            
-        bool fSleep = true;
-         
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        else
+            fMore = true;
+    }
+    boost::this_thread::interruption_point();
+
+    // Send messages
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+            g_signals.SendMessages(pnode, fSendTrickle || pnode->fWhitelisted);
+    }
+    boost::this_thread::interruption_point();
+
+    // Hand the peer back to the socket handler, if it held off on it for us
+    if (pnode->fSocketRetry.exchange(false) || pnode->fDisconnect)
+        WakeSocketHandler();
+
+    return fMore;
+}
+
+void ThreadMessageHandler()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        CNode* pnode = NULL;
+        bool fSendTrickle = false;
+        vector<CNode*> vSkipped;
         {
-            if (pnode->fDisconnect)
-                continue;
-            // Receive messages
+            boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+            while (pnode == NULL)
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                if (nRoundNext < vNodesRound.size())
                 {
-                    if (!g_signals.ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-                        
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
+                    CNode* pnodeNext = vNodesRound[nRoundNext++];
+                    if (pnodeNext->fProcessing) {
+                        // Whoever has it takes another round when done
+                        pnodeNext->fProcessAgain = true;
+                        vSkipped.push_back(pnodeNext);
+                    } else {
+                        pnodeNext->fProcessing = true;
+                        pnode = pnodeNext;
+                        fSendTrickle = (pnode == pnodeTrickle);
                     }
+                    continue;
+                }
+
+                boost::system_time now = boost::get_system_time();
+                if (!fMsgProcWake && now < timeNextRound)
+                {
+                    condMsgProc.timed_wait(lock, timeNextRound);
+                    continue;
+                }
+
+                // Poll the connected nodes for messages
+                {
+                    LOCK(cs_vNodes);
+                    vNodesRound = vNodes;
+                    BOOST_FOREACH(CNode* pnodeRound, vNodesRound)
+                        pnodeRound->AddRef();
                 }
+                pnodeTrickle = vNodesRound.empty() ? NULL : vNodesRound[GetRand(vNodesRound.size())];
+                nRoundNext = 0;
+                fMsgProcWake = false;
+                timeNextRound = now + boost::posix_time::milliseconds(100);
+                condMsgProc.notify_all();
             }
-            boost::this_thread::interruption_point();
+        }
+
+        bool fMore = ProcessNode(pnode, fSendTrickle);
 
-            // Send messages
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+            pnode->fProcessing = false;
+            if (fMore || pnode->fProcessAgain)
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
+                pnode->fProcessAgain = false;
+                fMsgProcWake = true;
+                condMsgProc.notify_one();
             }
-            boost::this_thread::interruption_point();
         }
 
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            pnode->Release();
+            BOOST_FOREACH(CNode* pnodeSkipped, vSkipped)
+                pnodeSkipped->Release();
         }
-
-        if (fSleep)
-            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
     }
 }
 
@@ -1702,7 +2081,9 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMsgHandlerThreads = std::max(1, std::min((int)GetArg("-msghandlers", DEFAULT_MSGHANDLER_THREADS), MAX_MSGHANDLER_THREADS));
+    for (int i = 0; i < nMsgHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1729,7 +2110,20 @@ bool StopNode()
 class CNetCleanup
 {
 public:
-    CNetCleanup() {}
+    CNetCleanup()
+    {
+#ifdef USE_EPOLL
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        hWakeEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (hEpoll == -1 || hWakeEvent == -1)
+            throw std::runtime_error("CNetCleanup() : failed to set up socket polling");
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        epoll_ctl(hEpoll, EPOLL_CTL_ADD, hWakeEvent, &event);
+#endif
+    }
     
     ~CNetCleanup()
     {
@@ -1755,6 +2149,11 @@ public:
         delete pnodeLocalHost;
         pnodeLocalHost = NULL;    
 
+#ifdef USE_EPOLL
+        close(hWakeEvent);
+        close(hEpoll);
+#endif
+
 #ifdef WIN32
         // Shutdown Windows Sockets
         WSACleanup();
@@ -1999,6 +2398,10 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    fPollSend = false;
+    fSocketRetry = false;
+    fProcessing = false;
+    fProcessAgain = false;
     hashContinue = uint256();
     nStartingHeight = -1;
     fGetAddr = false;
@@ -2019,6 +2422,11 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     else
         LogPrint("net", "Added connection peer=%d\n", id);
 
+#ifdef USE_EPOLL
+    if (hSocket != INVALID_SOCKET)
+        SetSocketEvents(this, EPOLL_CTL_ADD, false);
+#endif
+
     // Be shy and don't send version until we hear
     if (hSocket != INVALID_SOCKET && !fInbound)
         PushVersion();
@@ -27,6 +27,7 @@
 #include <arpa/inet.h>
 #endif
 
+#include <boost/atomic.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
 #include <boost/signals2/signal.hpp>
@@ -59,6 +60,9 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** Number of threads processing peer messages */
+static const int DEFAULT_MSGHANDLER_THREADS = 4;
+static const int MAX_MSGHANDLER_THREADS = 16;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -77,6 +81,11 @@ bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+void ThreadSocketHandler();
+/** Wake the socket handler thread, to look at peers it held off on and at disconnects */
+void WakeSocketHandler();
+/** Have the message handler threads look at the peers again, as one has new work */
+void WakeMessageHandler();
 
 typedef int NodeId;
 
@@ -244,6 +253,10 @@ public:
     uint64_t nSendBytes;
     std::deque<CSerializeData> vSendMsg;
     CCriticalSection cs_vSend;
+    bool fPollSend; // the socket is polled for writability, while vSendMsg is not empty; requires cs_vSend
+    boost::atomic<bool> fSocketRetry; // the socket handler held off on this ready socket, and waits for a wakeup; cleared by the message handlers
+    bool fProcessing; // a message handler thread has this peer; guarded by the message handlers' mutex
+    bool fProcessAgain; // ... and is to take another round when done with it
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
@@ -263,7 +276,9 @@ public:
     // to be printed out, displayed to humans in various forms and so on. So we sanitize it and
     // store the sanitized version in cleanSubVer. The original should be used when dealing with
     // the network or wire types and the cleaned string used when displayed or logged.
+    // Set by the version message; other threads read them under cs_SubVer.
     std::string strSubVer, cleanSubVer;
+    CCriticalSection cs_SubVer;
     bool fWhitelisted; // This peer can bypass DoS banning.
     bool fOneShot;
     bool fClient;
@@ -300,11 +315,11 @@ public:
     uint256 hashContinue;
     int nStartingHeight;
 
-    // flood relay
+    // flood relay, guarded by cs_inventory as other peers' message handlers push to it
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
     bool fGetAddr;
-    std::set<uint256> setKnown;
+    std::set<uint256> setKnown; // alerts, guarded by cs_mapAlerts
 
     // inventory based relay
     mruset<CInv> setInventoryKnown;
@@ -382,6 +397,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_inventory);
         addrKnown.insert(addr.GetKey());
     }
 
@@ -390,6 +406,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_inventory);
         if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
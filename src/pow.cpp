@@ -9,13 +9,24 @@
 #include "chain.h"
 #include "primitives/block.h"
 #include "main.h" //Necessary for KGW - Move later
+#include "random.h"
+#include "sync.h"
 #include "uint256.h"
 #include "util.h"
 
+#include <map>
+#include <vector>
+
+#include <boost/foreach.hpp>
+
 #include "bignum.h" //Necessary for KGW
 
 //static CBigNum bnProofOfWorkLimit(~uint256(0) >> 20); //Necessary for KGW
-static const CBigNum bnProofOfWorkLimit(uint256S("00000fffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"));
+static const char* KGW_POW_LIMIT = "00000fffffffffffffffffffffffffffffffffffffffffffffffffffffffffff";
+static const CBigNum bnProofOfWorkLimit(uint256S(KGW_POW_LIMIT));
+static const uint64_t KGW_PAST_BLOCKS_MAX = (60 * 60 * 24 * 7) / (2.5 * 60);
+
+bool fCheckKGW = false;
 
 // static const int64_t nInterval = nTargetTimespan / nTargetSpacing;
 
@@ -24,7 +35,9 @@ static const CBigNum bnProofOfWorkLimit(uint256S("00000fffffffffffffffffffffffff
 static const int64_t nReTargetHistoryFact = 4; // look at 4 times the retarget
                                              // interval into the block history
 
-unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, const CBlockHeader *pblock, uint64_t TargetBlocksSpacingSeconds, uint64_t PastBlocksMin, uint64_t PastBlocksMax, const Consensus::Params& params)
+// Original CBigNum implementation of Kimoto Gravity Well. Kept as the reference
+// KimotoGravityWell() is checked against (-checkkgw and pow_tests).
+unsigned int KimotoGravityWellLegacy(const CBlockIndex* pindexLast, const CBlockHeader *pblock, uint64_t TargetBlocksSpacingSeconds, uint64_t PastBlocksMin, uint64_t PastBlocksMax, const Consensus::Params& params)
 {
     const CBlockIndex  *BlockLastSolved				= pindexLast;
     const CBlockIndex  *BlockReading				= pindexLast;
@@ -93,11 +106,112 @@ unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, const CBloc
     }
     if (bnNew > bnProofOfWorkLimit) { bnNew = bnProofOfWorkLimit; }
 
+    return bnNew.GetCompact();
+}
+
+/** EventHorizonDeviation only depends on the number of blocks looked at, so it is tabulated once. */
+static std::vector<double> KGWEventHorizonTable()
+{
+    std::vector<double> vDeviation(KGW_PAST_BLOCKS_MAX + 1);
+    for (uint64_t PastBlocksMass = 1; PastBlocksMass <= KGW_PAST_BLOCKS_MAX; PastBlocksMass++)
+        vDeviation[PastBlocksMass] = 1 + (0.7084 * pow((double(PastBlocksMass)/double(144)), -1.228));
+    return vDeviation;
+}
+
+static double KGWEventHorizonDeviation(uint64_t PastBlocksMass)
+{
+    static const std::vector<double> vDeviation = KGWEventHorizonTable();
+    if (PastBlocksMass < vDeviation.size())
+        return vDeviation[PastBlocksMass];
+    return 1 + (0.7084 * pow((double(PastBlocksMass)/double(144)), -1.228));
+}
+
+/**
+ * Kimoto Gravity Well on arith_uint256. Produces exactly the nBits of
+ * KimotoGravityWellLegacy: the running average truncates towards zero like
+ * BN_div, and the final scaling is split so it cannot overflow 256 bits.
+ */
+unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, uint64_t TargetBlocksSpacingSeconds, uint64_t PastBlocksMin, uint64_t PastBlocksMax, const Consensus::Params& params)
+{
+    const CBlockIndex  *BlockLastSolved				= pindexLast;
+    const CBlockIndex  *BlockReading				= pindexLast;
+    uint64_t				PastBlocksMass				= 0;
+    int64_t				PastRateActualSeconds		= 0;
+    int64_t				PastRateTargetSeconds		= 0;
+    double				PastRateAdjustmentRatio		= double(1);
+    arith_uint256			PastDifficultyAverage;
+    arith_uint256			bnReading;
+    double				EventHorizonDeviation;
+    double				EventHorizonDeviationFast;
+    double				EventHorizonDeviationSlow;
+
+    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || (uint64_t)BlockLastSolved->nHeight < PastBlocksMin) { return UintToArith256(params.powLimit).GetCompact(); }
+
+    int64_t LatestBlockTime = BlockLastSolved->GetBlockTime();
+
+    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
+        if (PastBlocksMax > 0 && i > PastBlocksMax) { break; }
+        PastBlocksMass++;
+
+        bnReading.SetCompact(BlockReading->nBits);
+        if (i == 1)                                 { PastDifficultyAverage = bnReading; }
+        else if (bnReading >= PastDifficultyAverage) { PastDifficultyAverage += (bnReading - PastDifficultyAverage) / i; }
+        else                                        { PastDifficultyAverage -= (PastDifficultyAverage - bnReading) / i; }
+
+        if (LatestBlockTime < BlockReading->GetBlockTime()) {
+            if (BlockReading->nHeight > 29000) {
+                LatestBlockTime = BlockReading->GetBlockTime();
+            }
+        }
+
+        PastRateActualSeconds = LatestBlockTime - BlockReading->GetBlockTime(); //KGW patch
+        PastRateTargetSeconds			= TargetBlocksSpacingSeconds * PastBlocksMass;
+        PastRateAdjustmentRatio			= double(1);
+
+        if (BlockReading->nHeight > 29000) {
+            if (PastRateActualSeconds < 1) {
+                PastRateActualSeconds = 1;
+            }
+        } else {
+            if (PastRateActualSeconds < 0) {
+                PastRateActualSeconds = 0;
+            }
+        }
+
+        if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0) {
+        PastRateAdjustmentRatio			= double(PastRateTargetSeconds) / double(PastRateActualSeconds);
+        }
+        EventHorizonDeviation			= KGWEventHorizonDeviation(PastBlocksMass);
+        EventHorizonDeviationFast		= EventHorizonDeviation;
+        EventHorizonDeviationSlow		= 1 / EventHorizonDeviation;
+
+        if (PastBlocksMass >= PastBlocksMin) {
+            if ((PastRateAdjustmentRatio <= EventHorizonDeviationSlow) || (PastRateAdjustmentRatio >= EventHorizonDeviationFast)) { assert(BlockReading); break; }
+        }
+        if (BlockReading->pprev == NULL) { assert(BlockReading); break; }
+        BlockReading = BlockReading->pprev;
+    }
+
+    const arith_uint256 bnLimit = UintToArith256(uint256S(KGW_POW_LIMIT));
+    arith_uint256 bnNew(PastDifficultyAverage);
+    if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0) {
+        // bnNew * Actual / Target == q * Actual + r * Actual / Target, with q, r the
+        // quotient and remainder of bnNew / Target; if q * Actual alone is beyond the
+        // limit, so is the result.
+        const arith_uint256 bnActual((uint64_t)PastRateActualSeconds);
+        const arith_uint256 bnTarget((uint64_t)PastRateTargetSeconds);
+        arith_uint256 q = bnNew / bnTarget;
+        arith_uint256 r = bnNew - q * bnTarget;
+        if (q > bnLimit / bnActual)
+            bnNew = bnLimit;
+        else
+            bnNew = q * bnActual + (r * bnActual) / bnTarget;
+    }
+    if (bnNew > bnLimit) { bnNew = bnLimit; }
+
     /// debug print
     LogPrintf("Difficulty Retarget - Kimoto Gravity Well\n");
     LogPrintf("PastRateAdjustmentRatio = %g\n", PastRateAdjustmentRatio);
-//    LogPrintf("Before: %08x  %s\n", BlockLastSolved->nBits, CBigNum().SetCompact(BlockLastSolved->nBits).getuint256().ToString());
-//    LogPrintf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString());
 
     return bnNew.GetCompact();
 }
@@ -179,7 +293,21 @@ unsigned int static GetNextWorkRequired_V2(const CBlockIndex* pindexLast, const
     uint64_t				PastBlocksMin				= PastSecondsMin / BlocksTargetSpacing;
     uint64_t				PastBlocksMax				= PastSecondsMax / BlocksTargetSpacing;
 
-    return KimotoGravityWell(pindexLast, pblock, BlocksTargetSpacing, PastBlocksMin, PastBlocksMax, params);
+    // The result only depends on pindexLast and its ancestors, so it is
+    // computed once per block index entry.
+    if (pindexLast != NULL && pindexLast->nKGWNextBits != 0)
+        return pindexLast->nKGWNextBits;
+
+    unsigned int nBits = KimotoGravityWell(pindexLast, BlocksTargetSpacing, PastBlocksMin, PastBlocksMax, params);
+    if (fCheckKGW) {
+        unsigned int nLegacyBits = KimotoGravityWellLegacy(pindexLast, pblock, BlocksTargetSpacing, PastBlocksMin, PastBlocksMax, params);
+        if (nBits != nLegacyBits)
+            LogPrintf("ERROR: %s: KGW mismatch after height %d: %08x, legacy %08x\n", __func__, pindexLast ? pindexLast->nHeight : -1, nBits, nLegacyBits);
+        assert(nBits == nLegacyBits);
+    }
+    if (pindexLast != NULL)
+        pindexLast->nKGWNextBits = nBits;
+    return nBits;
 }
 
 
@@ -305,6 +433,157 @@ bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params&
     return true;
 }
 
+namespace {
+
+/**
+ * Scrypt PoW hashes by block hash, so a header that is checked more than once
+ * (CheckBlock before and during ConnectBlock, VerifyDB, serving blocks from
+ * disk) only pays for scrypt_1024_1_1_256 the first time.
+ */
+class CPoWHashCache
+{
+private:
+    std::map<uint256, uint256> mapPoWHash;
+    CPoWHashCacheStats stats;
+    CCriticalSection cs_powcache;
+    int64_t nMaxCacheSize;
+
+public:
+    CPoWHashCache() : nMaxCacheSize(DEFAULT_MAX_POW_CACHE_SIZE) {}
+
+    void SetMaxSize(int64_t nMaxCacheSizeIn)
+    {
+        LOCK(cs_powcache);
+        nMaxCacheSize = nMaxCacheSizeIn;
+    }
+
+    bool Get(const uint256& hash, uint256& hashPoW)
+    {
+        LOCK(cs_powcache);
+        std::map<uint256, uint256>::const_iterator mi = mapPoWHash.find(hash);
+        if (mi == mapPoWHash.end()) {
+            stats.nMisses++;
+            return false;
+        }
+        stats.nHits++;
+        hashPoW = mi->second;
+        return true;
+    }
+
+    void Set(const uint256& hash, const uint256& hashPoW)
+    {
+        LOCK(cs_powcache);
+        if (nMaxCacheSize <= 0) return;
+        while (static_cast<int64_t>(mapPoWHash.size()) >= nMaxCacheSize)
+        {
+            // Evict a random entry, as the signature cache does.
+            std::map<uint256, uint256>::iterator it = mapPoWHash.lower_bound(GetRandHash());
+            if (it == mapPoWHash.end())
+                it = mapPoWHash.begin();
+            mapPoWHash.erase(it);
+        }
+        mapPoWHash.insert(std::make_pair(hash, hashPoW));
+    }
+
+    bool Contains(const uint256& hash)
+    {
+        LOCK(cs_powcache);
+        return mapPoWHash.count(hash) != 0;
+    }
+
+    void Skipped()
+    {
+        LOCK(cs_powcache);
+        stats.nSkipped++;
+    }
+
+    void GetStats(CPoWHashCacheStats& statsOut)
+    {
+        LOCK(cs_powcache);
+        statsOut = stats;
+        statsOut.nEntries = mapPoWHash.size();
+    }
+};
+
+CPoWHashCache powHashCache;
+
+} // anon namespace
+
+void InitPoWHashCache()
+{
+    powHashCache.SetMaxSize(GetArg("-maxpowcachesize", DEFAULT_MAX_POW_CACHE_SIZE));
+}
+
+uint256 GetBlockPoWHash(const CBlockHeader& block)
+{
+    // The block hash commits to the same 80 header bytes scrypt runs over.
+    uint256 hash = block.GetHash();
+    uint256 hashPoW;
+    if (powHashCache.Get(hash, hashPoW))
+        return hashPoW;
+
+    hashPoW = block.GetPoWHash();
+    powHashCache.Set(hash, hashPoW);
+    return hashPoW;
+}
+
+void CacheBlockPoWHashes(const std::vector<CBlockHeader>& vHeaders)
+{
+    std::vector<uint256> vHash;
+    std::vector<const char*> vInput;
+    vHash.reserve(vHeaders.size());
+    vInput.reserve(vHeaders.size());
+    BOOST_FOREACH(const CBlockHeader& header, vHeaders) {
+        uint256 hash = header.GetHash();
+        if (powHashCache.Contains(hash))
+            continue;
+        vHash.push_back(hash);
+        vInput.push_back(BEGIN(header.nVersion));
+    }
+    if (vInput.empty())
+        return;
+
+    std::vector<uint256> vHashPoW(vInput.size());
+    std::vector<char*> vOutput(vInput.size());
+    for (unsigned int i = 0; i < vInput.size(); i++)
+        vOutput[i] = BEGIN(vHashPoW[i]);
+    scrypt_1024_1_1_256_multi(&vInput[0], &vOutput[0], vInput.size());
+
+    for (unsigned int i = 0; i < vHash.size(); i++)
+        powHashCache.Set(vHash[i], vHashPoW[i]);
+}
+
+bool CheckBlockHeadersPoW(const std::vector<CBlockHeader>& vHeaders, const Consensus::Params& params)
+{
+    if (vHeaders.empty())
+        return true;
+
+    std::vector<uint256> vHashPoW(vHeaders.size());
+    std::vector<const char*> vInput(vHeaders.size());
+    std::vector<char*> vOutput(vHeaders.size());
+    for (unsigned int i = 0; i < vHeaders.size(); i++) {
+        vInput[i] = BEGIN(vHeaders[i].nVersion);
+        vOutput[i] = BEGIN(vHashPoW[i]);
+    }
+    scrypt_1024_1_1_256_multi(&vInput[0], &vOutput[0], vInput.size());
+
+    for (unsigned int i = 0; i < vHeaders.size(); i++) {
+        if (!CheckProofOfWork(vHashPoW[i], vHeaders[i].nBits, params))
+            return error("%s: proof of work failed for block %s", __func__, vHeaders[i].GetHash().ToString());
+    }
+    return true;
+}
+
+void PoWHashCacheSkipped()
+{
+    powHashCache.Skipped();
+}
+
+void GetPoWHashCacheStats(CPoWHashCacheStats& stats)
+{
+    powHashCache.GetStats(stats);
+}
+
 arith_uint256 GetBlockProof(const CBlockIndex& block)
 {
     arith_uint256 bnTarget;
@@ -9,7 +9,9 @@
 
 #include "consensus/params.h"
 
+#include <stddef.h>
 #include <stdint.h>
+#include <vector>
 
 class CBlockIndex;
 class CBlockHeader;
@@ -17,12 +19,44 @@ class uint256;
 class arith_uint256;
 
 unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock, const Consensus::Params&);
+/** Cross-check every Kimoto Gravity Well retarget against the CBigNum reference (-checkkgw) */
+extern bool fCheckKGW;
+
 unsigned int CalculateNextWorkRequired(const CBlockIndex* pindexLast, int64_t nFirstBlockTime, const Consensus::Params&);
 
+/** Reference CBigNum implementation of the Kimoto Gravity Well retarget */
+unsigned int KimotoGravityWellLegacy(const CBlockIndex* pindexLast, const CBlockHeader *pblock, uint64_t TargetBlocksSpacingSeconds, uint64_t PastBlocksMin, uint64_t PastBlocksMax, const Consensus::Params&);
+
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params&);
 arith_uint256 GetBlockProof(const CBlockIndex& block);
 
+/** Default for -maxpowcachesize, number of memoized scrypt PoW hashes */
+static const unsigned int DEFAULT_MAX_POW_CACHE_SIZE = 20000;
+
+/** Hit/miss counters of the PoW hash cache */
+struct CPoWHashCacheStats
+{
+    size_t nEntries;
+    uint64_t nHits;      //! served from the cache
+    uint64_t nMisses;    //! scrypt computed
+    uint64_t nSkipped;   //! not needed: header already linked to a valid index entry
+
+    CPoWHashCacheStats() : nEntries(0), nHits(0), nMisses(0), nSkipped(0) {}
+};
+
+/** Size the PoW hash cache from -maxpowcachesize; until then it holds the default */
+void InitPoWHashCache();
+/** Scrypt PoW hash of a block header, memoized by block hash */
+uint256 GetBlockPoWHash(const CBlockHeader& block);
+/** Record a PoW check that was skipped because the block index already vouches for it */
+void PoWHashCacheSkipped();
+/** Compute and cache the PoW hashes of headers not cached yet, several per scrypt pass */
+void CacheBlockPoWHashes(const std::vector<CBlockHeader>& vHeaders);
+/** Check the PoW of a batch of headers, several per scrypt pass, bypassing the PoW hash cache */
+bool CheckBlockHeadersPoW(const std::vector<CBlockHeader>& vHeaders, const Consensus::Params&);
+void GetPoWHashCacheStats(CPoWHashCacheStats& stats);
+
 /** Return the time it would take to redo the work difference between from and to, assuming the current hashrate corresponds to the difficulty at tip, in seconds. */
 int64_t GetBlockProofEquivalentTime(const CBlockIndex& to, const CBlockIndex& from, const CBlockIndex& tip, const Consensus::Params&);
 
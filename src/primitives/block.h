@@ -89,6 +89,8 @@ public:
 
     // memory only
     mutable std::vector<uint256> vMerkleTree;
+    // Set by a full CheckBlock; whoever changes the block after that must clear it
+    mutable bool fChecked;
 
     CBlock()
     {
@@ -114,6 +116,7 @@ public:
         CBlockHeader::SetNull();
         vtx.clear();
         vMerkleTree.clear();
+        fChecked = false;
     }
 
     CBlockHeader GetBlockHeader() const
@@ -8,17 +8,147 @@
 
 #include "ecwrapper.h"
 
-bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
-    if (!IsValid())
+#include <secp256k1.h>
+
+namespace {
+
+// secp256k1_stop() frees the signing and the verification tables at once,
+// so it is left to key.cpp's CSecp256k1Init, the one teardown there is.
+class CSecp256k1VerifyInit {
+public:
+    CSecp256k1VerifyInit() {
+        secp256k1_start(SECP256K1_START_VERIFY);
+    }
+};
+static CSecp256k1VerifyInit instance_of_csecp256k1verify;
+
+/** Read a BER length at input[pos], advancing pos. Long forms are accepted. */
+bool ParseLength(const unsigned char *input, size_t inputlen, size_t &pos, size_t &len) {
+    if (pos == inputlen)
         return false;
-    CECKey key;
-    if (!key.SetPubKey(begin(), size()))
+    size_t lenbyte = input[pos++];
+    if (!(lenbyte & 0x80)) {
+        len = lenbyte;
+        return true;
+    }
+    lenbyte -= 0x80;
+    if (lenbyte > inputlen - pos)
+        return false;
+    while (lenbyte > 0 && input[pos] == 0) {
+        pos++;
+        lenbyte--;
+    }
+    if (lenbyte >= sizeof(size_t))
         return false;
-    if (!key.Verify(hash, vchSig))
+    len = 0;
+    while (lenbyte > 0) {
+        len = (len << 8) + input[pos];
+        pos++;
+        lenbyte--;
+    }
+    return true;
+}
+
+/** Read a non-negative BER INTEGER at input[pos] into a 32-byte big-endian value, advancing pos. */
+bool ParseInteger(const unsigned char *input, size_t inputlen, size_t &pos, unsigned char out[32]) {
+    if (pos == inputlen || input[pos] != 0x02)
+        return false;
+    pos++;
+    size_t len;
+    if (!ParseLength(input, inputlen, pos, len) || len > inputlen - pos)
         return false;
+    const unsigned char *p = input + pos;
+    pos += len;
+    // OpenSSL decodes a set top bit as a negative number, which never verifies.
+    if (len == 0 || (p[0] & 0x80))
+        return false;
+    while (len > 0 && p[0] == 0) {
+        p++;
+        len--;
+    }
+    if (len > 32)
+        return false;
+    memset(out, 0, 32 - len);
+    memcpy(out + 32 - len, p, len);
     return true;
 }
 
+/** Append a 32-byte big-endian value as a minimally encoded DER INTEGER. */
+void SerializeInteger(const unsigned char in[32], unsigned char *&out) {
+    const unsigned char *p = in;
+    const unsigned char *end = in + 32;
+    while (p < end - 1 && *p == 0)
+        p++;
+    bool fPad = (*p & 0x80) != 0;
+    *out++ = 0x02;
+    *out++ = (end - p) + fPad;
+    if (fPad)
+        *out++ = 0x00;
+    memcpy(out, p, end - p);
+    out += end - p;
+}
+
+/**
+ * Turn a signature into the strict DER form libsecp256k1 parses, accepting
+ * the same laxly encoded signatures OpenSSL's d2i_ECDSA_SIG does: long-form
+ * lengths, an indefinite sequence length, excess leading zeroes and trailing
+ * garbage after the sequence. Like OpenSSL, the sequence must fit in the
+ * buffer and its contents must be exactly the two integers.
+ * Whether a script may use such encodings at all is decided by the
+ * SCRIPT_VERIFY_DERSIG/LOW_S checks in the interpreter, before we get here.
+ */
+bool NormalizeSignature(const std::vector<unsigned char>& vchSig, unsigned char sig[72], int &siglen) {
+    const unsigned char *input = vchSig.empty() ? NULL : &vchSig[0];
+    size_t inputlen = vchSig.size();
+    size_t pos = 0;
+    size_t len;
+    unsigned char r[32], s[32];
+
+    if (pos == inputlen || input[pos] != 0x30)
+        return false;
+    pos++;
+    // A constructed type may run up to an end-of-contents marker instead
+    bool fIndefinite = pos < inputlen && input[pos] == 0x80;
+    size_t end;
+    if (fIndefinite) {
+        pos++;
+        end = inputlen;
+    } else {
+        if (!ParseLength(input, inputlen, pos, len) || len > inputlen - pos)
+            return false;
+        end = pos + len;
+    }
+    if (!ParseInteger(input, end, pos, r) || !ParseInteger(input, end, pos, s))
+        return false;
+    if (fIndefinite) {
+        if (end - pos < 2 || input[pos] != 0x00 || input[pos + 1] != 0x00)
+            return false;
+    } else if (pos != end) {
+        return false;
+    }
+
+    unsigned char *out = sig + 2;
+    SerializeInteger(r, out);
+    SerializeInteger(s, out);
+    sig[0] = 0x30;
+    sig[1] = (out - sig) - 2;
+    siglen = out - sig;
+    return true;
+}
+
+} // anon namespace
+
+bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
+    if (!IsValid())
+        return false;
+    unsigned char sig[72];
+    int siglen;
+    if (!NormalizeSignature(vchSig, sig, siglen))
+        return false;
+    // Like OpenSSL, libsecp256k1 fails zero and out of range R and S values.
+    return secp256k1_ecdsa_verify(hash.begin(), sig, siglen, begin(), size()) == 1;
+}
+
 bool CPubKey::RecoverCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) {
     if (vchSig.size() != 65)
         return false;
@@ -4,13 +4,19 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "main.h"
+#include "pow.h"
 #include "rpcserver.h"
+#include "script/sigcache.h"
 #include "sync.h"
+#include "txdb.h"
 #include "util.h"
 
 #include <stdint.h>
 
+#include <boost/filesystem.hpp>
+
 #include "json/json_spirit_value.h"
 
 using namespace json_spirit;
@@ -314,11 +320,15 @@ Value getblock(const Array& params, bool fHelp)
 
 Value gettxoutsetinfo(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( verify )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "These are kept up to date as blocks are connected, so this returns immediately,\n"
+            "unless verify is set.\n"
+            "\nArguments:\n"
+            "1. verify    (boolean, optional, default=false) Also scan the whole set on disk, to compute\n"
+            "             hash_serialized and check the statistics against it. Note this may take some time.\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
@@ -326,29 +336,124 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
             "  \"transactions\": n,      (numeric) The number of transactions\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
-            "  \"total_amount\": x.xxx          (numeric) The total amount\n"
+            "  \"hash_muhash\": \"hash\",       (string) Order-independent hash of the unspent outputs\n"
+            "  \"total_amount\": x.xxx,         (numeric) The total amount\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash (only with verify)\n"
+            "  \"verified\": true|false,        (boolean) Whether the scan matched the statistics (only with verify)\n"
+            "  \"cache_bytes\": n,              (numeric) Current memory usage of the coins cache in bytes\n"
+            "  \"cache_peak_bytes\": n          (numeric) Highest memory usage of the coins cache since startup in bytes\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "true")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
+    bool fVerify = false;
+    if (params.size() > 0)
+        fVerify = params[0].get_bool();
+
     LOCK(cs_main);
 
     Object ret;
 
-    CCoinsStats stats;
-    FlushStateToDisk();
-    if (pcoinsTip->GetStats(stats)) {
-        ret.push_back(Pair("height", (int64_t)stats.nHeight));
-        ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
-        ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
-        ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
-        ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
+    CCoinsSetInfo info;
+    if (!pcoinsTip->GetSetInfo(info))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "UTXO set statistics are not available");
+    ret.push_back(Pair("height", (int64_t)chainActive.Height()));
+    ret.push_back(Pair("bestblock", pcoinsTip->GetBestBlock().GetHex()));
+    ret.push_back(Pair("transactions", info.nTransactions));
+    ret.push_back(Pair("txouts", info.nTransactionOutputs));
+    ret.push_back(Pair("bytes_serialized", info.nSerializedSize));
+    ret.push_back(Pair("hash_muhash", info.GetHash().GetHex()));
+    ret.push_back(Pair("total_amount", ValueFromAmount(info.nTotalAmount)));
+
+    if (fVerify) {
+        CCoinsStats stats;
+        FlushStateToDisk();
+        if (!pcoinsTip->GetStats(stats))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to scan the UTXO set");
+        bool fMatch = stats.info.nTransactions == info.nTransactions &&
+                      stats.info.nTransactionOutputs == info.nTransactionOutputs &&
+                      stats.info.nSerializedSize == info.nSerializedSize &&
+                      stats.info.nTotalAmount == info.nTotalAmount &&
+                      stats.info.GetHash() == info.GetHash();
+        if (!fMatch)
+            LogPrintf("gettxoutsetinfo: UTXO set scan does not match the running statistics (%d txouts scanned, %d kept)\n",
+                stats.info.nTransactionOutputs, info.nTransactionOutputs);
         ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
-        ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+        ret.push_back(Pair("verified", fMatch));
+    }
+
+    ret.push_back(Pair("cache_bytes", (uint64_t)pcoinsTip->DynamicMemoryUsage()));
+    ret.push_back(Pair("cache_peak_bytes", (uint64_t)nCoinCacheUsagePeak));
+    return ret;
+}
+
+Value dumptxoutset(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrites the unspent transaction output set to a snapshot file, which another node can load\n"
+            "with -loadtxoutset. The set is captured as of the current tip; writing it out does not hold up the node.\n"
+            "\nArguments:\n"
+            "1. \"path\"    (string, required) The file to write; relative paths are taken from the data directory\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"path\": \"path\",            (string) The absolute path of the snapshot\n"
+            "  \"bestblock\": \"hex\",        (string) The block the snapshot is of\n"
+            "  \"height\": n,                 (numeric) Its height\n"
+            "  \"transactions\": n,           (numeric) The number of transactions written\n"
+            "  \"txouts\": n,                 (numeric) The number of outputs written\n"
+            "  \"hash_muhash\": \"hash\",     (string) Order-independent hash of the outputs, as in gettxoutsetinfo\n"
+            "  \"seconds\": x.xxx             (numeric) Time taken\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+
+    boost::filesystem::path path = boost::filesystem::absolute(params[0].get_str(), GetDataDir());
+    boost::filesystem::path pathTemp = path.string() + ".incomplete";
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+
+    int64_t nStart = GetTimeMillis();
+    boost::scoped_ptr<CTxOutSetSnapshotWriter> pwriter;
+    int nHeight;
+    {
+        LOCK(cs_main);
+        FlushStateToDisk();
+        pwriter.reset(new CTxOutSetSnapshotWriter(*pcoinsdbview));
+        nHeight = chainActive.Height();
+    }
+    const CTxOutSetSnapshotHeader& header = pwriter->GetHeader();
+
+    FILE* file = fopen(pathTemp.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        throw JSONRPCError(RPC_MISC_ERROR, "Cannot open " + pathTemp.string());
+    bool fOk = pwriter->Write(fileout);
+    if (fOk) {
+        FileCommit(fileout.Get());
+        fileout.fclose();
+        fOk = RenameOver(pathTemp, path);
+    } else {
+        fileout.fclose();
+        boost::filesystem::remove(pathTemp);
     }
+    if (!fOk)
+        throw JSONRPCError(RPC_MISC_ERROR, "Failed to write the UTXO set snapshot");
+
+    Object ret;
+    ret.push_back(Pair("path", path.string()));
+    ret.push_back(Pair("bestblock", header.hashBlock.GetHex()));
+    ret.push_back(Pair("height", nHeight));
+    ret.push_back(Pair("transactions", header.info.nTransactions));
+    ret.push_back(Pair("txouts", header.info.nTransactionOutputs));
+    ret.push_back(Pair("hash_muhash", header.info.GetHash().GetHex()));
+    ret.push_back(Pair("seconds", 0.001 * (GetTimeMillis() - nStart)));
     return ret;
 }
 
@@ -474,7 +579,24 @@ Value getblockchaininfo(const Array& params, bool fHelp)
             "  \"bestblockhash\": \"...\", (string) the hash of the currently best block\n"
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
-            "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"chainwork\": \"xxxx\",    (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"powcache\": {           (object) memoized scrypt proof-of-work hashes\n"
+            "     \"entries\": xxxxx,    (numeric) number of cached hashes\n"
+            "     \"hits\": xxxxx,       (numeric) lookups served from the cache\n"
+            "     \"misses\": xxxxx,     (numeric) lookups that had to run scrypt\n"
+            "     \"skipped\": xxxxx     (numeric) checks skipped because the block index already validated the header\n"
+            "  },\n"
+            "  \"coinscache\": {         (object) in-memory cache of the unspent transaction output set\n"
+            "     \"entries\": xxxxx,    (numeric) number of cached transactions\n"
+            "     \"bytes\": xxxxx,      (numeric) current memory usage in bytes\n"
+            "     \"peak_bytes\": xxxxx, (numeric) highest memory usage since startup in bytes\n"
+            "     \"limit_bytes\": xxxxx (numeric) memory usage at which the cache is flushed (-dbcache)\n"
+            "  },\n"
+            "  \"sigcache\": {           (object) cache of verified signatures\n"
+            "     \"bytes\": xxxxx,      (numeric) fixed memory size of the cache (-maxsigcachesize)\n"
+            "     \"hits\": xxxxx,       (numeric) signature checks answered from the cache\n"
+            "     \"misses\": xxxxx      (numeric) signature checks not found in the cache\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getblockchaininfo", "")
@@ -491,6 +613,30 @@ Value getblockchaininfo(const Array& params, bool fHelp)
     obj.push_back(Pair("difficulty",            (double)GetDifficulty()));
     obj.push_back(Pair("verificationprogress",  Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(Pair("chainwork",             chainActive.Tip()->nChainWork.GetHex()));
+
+    CPoWHashCacheStats powstats;
+    GetPoWHashCacheStats(powstats);
+    Object powcache;
+    powcache.push_back(Pair("entries",          (uint64_t)powstats.nEntries));
+    powcache.push_back(Pair("hits",             powstats.nHits));
+    powcache.push_back(Pair("misses",           powstats.nMisses));
+    powcache.push_back(Pair("skipped",          powstats.nSkipped));
+    obj.push_back(Pair("powcache",              powcache));
+
+    Object coinscache;
+    coinscache.push_back(Pair("entries",        (uint64_t)pcoinsTip->GetCacheSize()));
+    coinscache.push_back(Pair("bytes",          (uint64_t)pcoinsTip->DynamicMemoryUsage()));
+    coinscache.push_back(Pair("peak_bytes",     (uint64_t)nCoinCacheUsagePeak));
+    coinscache.push_back(Pair("limit_bytes",    (uint64_t)nCoinCacheUsage));
+    obj.push_back(Pair("coinscache",            coinscache));
+
+    CSignatureCacheStats sigstats;
+    GetSignatureCacheStats(sigstats);
+    Object sigcache;
+    sigcache.push_back(Pair("bytes",            sigstats.nBytes));
+    sigcache.push_back(Pair("hits",             sigstats.nHits));
+    sigcache.push_back(Pair("misses",           sigstats.nMisses));
+    obj.push_back(Pair("sigcache",              sigcache));
     return obj;
 }
 
@@ -609,6 +755,9 @@ Value getmempoolinfo(const Array& params, bool fHelp)
             "{\n"
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
+            "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum memory usage for the mempool\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee per kB for a transaction to be accepted\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
@@ -618,7 +767,89 @@ Value getmempoolinfo(const Array& params, bool fHelp)
     Object ret;
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
+    ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
+
+    return ret;
+}
+
+Value savemempool(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "savemempool\n"
+            "\nWrites the transaction memory pool to mempool.dat in the data directory, to be loaded on restart.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("savemempool", "")
+            + HelpExampleRpc("savemempool", "")
+        );
+
+    if (!fMempoolLoaded)
+        throw JSONRPCError(RPC_MISC_ERROR, "The mempool was not loaded yet");
+    if (!DumpMempool())
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to dump mempool to disk");
+
+    return Value::null;
+}
 
+Value getscriptcheckinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getscriptcheckinfo\n"
+            "\nReturns counters of the parallel script verification threads (-par).\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"threads\": xxxxx,         (numeric) verification threads, including the one connecting blocks\n"
+            "  \"batchsize\": xxxxx,       (numeric) maximum number of checks taken at once\n"
+            "  \"blocks\": xxxxx,          (numeric) blocks whose scripts were verified in parallel\n"
+            "  \"checks\": xxxxx,          (numeric) script checks run\n"
+            "  \"batches\": xxxxx,         (numeric) batches of checks taken\n"
+            "  \"stolen\": xxxxx,          (numeric) checks taken from another thread's queue\n"
+            "  \"verify_us\": xxxxx,       (numeric) total wall time spent verifying, in microseconds\n"
+            "  \"idle_us\": [ xxxxx, ... ] (array) per thread, time spent idle while blocks were verified\n"
+            "  \"last\": {                 (object) the most recently verified block\n"
+            "     \"checks\": xxxxx,\n"
+            "     \"batches\": xxxxx,\n"
+            "     \"stolen\": xxxxx,\n"
+            "     \"verify_us\": xxxxx,\n"
+            "     \"idle_us\": [ xxxxx, ... ]\n"
+            "  }\n"
+            "}\n"
+            "\nThread 0 is the thread connecting blocks, which adds checks and then helps verify them.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getscriptcheckinfo", "")
+            + HelpExampleRpc("getscriptcheckinfo", "")
+        );
+
+    CCheckQueueStats stats;
+    GetScriptCheckQueueStats(stats);
+
+    Array idle, lastIdle;
+    BOOST_FOREACH(int64_t nMicros, stats.vIdleMicros)
+        idle.push_back(nMicros);
+    BOOST_FOREACH(int64_t nMicros, stats.vLastIdleMicros)
+        lastIdle.push_back(nMicros);
+
+    Object last;
+    last.push_back(Pair("checks",       stats.nLastChecks));
+    last.push_back(Pair("batches",      stats.nLastBatches));
+    last.push_back(Pair("stolen",       stats.nLastStolen));
+    last.push_back(Pair("verify_us",    stats.nLastWallMicros));
+    last.push_back(Pair("idle_us",      lastIdle));
+
+    Object ret;
+    ret.push_back(Pair("threads",       (int)stats.nWorkers));
+    ret.push_back(Pair("batchsize",     (int)stats.nBatchSize));
+    ret.push_back(Pair("blocks",        stats.nRuns));
+    ret.push_back(Pair("checks",        stats.nChecks));
+    ret.push_back(Pair("batches",       stats.nBatches));
+    ret.push_back(Pair("stolen",        stats.nStolen));
+    ret.push_back(Pair("verify_us",     stats.nWallMicros));
+    ret.push_back(Pair("idle_us",       idle));
+    ret.push_back(Pair("last",          last));
     return ret;
 }
 
@@ -20,6 +20,7 @@
 #include "util.h"
 #include "validationinterface.h"
 #include "timedata.h"
+#include "ui_interface.h"
 #ifdef ENABLE_WALLET
 #include "wallet/db.h"
 #include "wallet/wallet.h"
@@ -27,18 +28,385 @@
 
 #include <stdint.h>
 
+#include <deque>
+
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 #include "json/json_spirit_utils.h"
 #include "json/json_spirit_value.h"
 
 using namespace json_spirit;
 using namespace std;
 
+/** Least number of seconds between rebuilds of the block template for mempool changes alone */
+static const int64_t BLOCK_TEMPLATE_REBUILD_INTERVAL = 5;
+/** Seconds without a template request after which the block template is no longer kept up to date */
+static const int64_t BLOCK_TEMPLATE_IDLE_TIMEOUT = 120;
+
+/** A block template built for the tip, with its getblocktemplate result */
+struct CCachedBlockTemplate
+{
+    CBlockTemplate tmpl;
+    CBlockIndex* pindexPrev;
+    uint64_t nSequence; // Numbers the templates built, for longpollid
+    CFeeRate minFeeRate; // Lowest fee rate of a fee-paying transaction in it
+    bool fFull;
+    Object result; // With curtime and bits as of the build
+};
+
+/**
+ * The block template for the current tip, shared by every getblocktemplate
+ * and getwork caller. A thread of its own, started by the first request,
+ * rebuilds it outside of any RPC call: at once when the tip changes, and for
+ * mempool changes, at most every BLOCK_TEMPLATE_REBUILD_INTERVAL seconds once
+ * a transaction has come in that pays a higher fee rate than the least in the
+ * template, or while the template has room. Longpolling callers wait for it
+ * to be rebuilt. Nothing is rebuilt on its own during initial block download,
+ * nor once BLOCK_TEMPLATE_IDLE_TIMEOUT seconds have passed without a request
+ * or a longpolling caller; the next request builds it again.
+ */
+class CBlockTemplateCache : public CValidationInterface
+{
+private:
+    boost::mutex cs;
+    boost::condition_variable condRebuild; // Wakes the builder
+    boost::condition_variable condUpdated; // Wakes callers waiting for a template
+    boost::thread_group threadGroup;
+    boost::signals2::connection connBlockTip;
+    bool fRunning;
+    bool fStopped; // Shutting down, not to be started again
+    bool fTipChanged;
+    bool fMempoolChanged;
+    bool fBuilding;
+    uint64_t nAttempts;
+    int64_t nLastBuild;
+    int64_t nLastRequest;
+    int nWaiting; // Longpolling callers
+    boost::shared_ptr<const CCachedBlockTemplate> pcurrent;
+
+    // Called with cs held
+    bool IsIdle() const
+    {
+        return nWaiting == 0 && GetTime() - nLastRequest >= BLOCK_TEMPLATE_IDLE_TIMEOUT;
+    }
+
+    // Called with cs held
+    void StartThread()
+    {
+        if (fRunning || fStopped)
+            return;
+        fRunning = true;
+        RegisterValidationInterface(this);
+        connBlockTip = uiInterface.NotifyBlockTip.connect(boost::bind(&CBlockTemplateCache::BlockTip, this, _1));
+        threadGroup.create_thread(boost::bind(&CBlockTemplateCache::ThreadBuild, this));
+    }
+
+    boost::shared_ptr<const CCachedBlockTemplate> Build(uint64_t nSequence)
+    {
+        boost::shared_ptr<CCachedBlockTemplate> pnew(new CCachedBlockTemplate());
+        pnew->nSequence = nSequence;
+        {
+            LOCK(cs_main);
+            CScript scriptDummy = CScript() << OP_TRUE;
+            boost::scoped_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(scriptDummy));
+            if (!pblocktemplate)
+                return boost::shared_ptr<const CCachedBlockTemplate>();
+            pnew->tmpl = *pblocktemplate;
+            pnew->pindexPrev = chainActive.Tip();
+        }
+        const CBlock& block = pnew->tmpl.block;
+        const CBlockIndex* pindexPrev = pnew->pindexPrev;
+
+        unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+        nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+        unsigned int nBlockSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+        pnew->fFull = nBlockSize + 4000 >= nBlockMaxSize;
+
+        static const Array aCaps = boost::assign::list_of("proposal");
+
+        Array transactions;
+        map<uint256, int64_t> setTxIndex;
+        bool fHaveFeeRate = false;
+        for (unsigned int i = 0; i < block.vtx.size(); i++) {
+            const CTransaction& tx = block.vtx[i];
+            uint256 txHash = tx.GetHash();
+            setTxIndex[txHash] = i;
+
+            if (tx.IsCoinBase())
+                continue;
+
+            Object entry;
+
+            entry.push_back(Pair("data", EncodeHexTx(tx)));
+
+            entry.push_back(Pair("hash", txHash.GetHex()));
+
+            Array deps;
+            BOOST_FOREACH (const CTxIn &in, tx.vin)
+            {
+                if (setTxIndex.count(in.prevout.hash))
+                    deps.push_back(setTxIndex[in.prevout.hash]);
+            }
+            entry.push_back(Pair("depends", deps));
+
+            entry.push_back(Pair("fee", pnew->tmpl.vTxFees[i]));
+            entry.push_back(Pair("sigops", pnew->tmpl.vTxSigOps[i]));
+
+            transactions.push_back(entry);
+
+            if (pnew->tmpl.vTxFees[i] > 0) {
+                CFeeRate feeRate(pnew->tmpl.vTxFees[i], ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION));
+                if (!fHaveFeeRate || feeRate < pnew->minFeeRate)
+                    pnew->minFeeRate = feeRate;
+                fHaveFeeRate = true;
+            }
+        }
+
+        Object aux;
+        aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
+
+        arith_uint256 hashTarget = arith_uint256().SetCompact(block.nBits);
+
+        static Array aMutable;
+        if (aMutable.empty())
+        {
+            aMutable.push_back("time");
+            aMutable.push_back("transactions");
+            aMutable.push_back("prevblock");
+        }
+
+        Object& result = pnew->result;
+        result.push_back(Pair("capabilities", aCaps));
+        result.push_back(Pair("version", block.nVersion));
+        result.push_back(Pair("previousblockhash", block.hashPrevBlock.GetHex()));
+        result.push_back(Pair("transactions", transactions));
+        result.push_back(Pair("coinbaseaux", aux));
+        result.push_back(Pair("coinbasevalue", (int64_t)block.vtx[0].vout[0].nValue));
+        result.push_back(Pair("longpollid", block.hashPrevBlock.GetHex() + i64tostr(nSequence)));
+        result.push_back(Pair("target", hashTarget.GetHex()));
+        result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
+        result.push_back(Pair("mutable", aMutable));
+        result.push_back(Pair("noncerange", "00000000ffffffff"));
+        result.push_back(Pair("sigoplimit", (int64_t)MAX_BLOCK_SIGOPS));
+        result.push_back(Pair("sizelimit", (int64_t)MAX_BLOCK_SIZE));
+        result.push_back(Pair("curtime", block.GetBlockTime()));
+        result.push_back(Pair("bits", strprintf("%08x", block.nBits)));
+        result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
+
+        return pnew;
+    }
+
+    // Build a template and make it the current one; called without cs held
+    void Rebuild(uint64_t nSequence)
+    {
+        int64_t nStart = GetTimeMicros();
+        boost::shared_ptr<const CCachedBlockTemplate> pnew;
+        try {
+            pnew = Build(nSequence);
+        } catch (const std::exception& e) {
+            LogPrintf("CBlockTemplateCache: failed to build a block template: %s\n", e.what());
+        }
+        if (pnew)
+            LogPrint("rpc", "CBlockTemplateCache: built template %u with %u transactions in %.2fms\n",
+                     nSequence, pnew->tmpl.block.vtx.size(), 0.001 * (GetTimeMicros() - nStart));
+
+        boost::lock_guard<boost::mutex> lock(cs);
+        if (pnew)
+            pcurrent = pnew;
+        nAttempts++;
+        nLastBuild = GetTime();
+        condUpdated.notify_all();
+    }
+
+    void ThreadBuild()
+    {
+        RenameThread("lycancoin-gbt");
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (fRunning) {
+            if (!fTipChanged && !fMempoolChanged) {
+                condRebuild.wait(lock);
+                continue;
+            }
+            // Nobody is asking for templates: drop it rather than keep it up to date
+            if (IsIdle()) {
+                fTipChanged = fMempoolChanged = false;
+                pcurrent.reset();
+                continue;
+            }
+            // Hold off rebuilds for mempool changes until the interval is up
+            int64_t nWait = nLastBuild + BLOCK_TEMPLATE_REBUILD_INTERVAL - GetTime();
+            if (!fTipChanged && nWait > 0) {
+                condRebuild.timed_wait(lock, boost::posix_time::seconds(nWait));
+                continue;
+            }
+            fTipChanged = fMempoolChanged = false;
+            uint64_t nSequence = nAttempts + 1;
+            fBuilding = true;
+            lock.unlock();
+            Rebuild(nSequence);
+            lock.lock();
+            fBuilding = false;
+        }
+    }
+
+    void BlockTip(const uint256& hashNewTip)
+    {
+        // Templates for a chain still catching up are for nobody but longpolling callers
+        bool fInitialDownload = IsInitialBlockDownload();
+        boost::lock_guard<boost::mutex> lock(cs);
+        if (IsIdle() || (fInitialDownload && nWaiting == 0))
+            return;
+        fTipChanged = true;
+        condRebuild.notify_one();
+    }
+
+protected:
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+    {
+        // Only transactions entering the pool: called under cs_main from AcceptToMemoryPool
+        if (pblock)
+            return;
+        {
+            boost::lock_guard<boost::mutex> lock(cs);
+            if (IsIdle())
+                return;
+        }
+        if (IsInitialBlockDownload())
+            return;
+        CFeeRate feeRate;
+        {
+            LOCK(mempool.cs);
+            std::map<uint256, CTxMemPoolEntry>::const_iterator it = mempool.mapTx.find(tx.GetHash());
+            if (it == mempool.mapTx.end())
+                return;
+            feeRate = CFeeRate(it->second.GetModFeesWithAncestors(), it->second.GetSizeWithAncestors());
+        }
+        boost::lock_guard<boost::mutex> lock(cs);
+        if (!pcurrent || !pcurrent->fFull || feeRate > pcurrent->minFeeRate) {
+            fMempoolChanged = true;
+            condRebuild.notify_one();
+        }
+    }
+
+public:
+    CBlockTemplateCache() : fRunning(false), fStopped(false), fTipChanged(false), fMempoolChanged(false), fBuilding(false), nAttempts(0), nLastBuild(0), nLastRequest(0), nWaiting(0) {}
+
+    void Stop()
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(cs);
+            fStopped = true;
+            if (!fRunning)
+                return;
+            fRunning = false;
+            connBlockTip.disconnect();
+            UnregisterValidationInterface(this);
+            condRebuild.notify_all();
+            condUpdated.notify_all();
+        }
+        threadGroup.join_all();
+        pcurrent.reset();
+    }
+
+    /** Wake longpolling callers, for them to notice that RPC is stopping */
+    void Interrupt()
+    {
+        boost::lock_guard<boost::mutex> lock(cs);
+        condUpdated.notify_all();
+    }
+
+    /** The template for the current tip, waiting for it to be built if need be */
+    boost::shared_ptr<const CCachedBlockTemplate> Get()
+    {
+        CBlockIndex* pindexTip;
+        {
+            LOCK(cs_main);
+            pindexTip = chainActive.Tip();
+        }
+        boost::unique_lock<boost::mutex> lock(cs);
+        // Left alone while idle, it may lack what came into the mempool since
+        if (IsIdle())
+            pcurrent.reset();
+        nLastRequest = GetTime();
+        StartThread();
+        if (pcurrent && pcurrent->pindexPrev == pindexTip)
+            return pcurrent;
+
+        // A build already under way may be for the previous tip, so wait for the next one
+        uint64_t nAttemptsStart = nAttempts;
+        if (fRunning) {
+            uint64_t nAttemptsEnd = nAttemptsStart + (fBuilding ? 2 : 1);
+            fTipChanged = true;
+            condRebuild.notify_one();
+            while (fRunning && nAttempts < nAttemptsEnd)
+                condUpdated.wait(lock);
+        } else {
+            // Not started (or stopped): build it here
+            lock.unlock();
+            Rebuild(nAttemptsStart + 1);
+            lock.lock();
+        }
+        if (!pcurrent || pcurrent->nSequence <= nAttemptsStart)
+            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+        return pcurrent;
+    }
+
+    /**
+     * Wait until the template for the current tip is for a tip other than
+     * hashWatchedChain, or, once a minute has passed, is another one than
+     * template nSequence, and return it. It is the template looked at that
+     * is returned, so what the caller serves is always a change.
+     */
+    boost::shared_ptr<const CCachedBlockTemplate> WaitForChange(const uint256& hashWatchedChain, uint64_t nSequence)
+    {
+        boost::system_time deadline = boost::get_system_time() + boost::posix_time::minutes(1);
+        {
+            boost::lock_guard<boost::mutex> lock(cs);
+            nWaiting++;
+        }
+        boost::shared_ptr<const CCachedBlockTemplate> ptemplate;
+        try {
+            while (true) {
+                ptemplate = Get();
+                if (ptemplate->tmpl.block.hashPrevBlock != hashWatchedChain)
+                    break;
+                bool fTimedOut = boost::get_system_time() >= deadline;
+                if (fTimedOut && ptemplate->nSequence != nSequence)
+                    break;
+                boost::unique_lock<boost::mutex> lock(cs);
+                if (!fRunning || !IsRPCRunning())
+                    break;
+                // Rebuilt since: look at the new one
+                if (pcurrent != ptemplate)
+                    continue;
+                if (fTimedOut)
+                    condUpdated.wait(lock);
+                else
+                    condUpdated.timed_wait(lock, deadline);
+            }
+        } catch (...) {
+            boost::lock_guard<boost::mutex> lock(cs);
+            nWaiting--;
+            throw;
+        }
+        boost::lock_guard<boost::mutex> lock(cs);
+        nWaiting--;
+        return ptemplate;
+    }
+};
+
+static CBlockTemplateCache blockTemplateCache;
+
 #ifdef ENABLE_WALLET
 // Key used by getwork miners.
 
 void InitRPCMining()
 {
+    RPCServer::OnStopped(boost::bind(&CBlockTemplateCache::Interrupt, &blockTemplateCache));
+
     if (!pwalletMain)
         return;
 
@@ -48,17 +416,112 @@ void InitRPCMining()
 
 void ShutdownRPCMining()
 {
+    blockTemplateCache.Stop();
+
     if (!pMiningKey)
         return;
 
     delete pMiningKey; pMiningKey = NULL;
 }
+
+/** Most blocks handed out by getwork and getworkex that are kept for their solutions */
+static const unsigned int MAX_GETWORK_BLOCKS = 1000;
+/** Seconds a block handed out by getwork or getworkex is kept for its solution */
+static const int64_t GETWORK_BLOCK_EXPIRY = 120;
+
+/**
+ * The blocks handed out by getwork and getworkex, by merkle root, for when a
+ * miner sends one back solved. Each is kept as the shared block template it
+ * was made from and its own coinbase, not as a copy of the block, and only
+ * the latest MAX_GETWORK_BLOCKS of the last GETWORK_BLOCK_EXPIRY seconds;
+ * a new tip drops them all.
+ */
+class CGetworkBlocks
+{
+private:
+    struct CEntry
+    {
+        boost::shared_ptr<const CCachedBlockTemplate> ptemplate;
+        CTransaction txCoinbase;
+        int64_t nTime;
+    };
+
+    CCriticalSection cs;
+    std::map<uint256, CEntry> mapBlocks;
+    std::deque<uint256> vOrder; // Merkle roots of mapBlocks, oldest first
+    uint256 hashPrevBlock;
+    unsigned int nExtraNonce;
+
+public:
+    CGetworkBlocks() : nExtraNonce(0) {}
+
+    // A new block to work on, from the shared block template, paying to the given key
+    bool New(CReserveKey& reservekey, CBlock& block, CBlockIndex*& pindexPrev)
+    {
+        CPubKey pubkey;
+        if (!reservekey.GetReservedKey(pubkey))
+            return false;
+
+        boost::shared_ptr<const CCachedBlockTemplate> pcached = blockTemplateCache.Get();
+        block = pcached->tmpl.block;
+        pindexPrev = pcached->pindexPrev;
+        CMutableTransaction txCoinbase(block.vtx[0]);
+        txCoinbase.vout[0].scriptPubKey = CScript() << ToByteVector(pubkey) << OP_CHECKSIG;
+        block.vtx[0] = txCoinbase;
+
+        LOCK(cs);
+        if (block.hashPrevBlock != hashPrevBlock) {
+            // Work on the old tip can't make a block anymore
+            mapBlocks.clear();
+            vOrder.clear();
+            hashPrevBlock = block.hashPrevBlock;
+        }
+        IncrementExtraNonce(&block, pindexPrev, nExtraNonce);
+
+        int64_t nNow = GetTime();
+        while (!vOrder.empty() && (vOrder.size() >= MAX_GETWORK_BLOCKS || mapBlocks[vOrder.front()].nTime < nNow - GETWORK_BLOCK_EXPIRY)) {
+            mapBlocks.erase(vOrder.front());
+            vOrder.pop_front();
+        }
+        CEntry& entry = mapBlocks[block.hashMerkleRoot];
+        if (!entry.ptemplate)
+            vOrder.push_back(block.hashMerkleRoot);
+        entry.ptemplate = pcached;
+        entry.txCoinbase = block.vtx[0];
+        entry.nTime = nNow;
+        return true;
+    }
+
+    // The block handed out with the given merkle root, if it is still kept
+    bool Get(const uint256& hashMerkleRoot, CBlock& block)
+    {
+        boost::shared_ptr<const CCachedBlockTemplate> ptemplate;
+        CTransaction txCoinbase;
+        {
+            LOCK(cs);
+            std::map<uint256, CEntry>::const_iterator it = mapBlocks.find(hashMerkleRoot);
+            if (it == mapBlocks.end())
+                return false;
+            ptemplate = it->second.ptemplate;
+            txCoinbase = it->second.txCoinbase;
+        }
+        block = ptemplate->tmpl.block;
+        block.vtx[0] = txCoinbase;
+        block.hashMerkleRoot = hashMerkleRoot;
+        // The block may have been submitted, and checked, before with another nonce
+        block.fChecked = false;
+        return true;
+    }
+};
+static CGetworkBlocks getworkBlocks;
 #else
 void InitRPCMining()
 {
+    RPCServer::OnStopped(boost::bind(&CBlockTemplateCache::Interrupt, &blockTemplateCache));
 }
 void ShutdownRPCMining()
 {
+    blockTemplateCache.Stop();
 }
 #endif
 
@@ -316,58 +779,18 @@ Value getworkex(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Lycancoin is downloading blocks...");
 
-    typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;
-    static vector<CBlockTemplate*> vNewBlockTemplate;
-
     if (params.size() == 0)
     {
-        // Update block
-        static unsigned int nTransactionsUpdatedLast;
-        static CBlockIndex* pindexPrev;
-        static int64_t nStart;
-        static CBlockTemplate* pblocktemplate;
-        if (pindexPrev != chainActive.Tip() ||
-            (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60))
-        {
-            if (pindexPrev != chainActive.Tip())
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlockTemplate* pblocktemplate, vNewBlockTemplate)
-                    delete pblocktemplate;
-                vNewBlockTemplate.clear();
-            }
-            
-            // Clear pindexPrev so future getworks make a new block, despite any failures from here on
-            pindexPrev = NULL;
-
-            // Store the pindexBest used before CreateNewBlock, to avoid races
-            nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-            CBlockIndex* pindexPrevNew = chainActive.Tip();
-            nStart = GetTime();
-
-            // Create new block
-            pblocktemplate = CreateNewBlockWithKey(*pMiningKey);
-            if (!pblocktemplate)
-                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-            vNewBlockTemplate.push_back(pblocktemplate);
-            // Need to update only after we know CreateNewBlock succeeded
-            pindexPrev = pindexPrevNew;
-        }
-        CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+        CBlock block;
+        CBlockIndex* pindexPrev = NULL;
+        if (!getworkBlocks.New(*pMiningKey, block, pindexPrev))
+            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+        CBlock* pblock = &block; // pointer for convenience
 
         // Update nTime
         pblock->nTime = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
         pblock->nNonce = 0;
 
-        // Update nExtraNonce
-        static unsigned int nExtraNonce = 0;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
-
-        // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
-
         // Prebuild hash buffers
         char pmidstate[32];
         char pdata[128];
@@ -419,19 +842,15 @@ Value getworkex(const Array& params, bool fHelp)
             ((unsigned int*)pdata)[i] = ByteReverse(((unsigned int*)pdata)[i]);
 
         // Get saved block
-        if (!mapNewBlock.count(pdata->hashMerkleRoot))
+        CBlock block;
+        if (!getworkBlocks.Get(pdata->hashMerkleRoot, block))
             return false;
-        CBlock* pblock = mapNewBlock[pdata->hashMerkleRoot].first;
+        CBlock* pblock = &block;
 
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
 
-        if(coinbase.size() == 0){
-            CMutableTransaction txCoinbase(pblock->vtx[0]);
-            txCoinbase.vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-            pblock->vtx[0] = CTransaction(txCoinbase);
-            }
-        else
+        if(coinbase.size() != 0)
             CDataStream(coinbase, SER_NETWORK, PROTOCOL_VERSION) >> pblock->vtx[0]; // FIXME - HACK!
 
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
@@ -471,59 +890,18 @@ Value getwork(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(-10, "Lycancoin server is downloading blocks...");
 
-    typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
-    static vector<CBlockTemplate*> vNewBlockTemplate;
-
     if (params.size() == 0)
     {
-        // Update block
-        static unsigned int nTransactionsUpdatedLast;
-        static CBlockIndex* pindexPrev;
-        static int64_t nStart;
-        static CBlockTemplate* pblocktemplate;
-        if (pindexPrev != chainActive.Tip() ||
-            (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60))
-        {
-            if (pindexPrev != chainActive.Tip())
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlockTemplate* pblocktemplate, vNewBlockTemplate)
-                    delete pblocktemplate;
-                vNewBlockTemplate.clear();
-            }
-            
-            // Clear pindexPrev so future getworks make a new block, despite any failures from here on
-            pindexPrev = NULL;
-
-            // Store the pindexBest used before CreateNewBlock, to avoid races
-            nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-            CBlockIndex* pindexPrevNew = chainActive.Tip();
-            nStart = GetTime();
-
-            // Create new block
-            pblocktemplate = CreateNewBlockWithKey(*pMiningKey);
-            if (!pblocktemplate)
-                throw JSONRPCError(-7, "Out of memory");
-            vNewBlockTemplate.push_back(pblocktemplate);
-
-            // Need to update only after we know CreateNewBlock succeeded
-            pindexPrev = pindexPrevNew;
-        }
-        CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+        CBlock block;
+        CBlockIndex* pindexPrev = NULL;
+        if (!getworkBlocks.New(*pMiningKey, block, pindexPrev))
+            throw JSONRPCError(-7, "Out of memory");
+        CBlock* pblock = &block; // pointer for convenience
 
         // Update nTime
         UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
         pblock->nNonce = 0;
 
-        // Update nExtraNonce
-        static unsigned int nExtraNonce = 0;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
-
-        // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
-
         // Prebuild hash buffers
         char pmidstate[32];
         char pdata[128];
@@ -553,16 +931,13 @@ Value getwork(const Array& params, bool fHelp)
             ((unsigned int*)pdata)[i] = ByteReverse(((unsigned int*)pdata)[i]);
 
         // Get saved block
-        if (!mapNewBlock.count(pdata->hashMerkleRoot))
+        CBlock block;
+        if (!getworkBlocks.Get(pdata->hashMerkleRoot, block))
             return false;
-        CBlock* pblock = mapNewBlock[pdata->hashMerkleRoot].first;
+        CBlock* pblock = &block;
 
         pblock->nTime = pdata->nTime;
-        pblock->nNonce = pdata->nNonce;
-        CMutableTransaction txCoinbase(pblock->vtx[0]);
-        txCoinbase.vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-        pblock->vtx[0] = CTransaction(txCoinbase);
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        pblock->nNonce = pdata->nNonce;
 
         return CheckWork(pblock, *pwalletMain, *pMiningKey);
     }
@@ -683,8 +1058,6 @@ Value getblocktemplate(const Array& params, bool fHelp)
             + HelpExampleRpc("getblocktemplate", "")
          );
 
-    LOCK(cs_main);
-
     std::string strMode = "template";
     Value lpval = Value::null;
     if (params.size() > 0)
@@ -711,6 +1084,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             if (!DecodeHexBlk(block, dataval.get_str()))
                 throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Block decode failed");
 
+            LOCK(cs_main);
             uint256 hash = block.GetHash();
             BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end()) {
@@ -741,154 +1115,62 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Lycancoin is downloading blocks...");
 
-    static unsigned int nTransactionsUpdatedLast;
-    
+    // The template is shared and built on a thread of its own, so none of
+    // this holds cs_main for more than a moment
+    boost::shared_ptr<const CCachedBlockTemplate> pcached;
     if (lpval.type() != null_type)
     {
         // Wait to respond until either the best block changes, OR a minute has passed and there are more transactions
         uint256 hashWatchedChain;
-        boost::system_time checktxtime;
-        unsigned int nTransactionsUpdatedLastLP;
+        uint64_t nSequenceLP;
 
         if (lpval.type() == str_type)
         {
-            // Format: <hashBestChain><nTransactionsUpdatedLast>
+            // Format: <hashBestChain><nSequence>
             std::string lpstr = lpval.get_str();
 
             hashWatchedChain.SetHex(lpstr.substr(0, 64));
-            nTransactionsUpdatedLastLP = atoi64(lpstr.substr(64));
+            nSequenceLP = atoi64(lpstr.substr(64));
         }
         else
         {
             // NOTE: Spec does not specify behaviour for non-string longpollid, but this makes testing easier
-            hashWatchedChain = chainActive.Tip()->GetBlockHash();
-            nTransactionsUpdatedLastLP = nTransactionsUpdatedLast;
+            pcached = blockTemplateCache.Get();
+            hashWatchedChain = pcached->tmpl.block.hashPrevBlock;
+            nSequenceLP = pcached->nSequence;
         }
 
-        // Release the wallet and main lock while waiting
-        LEAVE_CRITICAL_SECTION(cs_main);
-        {
-            checktxtime = boost::get_system_time() + boost::posix_time::minutes(1);
-
-            boost::unique_lock<boost::mutex> lock(csBestBlock);
-            while (chainActive.Tip()->GetBlockHash() == hashWatchedChain && IsRPCRunning())
-            {
-                if (!cvBlockChange.timed_wait(lock, checktxtime))
-                {
-                    // Timeout: Check transactions for update
-                    if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastLP)
-                        break;
-                    checktxtime += boost::posix_time::seconds(10);
-                }
-            }
-        }
-        ENTER_CRITICAL_SECTION(cs_main);
+        pcached = blockTemplateCache.WaitForChange(hashWatchedChain, nSequenceLP);
 
         if (!IsRPCRunning())
             throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
         // TODO: Maybe recheck connections/IBD and (if something wrong) send an expires-immediately template to stop miners?
     }
 
-    // Update block
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
-    {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
-
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
-
-        // Create new block
-        if(pblocktemplate)
-        {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
-        }
-        CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = CreateNewBlock(scriptDummy);
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
-    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
-
-    // Update nTime
-    UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
-    pblock->nNonce = 0;
-
-    static const Array aCaps = boost::assign::list_of("proposal");
-
-    Array transactions;
-    map<uint256, int64_t> setTxIndex;
-    int i = 0;
-    BOOST_FOREACH (CTransaction& tx, pblock->vtx)
-    {
-        uint256 txHash = tx.GetHash();
-        setTxIndex[txHash] = i++;
-
-        if (tx.IsCoinBase())
-            continue;
-
-        Object entry;
+    if (!pcached)
+        pcached = blockTemplateCache.Get();
 
-        entry.push_back(Pair("data", EncodeHexTx(tx)));
-
-        entry.push_back(Pair("hash", txHash.GetHex()));
-
-        Array deps;
-        BOOST_FOREACH (const CTxIn &in, tx.vin)
-        {
-            if (setTxIndex.count(in.prevout.hash))
-                deps.push_back(setTxIndex[in.prevout.hash]);
-        }
-        entry.push_back(Pair("depends", deps));
-
-        int index_in_template = i - 1;
-        entry.push_back(Pair("fee", pblocktemplate->vTxFees[index_in_template]));
-        entry.push_back(Pair("sigops", pblocktemplate->vTxSigOps[index_in_template]));
-
-        transactions.push_back(entry);
+    // Only the time (and with it, on test networks, the bits and target) differs per call
+    CBlockHeader header = pcached->tmpl.block.GetBlockHeader();
+    if (Params().GetConsensus().fPowAllowMinDifficultyBlocks) {
+        // Where the work required depends on the time, it is read from the chain
+        LOCK(cs_main);
+        UpdateTime(&header, Params().GetConsensus(), pcached->pindexPrev);
+    } else {
+        UpdateTime(&header, Params().GetConsensus(), pcached->pindexPrev);
     }
 
-    Object aux;
-    aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
-
-    arith_uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
-
-    static Array aMutable;
-    if (aMutable.empty())
+    Object result = pcached->result;
+    BOOST_FOREACH(Pair& pair, result)
     {
-        aMutable.push_back("time");
-        aMutable.push_back("transactions");
-        aMutable.push_back("prevblock");
+        if (pair.name_ == "curtime")
+            pair.value_ = header.GetBlockTime();
+        else if (pair.name_ == "bits")
+            pair.value_ = strprintf("%08x", header.nBits);
+        else if (pair.name_ == "target")
+            pair.value_ = arith_uint256().SetCompact(header.nBits).GetHex();
     }
 
-    Object result;
-    result.push_back(Pair("capabilities", aCaps));
-    result.push_back(Pair("version", pblock->nVersion));
-    result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
-    result.push_back(Pair("transactions", transactions));
-    result.push_back(Pair("coinbaseaux", aux));
-    result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue));
-    result.push_back(Pair("longpollid", chainActive.Tip()->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
-    result.push_back(Pair("target", hashTarget.GetHex()));
-    result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
-    result.push_back(Pair("mutable", aMutable));
-    result.push_back(Pair("noncerange", "00000000ffffffff"));
-    result.push_back(Pair("sigoplimit", (int64_t)MAX_BLOCK_SIGOPS));
-    result.push_back(Pair("sizelimit", (int64_t)MAX_BLOCK_SIZE));
-    result.push_back(Pair("curtime", pblock->GetBlockTime()));
-    result.push_back(Pair("bits", strprintf("%08x", pblock->nBits)));
-    result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
-
     return result;
 }
 
@@ -5,76 +5,141 @@
 
 #include "sigcache.h"
 
+#include "crypto/common.h"
+#include "crypto/sha256.h"
 #include "pubkey.h"
 #include "random.h"
 #include "uint256.h"
 #include "util.h"
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 namespace {
 
+/** Entries per set of the signature cache */
+static const unsigned int SIGCACHE_WAYS = 4;
+/** Independently locked slices of the signature cache */
+static const unsigned int SIGCACHE_STRIPES = 64;
+
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// Entries are salted SHA256 hashes of (signature hash, signature, public key)
+// kept in a fixed array of SIGCACHE_WAYS-way sets, so lookups and inserts
+// never allocate. Set i is guarded by the lock of stripe i % SIGCACHE_STRIPES.
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    struct CSet
+    {
+        uint256 entries[SIGCACHE_WAYS];
+    };
+
+    struct CStripe
+    {
+        boost::mutex cs;
+        uint64_t nHits;
+        uint64_t nMisses;
+        CStripe() : nHits(0), nMisses(0) {}
+    };
+
+    //! Salt, so that which entries share a set and evict each other cannot be predicted
+    uint256 nonce;
+    std::vector<CSet> vSets;
+    CStripe stripes[SIGCACHE_STRIPES];
+
+    void ComputeEntry(uint256& entry, const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const
+    {
+        CSHA256().Write(nonce.begin(), 32).Write(hash.begin(), 32).Write(vchSig.empty() ? NULL : &vchSig[0], vchSig.size()).Write(pubkey.begin(), pubkey.size()).Finalize(entry.begin());
+    }
 
 public:
+    CSignatureCache() : nonce(GetRandHash())
+    {
+        int64_t nMaxCacheSize = std::min(std::max(GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE), (int64_t)0), MAX_MAX_SIG_CACHE_SIZE);
+        vSets.resize((nMaxCacheSize << 20) / sizeof(CSet));
+        LogPrintf("Using %.1fMiB for the signature cache (%u entries)\n", vSets.size() * sizeof(CSet) * (1.0 / (1 << 20)), vSets.size() * SIGCACHE_WAYS);
+    }
+
     bool
     Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        if (vSets.empty())
+            return false;
+        uint256 entry;
+        ComputeEntry(entry, hash, vchSig, pubKey);
+        uint64_t nSet = ReadLE64(entry.begin()) % vSets.size();
+        CStripe& stripe = stripes[nSet % SIGCACHE_STRIPES];
+        const CSet& set = vSets[nSet];
+
+        boost::unique_lock<boost::mutex> lock(stripe.cs);
+        for (unsigned int i = 0; i < SIGCACHE_WAYS; i++) {
+            if (set.entries[i] == entry) {
+                stripe.nHits++;
+                return true;
+            }
+        }
+        stripe.nMisses++;
         return false;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+        if (vSets.empty())
+            return;
+        uint256 entry;
+        ComputeEntry(entry, hash, vchSig, pubKey);
+        uint64_t nSet = ReadLE64(entry.begin()) % vSets.size();
+        CStripe& stripe = stripes[nSet % SIGCACHE_STRIPES];
+        CSet& set = vSets[nSet];
+
+        boost::unique_lock<boost::mutex> lock(stripe.cs);
+        unsigned int nFree = SIGCACHE_WAYS;
+        for (unsigned int i = 0; i < SIGCACHE_WAYS; i++) {
+            if (set.entries[i] == entry)
+                return;
+            if (nFree == SIGCACHE_WAYS && set.entries[i].IsNull())
+                nFree = i;
         }
+        // With the set full, evict a random way. Random because that helps
+        // foil would-be DoS attackers who might try to pre-generate and re-use
+        // a set of valid signatures; the salted entry itself supplies the
+        // randomness, without drawing from the RNG.
+        if (nFree == SIGCACHE_WAYS)
+            nFree = ReadLE64(entry.begin() + 8) % SIGCACHE_WAYS;
+        set.entries[nFree] = entry;
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    void GetStats(CSignatureCacheStats& stats)
+    {
+        stats.nBytes = vSets.size() * sizeof(CSet);
+        stats.nHits = 0;
+        stats.nMisses = 0;
+        for (unsigned int i = 0; i < SIGCACHE_STRIPES; i++) {
+            boost::unique_lock<boost::mutex> lock(stripes[i].cs);
+            stats.nHits += stripes[i].nHits;
+            stats.nMisses += stripes[i].nMisses;
+        }
     }
 };
 
+CSignatureCache& GetSignatureCache()
+{
+    static CSignatureCache signatureCache;
+    return signatureCache;
+}
+
+}
+
+void GetSignatureCacheStats(CSignatureCacheStats& stats)
+{
+    GetSignatureCache().GetStats(stats);
 }
 
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    static CSignatureCache signatureCache;
+    CSignatureCache& signatureCache = GetSignatureCache();
 
     if (signatureCache.Get(sighash, vchSig, pubkey))
         return true;
@@ -85,4 +150,4 @@ bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsig
     if (store)
         signatureCache.Set(sighash, vchSig, pubkey);
     return true;
-}
\ No newline at end of file
+}
@@ -8,10 +8,26 @@
 
 #include "script/interpreter.h"
 
+#include <stdint.h>
 #include <vector>
 
 class CPubKey;
 
+/** Default for -maxsigcachesize, in megabytes */
+static const int64_t DEFAULT_MAX_SIG_CACHE_SIZE = 10;
+/** Largest accepted -maxsigcachesize, in megabytes */
+static const int64_t MAX_MAX_SIG_CACHE_SIZE = 256;
+
+struct CSignatureCacheStats
+{
+    uint64_t nBytes;
+    uint64_t nHits;
+    uint64_t nMisses;
+};
+
+/** Fill in the size and hit/miss counts of the signature cache */
+void GetSignatureCacheStats(CSignatureCacheStats& stats);
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
@@ -327,4 +327,187 @@ void scrypt_1024_1_1_256(const char *input, char *output)
 {
 	char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
     scrypt_1024_1_1_256_sp(input, output, scratchpad);
+}
+
+/*
+ * N-way interleaved scrypt(1024,1,1): SCRYPT_MULTI_WAYS independent hashes run
+ * in lock step, with every 32-bit Salsa20/8 state word stored as a row of
+ * lanes (X[word][lane]).  Each step of the core is then the same operation
+ * over all lanes, which the compiler turns into one AVX2/AVX-512 instruction
+ * (or a pair of SSE2 ones).  The kernel is instantiated once per instruction
+ * set and scrypt_detect_multi() picks the widest the CPU supports.
+ */
+
+#define MULTI_LANES(l) for (l = 0; l < SCRYPT_MULTI_WAYS; l++)
+
+#if defined(__GNUC__) && !defined(__clang__) && (defined(__x86_64__) || defined(__i386__))
+#define SCRYPT_MULTI_X86 1
+#define SCRYPT_MULTI_INLINE inline __attribute__((always_inline))
+#define SCRYPT_MULTI_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SCRYPT_MULTI_INLINE inline
+#endif
+
+typedef uint32_t scrypt_lanes_t[SCRYPT_MULTI_WAYS];
+
+static SCRYPT_MULTI_INLINE void xor_salsa8_multi(scrypt_lanes_t B[16], const scrypt_lanes_t Bx[16])
+{
+	scrypt_lanes_t x[16];
+	int i, k, l;
+
+	for (k = 0; k < 16; k++)
+		MULTI_LANES(l) x[k][l] = (B[k][l] ^= Bx[k][l]);
+
+#define R(a, b, c, s) MULTI_LANES(l) x[a][l] ^= ROTL(x[b][l] + x[c][l], s)
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on columns. */
+		R( 4, 0,12, 7); R( 9, 5, 1, 7); R(14,10, 6, 7); R( 3,15,11, 7);
+		R( 8, 4, 0, 9); R(13, 9, 5, 9); R( 2,14,10, 9); R( 7, 3,15, 9);
+		R(12, 8, 4,13); R( 1,13, 9,13); R( 6, 2,14,13); R(11, 7, 3,13);
+		R( 0,12, 8,18); R( 5, 1,13,18); R(10, 6, 2,18); R(15,11, 7,18);
+
+		/* Operate on rows. */
+		R( 1, 0, 3, 7); R( 6, 5, 4, 7); R(11,10, 9, 7); R(12,15,14, 7);
+		R( 2, 1, 0, 9); R( 7, 6, 5, 9); R( 8,11,10, 9); R(13,12,15, 9);
+		R( 3, 2, 1,13); R( 4, 7, 6,13); R( 9, 8,11,13); R(14,13,12,13);
+		R( 0, 3, 2,18); R( 5, 4, 7,18); R(10, 9, 8,18); R(15,14,13,18);
+	}
+#undef R
+
+	for (k = 0; k < 16; k++)
+		MULTI_LANES(l) B[k][l] += x[k][l];
+}
+
+static SCRYPT_MULTI_INLINE void scrypt_1024_1_1_256_sp_multi_kernel(const char * const input[], char * const output[], char *scratchpad)
+{
+	uint8_t B[128];
+	scrypt_lanes_t X[32];
+	scrypt_lanes_t *V;
+	uint32_t i, k, l;
+	uint32_t j[SCRYPT_MULTI_WAYS];
+
+	/* V[i * 32 + k][l] is word k of step i for lane l. */
+	V = (scrypt_lanes_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+
+	MULTI_LANES(l) {
+		PBKDF2_SHA256((const uint8_t *)input[l], 80, (const uint8_t *)input[l], 80, 1, B, 128);
+		for (k = 0; k < 32; k++)
+			X[k][l] = le32dec(&B[4 * k]);
+	}
+
+	for (i = 0; i < 1024; i++) {
+		memcpy(&V[i * 32], X, sizeof(X));
+		xor_salsa8_multi(&X[0], &X[16]);
+		xor_salsa8_multi(&X[16], &X[0]);
+	}
+	for (i = 0; i < 1024; i++) {
+		MULTI_LANES(l) j[l] = 32 * (X[16][l] & 1023);
+		for (k = 0; k < 32; k++)
+			MULTI_LANES(l) X[k][l] ^= V[j[l] + k][l];
+		xor_salsa8_multi(&X[0], &X[16]);
+		xor_salsa8_multi(&X[16], &X[0]);
+	}
+
+	MULTI_LANES(l) {
+		for (k = 0; k < 32; k++)
+			le32enc(&B[4 * k], X[k][l]);
+		PBKDF2_SHA256((const uint8_t *)input[l], 80, B, 128, 1, (uint8_t *)output[l], 32);
+	}
+}
+
+static void scrypt_1024_1_1_256_sp_multi_generic(const char * const input[], char * const output[], char *scratchpad)
+{
+	scrypt_1024_1_1_256_sp_multi_kernel(input, output, scratchpad);
+}
+
+#if defined(SCRYPT_MULTI_X86)
+static SCRYPT_MULTI_TARGET("avx2") void scrypt_1024_1_1_256_sp_multi_avx2(const char * const input[], char * const output[], char *scratchpad)
+{
+	scrypt_1024_1_1_256_sp_multi_kernel(input, output, scratchpad);
+}
+
+static SCRYPT_MULTI_TARGET("avx512f,avx512vl") void scrypt_1024_1_1_256_sp_multi_avx512(const char * const input[], char * const output[], char *scratchpad)
+{
+	scrypt_1024_1_1_256_sp_multi_kernel(input, output, scratchpad);
+}
+#endif
+
+typedef void (*scrypt_multi_fn)(const char * const input[], char * const output[], char *scratchpad);
+
+static scrypt_multi_fn scrypt_multi_select(const char *&name)
+{
+#if defined(SCRYPT_MULTI_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")) {
+		name = "avx512";
+		return &scrypt_1024_1_1_256_sp_multi_avx512;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		name = "avx2";
+		return &scrypt_1024_1_1_256_sp_multi_avx2;
+	}
+#endif
+	name = "generic";
+	return &scrypt_1024_1_1_256_sp_multi_generic;
+}
+
+static const char *scrypt_multi_name = NULL;
+static scrypt_multi_fn scrypt_multi_detected = scrypt_multi_select(scrypt_multi_name);
+
+const char *scrypt_detect_multi()
+{
+	return scrypt_multi_name;
+}
+
+static void scrypt_multi_run(scrypt_multi_fn fn, const char * const inputs[], char * const outputs[], unsigned int n, char *scratchpad)
+{
+	const char *in[SCRYPT_MULTI_WAYS];
+	char *out[SCRYPT_MULTI_WAYS];
+	char pad[SCRYPT_MULTI_WAYS][32];
+	unsigned int i, l;
+
+	for (i = 0; i < n; i += SCRYPT_MULTI_WAYS) {
+		if (n - i == 1) {
+			/* Not worth running idle lanes for. */
+			scrypt_1024_1_1_256_sp(inputs[i], outputs[i], scratchpad);
+			break;
+		}
+		/* A short final group repeats its first input in the idle lanes. */
+		MULTI_LANES(l) {
+			in[l] = inputs[i + l < n ? i + l : i];
+			out[l] = i + l < n ? outputs[i + l] : pad[l];
+		}
+		fn(in, out, scratchpad);
+	}
+}
+
+bool scrypt_1024_1_1_256_multi_sp_impl(const char *impl, const char * const inputs[], char * const outputs[], unsigned int n, char *scratchpad)
+{
+	scrypt_multi_fn fn = NULL;
+	if (strcmp(impl, "generic") == 0)
+		fn = &scrypt_1024_1_1_256_sp_multi_generic;
+#if defined(SCRYPT_MULTI_X86)
+	else if (strcmp(impl, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+		fn = &scrypt_1024_1_1_256_sp_multi_avx2;
+	else if (strcmp(impl, "avx512") == 0 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl"))
+		fn = &scrypt_1024_1_1_256_sp_multi_avx512;
+#endif
+	if (fn == NULL)
+		return false;
+	scrypt_multi_run(fn, inputs, outputs, n, scratchpad);
+	return true;
+}
+
+void scrypt_1024_1_1_256_multi_sp(const char * const inputs[], char * const outputs[], unsigned int n, char *scratchpad)
+{
+	scrypt_multi_run(scrypt_multi_detected, inputs, outputs, n, scratchpad);
+}
+
+void scrypt_1024_1_1_256_multi(const char * const inputs[], char * const outputs[], unsigned int n)
+{
+	char *scratchpad = (char *)malloc(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+	if (scratchpad == NULL)
+		abort();
+	scrypt_1024_1_1_256_multi_sp(inputs, outputs, n, scratchpad);
+	free(scratchpad);
 }
\ No newline at end of file
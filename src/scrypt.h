@@ -24,6 +24,22 @@ extern void (*scrypt_1024_1_1_256_sp_detected)(const char *input, char *output,
 #define scrypt_1024_1_1_256_sp(input, output, scratchpad) scrypt_1024_1_1_256_sp_generic((input), (output), (scratchpad))
 #endif
 
+/** Number of hashes the interleaved kernel computes per pass */
+static const unsigned int SCRYPT_MULTI_WAYS = 8;
+static const int SCRYPT_MULTI_SCRATCHPAD_SIZE = SCRYPT_MULTI_WAYS * 131072 + 63;
+
+/**
+ * Hash n independent 80-byte inputs, SCRYPT_MULTI_WAYS at a time, with the
+ * widest SIMD kernel the CPU supports.  The _sp variant takes a scratchpad of
+ * SCRYPT_MULTI_SCRATCHPAD_SIZE bytes so callers in a loop can reuse it.
+ */
+void scrypt_1024_1_1_256_multi(const char * const inputs[], char * const outputs[], unsigned int n);
+void scrypt_1024_1_1_256_multi_sp(const char * const inputs[], char * const outputs[], unsigned int n, char *scratchpad);
+/** Same, forcing one kernel ("generic", "avx2", "avx512"); false if the CPU lacks it */
+bool scrypt_1024_1_1_256_multi_sp_impl(const char *impl, const char * const inputs[], char * const outputs[], unsigned int n, char *scratchpad);
+/** Name of the kernel picked for scrypt_1024_1_1_256_multi */
+const char *scrypt_detect_multi();
+
 void
 PBKDF2_SHA256(const uint8_t *passwd, size_t passwdlen, const uint8_t *salt,
     size_t saltlen, uint64_t c, uint8_t *buf, size_t dkLen);
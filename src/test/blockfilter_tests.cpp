@@ -0,0 +1,195 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+#include "clientversion.h"
+#include "key.h"
+#include "primitives/block.h"
+#include "pubkey.h"
+#include "random.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "undo.h"
+
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockfilter_tests)
+
+static CScript RandomScript()
+{
+    uint256 hash = GetRandHash();
+    return GetScriptForDestination(CKeyID(uint160(std::vector<unsigned char>(hash.begin(), hash.begin() + 20))));
+}
+
+static CBlockFilter::Element ToElement(const CScript& script)
+{
+    return CBlockFilter::Element(script.begin(), script.end());
+}
+
+/** A block of nTx transactions paying to random scripts, with the outputs they spend as undo data */
+static void RandomBlock(unsigned int nTx, CBlock& block, CBlockUndo& blockundo)
+{
+    block.nNonce = insecure_rand();
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.push_back(CTxOut(50 * COIN, RandomScript()));
+    block.vtx.push_back(coinbase);
+    for (unsigned int i = 1; i < nTx; i++) {
+        CMutableTransaction tx;
+        tx.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+        tx.vout.push_back(CTxOut(1 * COIN, RandomScript()));
+        tx.vout.push_back(CTxOut(2 * COIN, RandomScript()));
+        block.vtx.push_back(tx);
+        blockundo.vtxundo.push_back(CTxUndo());
+        blockundo.vtxundo.back().vprevout.push_back(CTxInUndo(CTxOut(3 * COIN, RandomScript())));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_match)
+{
+    CBlock block;
+    CBlockUndo blockundo;
+    RandomBlock(50, block, blockundo);
+
+    CScript scriptPaid = RandomScript();
+    CScript scriptSpent = RandomScript();
+    CScript scriptData = CScript() << OP_RETURN << std::vector<unsigned char>(20, 1);
+    CMutableTransaction tx;
+    tx.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+    tx.vout.push_back(CTxOut(1 * COIN, scriptPaid));
+    tx.vout.push_back(CTxOut(0, scriptData));
+    block.vtx.push_back(tx);
+    blockundo.vtxundo.push_back(CTxUndo());
+    blockundo.vtxundo.back().vprevout.push_back(CTxInUndo(CTxOut(2 * COIN, scriptSpent)));
+
+    CBlockFilter filter(block, blockundo);
+    BOOST_CHECK(filter.hashBlock == block.GetHash());
+    // The coinbase output, two outputs and a spent one per transaction, and the last one's two
+    BOOST_CHECK_EQUAL(filter.GetSize(), 1U + 49 * 3 + 2);
+
+    // Every output script and spent script is found
+    CBlockFilter::ElementSet elements;
+    CBlockFilter::GetElements(block, blockundo, elements);
+    BOOST_FOREACH(const CBlockFilter::Element& element, elements) {
+        CBlockFilter::ElementSet query;
+        query.insert(element);
+        BOOST_CHECK(filter.MatchAny(query));
+    }
+
+    // Unrelated scripts and data outputs are not, short of a 1 in M false positive
+    CBlockFilter::ElementSet query;
+    query.insert(ToElement(scriptData));
+    for (int i = 0; i < 100; i++)
+        query.insert(ToElement(RandomScript()));
+    BOOST_CHECK(!filter.MatchAny(query));
+    BOOST_CHECK(!filter.MatchAny(CBlockFilter::ElementSet()));
+    query.insert(ToElement(scriptSpent));
+    BOOST_CHECK(filter.MatchAny(query));
+
+    // Stored without its block hash, it works again once given it
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << filter;
+    CBlockFilter filterRead;
+    ss >> filterRead;
+    filterRead.hashBlock = block.GetHash();
+    BOOST_CHECK(filterRead.GetEncoded() == filter.GetEncoded());
+    BOOST_CHECK(filterRead.MatchAny(query));
+
+    // A truncated filter still matches everything it should
+    std::vector<unsigned char> vTruncated(filter.GetEncoded().begin(), filter.GetEncoded().begin() + filter.GetEncoded().size() / 2);
+    uint32_t nElements = filter.GetSize();
+    ss << VARINT(nElements) << vTruncated;
+    ss >> filterRead;
+    filterRead.hashBlock = block.GetHash();
+    BOOST_FOREACH(const CBlockFilter::Element& element, elements) {
+        CBlockFilter::ElementSet query;
+        query.insert(element);
+        BOOST_CHECK(filterRead.MatchAny(query));
+    }
+
+    // An empty block has nothing to match
+    CBlock blockEmpty;
+    CBlockFilter filterEmpty(blockEmpty, CBlockUndo());
+    BOOST_CHECK_EQUAL(filterEmpty.GetSize(), 0U);
+    BOOST_CHECK(!filterEmpty.MatchAny(query));
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_multisig)
+{
+    // A bare multisig is found by the pay-to-pubkey script of any of its keys
+    std::vector<CPubKey> vPaid, vSpent;
+    for (int i = 0; i < 3; i++) {
+        CKey key;
+        key.MakeNewKey(i != 1);
+        vPaid.push_back(key.GetPubKey());
+        key.MakeNewKey(true);
+        vSpent.push_back(key.GetPubKey());
+    }
+    CBlock block;
+    CBlockUndo blockundo;
+    RandomBlock(10, block, blockundo);
+    CMutableTransaction tx;
+    tx.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+    tx.vout.push_back(CTxOut(1 * COIN, GetScriptForMultisig(2, vPaid)));
+    block.vtx.push_back(tx);
+    blockundo.vtxundo.push_back(CTxUndo());
+    blockundo.vtxundo.back().vprevout.push_back(CTxInUndo(CTxOut(2 * COIN, GetScriptForMultisig(1, vSpent))));
+
+    CBlockFilter filter(block, blockundo);
+    BOOST_CHECK_EQUAL(filter.GetSize(), 1U + 9 * 3 + 2 * (1 + 3));
+    for (int i = 0; i < 3; i++) {
+        CBlockFilter::ElementSet query;
+        query.insert(ToElement(CScript() << ToByteVector(vPaid[i]) << OP_CHECKSIG));
+        BOOST_CHECK(filter.MatchAny(query));
+        query.clear();
+        query.insert(ToElement(CScript() << ToByteVector(vSpent[i]) << OP_CHECKSIG));
+        BOOST_CHECK(filter.MatchAny(query));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_rescan)
+{
+    // A wallet with 200 scripts, paid in a few of 100 blocks of 50 transactions
+    static const unsigned int nBlocks = 100;
+    CBlockFilter::ElementSet setWallet;
+    std::vector<CScript> vWallet;
+    for (int i = 0; i < 200; i++) {
+        vWallet.push_back(RandomScript());
+        setWallet.insert(ToElement(vWallet.back()));
+    }
+
+    unsigned int nOurs = 0, nMatched = 0;
+    for (unsigned int i = 0; i < nBlocks; i++) {
+        CBlock block;
+        CBlockUndo blockundo;
+        RandomBlock(50, block, blockundo);
+        bool fOurs = i % 10 == 7;
+        if (fOurs) {
+            CMutableTransaction tx(block.vtx[1 + i % 40]);
+            tx.vout[0].scriptPubKey = vWallet[i % vWallet.size()];
+            block.vtx[1 + i % 40] = tx;
+            nOurs++;
+        }
+
+        // Stored and read back, as the index does
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << CBlockFilter(block, blockundo);
+        CBlockFilter filter;
+        ss >> filter;
+        filter.hashBlock = block.GetHash();
+
+        // Every block paying the wallet matches; the others only by a rare false positive
+        bool fMatch = filter.MatchAny(setWallet);
+        if (fOurs)
+            BOOST_CHECK(fMatch);
+        nMatched += fMatch;
+    }
+    BOOST_CHECK(nMatched >= nOurs);
+    BOOST_CHECK(nMatched <= nOurs + 5);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 
 
 #include "main.h"
+#include "pow.h"
 #include "utiltime.h"
 
 #include <cstdio>
@@ -65,4 +66,28 @@ BOOST_AUTO_TEST_CASE(May15)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(PoWHashCache)
+{
+    CBlockHeader header;
+    header.nTime = 1400000000;
+    header.nBits = 0x1e0ffff0;
+    header.nNonce = 42;
+
+    CPoWHashCacheStats before, after;
+    GetPoWHashCacheStats(before);
+
+    // First lookup runs scrypt, the second is served from the cache
+    BOOST_CHECK(GetBlockPoWHash(header) == header.GetPoWHash());
+    BOOST_CHECK(GetBlockPoWHash(header) == header.GetPoWHash());
+    GetPoWHashCacheStats(after);
+    BOOST_CHECK_EQUAL(after.nMisses, before.nMisses + 1);
+    BOOST_CHECK_EQUAL(after.nHits, before.nHits + 1);
+
+    // A different nonce is a different header
+    header.nNonce++;
+    BOOST_CHECK(GetBlockPoWHash(header) == header.GetPoWHash());
+    GetPoWHashCacheStats(after);
+    BOOST_CHECK_EQUAL(after.nMisses, before.nMisses + 2);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,119 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+#include "random.h"
+
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+static boost::atomic<unsigned int> nChecksRun(0);
+
+struct CountingCheck
+{
+    bool fOk;
+    unsigned int nWork;
+
+    CountingCheck(bool fOkIn = true, unsigned int nWorkIn = 0) : fOk(fOkIn), nWork(nWorkIn) {}
+
+    bool operator()()
+    {
+        volatile unsigned int n = 0;
+        for (unsigned int i = 0; i < nWork; i++)
+            n += i;
+        nChecksRun++;
+        return fOk;
+    }
+
+    void swap(CountingCheck& check)
+    {
+        std::swap(fOk, check.fOk);
+        std::swap(nWork, check.nWork);
+    }
+};
+
+static void RunWorker(CCheckQueue<CountingCheck>* pqueue)
+{
+    pqueue->Thread();
+}
+
+static bool RunChecks(CCheckQueue<CountingCheck>* pqueue, unsigned int nChecks, unsigned int nWork, int nFail = -1)
+{
+    CCheckQueueControl<CountingCheck> control(pqueue);
+    // Add in uneven chunks, the way ConnectBlock adds per transaction
+    unsigned int nAdded = 0;
+    while (nAdded < nChecks) {
+        unsigned int nNow = std::min(nChecks - nAdded, 1 + (unsigned int)GetRand(20));
+        vector<CountingCheck> vChecks;
+        for (unsigned int i = 0; i < nNow; i++, nAdded++)
+            vChecks.push_back(CountingCheck((int)nAdded != nFail, nWork));
+        control.Add(vChecks);
+    }
+    return control.Wait();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_results)
+{
+    for (unsigned int nThreads = 0; nThreads <= 4; nThreads += 2) {
+        CCheckQueue<CountingCheck> queue(16);
+        boost::thread_group threads;
+        for (unsigned int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&RunWorker, &queue));
+
+        for (unsigned int nChecks = 0; nChecks <= 1000; nChecks += 111) {
+            nChecksRun = 0;
+            BOOST_CHECK(RunChecks(&queue, nChecks, 0));
+            BOOST_CHECK_EQUAL(nChecksRun, nChecks);
+            BOOST_CHECK(queue.IsIdle());
+        }
+
+        // A failure anywhere fails the run, and does not leak into the next one
+        BOOST_CHECK(!RunChecks(&queue, 500, 0, 0));
+        BOOST_CHECK(!RunChecks(&queue, 500, 0, 250));
+        BOOST_CHECK(!RunChecks(&queue, 500, 0, 499));
+        BOOST_CHECK(RunChecks(&queue, 500, 0));
+
+        threads.interrupt_all();
+        threads.join_all();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_stats)
+{
+    CCheckQueue<CountingCheck> queue(16);
+    boost::thread_group threads;
+    for (unsigned int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(&RunWorker, &queue));
+
+    // An empty run is not counted
+    BOOST_CHECK(RunChecks(&queue, 0, 0));
+    BOOST_CHECK(RunChecks(&queue, 2000, 1000));
+    BOOST_CHECK(RunChecks(&queue, 3000, 1000));
+
+    CCheckQueueStats stats;
+    queue.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nBatchSize, 16U);
+    BOOST_CHECK_EQUAL(stats.nRuns, 2U);
+    BOOST_CHECK_EQUAL(stats.nChecks, 5000U);
+    BOOST_CHECK_EQUAL(stats.nLastChecks, 3000U);
+    BOOST_CHECK(stats.nLastBatches >= 3000 / 16);
+    BOOST_CHECK(stats.nStolen <= stats.nChecks);
+    BOOST_CHECK(stats.nWallMicros >= stats.nLastWallMicros);
+    BOOST_CHECK(stats.vLastIdleMicros.size() <= stats.nWorkers);
+    for (unsigned int i = 0; i < stats.vLastIdleMicros.size(); i++)
+        BOOST_CHECK(stats.vLastIdleMicros[i] <= stats.nLastWallMicros);
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -17,6 +17,7 @@ class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
     std::map<uint256, CCoins> map_;
+    CCoinsSetInfo setInfo_;
 
 public:
     bool GetCoins(const uint256& txid, CCoins& coins) const
@@ -41,7 +42,7 @@ public:
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
 
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, const CCoinsSetInfo& delta)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             map_[it->first] = it->second.coins;
@@ -53,11 +54,34 @@ public:
         }
         mapCoins.clear();
         hashBestBlock_ = hashBlock;
+        setInfo_.Add(delta);
+        return true;
+    }
+
+    bool GetSetInfo(CCoinsSetInfo& info) const
+    {
+        info = setInfo_;
         return true;
     }
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    void SelfTest() const
+    {
+        // Manually recompute the dynamic usage of the whole data, and compare it.
+        size_t ret = cacheCoins.DynamicMemoryUsage();
+        for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            ret += it->second.coins.DynamicMemoryUsage();
+        }
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+    }
+};
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -83,14 +107,16 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool partially_flushed = false;
+    bool prefetched_an_entry = false;
 
     // A simple map to track what we expect the cache stack to represent.
     std::map<uint256, CCoins> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -113,16 +139,33 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                     updated_an_entry = true;
                 }
                 coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
+                coins.nHeight = insecure_rand() % 1000;
+                coins.vout.resize(1 + insecure_rand() % 3);
+                for (unsigned int j = 0; j < coins.vout.size(); j++)
+                    coins.vout[j].nValue = insecure_rand();
+                stack.back()->GetSetInfoDelta().RemoveCoins(txid, *entry);
                 *entry = coins;
+                stack.back()->GetSetInfoDelta().AddCoins(txid, *entry);
             } else {
+                stack.back()->GetSetInfoDelta().RemoveCoins(txid, *entry);
                 coins.Clear();
                 entry->Clear();
                 removed_an_entry = true;
             }
         }
 
+        // Sometimes read an entry ahead of time, the way block connection prefetches inputs.
+        if (insecure_rand() % 10 == 0) {
+            uint256 txid = txids[insecure_rand() % txids.size()];
+            if (!stack.back()->HaveCoinsInCache(txid)) {
+                CCoins coins;
+                bool fFound = stack.back()->GetBackend()->GetCoins(txid, coins);
+                stack.back()->AddPrefetched(txid, coins, fFound);
+                BOOST_CHECK(stack.back()->HaveCoinsInCache(txid));
+                prefetched_an_entry = true;
+            }
+        }
+
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
             for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
@@ -135,10 +178,31 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                     missed_an_entry = true;
                 }
             }
+            BOOST_FOREACH(const CCoinsViewCacheTest *test, stack) {
+                test->SelfTest();
+            }
+
+            // The running set totals, through all the caches, match the expected set.
+            CCoinsSetInfo info, infoExpected;
+            BOOST_CHECK(stack.back()->GetSetInfo(info));
+            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++)
+                infoExpected.AddCoins(it->first, it->second);
+            BOOST_CHECK_EQUAL(info.nTransactions, infoExpected.nTransactions);
+            BOOST_CHECK_EQUAL(info.nTransactionOutputs, infoExpected.nTransactionOutputs);
+            BOOST_CHECK_EQUAL(info.nSerializedSize, infoExpected.nSerializedSize);
+            BOOST_CHECK_EQUAL(info.nTotalAmount, infoExpected.nTotalAmount);
+            if (i == NUM_SIMULATION_ITERATIONS - 1)
+                BOOST_CHECK(info.GetHash() == infoExpected.GetHash());
         }
 
         if (insecure_rand() % 100 == 0) {
             // Every 100 iterations, change the cache stack.
+            if (stack.size() > 0 && insecure_rand() % 4 == 0) {
+                // Write through but keep (part of) the tip cache.
+                stack.back()->PartialFlush(insecure_rand() % 100000);
+                stack.back()->SelfTest();
+                partially_flushed = true;
+            }
             if (stack.size() > 0 && insecure_rand() % 2 == 0) {
                 stack.back()->Flush();
                 delete stack.back();
@@ -151,7 +215,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -173,6 +237,54 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(partially_flushed);
+    BOOST_CHECK(prefetched_an_entry);
+}
+
+// Random inserts, lookups and erases on a CCoinsMap, checked against a std::map.
+BOOST_AUTO_TEST_CASE(coins_map_test)
+{
+    CCoinsMap map;
+    std::map<uint256, uint32_t> expected;
+    std::vector<uint256> txids(5000);
+    for (unsigned int i = 0; i < txids.size(); i++)
+        txids[i] = GetRandHash();
+
+    for (unsigned int i = 0; i < 100000; i++) {
+        const uint256& txid = txids[insecure_rand() % txids.size()];
+        if (insecure_rand() % 3) {
+            std::pair<CCoinsMap::iterator, bool> ret = map.insert(std::make_pair(txid, CCoinsCacheEntry()));
+            BOOST_CHECK_EQUAL(ret.second, expected.count(txid) == 0);
+            ret.first->second.coins.nVersion = i;
+            expected[txid] = i;
+        } else {
+            BOOST_CHECK_EQUAL(map.erase(txid), expected.erase(txid));
+        }
+    }
+    BOOST_CHECK_EQUAL(map.size(), expected.size());
+    for (std::map<uint256, uint32_t>::const_iterator it = expected.begin(); it != expected.end(); it++) {
+        CCoinsMap::const_iterator itMap = map.find(it->first);
+        BOOST_CHECK(itMap != map.end());
+        BOOST_CHECK_EQUAL((uint32_t)itMap->second.coins.nVersion, it->second);
+    }
+
+    // Entries must not move when the table grows.
+    CCoinsCacheEntry* pentry = &map[txids[0]];
+    for (unsigned int i = 0; i < 10000; i++)
+        map[GetRandHash()];
+    BOOST_CHECK(pentry == &map.find(txids[0])->second);
+
+    // Erasing while iterating visits every entry exactly once.
+    size_t nVisited = 0;
+    size_t nSize = map.size();
+    for (CCoinsMap::iterator it = map.begin(); it != map.end();) {
+        map.erase(it++);
+        nVisited++;
+    }
+    BOOST_CHECK_EQUAL(nVisited, nSize);
+    BOOST_CHECK(map.empty());
+    map.clear();
+    BOOST_CHECK_EQUAL(map.DynamicMemoryUsage(), 0U);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
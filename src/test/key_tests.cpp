@@ -5,6 +5,9 @@
 #include "key.h"
 
 #include "base58.h"
+#include "ecwrapper.h"
+#include "pubkey.h"
+#include "random.h"
 #include "script/script.h"
 #include "uint256.h"
 #include "util.h"
@@ -144,4 +147,132 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+// Laxly encoded signatures OpenSSL's BER parser accepts must keep verifying
+// now that CPubKey::Verify uses libsecp256k1; broken ones must keep failing.
+BOOST_AUTO_TEST_CASE(key_verify_lax_der)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+
+    for (int n = 0; n < 16; n++) {
+        uint256 hash = GetRandHash();
+        vector<unsigned char> sig;
+        BOOST_CHECK(key.Sign(hash, sig));
+        BOOST_CHECK(pubkey.Verify(hash, sig));
+        BOOST_CHECK(!pubkey.Verify(GetRandHash(), sig));
+
+        // 30 len 02 lenR R 02 lenS S
+        unsigned int nLenR = sig[3];
+        vector<unsigned char> R(sig.begin() + 4, sig.begin() + 4 + nLenR);
+        vector<unsigned char> S(sig.begin() + 6 + nLenR, sig.end());
+
+        // Long-form sequence length
+        vector<unsigned char> sigLong(sig);
+        sigLong.insert(sigLong.begin() + 1, 0x81);
+        BOOST_CHECK(pubkey.Verify(hash, sigLong));
+
+        // Long-form R length with a padding zero length byte
+        vector<unsigned char> sigLongR(sig);
+        sigLongR[1] += 2;
+        sigLongR[3] = 0x82;
+        sigLongR.insert(sigLongR.begin() + 4, 0x00);
+        sigLongR.insert(sigLongR.begin() + 5, nLenR);
+        BOOST_CHECK(pubkey.Verify(hash, sigLongR));
+
+        // Excess leading zeroes in R
+        vector<unsigned char> sigPadded(sig);
+        sigPadded[1] += 2;
+        sigPadded[3] += 2;
+        sigPadded.insert(sigPadded.begin() + 4, 2, 0x00);
+        BOOST_CHECK(pubkey.Verify(hash, sigPadded));
+
+        // Trailing garbage
+        vector<unsigned char> sigTrailing(sig);
+        sigTrailing.push_back(0x01);
+        sigTrailing.push_back(0x02);
+        BOOST_CHECK(pubkey.Verify(hash, sigTrailing));
+
+        // Sequence length one past the integers, with a byte there to cover
+        vector<unsigned char> sigLenLong(sigTrailing);
+        sigLenLong[1] += 1;
+        BOOST_CHECK(!pubkey.Verify(hash, sigLenLong));
+
+        // Sequence length short of the integers
+        vector<unsigned char> sigLenShort(sigTrailing);
+        sigLenShort[1] -= 1;
+        BOOST_CHECK(!pubkey.Verify(hash, sigLenShort));
+
+        // Sequence length past the end of the signature
+        vector<unsigned char> sigLenOver(sig);
+        sigLenOver[1] += 2;
+        BOOST_CHECK(!pubkey.Verify(hash, sigLenOver));
+        vector<unsigned char> sigLenHuge(sig);
+        sigLenHuge[1] = 0x84;
+        static const unsigned char vchHuge[] = {0x7F, 0xFF, 0xFF, 0xFF};
+        sigLenHuge.insert(sigLenHuge.begin() + 2, vchHuge, vchHuge + sizeof(vchHuge));
+        BOOST_CHECK(!pubkey.Verify(hash, sigLenHuge));
+
+        // Indefinite sequence length, which needs its end-of-contents marker
+        vector<unsigned char> sigIndefinite(sig);
+        sigIndefinite[1] = 0x80;
+        BOOST_CHECK(!pubkey.Verify(hash, sigIndefinite));
+        sigIndefinite.push_back(0x00);
+        BOOST_CHECK(!pubkey.Verify(hash, sigIndefinite));
+        sigIndefinite.push_back(0x00);
+        BOOST_CHECK(pubkey.Verify(hash, sigIndefinite));
+        sigIndefinite.push_back(0x01);
+        BOOST_CHECK(pubkey.Verify(hash, sigIndefinite));
+
+        // R without its sign padding decodes as negative in OpenSSL
+        if (R[0] == 0x00) {
+            vector<unsigned char> sigNegative(sig);
+            sigNegative[1] -= 1;
+            sigNegative[3] -= 1;
+            sigNegative.erase(sigNegative.begin() + 4);
+            BOOST_CHECK(!pubkey.Verify(hash, sigNegative));
+        }
+
+        // Modified S
+        vector<unsigned char> sigBadS(sig);
+        sigBadS.back() ^= 0x01;
+        BOOST_CHECK(!pubkey.Verify(hash, sigBadS));
+
+        // Truncated
+        vector<unsigned char> sigShort(sig.begin(), sig.end() - 1);
+        BOOST_CHECK(!pubkey.Verify(hash, sigShort));
+    }
+
+    // Zero and out of range values
+    static const unsigned char zeroR[] = {0x30, 0x06, 0x02, 0x01, 0x00, 0x02, 0x01, 0x01};
+    BOOST_CHECK(!pubkey.Verify(GetRandHash(), vector<unsigned char>(zeroR, zeroR + sizeof(zeroR))));
+    vector<unsigned char> sigOverflow(2 + 2 * 35, 0xFF);
+    sigOverflow[0] = 0x30; sigOverflow[1] = 2 * 35;
+    sigOverflow[2] = 0x02; sigOverflow[3] = 33; sigOverflow[4] = 0x00;
+    sigOverflow[37] = 0x02; sigOverflow[38] = 33; sigOverflow[39] = 0x00;
+    BOOST_CHECK(!pubkey.Verify(GetRandHash(), sigOverflow));
+    BOOST_CHECK(!pubkey.Verify(GetRandHash(), vector<unsigned char>()));
+}
+
+// Signatures verify the same through libsecp256k1 as through OpenSSL.
+BOOST_AUTO_TEST_CASE(key_verify_openssl)
+{
+    static const int nSigs = 200;
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    CECKey eckey;
+    BOOST_CHECK(eckey.SetPubKey(pubkey.begin(), pubkey.size()));
+    for (int i = 0; i < nSigs; i++) {
+        uint256 hash = GetRandHash();
+        vector<unsigned char> sig;
+        BOOST_CHECK(key.Sign(hash, sig));
+        BOOST_CHECK(pubkey.Verify(hash, sig));
+        BOOST_CHECK(eckey.Verify(hash, sig));
+        hash = GetRandHash();
+        BOOST_CHECK(!pubkey.Verify(hash, sig));
+        BOOST_CHECK(!eckey.Verify(hash, sig));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,417 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "miner.h"
+#include "random.h"
+#include "txmempool.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <list>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+// A transaction spending the given outputs into nOutputs equal outputs, less nFee
+static CMutableTransaction SpendTx(const std::vector<COutPoint>& vPrevout, CAmount nValueIn, CAmount nFee, unsigned int nOutputs)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(vPrevout.size());
+    for (unsigned int i = 0; i < vPrevout.size(); i++)
+        tx.vin[i].prevout = vPrevout[i];
+    tx.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        tx.vout[i].nValue = (nValueIn - nFee) / nOutputs;
+        tx.vout[i].scriptPubKey = CScript() << OP_TRUE;
+    }
+    return tx;
+}
+
+static CTxMemPool::txiter Find(CTxMemPool& pool, const CTransaction& tx)
+{
+    CTxMemPool::txiter it = pool.mapTx.find(tx.GetHash());
+    BOOST_REQUIRE(it != pool.mapTx.end());
+    return it;
+}
+
+static void CheckPackage(CTxMemPool& pool, const CTransaction& tx, uint64_t nAncestors, CAmount nAncestorFees, uint64_t nDescendants, CAmount nDescendantFees)
+{
+    const CTxMemPoolEntry& entry = Find(pool, tx)->second;
+    BOOST_CHECK_EQUAL(entry.GetCountWithAncestors(), nAncestors);
+    BOOST_CHECK_EQUAL(entry.GetModFeesWithAncestors(), nAncestorFees);
+    BOOST_CHECK_EQUAL(entry.GetCountWithDescendants(), nDescendants);
+    BOOST_CHECK_EQUAL(entry.GetModFeesWithDescendants(), nDescendantFees);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_package_state)
+{
+    CTxMemPool pool(CFeeRate(0));
+    std::list<CTransaction> removed;
+
+    // a <- b <- c, with d spending both a and c, and e on its own
+    CTransaction a = SpendTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 100 * COIN, 1000, 2);
+    CTransaction b = SpendTx(std::vector<COutPoint>(1, COutPoint(a.GetHash(), 0)), a.vout[0].nValue, 2000, 1);
+    CTransaction c = SpendTx(std::vector<COutPoint>(1, COutPoint(b.GetHash(), 0)), b.vout[0].nValue, 3000, 1);
+    std::vector<COutPoint> vPrevout;
+    vPrevout.push_back(COutPoint(a.GetHash(), 1));
+    vPrevout.push_back(COutPoint(c.GetHash(), 0));
+    CTransaction d = SpendTx(vPrevout, a.vout[1].nValue + c.vout[0].nValue, 400000, 1);
+    CTransaction e = SpendTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 100 * COIN, 50000, 1);
+
+    pool.addUnchecked(a.GetHash(), CTxMemPoolEntry(a, 1000, 0, 0.0, 1));
+    pool.addUnchecked(b.GetHash(), CTxMemPoolEntry(b, 2000, 0, 0.0, 1));
+    pool.addUnchecked(c.GetHash(), CTxMemPoolEntry(c, 3000, 0, 0.0, 1));
+    pool.addUnchecked(d.GetHash(), CTxMemPoolEntry(d, 400000, 0, 0.0, 1));
+    pool.addUnchecked(e.GetHash(), CTxMemPoolEntry(e, 50000, 0, 0.0, 1));
+
+    CheckPackage(pool, a, 1, 1000, 4, 406000);
+    CheckPackage(pool, b, 2, 3000, 3, 405000);
+    CheckPackage(pool, c, 3, 6000, 2, 403000);
+    CheckPackage(pool, d, 4, 406000, 1, 400000);
+    CheckPackage(pool, e, 1, 50000, 1, 50000);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(Find(pool, d)).size(), 2U);
+
+    // d pays for its ancestors, so its package comes first; a on its own pays least
+    BOOST_CHECK(*pool.setByAncestorFeeRate.begin() == Find(pool, d));
+    BOOST_CHECK(*pool.setByAncestorFeeRate.rbegin() == Find(pool, a));
+    BOOST_CHECK(*pool.setByDescendantScore.begin() == Find(pool, e));
+
+    // Prioritising moves the totals of the relatives along
+    pool.PrioritiseTransaction(b.GetHash(), b.GetHash().ToString(), 0.0, 10000);
+    CheckPackage(pool, a, 1, 1000, 4, 416000);
+    CheckPackage(pool, c, 3, 16000, 2, 403000);
+    CheckPackage(pool, d, 4, 416000, 1, 400000);
+
+    // As a block confirms a, it leaves the others' totals
+    pool.remove(a, removed, false);
+    CheckPackage(pool, b, 1, 12000, 3, 415000);
+    CheckPackage(pool, d, 3, 415000, 1, 400000);
+
+    // When a disconnected block brings a back, its spenders are counted again
+    pool.addUnchecked(a.GetHash(), CTxMemPoolEntry(a, 1000, 0, 0.0, 1));
+    CheckPackage(pool, a, 1, 1000, 4, 416000);
+    CheckPackage(pool, b, 2, 13000, 3, 415000);
+    CheckPackage(pool, d, 4, 416000, 1, 400000);
+
+    // Recursive removal takes the descendants along
+    removed.clear();
+    pool.remove(b, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 3U);
+    CheckPackage(pool, a, 1, 1000, 1, 1000);
+    BOOST_CHECK_EQUAL(pool.size(), 2U);
+    BOOST_CHECK_EQUAL(pool.setByAncestorFeeRate.size(), 2U);
+    BOOST_CHECK_EQUAL(pool.setByDescendantScore.size(), 2U);
+    BOOST_CHECK_EQUAL(pool.setByPriority.size(), 2U);
+    BOOST_CHECK(pool.GetMemPoolChildren(Find(pool, a)).empty());
+
+    pool.clear();
+    BOOST_CHECK(pool.setByAncestorFeeRate.empty());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_chain_limits)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // A chain of five in the pool, and a sixth to add to it
+    std::vector<CTransaction> vChain;
+    COutPoint prevout(GetRandHash(), 0);
+    CAmount nValue = 100 * COIN;
+    uint64_t nSize = 0;
+    for (int i = 0; i < 6; i++) {
+        CTransaction tx = SpendTx(std::vector<COutPoint>(1, prevout), nValue, 1000, 1);
+        CTxMemPoolEntry entry(tx, 1000, 0, 0.0, 1);
+        if (i < 5)
+            pool.addUnchecked(tx.GetHash(), entry);
+        vChain.push_back(tx);
+        prevout = COutPoint(tx.GetHash(), 0);
+        nValue = tx.vout[0].nValue;
+        nSize += entry.GetTxSize();
+    }
+    CTxMemPoolEntry entry(vChain[5], 1000, 0, 0.0, 1);
+
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entry, setAncestors, 6, nSize, 6, nSize, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 5U);
+    BOOST_CHECK(setAncestors.count(Find(pool, vChain[0])));
+
+    // It would be the sixth of its ancestors, and of the first one's descendants
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry, setAncestors, 5, nSize, 6, nSize, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry, setAncestors, 6, nSize, 5, nSize, errString));
+    // ... and the six of them are nSize bytes
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry, setAncestors, 6, nSize - 1, 6, nSize, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry, setAncestors, 6, nSize, 6, nSize - 1, errString));
+
+    // A transaction spending nothing in the pool is within any limit
+    CTransaction tx = SpendTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), nValue, 1000, 1);
+    setAncestors.clear();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(CTxMemPoolEntry(tx, 1000, 0, 0.0, 1), setAncestors, 1, 1000, 1, 1000, errString));
+    BOOST_CHECK(setAncestors.empty());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_size_limit)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    std::list<CTransaction> removed;
+    int64_t nStartTime = GetTime();
+    SetMockTime(nStartTime);
+
+    // a pays well; b pays little, and its child c does not make up for it
+    CTransaction a = SpendTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 100 * COIN, 1000000, 1);
+    CTransaction b = SpendTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 100 * COIN, 100000, 2);
+    CTransaction c = SpendTx(std::vector<COutPoint>(1, COutPoint(b.GetHash(), 0)), b.vout[0].nValue, 200000, 1);
+    pool.addUnchecked(a.GetHash(), CTxMemPoolEntry(a, 1000000, 0, 0.0, 1));
+    size_t nUsageA = pool.DynamicMemoryUsage();
+    BOOST_CHECK(nUsageA > 0);
+    pool.addUnchecked(b.GetHash(), CTxMemPoolEntry(b, 100000, 0, 0.0, 1));
+    pool.addUnchecked(c.GetHash(), CTxMemPoolEntry(c, 200000, 0, 0.0, 1));
+    size_t nUsage = pool.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > nUsageA);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(nUsage).GetFeePerK(), 0);
+
+    // Within the limit nothing goes; over it, b's package goes as a whole
+    pool.TrimToSize(nUsage, &removed);
+    BOOST_CHECK_EQUAL(pool.size(), 3U);
+    pool.TrimToSize(nUsage - 1, &removed);
+    BOOST_CHECK_EQUAL(removed.size(), 2U);
+    BOOST_CHECK(pool.exists(a.GetHash()));
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), nUsageA);
+
+    // Getting in now takes more than the evicted package paid, until a block
+    // comes in, after which the minimum fee halves with each half-life
+    CAmount nRollingFee = CFeeRate(300000, ::GetSerializeSize(b, SER_NETWORK, PROTOCOL_VERSION) + ::GetSerializeSize(c, SER_NETWORK, PROTOCOL_VERSION)).GetFeePerK() + 1000;
+    BOOST_CHECK_EQUAL(pool.GetMinFee(nUsage).GetFeePerK(), nRollingFee);
+    SetMockTime(nStartTime + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(nUsage).GetFeePerK(), nRollingFee);
+    pool.removeForBlock(std::vector<CTransaction>(), 2, removed);
+    // ... which is a quarter as long with the pool under a quarter full
+    SetMockTime(nStartTime + 2 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(4 * nUsage).GetFeePerK(), nRollingFee / 16);
+    SetMockTime(nStartTime + 10 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(4 * nUsage).GetFeePerK(), 0);
+
+    pool.remove(a, removed, false);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0U);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_persist)
+{
+    CTransaction tx = SpendTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 100 * COIN, 1000, 1);
+    uint256 hashOther = GetRandHash();
+    mempool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 1000, GetTime(), 0.0, 1));
+    mempool.PrioritiseTransaction(tx.GetHash(), tx.GetHash().ToString(), 0.0, 5000);
+    mempool.PrioritiseTransaction(hashOther, hashOther.ToString(), 1.0, 100);
+    BOOST_CHECK(DumpMempool());
+    BOOST_CHECK(boost::filesystem::exists(GetDataDir() / "mempool.dat"));
+
+    mempool.clear();
+    mempool.ClearPrioritisation(tx.GetHash());
+    mempool.ClearPrioritisation(hashOther);
+
+    // The transaction's inputs are unknown here, so it does not get back in,
+    // but the prioritisations do
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK(!mempool.exists(tx.GetHash()));
+    double dPriorityDelta = 0;
+    CAmount nFeeDelta = 0;
+    mempool.ApplyDeltas(tx.GetHash(), dPriorityDelta, nFeeDelta);
+    BOOST_CHECK_EQUAL(nFeeDelta, 5000);
+    dPriorityDelta = 0;
+    nFeeDelta = 0;
+    mempool.ApplyDeltas(hashOther, dPriorityDelta, nFeeDelta);
+    BOOST_CHECK_EQUAL(dPriorityDelta, 1.0);
+    BOOST_CHECK_EQUAL(nFeeDelta, 100);
+
+    mempool.ClearPrioritisation(tx.GetHash());
+    mempool.ClearPrioritisation(hashOther);
+    boost::filesystem::remove(GetDataDir() / "mempool.dat");
+}
+
+BOOST_AUTO_TEST_CASE(mempool_block_template)
+{
+    // A small block, so a pool several times its size stays quick to set up
+    static const unsigned int nTransactions = 1000;
+    static const unsigned int nBlockMaxSize = 20000;
+    mapArgs["-blockmaxsize"] = strprintf("%u", nBlockMaxSize);
+    CScript scriptPubKey = CScript() << OP_TRUE;
+
+    // Confirmed coins for the pool to spend, in a view that is thrown away afterwards
+    CCoinsViewCache* pcoinsOld = pcoinsTip;
+    CCoinsViewCache viewTest(pcoinsOld);
+    pcoinsTip = &viewTest;
+    std::vector<COutPoint> vConfirmed;
+    for (unsigned int i = 0; i < nTransactions; i++) {
+        uint256 txid = GetRandHash();
+        CCoinsModifier coins = viewTest.ModifyCoins(txid);
+        coins->nVersion = 1;
+        coins->nHeight = 1;
+        coins->vout.resize(1);
+        coins->vout[0].nValue = 100 * COIN;
+        coins->vout[0].scriptPubKey = scriptPubKey;
+        vConfirmed.push_back(COutPoint(txid, 0));
+    }
+
+    // A parent paying nothing, and a child paying for both
+    CTransaction parent = SpendTx(std::vector<COutPoint>(1, vConfirmed.back()), 100 * COIN, 0, 1);
+    vConfirmed.pop_back();
+    CTransaction child = SpendTx(std::vector<COutPoint>(1, COutPoint(parent.GetHash(), 0)), parent.vout[0].nValue, 50 * COIN, 1);
+
+    // The rest spend confirmed coins, or outputs of earlier pool transactions
+    std::vector<CTransaction> vtx;
+    std::vector<std::pair<COutPoint, CAmount> > vUnconfirmed;
+    while (vtx.size() + 2 < nTransactions) {
+        CAmount nFee = (1 + insecure_rand() % 100) * COIN / 10;
+        COutPoint prevout;
+        CAmount nValueIn = 100 * COIN;
+        if (!vUnconfirmed.empty() && insecure_rand() % 5 == 0) {
+            unsigned int n = insecure_rand() % vUnconfirmed.size();
+            prevout = vUnconfirmed[n].first;
+            nValueIn = vUnconfirmed[n].second;
+            vUnconfirmed[n] = vUnconfirmed.back();
+            vUnconfirmed.pop_back();
+        } else {
+            prevout = vConfirmed.back();
+            vConfirmed.pop_back();
+        }
+        CTransaction tx = SpendTx(std::vector<COutPoint>(1, prevout), nValueIn, std::min(nFee, nValueIn / 10), 2);
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+            vUnconfirmed.push_back(std::make_pair(COutPoint(tx.GetHash(), i), tx.vout[i].nValue));
+        vtx.push_back(tx);
+    }
+
+    mempool.addUnchecked(parent.GetHash(), CTxMemPoolEntry(parent, 0, GetTime(), 0.0, 1));
+    mempool.addUnchecked(child.GetHash(), CTxMemPoolEntry(child, 50 * COIN, GetTime(), 0.0, 1));
+    BOOST_FOREACH(const CTransaction& tx, vtx) {
+        CAmount nValueIn = 0;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            CTransaction txPrev;
+            nValueIn += mempool.lookup(txin.prevout.hash, txPrev) ? txPrev.vout[txin.prevout.n].nValue : 100 * COIN;
+        }
+        mempool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, nValueIn - tx.GetValueOut(), GetTime(), 0.0, 1));
+    }
+    BOOST_CHECK_EQUAL(mempool.size(), nTransactions);
+
+    CBlockTemplate* pblocktemplate = CreateNewBlock(scriptPubKey);
+    BOOST_REQUIRE(pblocktemplate);
+    const CBlock& block = pblocktemplate->block;
+
+    // The block is full, and the child brought its parent in, ahead of it
+    BOOST_CHECK(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) > nBlockMaxSize - 2000);
+    int nParent = -1, nChild = -1;
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        if (block.vtx[i].GetHash() == parent.GetHash())
+            nParent = i;
+        if (block.vtx[i].GetHash() == child.GetHash())
+            nChild = i;
+    }
+    BOOST_CHECK(nParent > 0 && nChild > nParent);
+
+    delete pblocktemplate;
+    mempool.clear();
+    pcoinsTip = pcoinsOld;
+    mapArgs.erase("-blockmaxsize");
+}
+
+BOOST_AUTO_TEST_CASE(mempool_block_template_packages)
+{
+    CScript scriptPubKey = CScript() << OP_TRUE;
+
+    // Confirmed coins for the pool to spend, in a view that is thrown away afterwards
+    CCoinsViewCache* pcoinsOld = pcoinsTip;
+    CCoinsViewCache viewTest(pcoinsOld);
+    pcoinsTip = &viewTest;
+    std::vector<COutPoint> vConfirmed;
+    for (unsigned int i = 0; i < 3; i++) {
+        uint256 txid = GetRandHash();
+        CCoinsModifier coins = viewTest.ModifyCoins(txid);
+        coins->nVersion = 1;
+        coins->nHeight = 1;
+        coins->vout.resize(1);
+        coins->vout[0].nValue = 100 * COIN;
+        coins->vout[0].scriptPubKey = scriptPubKey;
+        vConfirmed.push_back(COutPoint(txid, 0));
+    }
+
+    // parent pays well, its child little: once the parent is in the block,
+    // other, paying less than the two together but more than the child, goes first
+    CTransaction parent = SpendTx(std::vector<COutPoint>(1, vConfirmed[0]), 100 * COIN, 10 * COIN, 1);
+    CTransaction child = SpendTx(std::vector<COutPoint>(1, COutPoint(parent.GetHash(), 0)), parent.vout[0].nValue, COIN / 5, 1);
+    CTransaction other = SpendTx(std::vector<COutPoint>(1, vConfirmed[1]), 100 * COIN, COIN, 1);
+    // Free, and in on priority: the child of higher priority right after its parent
+    CTransaction parentFree = SpendTx(std::vector<COutPoint>(1, vConfirmed[2]), 100 * COIN, 0, 1);
+    CTransaction childFree = SpendTx(std::vector<COutPoint>(1, COutPoint(parentFree.GetHash(), 0)), parentFree.vout[0].nValue, 0, 1);
+
+    mempool.addUnchecked(parent.GetHash(), CTxMemPoolEntry(parent, 10 * COIN, GetTime(), 0.0, 1));
+    mempool.addUnchecked(child.GetHash(), CTxMemPoolEntry(child, COIN / 5, GetTime(), 0.0, 1));
+    mempool.addUnchecked(other.GetHash(), CTxMemPoolEntry(other, COIN, GetTime(), 0.0, 1));
+    mempool.addUnchecked(parentFree.GetHash(), CTxMemPoolEntry(parentFree, 0, GetTime(), 2 * AllowFreeThreshold(), 1));
+    mempool.addUnchecked(childFree.GetHash(), CTxMemPoolEntry(childFree, 0, GetTime(), 10 * AllowFreeThreshold(), 1));
+
+    CBlockTemplate* pblocktemplate = CreateNewBlock(scriptPubKey);
+    BOOST_REQUIRE(pblocktemplate);
+    const CBlock& block = pblocktemplate->block;
+    BOOST_REQUIRE_EQUAL(block.vtx.size(), 6U);
+    BOOST_CHECK(block.vtx[1].GetHash() == parentFree.GetHash());
+    BOOST_CHECK(block.vtx[2].GetHash() == childFree.GetHash());
+    BOOST_CHECK(block.vtx[3].GetHash() == parent.GetHash());
+    BOOST_CHECK(block.vtx[4].GetHash() == other.GetHash());
+    BOOST_CHECK(block.vtx[5].GetHash() == child.GetHash());
+
+    delete pblocktemplate;
+    mempool.clear();
+    pcoinsTip = pcoinsOld;
+}
+
+BOOST_AUTO_TEST_CASE(mempool_block_template_priority_descendants)
+{
+    CScript scriptPubKey = CScript() << OP_TRUE;
+
+    CCoinsViewCache* pcoinsOld = pcoinsTip;
+    CCoinsViewCache viewTest(pcoinsOld);
+    pcoinsTip = &viewTest;
+    std::vector<COutPoint> vConfirmed;
+    for (unsigned int i = 0; i < 2; i++) {
+        uint256 txid = GetRandHash();
+        CCoinsModifier coins = viewTest.ModifyCoins(txid);
+        coins->nVersion = 1;
+        coins->nHeight = 1;
+        coins->vout.resize(1);
+        coins->vout[0].nValue = 100 * COIN;
+        coins->vout[0].scriptPubKey = scriptPubKey;
+        vConfirmed.push_back(COutPoint(txid, 0));
+    }
+
+    // parent goes in on priority alone. Its child pays more on its own than
+    // other, but less together with parent: it must be scored without parent.
+    CTransaction parent = SpendTx(std::vector<COutPoint>(1, vConfirmed[0]), 100 * COIN, 0, 1);
+    CTransaction child = SpendTx(std::vector<COutPoint>(1, COutPoint(parent.GetHash(), 0)), parent.vout[0].nValue, 2 * COIN, 1);
+    CTransaction other = SpendTx(std::vector<COutPoint>(1, vConfirmed[1]), 100 * COIN, 3 * COIN / 2, 1);
+
+    mempool.addUnchecked(parent.GetHash(), CTxMemPoolEntry(parent, 0, GetTime(), 2 * AllowFreeThreshold(), 1));
+    mempool.addUnchecked(child.GetHash(), CTxMemPoolEntry(child, 2 * COIN, GetTime(), 0.0, 1));
+    mempool.addUnchecked(other.GetHash(), CTxMemPoolEntry(other, 3 * COIN / 2, GetTime(), 0.0, 1));
+
+    CBlockTemplate* pblocktemplate = CreateNewBlock(scriptPubKey);
+    BOOST_REQUIRE(pblocktemplate);
+    const CBlock& block = pblocktemplate->block;
+    BOOST_REQUIRE_EQUAL(block.vtx.size(), 4U);
+    BOOST_CHECK(block.vtx[1].GetHash() == parent.GetHash());
+    BOOST_CHECK(block.vtx[2].GetHash() == child.GetHash());
+    BOOST_CHECK(block.vtx[3].GetHash() == other.GetHash());
+
+    delete pblocktemplate;
+    mempool.clear();
+    pcoinsTip = pcoinsOld;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,72 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "muhash.h"
+#include "random.h"
+#include "streams.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(muhash_tests)
+
+BOOST_AUTO_TEST_CASE(muhash_set)
+{
+    std::vector<uint256> vElements(100);
+    for (unsigned int i = 0; i < vElements.size(); i++)
+        vElements[i] = GetRandHash();
+
+    CMuHash3072 empty;
+    BOOST_CHECK(empty.IsEmpty());
+
+    // Insertion order does not matter
+    CMuHash3072 a, b;
+    for (unsigned int i = 0; i < vElements.size(); i++)
+        a.Insert(vElements[i]);
+    std::random_shuffle(vElements.begin(), vElements.end());
+    for (unsigned int i = 0; i < vElements.size(); i++)
+        b.Insert(vElements[i]);
+    BOOST_CHECK(!a.IsEmpty());
+    BOOST_CHECK(a.GetHash() == b.GetHash());
+
+    // Removing an element differs from never adding it, until it is added back
+    CMuHash3072 c(a);
+    c.Remove(vElements[0]);
+    BOOST_CHECK(c.GetHash() != a.GetHash());
+    CMuHash3072 d;
+    d.Insert(vElements[0]);
+    c *= d;
+    BOOST_CHECK(c.GetHash() == a.GetHash());
+
+    // Removing everything, in any order, gives the empty set
+    for (unsigned int i = 0; i < vElements.size(); i++)
+        b.Remove(vElements[vElements.size() - 1 - i]);
+    BOOST_CHECK(b.IsEmpty());
+    BOOST_CHECK(b.GetHash() == empty.GetHash());
+
+    // A set and its removals may be kept apart, and combined later
+    CMuHash3072 removals;
+    for (unsigned int i = 0; i < 10; i++)
+        removals.Remove(vElements[i]);
+    CMuHash3072 e(a);
+    for (unsigned int i = 0; i < 10; i++)
+        e.Remove(vElements[i]);
+    a *= removals;
+    BOOST_CHECK(a.GetHash() == e.GetHash());
+
+    // Serialization keeps the set
+    CDataStream ss(SER_DISK, 0);
+    ss << a;
+    BOOST_CHECK_EQUAL(ss.size(), 384U);
+    CMuHash3072 f;
+    ss >> f;
+    BOOST_CHECK(f.GetHash() == a.GetHash());
+    f.Insert(vElements[0]);
+    e.Insert(vElements[0]);
+    BOOST_CHECK(f.GetHash() == e.GetHash());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,83 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "net.h"
+#include "protocol.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <vector>
+
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(socket_handler_idle)
+{
+    static const int nConnections = 200;
+
+    // Inbound peers on one end of local socket pairs, the other end left to the test
+    std::vector<CNode*> vPeers;
+    std::vector<SOCKET> vRemote;
+    for (int i = 0; i < nConnections; i++) {
+        int sockets[2];
+        BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+        CNode* pnode = new CNode(sockets[0], CAddress(), "", true);
+        pnode->AddRef();
+        vPeers.push_back(pnode);
+        vRemote.push_back(sockets[1]);
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
+    }
+
+    boost::thread threadSocketHandler(&ThreadSocketHandler);
+    MilliSleep(100);
+
+    // With the others idle, a message to one of them gets through ...
+    CDataStream ssMsg(SER_NETWORK, PROTOCOL_VERSION);
+    ssMsg << CMessageHeader(Params().MessageStart(), "ping", 0);
+    BOOST_REQUIRE(send(vRemote[1], &ssMsg[0], ssMsg.size(), 0) == (int)ssMsg.size());
+    bool fReceived = false;
+    for (int i = 0; i < 100 && !fReceived; i++) {
+        MilliSleep(10);
+        LOCK(vPeers[1]->cs_vRecvMsg);
+        fReceived = !vPeers[1]->vRecvMsg.empty() && vPeers[1]->vRecvMsg.front().complete();
+    }
+    BOOST_CHECK(fReceived);
+
+    // ... and hanging up on another gets it disconnected, and deleted by the socket handler
+    CloseSocket(vRemote[2]);
+    bool fDisconnected = false;
+    for (int i = 0; i < 100 && !fDisconnected; i++) {
+        MilliSleep(10);
+        LOCK(cs_vNodes);
+        fDisconnected = std::find(vNodes.begin(), vNodes.end(), vPeers[2]) == vNodes.end();
+    }
+    BOOST_REQUIRE(fDisconnected);
+
+    threadSocketHandler.interrupt();
+    WakeSocketHandler();
+    threadSocketHandler.join();
+
+    LOCK(cs_vNodes);
+    for (int i = 0; i < nConnections; i++) {
+        if (i != 2) {
+            vNodes.erase(std::remove(vNodes.begin(), vNodes.end(), vPeers[i]), vNodes.end());
+            vPeers[i]->CloseSocketDisconnect();
+            delete vPeers[i];
+            CloseSocket(vRemote[i]);
+        }
+    }
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,110 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "chainparams.h"
+#include "main.h"
+#include "pow.h"
+#include "random.h"
+#include "scrypt.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(pow_tests)
+
+static const int KGW_TEST_FIRST_HEIGHT = 24000;
+static const int KGW_TEST_BLOCKS = 3000;
+
+/* Build a chain whose block times wander around the target spacing, with
+ * stalls and bursts, and whose nBits follow the retarget rules. */
+static void BuildChain(vector<CBlockIndex>& blocks, const Consensus::Params& params)
+{
+    blocks.resize(KGW_TEST_FIRST_HEIGHT + KGW_TEST_BLOCKS);
+    unsigned int nLimitBits = UintToArith256(params.powLimit).GetCompact();
+    for (unsigned int i = 0; i < blocks.size(); i++) {
+        CBlockIndex& block = blocks[i];
+        block.nHeight = i;
+        block.pprev = i ? &blocks[i - 1] : NULL;
+        block.nTime = i ? blocks[i - 1].nTime : 1400000000;
+        int nRand = insecure_rand() % 100;
+        if (nRand < 5)
+            block.nTime += 150 * (10 + insecure_rand() % 20);
+        else if (nRand < 15)
+            block.nTime -= insecure_rand() % 300;
+        else
+            block.nTime += insecure_rand() % 300;
+        if ((int)i < KGW_TEST_FIRST_HEIGHT)
+            block.nBits = nLimitBits - (insecure_rand() % 0x1000);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(kgw_matches_legacy)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    vector<CBlockIndex> blocks;
+    BuildChain(blocks, params);
+
+    for (int h = KGW_TEST_FIRST_HEIGHT; h < (int)blocks.size(); h++) {
+        const CBlockIndex* pindexLast = &blocks[h - 1];
+        unsigned int nLegacyBits = KimotoGravityWellLegacy(pindexLast, NULL, 150, 144, 4032, params);
+        unsigned int nBits = GetNextWorkRequired(pindexLast, NULL, params);
+        BOOST_CHECK_EQUAL(nBits, nLegacyBits);
+        BOOST_CHECK_EQUAL(pindexLast->nKGWNextBits, nBits);
+        // Memoized on the index: a second call must return the same value.
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(pindexLast, NULL, params), nBits);
+        blocks[h].nBits = nBits;
+    }
+}
+
+static void CacheHeadersBatches(const vector<vector<CBlockHeader> >* pvBatches)
+{
+    BOOST_FOREACH(const vector<CBlockHeader>& vHeaders, *pvBatches)
+        CacheHeadersPoW(vHeaders);
+}
+
+BOOST_AUTO_TEST_CASE(cache_headers_pow_concurrent)
+{
+    // Two peers' headers messages handled at once, both masters of the one PoW check queue
+    vector<vector<CBlockHeader> > vBatches[2];
+    for (int n = 0; n < 2; n++) {
+        for (int i = 0; i < 10; i++) {
+            vBatches[n].push_back(vector<CBlockHeader>(3 * SCRYPT_MULTI_WAYS));
+            BOOST_FOREACH(CBlockHeader& header, vBatches[n].back()) {
+                header.hashPrevBlock = GetRandHash();
+                header.nNonce = insecure_rand();
+            }
+        }
+    }
+
+    CPoWHashCacheStats statsBefore;
+    GetPoWHashCacheStats(statsBefore);
+    boost::thread thread0(boost::bind(&CacheHeadersBatches, &vBatches[0]));
+    boost::thread thread1(boost::bind(&CacheHeadersBatches, &vBatches[1]));
+    thread0.join();
+    thread1.join();
+
+    // Both got all of their hashes cached, and right
+    uint64_t nHeaders = 0;
+    for (int n = 0; n < 2; n++) {
+        BOOST_FOREACH(const vector<CBlockHeader>& vHeaders, vBatches[n]) {
+            BOOST_FOREACH(const CBlockHeader& header, vHeaders) {
+                BOOST_CHECK(GetBlockPoWHash(header) == header.GetPoWHash());
+                nHeaders++;
+            }
+        }
+    }
+    CPoWHashCacheStats stats;
+    GetPoWHashCacheStats(stats);
+    BOOST_CHECK_EQUAL(stats.nHits - statsBefore.nHits, nHeaders);
+    BOOST_CHECK_EQUAL(stats.nMisses, statsBefore.nMisses);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
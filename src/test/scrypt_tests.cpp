@@ -0,0 +1,78 @@
+// Copyright (c) 2013-2014 The Litecoin developers
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "scrypt.h"
+#include "uint256.h"
+#include "utilstrencodings.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(scrypt_tests)
+
+static const char* inputhex[] = {
+    "020000004c1271c211717198227392b029a64a7971931d351b387bb80db027f270411e398a07046f7d4a08dd815412a8712f874a7ebf0507e3878bd24e20a3b73fd750a667d2f451eac7471b00de6659",
+    "0200000011503ee6a855e900c00cfdd98f5f55fffeaee9b6bf55bea9b852d9de2ce35828e204eef76acfd36949ae56d1fbe81c1ac9c0209e6331ad56414f9072506a77f8c6faf551eac7471b00389d01",
+    "02000000a72c8a177f523946f42f22c3e86b8023221b4105e8007e59e81f6beb013e29aaf635295cb9ac966213fb56e046dc71df5b3f7f67ceaeab24038e743f883aff1aaafaf551eac7471b0166249b",
+    "010000007824bc3a8a1b4628485eee3024abd8626721f7f870f8ad4d2f33a27155167f6a4009d1285049603888fe85a84b6c803a53305a8d497965a5e896e1a00568359589faf551eac7471b0065434e",
+    "0200000050bfd4e4a307a8cb6ef4aef69abc5c0f2d579648bd80d7733e1ccc3fbc90ed664a7f74006cb11bde87785f229ecd366c2d4e44432832580e0608c579e4cb76f383f7f551eac7471b00c36982",
+};
+static const char* outputhex[] = {
+    "00000000002bef4107f882f6115e0b01f348d21195dacd3582aa2dabd7985806",
+    "00000000003a0d11bdd5eb634e08b7feddcfbbf228ed35d250daf19f1c88fc94",
+    "00000000000b40f895f288e13244728a6c2d9d59d8aff29c65f8dd5114a8ca81",
+    "00000000003007005891cd4923031e99d8e8d72f6e8e7edc6a86181897e105fe",
+    "000000000018f0b426a4afc7130ccb47fa02af730d345b4fe7c7724d3800ec8c",
+};
+static const unsigned int nVectors = sizeof(inputhex) / sizeof(inputhex[0]);
+static const char* kernels[] = { "generic", "avx2", "avx512" };
+
+BOOST_AUTO_TEST_CASE(scrypt_hashtest)
+{
+    for (unsigned int i = 0; i < nVectors; i++) {
+        vector<unsigned char> input = ParseHex(inputhex[i]);
+        uint256 hash;
+        scrypt_1024_1_1_256((const char*)&input[0], BEGIN(hash));
+        BOOST_CHECK_EQUAL(hash.GetHex(), outputhex[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_multi)
+{
+    // More inputs than lanes, so that the last pass is only partly filled
+    const unsigned int n = SCRYPT_MULTI_WAYS + 3;
+    vector<vector<unsigned char> > inputs(n);
+    vector<uint256> hashes(n);
+    const char* pinputs[n];
+    char* poutputs[n];
+    for (unsigned int i = 0; i < n; i++) {
+        inputs[i] = ParseHex(inputhex[i % nVectors]);
+        inputs[i][76] += i / nVectors; // vary the nonce of repeated vectors
+        pinputs[i] = (const char*)&inputs[i][0];
+        poutputs[i] = BEGIN(hashes[i]);
+    }
+    vector<uint256> expected(n);
+    for (unsigned int i = 0; i < n; i++)
+        scrypt_1024_1_1_256(pinputs[i], BEGIN(expected[i]));
+    for (unsigned int i = 0; i < nVectors; i++)
+        BOOST_CHECK_EQUAL(expected[i].GetHex(), outputhex[i]);
+
+    scrypt_1024_1_1_256_multi(pinputs, poutputs, n);
+    BOOST_CHECK(hashes == expected);
+
+    vector<char> scratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+    for (unsigned int k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        hashes.assign(n, uint256());
+        if (!scrypt_1024_1_1_256_multi_sp_impl(kernels[k], pinputs, poutputs, n, &scratchpad[0]))
+            continue; // not supported by this CPU
+        BOOST_CHECK_MESSAGE(hashes == expected, kernels[k]);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,89 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "key.h"
+#include "pubkey.h"
+#include "random.h"
+#include "script/sigcache.h"
+#include "uint256.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(sigcache_tests)
+
+static const unsigned int SIGCACHE_TEST_SIGS = 256;
+
+struct SigCacheTestData
+{
+    vector<uint256> vHash;
+    vector<vector<unsigned char> > vSig;
+    vector<CPubKey> vPubKey;
+
+    SigCacheTestData()
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        for (unsigned int i = 0; i < SIGCACHE_TEST_SIGS; i++) {
+            vHash.push_back(GetRandHash());
+            vSig.push_back(vector<unsigned char>());
+            BOOST_CHECK(key.Sign(vHash.back(), vSig.back()));
+            vPubKey.push_back(key.GetPubKey());
+        }
+    }
+};
+
+static void CheckSignatures(const SigCacheTestData* data, unsigned int nRounds, bool* pfOk)
+{
+    CachingTransactionSignatureChecker checker(NULL, 0);
+    for (unsigned int r = 0; r < nRounds; r++) {
+        for (unsigned int i = 0; i < data->vHash.size(); i++) {
+            if (!checker.VerifySignature(data->vSig[i], data->vPubKey[i], data->vHash[i]))
+                *pfOk = false;
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_hits)
+{
+    SigCacheTestData data;
+    CachingTransactionSignatureChecker checker(NULL, 0);
+    CSignatureCacheStats before, after;
+
+    GetSignatureCacheStats(before);
+    BOOST_CHECK_EQUAL(before.nBytes, (uint64_t)DEFAULT_MAX_SIG_CACHE_SIZE << 20);
+    for (unsigned int i = 0; i < SIGCACHE_TEST_SIGS; i++)
+        BOOST_CHECK(checker.VerifySignature(data.vSig[i], data.vPubKey[i], data.vHash[i]));
+    for (unsigned int i = 0; i < SIGCACHE_TEST_SIGS; i++)
+        BOOST_CHECK(checker.VerifySignature(data.vSig[i], data.vPubKey[i], data.vHash[i]));
+    GetSignatureCacheStats(after);
+    BOOST_CHECK_EQUAL(after.nMisses - before.nMisses, SIGCACHE_TEST_SIGS);
+    BOOST_CHECK_EQUAL(after.nHits - before.nHits, SIGCACHE_TEST_SIGS);
+
+    // A cached signature must not validate another hash.
+    BOOST_CHECK(!checker.VerifySignature(data.vSig[0], data.vPubKey[0], data.vHash[1]));
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_threads)
+{
+    static const unsigned int nRounds = 200;
+    SigCacheTestData data;
+    bool fOk = true;
+    CheckSignatures(&data, 1, &fOk);
+
+    for (unsigned int nThreads = 1; nThreads <= 8; nThreads *= 2) {
+        boost::thread_group threads;
+        for (unsigned int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CheckSignatures, &data, nRounds, &fOk));
+        threads.join_all();
+    }
+    BOOST_CHECK(fOk);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
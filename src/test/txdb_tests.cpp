@@ -0,0 +1,115 @@
+// Copyright (c) 2014-2020 Lycancoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "random.h"
+#include "streams.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+static void CheckSetInfoEqual(const CCoinsSetInfo& a, const CCoinsSetInfo& b)
+{
+    BOOST_CHECK_EQUAL(a.nTransactions, b.nTransactions);
+    BOOST_CHECK_EQUAL(a.nTransactionOutputs, b.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(a.nSerializedSize, b.nSerializedSize);
+    BOOST_CHECK_EQUAL(a.nTotalAmount, b.nTotalAmount);
+    BOOST_CHECK(a.GetHash() == b.GetHash());
+}
+
+static bool LoadSnapshot(const boost::filesystem::path& path, CCoinsViewDB& view, CTxOutSetSnapshotHeader& header)
+{
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    return !filein.IsNull() && view.LoadTxOutSet(filein, header);
+}
+
+BOOST_AUTO_TEST_CASE(txoutset_snapshot)
+{
+    static const unsigned int nTransactions = 20000;
+    std::vector<uint256> vTxids;
+
+    // A coin database with random coins, its totals kept as block connection keeps them
+    CCoinsViewDB viewFrom(1 << 20, true, true);
+    BOOST_CHECK(viewFrom.InitSetInfo());
+    uint256 hashBlock = GetRandHash();
+    {
+        CCoinsViewCache cache(&viewFrom);
+        for (unsigned int i = 0; i < nTransactions; i++) {
+            uint256 txid = GetRandHash();
+            CCoinsModifier coins = cache.ModifyCoins(txid);
+            coins->nVersion = 1;
+            coins->nHeight = i;
+            coins->fCoinBase = i % 10 == 0;
+            coins->vout.resize(1 + insecure_rand() % 4);
+            for (unsigned int j = 0; j < coins->vout.size(); j++) {
+                coins->vout[j].nValue = insecure_rand() % 1000000;
+                coins->vout[j].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, (unsigned char)j) << OP_EQUALVERIFY << OP_CHECKSIG;
+            }
+            if (coins->vout.size() > 2)
+                coins->vout[1].SetNull();
+            cache.GetSetInfoDelta().AddCoins(txid, *coins);
+            vTxids.push_back(txid);
+        }
+        cache.SetBestBlock(hashBlock);
+        BOOST_CHECK(cache.Flush());
+    }
+    CCoinsSetInfo infoFrom;
+    BOOST_CHECK(viewFrom.GetSetInfo(infoFrom));
+    BOOST_CHECK_EQUAL(infoFrom.nTransactions, (int64_t)nTransactions);
+
+    boost::filesystem::path path = GetDataDir() / "txoutset_test.dat";
+    {
+        CTxOutSetSnapshotWriter writer(viewFrom);
+        CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(writer.Write(fileout));
+    }
+
+    // Load it into an empty database
+    CCoinsViewDB viewTo(1 << 20, true, true);
+    CTxOutSetSnapshotHeader header;
+    BOOST_CHECK(LoadSnapshot(path, viewTo, header));
+    BOOST_CHECK(header.hashBlock == hashBlock);
+    BOOST_CHECK(viewTo.GetBestBlock() == hashBlock);
+    BOOST_CHECK(viewTo.GetSnapshotBlock() == hashBlock);
+    CCoinsSetInfo infoTo;
+    BOOST_CHECK(viewTo.GetSetInfo(infoTo));
+    CheckSetInfoEqual(infoFrom, infoTo);
+    for (unsigned int i = 0; i < vTxids.size(); i += 97) {
+        CCoins coinsFrom, coinsTo;
+        BOOST_CHECK(viewFrom.GetCoins(vTxids[i], coinsFrom));
+        BOOST_CHECK(viewTo.GetCoins(vTxids[i], coinsTo));
+        BOOST_CHECK(coinsFrom == coinsTo);
+    }
+    // A scan of the loaded database agrees with the totals loaded with it
+    CCoinsStats stats;
+    BOOST_CHECK(viewTo.GetStats(stats));
+    CheckSetInfoEqual(stats.info, infoTo);
+
+    // Only into an empty database
+    BOOST_CHECK(!LoadSnapshot(path, viewTo, header));
+
+    // A corrupted snapshot is refused
+    {
+        CAutoFile file(fopen(path.string().c_str(), "r+b"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(!file.IsNull());
+        fseek(file.Get(), boost::filesystem::file_size(path) / 2, SEEK_SET);
+        unsigned char ch;
+        BOOST_CHECK(fread(&ch, 1, 1, file.Get()) == 1);
+        ch ^= 1;
+        fseek(file.Get(), -1, SEEK_CUR);
+        BOOST_CHECK(fwrite(&ch, 1, 1, file.Get()) == 1);
+    }
+    CCoinsViewDB viewBad(1 << 20, true, true);
+    BOOST_CHECK(!LoadSnapshot(path, viewBad, header));
+    BOOST_CHECK(viewBad.GetBestBlock().IsNull());
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
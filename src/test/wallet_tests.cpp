@@ -3,6 +3,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "wallet.h"
+#include "main.h"
+#include "walletdb.h"
 
 #include <set>
 #include <stdint.h>
@@ -21,6 +23,8 @@
 
 using namespace std;
 
+extern CWallet* pwalletMain;
+
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
 BOOST_AUTO_TEST_SUITE(wallet_tests)
@@ -305,4 +309,195 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+static CTransaction PayTo(const vector<COutPoint>& vPrevout, const CScript& scriptPubKey, CAmount nValue, const CScript& scriptChange, CAmount nChange)
+{
+    CMutableTransaction tx;
+    BOOST_FOREACH(const COutPoint& prevout, vPrevout)
+        tx.vin.push_back(CTxIn(prevout));
+    tx.vout.push_back(CTxOut(nValue, scriptPubKey));
+    if (nChange > 0)
+        tx.vout.push_back(CTxOut(nChange, scriptChange));
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(running_balance_totals)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+    bool fCheckBalancesPrev = fCheckBalances;
+    fCheckBalances = true; // every query below is also checked against a full scan
+
+    CScript scriptMine = GetScriptForDestination(pwalletMain->GenerateNewKey().GetID());
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    CScript scriptOther = GetScriptForDestination(keyOther.GetPubKey().GetID());
+
+    CAmount nBalance = pwalletMain->GetBalance();
+    CAmount nUnconfirmed = pwalletMain->GetUnconfirmedBalance();
+
+    // Received, unconfirmed
+    CTransaction txIn = PayTo(vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), scriptMine, 10 * COIN, scriptMine, 0);
+    mempool.addUnchecked(txIn.GetHash(), CTxMemPoolEntry(txIn, 0, 0, 0.0, 1));
+    BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, txIn), false, &walletdb));
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), nBalance);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 10 * COIN);
+
+    // Spent by us: the received output is gone and our unconfirmed change is trusted
+    CTransaction txOut = PayTo(vector<COutPoint>(1, COutPoint(txIn.GetHash(), 0)), scriptOther, 4 * COIN, scriptMine, 6 * COIN);
+    mempool.addUnchecked(txOut.GetHash(), CTxMemPoolEntry(txOut, 0, 0, 0.0, 1));
+    BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, txOut), false, &walletdb));
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), nBalance + 6 * COIN);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+
+    // The spend drops out of the mempool without the wallet being told
+    std::list<CTransaction> removed;
+    mempool.remove(txOut, removed);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), nBalance);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 10 * COIN);
+
+    // Rebuilding from scratch gives the same answer
+    pwalletMain->MarkDirty();
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 10 * COIN);
+
+    mempool.remove(txIn, removed);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+
+    // A spend added before what it spends is trusted once that comes in
+    CTransaction txParent = PayTo(vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), scriptMine, 10 * COIN, scriptMine, 0);
+    CTransaction txChild = PayTo(vector<COutPoint>(1, COutPoint(txParent.GetHash(), 0)), scriptOther, 4 * COIN, scriptMine, 6 * COIN);
+    mempool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1));
+    mempool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 0, 0, 0.0, 1));
+    BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, txChild), false, &walletdb));
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), nBalance);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 6 * COIN);
+    BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, txParent), false, &walletdb));
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), nBalance + 6 * COIN);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+
+    mempool.remove(txParent, removed, true);
+    fCheckBalances = fCheckBalancesPrev;
+}
+
+BOOST_AUTO_TEST_CASE(available_coins_index)
+{
+    static const int nTransactions = 100;
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+    bool fCheckBalancesPrev = fCheckBalances;
+    fCheckBalances = false;
+
+    CScript scriptMine = GetScriptForDestination(pwalletMain->GenerateNewKey().GetID());
+    vector<COutput> vCoins;
+    pwalletMain->AvailableCoins(vCoins, false);
+    size_t nCoins = vCoins.size();
+
+    vector<CTransaction> vtx;
+    for (int i = 0; i < nTransactions; i++)
+    {
+        CTransaction tx = PayTo(vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), scriptMine, COIN, scriptMine, i + 1);
+        mempool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 0, 0, 0.0, 1));
+        BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, tx), false, &walletdb));
+        vtx.push_back(tx);
+    }
+
+    pwalletMain->AvailableCoins(vCoins, false);
+    BOOST_CHECK_EQUAL(vCoins.size(), nCoins + 2 * nTransactions);
+
+    // Untrusted coins aren't offered for spending, locked ones never are
+    pwalletMain->AvailableCoins(vCoins, true);
+    BOOST_CHECK_EQUAL(vCoins.size(), 0U);
+    COutPoint outpointLocked(vtx[0].GetHash(), 1);
+    pwalletMain->LockCoin(outpointLocked);
+    pwalletMain->AvailableCoins(vCoins, false);
+    BOOST_CHECK_EQUAL(vCoins.size(), nCoins + 2 * nTransactions - 1);
+    pwalletMain->UnlockCoin(outpointLocked);
+
+    // Spending one output takes it out of the index; the full scan must agree
+    fCheckBalances = true;
+    CTransaction txSpend = PayTo(vector<COutPoint>(1, COutPoint(vtx[1].GetHash(), 0)), scriptMine, COIN / 2, scriptMine, 0);
+    mempool.addUnchecked(txSpend.GetHash(), CTxMemPoolEntry(txSpend, 0, 0, 0.0, 1));
+    BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, txSpend), false, &walletdb));
+    pwalletMain->AvailableCoins(vCoins, false);
+    BOOST_CHECK_EQUAL(vCoins.size(), nCoins + 2 * nTransactions);
+    BOOST_FOREACH(const COutput& out, vCoins)
+        BOOST_CHECK(!(out.tx->GetHash() == vtx[1].GetHash() && out.i == 0));
+
+    std::list<CTransaction> removed;
+    mempool.remove(txSpend, removed);
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        mempool.remove(tx, removed);
+    pwalletMain->AvailableCoins(vCoins, false);
+    BOOST_CHECK_EQUAL(vCoins.size(), nCoins);
+    fCheckBalances = fCheckBalancesPrev;
+}
+
+BOOST_AUTO_TEST_CASE(keystore_snapshot)
+{
+    CBasicKeyStore keystore;
+    CKey key[3];
+    for (int i = 0; i < 3; i++)
+        key[i].MakeNewKey(true);
+    keystore.AddKey(key[0]);
+    keystore.AddKey(key[1]);
+
+    std::vector<CPubKey> vMultisig;
+    vMultisig.push_back(key[0].GetPubKey());
+    vMultisig.push_back(key[1].GetPubKey());
+    CScript scriptMultisig = GetScriptForMultisig(1, vMultisig);
+    keystore.AddCScript(scriptMultisig);
+    CScript scriptWatched = GetScriptForDestination(key[2].GetPubKey().GetID());
+    keystore.AddWatchOnly(scriptWatched);
+
+    std::vector<CScript> vScripts;
+    vScripts.push_back(GetScriptForDestination(key[0].GetPubKey().GetID()));
+    vScripts.push_back(CScript() << ToByteVector(key[1].GetPubKey()) << OP_CHECKSIG);
+    vScripts.push_back(GetScriptForDestination(CScriptID(scriptMultisig)));
+    vScripts.push_back(scriptWatched);
+    vScripts.push_back(CScript() << ToByteVector(key[2].GetPubKey()) << OP_CHECKSIG);
+    vScripts.push_back(CScript() << OP_RETURN);
+
+    CKeyStoreSnapshot snapshot(keystore);
+    BOOST_FOREACH(const CScript& script, vScripts)
+        BOOST_CHECK_EQUAL(IsMine(snapshot, script), IsMine(keystore, script));
+
+    // Secrets stay behind, and later changes don't show up
+    CKey keyOut;
+    BOOST_CHECK(!snapshot.GetKey(key[0].GetPubKey().GetID(), keyOut));
+    keystore.AddKey(key[2]);
+    BOOST_CHECK_EQUAL(IsMine(keystore, vScripts[4]), ISMINE_SPENDABLE);
+    BOOST_CHECK_EQUAL(IsMine(snapshot, vScripts[4]), ISMINE_NO);
+}
+
+BOOST_AUTO_TEST_CASE(verify_keys)
+{
+    CWallet wallet;
+    std::vector<CPubKey> vPubKeys;
+    for (int i = 0; i < 1000; i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        vPubKeys.push_back(key.GetPubKey());
+        BOOST_CHECK(wallet.LoadKey(key, key.GetPubKey()));
+    }
+    // Loaded unchecked: a key stored under some other key's public key, and a key not there at all
+    CKey keyWrong, keyMissing;
+    keyWrong.MakeNewKey(true);
+    keyMissing.MakeNewKey(true);
+    BOOST_CHECK(wallet.LoadKey(keyWrong, vPubKeys[0]));
+    CPubKey pubkeyWrong = vPubKeys[0];
+    vPubKeys.push_back(keyMissing.GetPubKey());
+
+    // The same on this thread alone and with helpers taking batches
+    int nScriptCheckThreadsPrev = nScriptCheckThreads;
+    for (nScriptCheckThreads = 0; nScriptCheckThreads <= 3; nScriptCheckThreads += 3) {
+        std::vector<CPubKey> vBad;
+        wallet.VerifyKeys(vPubKeys, vBad);
+        std::set<CPubKey> setBad(vBad.begin(), vBad.end());
+        BOOST_CHECK_EQUAL(vBad.size(), 2U);
+        BOOST_CHECK(setBad.count(pubkeyWrong));
+        BOOST_CHECK(setBad.count(keyMissing.GetPubKey()));
+    }
+    nScriptCheckThreads = nScriptCheckThreadsPrev;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -5,7 +5,9 @@
 
 #include "txdb.h"
 
+#include "blockfilter.h"
 #include "chainparams.h"
+#include "checkqueue.h"
 #include "hash.h"
 #include "main.h"
 #include "pow.h"
@@ -21,11 +23,19 @@ static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
 static const char DB_BLOCK_INDEX = 'b';
+static const char DB_BLOCK_FILTER = 'g';
 
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_VERSION = 'V';
+static const char DB_SET_INFO = 'U';
+static const char DB_SNAPSHOT = 'S';
+static const char DB_SNAPSHOT_LOADING = 'L';
+
+/** Bytes of coins -loadtxoutset collects in one database write */
+static const size_t TXOUTSET_LOAD_BATCH_BYTES = 16 << 20;
 
 
 void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
@@ -40,6 +50,12 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
 }
 
 CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+    // The totals are for the best block they were written with; an older version
+    // may have moved the coins on without them since.
+    std::pair<uint256, CCoinsSetInfo> record;
+    fSetInfo = db.Read(DB_SET_INFO, record) && record.first == GetBestBlock();
+    if (fSetInfo)
+        setInfo = record.second;
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
@@ -57,7 +73,7 @@ uint256 CCoinsViewDB::GetBestBlock() const {
     return hashBestChain;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsSetInfo &delta) {
     CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
@@ -72,14 +88,205 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     }
     if (!hashBlock.IsNull())
         BatchWriteHashBestChain(batch, hashBlock);
+    // Kept in step with what is on disk: only taken on once written
+    CCoinsSetInfo infoNew = setInfo;
+    if (fSetInfo) {
+        infoNew.Add(delta);
+        batch.Write(DB_SET_INFO, make_pair(hashBlock.IsNull() ? GetBestBlock() : hashBlock, infoNew));
+    }
 
     LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    if (!db.WriteBatch(batch))
+        return false;
+    setInfo = infoNew;
+    return true;
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
+bool CCoinsViewDB::GetSetInfo(CCoinsSetInfo &info) const {
+    if (!fSetInfo)
+        return false;
+    info = setInfo;
+    return true;
+}
+
+bool CCoinsViewDB::InitSetInfo() {
+    if (fSetInfo)
+        return true;
+    CCoinsSetInfo info;
+    if (GetBestBlock().IsNull()) {
+        // Nothing stored yet (or a -reindex wiped it)
+        info.SetNull();
+    } else {
+        LogPrintf("Computing UTXO set totals, this is done once...\n");
+        int64_t nStart = GetTimeMillis();
+        CCoinsStats stats;
+        if (!GetStats(stats))
+            return false;
+        info = stats.info;
+        LogPrintf("UTXO set totals: %d transactions, %d outputs (%dms)\n", info.nTransactions, info.nTransactionOutputs, GetTimeMillis() - nStart);
+    }
+    if (!db.Write(DB_SET_INFO, make_pair(GetBestBlock(), info), true))
+        return false;
+    setInfo = info;
+    fSetInfo = true;
+    return true;
+}
+
+bool CCoinsViewDB::HaveAnyCoins() {
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair(DB_COINS, uint256());
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    pcursor->Seek(ssKeySet.str());
+    return pcursor->Valid() && pcursor->key().size() > 0 && pcursor->key()[0] == DB_COINS;
+}
+
+bool CCoinsViewDB::IsSnapshotLoadInterrupted() const {
+    return db.Exists(DB_SNAPSHOT_LOADING);
+}
+
+uint256 CCoinsViewDB::GetSnapshotBlock() const {
+    uint256 hash;
+    if (!db.Read(DB_SNAPSHOT, hash))
+        return uint256();
+    return hash;
+}
+
+bool CCoinsViewDB::LoadTxOutSet(CAutoFile& filein, CTxOutSetSnapshotHeader& header) {
+    if (!GetBestBlock().IsNull() || HaveAnyCoins() || IsSnapshotLoadInterrupted())
+        return error("%s : the coin database is not empty", __func__);
+
+    // Everything read is hashed again as it is serialized, which is canonical
+    CHashWriter hasher(SER_GETHASH, 0);
+    CCoinsSetInfo info;
+    int64_t nStart = GetTimeMillis();
+    int64_t nLastLog = nStart;
+    int64_t nLoaded = 0;
+    try {
+        filein >> header;
+        if (header.nMagic != CTxOutSetSnapshotHeader::MAGIC || header.nVersion > CTxOutSetSnapshotHeader::CURRENT_VERSION)
+            return error("%s : not a UTXO set snapshot, or of an unknown version", __func__);
+        if (header.hashBlock.IsNull() || header.info.nTransactions < 0)
+            return error("%s : invalid snapshot header", __func__);
+        hasher << header;
+        LogPrintf("Loading UTXO set snapshot of block %s: %d transactions, %d outputs\n", header.hashBlock.ToString(),
+            header.info.nTransactions, header.info.nTransactionOutputs);
+
+        // Marks the database as half-loaded until the best block is written
+        // with the last batch, should the node stop before then
+        CLevelDBBatch batchStart;
+        batchStart.Write(DB_SNAPSHOT_LOADING, header.hashBlock);
+        if (!db.WriteBatch(batchStart, true))
+            return false;
+
+        uint256 txidPrev;
+        while (nLoaded < header.info.nTransactions) {
+            // Stream in bounded batches, so memory use does not depend on the set size
+            CLevelDBBatch batch;
+            size_t nBatchBytes = 0;
+            while (nLoaded < header.info.nTransactions && nBatchBytes < TXOUTSET_LOAD_BATCH_BYTES) {
+                boost::this_thread::interruption_point();
+                uint256 txid;
+                CCoins coins;
+                filein >> txid >> coins;
+                hasher << txid << coins;
+                // Records are in database order, so every txid appears once
+                if (nLoaded > 0 && !(txidPrev < txid))
+                    return error("%s : snapshot records out of order", __func__);
+                if (coins.IsPruned())
+                    return error("%s : snapshot contains spent transaction %s", __func__, txid.ToString());
+                txidPrev = txid;
+                info.AddCoins(txid, coins);
+                BatchWriteCoins(batch, txid, coins);
+                nBatchBytes += 32 + ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
+                nLoaded++;
+            }
+            if (!db.WriteBatch(batch))
+                return false;
+            if (GetTimeMillis() - nLastLog > 10000) {
+                nLastLog = GetTimeMillis();
+                LogPrintf("Loaded %d of %d UTXO set snapshot transactions (%.0f/s)\n", nLoaded, header.info.nTransactions,
+                    1000.0 * nLoaded / std::max(nLastLog - nStart, (int64_t)1));
+            }
+        }
+
+        uint256 hashFile;
+        filein >> hashFile;
+        if (hashFile != hasher.GetHash())
+            return error("%s : snapshot checksum mismatch", __func__);
+    } catch (const std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    if (info.nTransactionOutputs != header.info.nTransactionOutputs || info.nSerializedSize != header.info.nSerializedSize ||
+        info.nTotalAmount != header.info.nTotalAmount || info.GetHash() != header.info.GetHash())
+        return error("%s : snapshot contents do not match its header", __func__);
+
+    // Only now does the database get a best block, so an interrupted load is not mistaken for a state
+    CLevelDBBatch batch;
+    BatchWriteHashBestChain(batch, header.hashBlock);
+    batch.Write(DB_SET_INFO, make_pair(header.hashBlock, info));
+    batch.Write(DB_SNAPSHOT, header.hashBlock);
+    batch.Erase(DB_SNAPSHOT_LOADING);
+    if (!db.WriteBatch(batch, true))
+        return false;
+    setInfo = info;
+    fSetInfo = true;
+
+    int64_t nElapsed = GetTimeMillis() - nStart;
+    LogPrintf("Loaded UTXO set snapshot: %d transactions, %d outputs in %.2fs (%.0f transactions/s, %.0f outputs/s)\n",
+        nLoaded, info.nTransactionOutputs, 0.001 * nElapsed, 1000.0 * nLoaded / std::max(nElapsed, (int64_t)1),
+        1000.0 * info.nTransactionOutputs / std::max(nElapsed, (int64_t)1));
+    return true;
+}
+
+CTxOutSetSnapshotWriter::CTxOutSetSnapshotWriter(CCoinsViewDB& view) : pcursor(view.db.NewIterator()) {
+    // A LevelDB iterator reads the database as of its creation
+    header.hashBlock = view.GetBestBlock();
+    fValid = view.GetSetInfo(header.info);
+}
+
+bool CTxOutSetSnapshotWriter::Write(CAutoFile& fileout) {
+    if (!fValid)
+        return error("%s : UTXO set statistics are not available", __func__);
+
+    CHashWriter hasher(SER_GETHASH, 0);
+    int64_t nWritten = 0;
+    try {
+        fileout << header;
+        hasher << header;
+
+        CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+        ssKeySet << make_pair(DB_COINS, uint256());
+        for (pcursor->Seek(ssKeySet.str()); pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType != DB_COINS)
+                break;
+            uint256 txid;
+            ssKey >> txid;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoins coins;
+            ssValue >> coins;
+            fileout << txid << coins;
+            hasher << txid << coins;
+            nWritten++;
+        }
+        if (nWritten != header.info.nTransactions)
+            return error("%s : wrote %d transactions, expected %d", __func__, nWritten, header.info.nTransactions);
+        fileout << hasher.GetHash();
+    } catch (const std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    return true;
+}
+
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
     return Read(make_pair(DB_BLOCK_FILES, nFile), info);
 }
@@ -110,7 +317,7 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    stats.info.SetNull();
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
@@ -129,17 +336,14 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
                 ss << VARINT(coins.nVersion);
                 ss << (coins.fCoinBase ? 'c' : 'n');
                 ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
                 for (unsigned int i=0; i<coins.vout.size(); i++) {
                     const CTxOut &out = coins.vout[i];
                     if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
                         ss << VARINT(i+1);
                         ss << out;
-                        nTotalAmount += out.nValue;
                     }
                 }
-                stats.nSerializedSize += 32 + slValue.size();
+                stats.info.AddCoins(txhash, coins);
                 ss << VARINT(0);
             }
             pcursor->Next();
@@ -147,9 +351,7 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
             return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
     }
-    stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
@@ -188,8 +390,21 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts()
+/** Number of headers per PoW check job queued by LoadBlockIndexGuts */
+static const unsigned int INDEX_POW_CHECK_BATCH = 128;
+
+/**
+ * Entries at BLOCK_VALID_TREE or above had their header fully checked before
+ * being written, so their PoW is not rechecked here. With pcontrol (-checkindexpow)
+ * every entry's scrypt PoW is instead verified on the check queue while the
+ * iteration continues; the caller collects the result with pcontrol->Wait().
+ */
+bool CBlockTreeDB::LoadBlockIndexGuts(CCheckQueueControl<CPoWHashCheck>* pcontrol)
 {
+    std::vector<CBlockHeader> vHeaders;
+    if (pcontrol)
+        vHeaders.reserve(INDEX_POW_CHECK_BATCH);
+
     boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
 
     CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
@@ -225,8 +440,18 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 pindexNew->nStatus        = diskindex.nStatus;
                 pindexNew->nTx            = diskindex.nTx;
 
-                if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
-                    return error("LoadBlockIndex() : CheckProofOfWork failed: %s", pindexNew->ToString());
+                if (pcontrol) {
+                    vHeaders.push_back(pindexNew->GetBlockHeader());
+                    if (vHeaders.size() == INDEX_POW_CHECK_BATCH) {
+                        std::vector<CPoWHashCheck> vChecks(1);
+                        CPoWHashCheck(vHeaders.begin(), vHeaders.end(), true).swap(vChecks[0]);
+                        pcontrol->Add(vChecks);
+                        vHeaders.clear();
+                    }
+                } else if (!pindexNew->IsValid(BLOCK_VALID_TREE)) {
+                    if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
+                        return error("LoadBlockIndex() : CheckProofOfWork failed: %s", pindexNew->ToString());
+                }
 
                 pcursor->Next();
             } else {
@@ -237,5 +462,45 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
         }
     }
 
+    if (pcontrol && !vHeaders.empty()) {
+        std::vector<CPoWHashCheck> vChecks(1);
+        CPoWHashCheck(vHeaders.begin(), vHeaders.end(), true).swap(vChecks[0]);
+        pcontrol->Add(vChecks);
+    }
+
     return true;
-}
\ No newline at end of file
+}
+
+CBlockFilterDB::CBlockFilterDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "filter", nCacheSize, fMemory, fWipe) {
+}
+
+bool CBlockFilterDB::ReadFilter(const uint256 &hash, CBlockFilter &filter) {
+    if (!Read(make_pair(DB_BLOCK_FILTER, hash), filter))
+        return false;
+    filter.hashBlock = hash;
+    return true;
+}
+
+bool CBlockFilterDB::HaveFilter(const uint256 &hash) {
+    return Exists(make_pair(DB_BLOCK_FILTER, hash));
+}
+
+bool CBlockFilterDB::WriteFilter(const CBlockFilter &filter) {
+    return Write(make_pair(DB_BLOCK_FILTER, filter.hashBlock), filter);
+}
+
+bool CBlockFilterDB::ReadBestBlock(CBlockLocator &locator) {
+    return Read(DB_BEST_BLOCK, locator);
+}
+
+bool CBlockFilterDB::WriteBestBlock(const CBlockLocator &locator) {
+    return Write(DB_BEST_BLOCK, locator);
+}
+
+bool CBlockFilterDB::ReadVersion(int &nVersion) {
+    return Read(DB_VERSION, nVersion);
+}
+
+bool CBlockFilterDB::WriteVersion(int nVersion) {
+    return Write(DB_VERSION, nVersion);
+}
@@ -14,9 +14,16 @@
 #include <utility>
 #include <vector>
 
+#include <boost/scoped_ptr.hpp>
+
+class CAutoFile;
 class CBlockFileInfo;
+class CBlockFilter;
 class CBlockIndex;
+class CPoWHashCheck;
+struct CBlockLocator;
 struct CDiskTxPos;
+template <typename T> class CCheckQueueControl;
 class uint256;
 
 // -dbcache default (MiB)
@@ -26,19 +33,89 @@ static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 // min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
 
+/**
+ * Header of a UTXO set snapshot file (dumptxoutset, -loadtxoutset). It is
+ * followed by info.nTransactions (txid, CCoins) records, the outputs
+ * compressed with CTxOutCompressor as in the coin database, and finally a
+ * SHA256 hash of everything before it.
+ */
+class CTxOutSetSnapshotHeader
+{
+public:
+    static const uint32_t MAGIC = 0x6f787475; // "utxo"
+    static const int CURRENT_VERSION = 1;
+
+    uint32_t nMagic;
+    int nVersion;
+    uint256 hashBlock;  // the block the set is the state after
+    CCoinsSetInfo info; // totals and set hash of the records
+
+    CTxOutSetSnapshotHeader() : nMagic(MAGIC), nVersion(CURRENT_VERSION) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nMagic);
+        READWRITE(this->nVersion);
+        READWRITE(hashBlock);
+        READWRITE(info);
+    }
+};
+
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
+    // Running set totals, stored along with the best block; fSetInfo is false
+    // for a database written before they were kept, until InitSetInfo().
+    bool fSetInfo;
+    CCoinsSetInfo setInfo;
+
+    bool HaveAnyCoins();
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsSetInfo &delta);
+    bool GetSetInfo(CCoinsSetInfo &info) const;
     bool GetStats(CCoinsStats &stats) const;
+
+    // Start keeping the set totals, computing them with a full scan if the database
+    // has coins but no totals yet.
+    bool InitSetInfo();
+
+    // Fill an empty database from a UTXO set snapshot file, checking it against
+    // its header and checksum. Afterwards the best block is the snapshot block.
+    bool LoadTxOutSet(CAutoFile& filein, CTxOutSetSnapshotHeader& header);
+    // The block of the snapshot this database was loaded from, if any
+    uint256 GetSnapshotBlock() const;
+    // Whether a LoadTxOutSet stopped before it finished, leaving a partial set
+    bool IsSnapshotLoadInterrupted() const;
+
+    friend class CTxOutSetSnapshotWriter;
+};
+
+/**
+ * Writes the coin database out as a UTXO set snapshot. The state is captured
+ * when the writer is constructed, which must be with the database flushed and
+ * cs_main held; Write() can then run without any lock while the node goes on.
+ */
+class CTxOutSetSnapshotWriter
+{
+private:
+    boost::scoped_ptr<leveldb::Iterator> pcursor;
+    CTxOutSetSnapshotHeader header;
+    bool fValid;
+
+public:
+    CTxOutSetSnapshotWriter(CCoinsViewDB& view);
+
+    const CTxOutSetSnapshotHeader& GetHeader() const { return header; }
+    bool Write(CAutoFile& fileout);
 };
 
 /** Access to the block database (blocks/index/) */
@@ -59,7 +136,27 @@ public:
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
-    bool LoadBlockIndexGuts();
+    bool LoadBlockIndexGuts(CCheckQueueControl<CPoWHashCheck>* pcontrol = NULL);
+};
+
+/** Access to the block filter index (blocks/filter/), filters keyed by block hash */
+class CBlockFilterDB : public CLevelDBWrapper
+{
+public:
+    CBlockFilterDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+private:
+    CBlockFilterDB(const CBlockFilterDB&);
+    void operator=(const CBlockFilterDB&);
+public:
+    bool ReadFilter(const uint256 &hash, CBlockFilter &filter);
+    bool HaveFilter(const uint256 &hash);
+    bool WriteFilter(const CBlockFilter &filter);
+    // How far along the active chain filters were built for every block
+    bool ReadBestBlock(CBlockLocator &locator);
+    bool WriteBestBlock(const CBlockLocator &locator);
+    // CBlockFilter::VERSION of the filters stored
+    bool ReadVersion(int &nVersion);
+    bool WriteVersion(int nVersion);
 };
 
 #endif // BITCOIN_TXDB_LEVELDB_H
\ No newline at end of file
@@ -8,17 +8,33 @@
 #include "clientversion.h"
 #include "consensus/consensus.h"
 #include "main.h"
+#include "memusage.h"
 #include "streams.h"
 #include "util.h"
 #include "utilmoneystr.h"
 #include "version.h"
 
+#include <cmath>
+
 #include <boost/circular_buffer.hpp>
 
 using namespace std;
 
+// Heap memory held by a transaction's inputs, outputs and their scripts
+static size_t RecursiveDynamicUsage(const CTransaction& tx)
+{
+    size_t nUsage = memusage::DynamicUsage(tx.vin) + memusage::DynamicUsage(tx.vout);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += memusage::DynamicUsage(txin.scriptSig);
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += memusage::DynamicUsage(txout.scriptPubKey);
+    return nUsage;
+}
+
 CTxMemPoolEntry::CTxMemPoolEntry():
-    nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0)
+    nFee(0), nTxSize(0), nModSize(0), nUsageSize(0), nTime(0), dPriority(0.0), nFeeDelta(0), dPriorityDelta(0.0), dIndexPriority(0.0),
+    nCountWithAncestors(1), nSizeWithAncestors(0), nModFeesWithAncestors(0),
+    nCountWithDescendants(1), nSizeWithDescendants(0), nModFeesWithDescendants(0)
 {
     nHeight = MEMPOOL_HEIGHT;
 }
@@ -26,11 +42,17 @@ CTxMemPoolEntry::CTxMemPoolEntry():
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                                  int64_t _nTime, double _dPriority,
                                  unsigned int _nHeight):
-    tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
+    tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight),
+    nFeeDelta(0), dPriorityDelta(0.0), dIndexPriority(_dPriority)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
     nModSize = tx.CalculateModifiedSize(nTxSize);
+    nUsageSize = RecursiveDynamicUsage(tx);
+
+    nCountWithAncestors = nCountWithDescendants = 1;
+    nSizeWithAncestors = nSizeWithDescendants = nTxSize;
+    nModFeesWithAncestors = nModFeesWithDescendants = nFee;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -47,6 +69,36 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
     return dResult;
 }
 
+void CTxMemPoolEntry::SetDeltas(double dPriorityDeltaIn, CAmount nFeeDeltaIn)
+{
+    nModFeesWithAncestors += nFeeDeltaIn - nFeeDelta;
+    nModFeesWithDescendants += nFeeDeltaIn - nFeeDelta;
+    dIndexPriority += dPriorityDeltaIn - dPriorityDelta;
+    nFeeDelta = nFeeDeltaIn;
+    dPriorityDelta = dPriorityDeltaIn;
+}
+
+void CTxMemPoolEntry::UpdateIndexPriority(unsigned int currentHeight)
+{
+    dIndexPriority = GetPriority(std::max(currentHeight, nHeight)) + dPriorityDelta;
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount)
+{
+    nSizeWithAncestors += nModifySize;
+    nModFeesWithAncestors += nModifyFee;
+    nCountWithAncestors += nModifyCount;
+    assert(int64_t(nCountWithAncestors) > 0);
+}
+
+void CTxMemPoolEntry::UpdateDescendantState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount)
+{
+    nSizeWithDescendants += nModifySize;
+    nModFeesWithDescendants += nModifyFee;
+    nCountWithDescendants += nModifyCount;
+    assert(int64_t(nCountWithDescendants) > 0);
+}
+
 //
 // Keep track of fee/priority for transactions confirmed within N blocks
 //
@@ -366,7 +418,12 @@ public:
 
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) :
     nTransactionsUpdated(0),
-    minRelayFee(_minRelayFee)
+    minRelayFee(_minRelayFee),
+    totalTxSize(0),
+    cachedInnerUsage(0),
+    rollingMinimumFeeRate(0),
+    lastRollingFeeUpdate(GetTime()),
+    blockSinceLastRollingFeeBump(false)
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
@@ -412,6 +469,156 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 }
 
 
+void CTxMemPool::UpdateAncestorState(txiter it, int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount)
+{
+    setByAncestorFeeRate.erase(it);
+    it->second.UpdateAncestorState(nModifySize, nModifyFee, nModifyCount);
+    setByAncestorFeeRate.insert(it);
+}
+
+void CTxMemPool::UpdateDescendantState(txiter it, int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount)
+{
+    setByDescendantScore.erase(it);
+    it->second.UpdateDescendantState(nModifySize, nModifyFee, nModifyCount);
+    setByDescendantScore.insert(it);
+}
+
+void CTxMemPool::RecalculateAncestorState(txiter it)
+{
+    setEntries setAncestors;
+    CalculateMemPoolAncestors(it, setAncestors);
+    int64_t nSize = it->second.GetTxSize();
+    CAmount nModFees = it->second.GetModifiedFee();
+    BOOST_FOREACH(txiter ancestor, setAncestors) {
+        nSize += ancestor->second.GetTxSize();
+        nModFees += ancestor->second.GetModifiedFee();
+    }
+    const CTxMemPoolEntry& entry = it->second;
+    UpdateAncestorState(it, nSize - entry.GetSizeWithAncestors(), nModFees - entry.GetModFeesWithAncestors(),
+                        (int64_t)setAncestors.size() + 1 - entry.GetCountWithAncestors());
+}
+
+void CTxMemPool::RecalculateDescendantState(txiter it)
+{
+    setEntries setDescendants;
+    CalculateDescendants(it, setDescendants);
+    int64_t nSize = it->second.GetTxSize();
+    CAmount nModFees = it->second.GetModifiedFee();
+    BOOST_FOREACH(txiter descendant, setDescendants) {
+        nSize += descendant->second.GetTxSize();
+        nModFees += descendant->second.GetModifiedFee();
+    }
+    const CTxMemPoolEntry& entry = it->second;
+    UpdateDescendantState(it, nSize - entry.GetSizeWithDescendants(), nModFees - entry.GetModFeesWithDescendants(),
+                          (int64_t)setDescendants.size() + 1 - entry.GetCountWithDescendants());
+}
+
+void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
+{
+    setEntries& parents = mapLinks[entry].parents;
+    if (add && parents.insert(parent).second)
+        cachedInnerUsage += memusage::IncrementalDynamicUsage(parents);
+    else if (!add && parents.erase(parent))
+        cachedInnerUsage -= memusage::IncrementalDynamicUsage(parents);
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    setEntries& children = mapLinks[entry].children;
+    if (add && children.insert(child).second)
+        cachedInnerUsage += memusage::IncrementalDynamicUsage(children);
+    else if (!add && children.erase(child))
+        cachedInnerUsage -= memusage::IncrementalDynamicUsage(children);
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolParents(txiter it) const
+{
+    std::map<txiter, TxLinks, CompareIteratorByHash>::const_iterator itLinks = mapLinks.find(it);
+    assert(itLinks != mapLinks.end());
+    return itLinks->second.parents;
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolChildren(txiter it) const
+{
+    std::map<txiter, TxLinks, CompareIteratorByHash>::const_iterator itLinks = mapLinks.find(it);
+    assert(itLinks != mapLinks.end());
+    return itLinks->second.children;
+}
+
+void CTxMemPool::CalculateMemPoolAncestors(txiter it, setEntries& setAncestors) const
+{
+    std::vector<txiter> vToVisit(1, it);
+    while (!vToVisit.empty()) {
+        txiter itVisit = vToVisit.back();
+        vToVisit.pop_back();
+        BOOST_FOREACH(txiter parent, GetMemPoolParents(itVisit)) {
+            if (setAncestors.insert(parent).second)
+                vToVisit.push_back(parent);
+        }
+    }
+}
+
+void CTxMemPool::CalculateDescendants(txiter it, setEntries& setDescendants) const
+{
+    std::vector<txiter> vToVisit(1, it);
+    while (!vToVisit.empty()) {
+        txiter itVisit = vToVisit.back();
+        vToVisit.pop_back();
+        BOOST_FOREACH(txiter child, GetMemPoolChildren(itVisit)) {
+            if (setDescendants.insert(child).second)
+                vToVisit.push_back(child);
+        }
+    }
+}
+
+bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors,
+                                           uint64_t limitAncestorCount, uint64_t limitAncestorSize,
+                                           uint64_t limitDescendantCount, uint64_t limitDescendantSize,
+                                           std::string& errString)
+{
+    const CTransaction& tx = entry.GetTx();
+    setEntries setStaged;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+        txiter parent = mapTx.find(txin.prevout.hash);
+        if (parent == mapTx.end())
+            continue;
+        setStaged.insert(parent);
+        if (setStaged.size() + 1 > limitAncestorCount) {
+            errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
+            return false;
+        }
+    }
+
+    uint64_t nSizeWithAncestors = entry.GetTxSize();
+    while (!setStaged.empty()) {
+        txiter stage = *setStaged.begin();
+        setStaged.erase(setStaged.begin());
+        setAncestors.insert(stage);
+        nSizeWithAncestors += stage->second.GetTxSize();
+
+        if (stage->second.GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
+            errString = strprintf("exceeds descendant size limit for tx %s [limit: %u]", stage->first.ToString(), limitDescendantSize);
+            return false;
+        } else if (stage->second.GetCountWithDescendants() + 1 > limitDescendantCount) {
+            errString = strprintf("too many descendants for tx %s [limit: %u]", stage->first.ToString(), limitDescendantCount);
+            return false;
+        } else if (nSizeWithAncestors > limitAncestorSize) {
+            errString = strprintf("exceeds ancestor size limit [limit: %u]", limitAncestorSize);
+            return false;
+        }
+
+        BOOST_FOREACH(txiter parent, GetMemPoolParents(stage)) {
+            if (!setAncestors.count(parent))
+                setStaged.insert(parent);
+        }
+        if (setStaged.size() + setAncestors.size() + 1 > limitAncestorCount) {
+            errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
+            return false;
+        }
+    }
+    return true;
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
 {
     // Add to memory pool without checking anything.
@@ -419,16 +626,131 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = entry;
-        const CTransaction& tx = mapTx[hash].GetTx();
-        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        txiter it = mapTx.insert(std::make_pair(hash, entry)).first;
+        std::map<uint256, std::pair<double, CAmount> >::const_iterator pos = mapDeltas.find(hash);
+        if (pos != mapDeltas.end())
+            it->second.SetDeltas(pos->second.first, pos->second.second);
+
+        // Link it to the pool transactions it spends, and to any that already
+        // spend it, which happens when a disconnected block's transactions return
+        const CTransaction& tx = it->second.GetTx();
+        TxLinks& links = mapLinks[it];
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
             mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+            txiter parent = mapTx.find(tx.vin[i].prevout.hash);
+            if (parent != mapTx.end()) {
+                UpdateParent(it, parent, true);
+                UpdateChild(parent, it, true);
+            }
+        }
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            std::map<COutPoint, CInPoint>::iterator itNext = mapNextTx.find(COutPoint(hash, i));
+            if (itNext == mapNextTx.end())
+                continue;
+            txiter child = mapTx.find(itNext->second.ptx->GetHash());
+            assert(child != mapTx.end());
+            UpdateChild(it, child, true);
+            UpdateParent(child, it, true);
+        }
+
+        setEntries setAncestors;
+        CalculateMemPoolAncestors(it, setAncestors);
+        if (links.children.empty()) {
+            // The usual case: only the ancestors' descendant totals change
+            int64_t nSize = 0;
+            CAmount nModFees = 0;
+            BOOST_FOREACH(txiter ancestor, setAncestors) {
+                UpdateDescendantState(ancestor, it->second.GetTxSize(), it->second.GetModifiedFee(), 1);
+                nSize += ancestor->second.GetTxSize();
+                nModFees += ancestor->second.GetModifiedFee();
+            }
+            it->second.UpdateAncestorState(nSize, nModFees, setAncestors.size());
+        } else {
+            // Descendants may share ancestors with it, so count everything afresh
+            setEntries setDescendants;
+            CalculateDescendants(it, setDescendants);
+            BOOST_FOREACH(txiter ancestor, setAncestors)
+                RecalculateDescendantState(ancestor);
+            BOOST_FOREACH(txiter descendant, setDescendants)
+                RecalculateAncestorState(descendant);
+            RecalculateAncestorState(it);
+            RecalculateDescendantState(it);
+        }
+        setByAncestorFeeRate.insert(it);
+        setByDescendantScore.insert(it);
+        setByPriority.insert(it);
+
         nTransactionsUpdated++;
         totalTxSize += entry.GetTxSize();
+        cachedInnerUsage += entry.DynamicMemoryUsage();
     }
     return true;
 }
 
+void CTxMemPool::RemoveStaged(const std::vector<txiter>& vRemove, std::list<CTransaction>& removed)
+{
+    // First take the transactions out of the totals of those that stay. That
+    // is a subtraction, unless a transaction removed from between others
+    // (never the case for a block's, whose parents go first) cuts ancestors
+    // off from descendants: those relatives are counted afresh afterwards.
+    setEntries setRemove(vRemove.begin(), vRemove.end());
+    std::vector<std::pair<setEntries, setEntries> > vRelatives(vRemove.size());
+    setEntries setRecalcAncestors, setRecalcDescendants;
+    for (unsigned int i = 0; i < vRemove.size(); i++) {
+        setEntries setAncestors, setDescendants;
+        CalculateMemPoolAncestors(vRemove[i], setAncestors);
+        CalculateDescendants(vRemove[i], setDescendants);
+        BOOST_FOREACH(txiter ancestor, setAncestors) {
+            if (!setRemove.count(ancestor))
+                vRelatives[i].first.insert(ancestor);
+        }
+        BOOST_FOREACH(txiter descendant, setDescendants) {
+            if (!setRemove.count(descendant))
+                vRelatives[i].second.insert(descendant);
+        }
+        if (!vRelatives[i].first.empty() && !vRelatives[i].second.empty()) {
+            setRecalcDescendants.insert(vRelatives[i].first.begin(), vRelatives[i].first.end());
+            setRecalcAncestors.insert(vRelatives[i].second.begin(), vRelatives[i].second.end());
+        }
+    }
+    for (unsigned int i = 0; i < vRemove.size(); i++) {
+        const CTxMemPoolEntry& entry = vRemove[i]->second;
+        BOOST_FOREACH(txiter ancestor, vRelatives[i].first) {
+            if (!setRecalcDescendants.count(ancestor))
+                UpdateDescendantState(ancestor, -(int64_t)entry.GetTxSize(), -entry.GetModifiedFee(), -1);
+        }
+        BOOST_FOREACH(txiter descendant, vRelatives[i].second) {
+            if (!setRecalcAncestors.count(descendant))
+                UpdateAncestorState(descendant, -(int64_t)entry.GetTxSize(), -entry.GetModifiedFee(), -1);
+        }
+    }
+    BOOST_FOREACH(txiter it, vRemove) {
+        const TxLinks& links = mapLinks[it];
+        BOOST_FOREACH(txiter parent, links.parents)
+            UpdateChild(parent, it, false);
+        BOOST_FOREACH(txiter child, links.children)
+            UpdateParent(child, it, false);
+        cachedInnerUsage -= memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
+        mapLinks.erase(it);
+        setByAncestorFeeRate.erase(it);
+        setByDescendantScore.erase(it);
+        setByPriority.erase(it);
+
+        const CTransaction& tx = it->second.GetTx();
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            mapNextTx.erase(txin.prevout);
+
+        removed.push_back(tx);
+        totalTxSize -= it->second.GetTxSize();
+        cachedInnerUsage -= it->second.DynamicMemoryUsage();
+        mapTx.erase(it);
+        nTransactionsUpdated++;
+    }
+    BOOST_FOREACH(txiter it, setRecalcAncestors)
+        RecalculateAncestorState(it);
+    BOOST_FOREACH(txiter it, setRecalcDescendants)
+        RecalculateDescendantState(it);
+}
 
 void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& removed, bool fRecursive)
 {
@@ -449,29 +771,22 @@ void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& rem
                 txToRemove.push_back(it->second.ptx->GetHash());
             }
         }
+        std::vector<txiter> vRemove;
+        setEntries setRemove;
         while (!txToRemove.empty())
         {
             uint256 hash = txToRemove.front();
             txToRemove.pop_front();
-            if (!mapTx.count(hash))
+            txiter it = mapTx.find(hash);
+            if (it == mapTx.end() || !setRemove.insert(it).second)
                 continue;
-            const CTransaction& tx = mapTx[hash].GetTx();
             if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it == mapNextTx.end())
-                        continue;
-                    txToRemove.push_back(it->second.ptx->GetHash());
-                }
+                BOOST_FOREACH(txiter child, GetMemPoolChildren(it))
+                    txToRemove.push_back(child->first);
             }
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-
-            removed.push_back(tx);
-            totalTxSize -= mapTx[hash].GetTxSize();
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
+            vRemove.push_back(it);
         }
+        RemoveStaged(vRemove, removed);
     }
 }
 
@@ -537,15 +852,33 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
         removeConflicts(tx, conflicts);
         ClearPrioritisation(tx.GetHash());
     }
+
+    // Priorities grow with the inputs' age, at different rates, so reorder by
+    // them as of the new height once per block rather than per template
+    setByPriority.clear();
+    for (txiter it = mapTx.begin(); it != mapTx.end(); ++it) {
+        it->second.UpdateIndexPriority(nBlockHeight);
+        setByPriority.insert(it);
+    }
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = true;
 }
 
 
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    mapLinks.clear();
+    setByAncestorFeeRate.clear();
+    setByDescendantScore.clear();
+    setByPriority.clear();
     mapTx.clear();
     mapNextTx.clear();
     totalTxSize = 0;
+    cachedInnerUsage = 0;
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = false;
+    rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
 }
 
@@ -557,7 +890,8 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     LogPrint("mempool", "Checking mempool with %u transactions and %u inputs\n", (unsigned int)mapTx.size(), (unsigned int)mapNextTx.size());
 
     uint64_t checkTotal = 0;
-    
+    uint64_t innerUsage = 0;
+
     CCoinsViewCache mempoolDuplicate(const_cast<CCoinsViewCache*>(pcoins));
 
     LOCK(cs);
@@ -565,6 +899,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
         checkTotal += it->second.GetTxSize();
+        innerUsage += it->second.DynamicMemoryUsage();
         const CTransaction& tx = it->second.GetTx();
         bool fDependsWait = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
@@ -608,6 +943,46 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             stepsSinceLastRemove = 0;
         }
     }
+    // Check the links, the package totals and the indexes against mapTx
+    assert(mapLinks.size() == mapTx.size());
+    assert(setByAncestorFeeRate.size() == mapTx.size());
+    assert(setByDescendantScore.size() == mapTx.size());
+    assert(setByPriority.size() == mapTx.size());
+    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+        txiter itMut = const_cast<CTxMemPool*>(this)->mapTx.find(it->first);
+        setEntries setParents;
+        BOOST_FOREACH(const CTxIn& txin, it->second.GetTx().vin) {
+            txiter parent = const_cast<CTxMemPool*>(this)->mapTx.find(txin.prevout.hash);
+            if (parent != mapTx.end()) {
+                setParents.insert(parent);
+                assert(GetMemPoolChildren(parent).count(itMut));
+            }
+        }
+        assert(setParents == GetMemPoolParents(itMut));
+        innerUsage += memusage::DynamicUsage(setParents) + memusage::DynamicUsage(GetMemPoolChildren(itMut));
+        setEntries setAncestors, setDescendants;
+        CalculateMemPoolAncestors(itMut, setAncestors);
+        CalculateDescendants(itMut, setDescendants);
+        uint64_t nSize = it->second.GetTxSize();
+        CAmount nModFees = it->second.GetModifiedFee();
+        BOOST_FOREACH(txiter ancestor, setAncestors) {
+            nSize += ancestor->second.GetTxSize();
+            nModFees += ancestor->second.GetModifiedFee();
+        }
+        assert(it->second.GetCountWithAncestors() == setAncestors.size() + 1);
+        assert(it->second.GetSizeWithAncestors() == nSize);
+        assert(it->second.GetModFeesWithAncestors() == nModFees);
+        nSize = it->second.GetTxSize();
+        nModFees = it->second.GetModifiedFee();
+        BOOST_FOREACH(txiter descendant, setDescendants) {
+            nSize += descendant->second.GetTxSize();
+            nModFees += descendant->second.GetModifiedFee();
+        }
+        assert(it->second.GetCountWithDescendants() == setDescendants.size() + 1);
+        assert(it->second.GetSizeWithDescendants() == nSize);
+        assert(it->second.GetModFeesWithDescendants() == nModFees);
+        assert(setByAncestorFeeRate.count(itMut) && setByDescendantScore.count(itMut) && setByPriority.count(itMut));
+    }
     for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
         map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
@@ -619,6 +994,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     }
 
     assert(totalTxSize == checkTotal);
+    assert(cachedInnerUsage == innerUsage);
 }
 
 void CTxMemPool::queryHashes(vector<uint256>& vtxid)
@@ -686,6 +1062,81 @@ CTxMemPool::ReadFeeEstimates(CAutoFile& filein)
     return true;
 }
 
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return memusage::DynamicUsage(mapTx) + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) +
+        memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(setByAncestorFeeRate) +
+        memusage::DynamicUsage(setByDescendantScore) + memusage::DynamicUsage(setByPriority) + cachedInnerUsage;
+}
+
+void CTxMemPool::trackPackageRemoved(const CFeeRate& rate)
+{
+    if (rate.GetFeePerK() > rollingMinimumFeeRate) {
+        rollingMinimumFeeRate = rate.GetFeePerK();
+        blockSinceLastRollingFeeBump = false;
+    }
+}
+
+CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const
+{
+    LOCK(cs);
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+        return CFeeRate((CAmount)rollingMinimumFeeRate);
+
+    int64_t time = GetTime();
+    if (time > lastRollingFeeUpdate + 10) {
+        // Decay faster the further the pool has drained below its limit
+        double halflife = ROLLING_FEE_HALFLIFE;
+        if (DynamicMemoryUsage() < sizelimit / 4)
+            halflife /= 4;
+        else if (DynamicMemoryUsage() < sizelimit / 2)
+            halflife /= 2;
+
+        rollingMinimumFeeRate = rollingMinimumFeeRate / pow(2.0, (time - lastRollingFeeUpdate) / halflife);
+        lastRollingFeeUpdate = time;
+
+        if (rollingMinimumFeeRate < minRelayFee.GetFeePerK() / 2) {
+            rollingMinimumFeeRate = 0;
+            return CFeeRate(0);
+        }
+    }
+    return std::max(CFeeRate((CAmount)rollingMinimumFeeRate), minRelayFee);
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit, std::list<CTransaction>* pvRemoved)
+{
+    LOCK(cs);
+
+    unsigned int nTxnRemoved = 0;
+    CFeeRate maxFeeRateRemoved(0);
+    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
+        txiter it = *setByDescendantScore.begin();
+
+        // Whatever replaces the package has to pay more than it did, by at
+        // least the relay fee, or evicting it would only have cost bandwidth
+        const CTxMemPoolEntry& entry = it->second;
+        CFeeRate removed(entry.GetModFeesWithDescendants(), entry.GetSizeWithDescendants());
+        removed = CFeeRate(removed.GetFeePerK() + minRelayFee.GetFeePerK());
+        trackPackageRemoved(removed);
+        maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
+
+        setEntries setDescendants;
+        CalculateDescendants(it, setDescendants);
+        std::vector<txiter> vRemove(1, it);
+        vRemove.insert(vRemove.end(), setDescendants.begin(), setDescendants.end());
+        nTxnRemoved += vRemove.size();
+
+        std::list<CTransaction> removedTxs;
+        RemoveStaged(vRemove, removedTxs);
+        if (pvRemoved)
+            pvRemoved->splice(pvRemoved->end(), removedTxs);
+    }
+
+    if (maxFeeRateRemoved > CFeeRate(0))
+        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
+}
+
 void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash, double dPriorityDelta, const CAmount& nFeeDelta)
 {
     {
@@ -693,6 +1144,24 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         std::pair<double, CAmount> &deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end()) {
+            // Moves it in all three orders, and its relatives in the package ones
+            setEntries setAncestors, setDescendants;
+            CalculateMemPoolAncestors(it, setAncestors);
+            CalculateDescendants(it, setDescendants);
+            BOOST_FOREACH(txiter ancestor, setAncestors)
+                UpdateDescendantState(ancestor, 0, nFeeDelta, 0);
+            BOOST_FOREACH(txiter descendant, setDescendants)
+                UpdateAncestorState(descendant, 0, nFeeDelta, 0);
+            setByAncestorFeeRate.erase(it);
+            setByDescendantScore.erase(it);
+            setByPriority.erase(it);
+            it->second.SetDeltas(deltas.first, deltas.second);
+            setByAncestorFeeRate.insert(it);
+            setByDescendantScore.insert(it);
+            setByPriority.insert(it);
+        }
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
@@ -5,7 +5,10 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <algorithm>
 #include <list>
+#include <map>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
@@ -39,9 +42,22 @@ private:
     CAmount nFee; // Cached to avoid expensive parent-transaction lookups
     size_t nTxSize; // ... and avoid recomputing tx size
     size_t nModSize; // ... and modified size for priority
+    size_t nUsageSize; // ... and total memory usage
     int64_t nTime; // Local time when entering the mempool
     double dPriority; // Priority when entering the mempool
     unsigned int nHeight; // Chain height when entering the mempool
+    CAmount nFeeDelta; // Fee delta set with prioritisetransaction
+    double dPriorityDelta; // Priority delta set with prioritisetransaction
+    double dIndexPriority; // Priority the pool orders the entry by, as of the last block
+
+    // Totals over the entry and all its ancestors in the pool
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+    // Totals over the entry and all its descendants in the pool
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    CAmount nModFeesWithDescendants;
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
@@ -55,6 +71,79 @@ public:
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+    CAmount GetModifiedFee() const { return nFee + nFeeDelta; }
+    double GetIndexPriority() const { return dIndexPriority; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+
+    // Only for CTxMemPool, which keeps its indexes in step with these
+    void SetDeltas(double dPriorityDeltaIn, CAmount nFeeDeltaIn);
+    void UpdateIndexPriority(unsigned int currentHeight);
+    void UpdateAncestorState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount);
+    void UpdateDescendantState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount);
+};
+
+typedef std::map<uint256, CTxMemPoolEntry>::iterator CTxMemPoolIter;
+
+struct CompareIteratorByHash
+{
+    bool operator()(const CTxMemPoolIter& a, const CTxMemPoolIter& b) const
+    {
+        return a->first < b->first;
+    }
+};
+
+/** Orders pool entries by the fee rate of the entry with its ancestors, highest first */
+struct CompareTxMemPoolEntryByAncestorFeeRate
+{
+    bool operator()(const CTxMemPoolIter& a, const CTxMemPoolIter& b) const
+    {
+        double f1 = (double)a->second.GetModFeesWithAncestors() * b->second.GetSizeWithAncestors();
+        double f2 = (double)b->second.GetModFeesWithAncestors() * a->second.GetSizeWithAncestors();
+        if (f1 == f2)
+            return a->first < b->first;
+        return f1 > f2;
+    }
+};
+
+/**
+ * Orders pool entries by the higher of the fee rate of the entry alone and
+ * of the entry with its descendants, lowest first: the order to give up
+ * transactions in, as dropping one drops its descendants too.
+ */
+struct CompareTxMemPoolEntryByDescendantScore
+{
+    bool operator()(const CTxMemPoolIter& a, const CTxMemPoolIter& b) const
+    {
+        double f1 = GetScore(a->second);
+        double f2 = GetScore(b->second);
+        if (f1 == f2)
+            return a->first < b->first;
+        return f1 < f2;
+    }
+
+private:
+    static double GetScore(const CTxMemPoolEntry& e)
+    {
+        return std::max((double)e.GetModifiedFee() / e.GetTxSize(), (double)e.GetModFeesWithDescendants() / e.GetSizeWithDescendants());
+    }
+};
+
+/** Orders pool entries by priority as of the last block, highest first */
+struct CompareTxMemPoolEntryByPriority
+{
+    bool operator()(const CTxMemPoolIter& a, const CTxMemPoolIter& b) const
+    {
+        if (a->second.GetIndexPriority() == b->second.GetIndexPriority())
+            return a->first < b->first;
+        return a->second.GetIndexPriority() > b->second.GetIndexPriority();
+    }
 };
 
 class CMinerPolicyEstimator;
@@ -91,13 +180,48 @@ private:
 
     CFeeRate minRelayFee; // Passed to constructor to avoid dependency on main
     uint64_t totalTxSize; // sum of all mempool tx' byte sizes
+    uint64_t cachedInnerUsage; // sum of the entries' and their links' dynamic memory usage
+
+    // Minimum fee rate (per kB) to get in, raised as the pool evicts and decaying after
+    mutable double rollingMinimumFeeRate;
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
 
 public:
+    typedef CTxMemPoolIter txiter;
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
     mutable CCriticalSection cs;
     std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
+    // Secondary indexes over mapTx, kept up to date by the pool: read only
+    std::set<txiter, CompareTxMemPoolEntryByAncestorFeeRate> setByAncestorFeeRate;
+    std::set<txiter, CompareTxMemPoolEntryByDescendantScore> setByDescendantScore;
+    std::set<txiter, CompareTxMemPoolEntryByPriority> setByPriority;
+
+private:
+    // In-pool parents and children of each entry
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+    std::map<txiter, TxLinks, CompareIteratorByHash> mapLinks;
+
+    void UpdateAncestorState(txiter it, int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount);
+    void UpdateDescendantState(txiter it, int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount);
+    void RecalculateAncestorState(txiter it);
+    void RecalculateDescendantState(txiter it);
+    void UpdateParent(txiter entry, txiter parent, bool add);
+    void UpdateChild(txiter entry, txiter child, bool add);
+    void RemoveStaged(const std::vector<txiter>& vRemove, std::list<CTransaction>& removed);
+    void trackPackageRemoved(const CFeeRate& rate);
+
+public:
+    /** Halving time of the rolling minimum fee, once a block has come in since it was raised */
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
 
@@ -127,6 +251,35 @@ public:
     void ApplyDeltas(const uint256 hash, double &dPriorityDelta, CAmount &nFeeDelta);
     void ClearPrioritisation(const uint256 hash);
 
+    /** The in-pool parents or children of an entry */
+    const setEntries& GetMemPoolParents(txiter it) const;
+    const setEntries& GetMemPoolChildren(txiter it) const;
+    /** Collect all in-pool ancestors or descendants of an entry, not including itself */
+    void CalculateMemPoolAncestors(txiter it, setEntries& setAncestors) const;
+    void CalculateDescendants(txiter it, setEntries& setDescendants) const;
+    /**
+     * Collect the in-pool ancestors of a transaction that is not in the pool
+     * yet, checking on the way that adding it keeps within the limits: on its
+     * ancestors, and on the descendants of each of them, itself included.
+     * Returns false, with the limit it would break in errString, if not.
+     */
+    bool CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors,
+                                   uint64_t limitAncestorCount, uint64_t limitAncestorSize,
+                                   uint64_t limitDescendantCount, uint64_t limitDescendantSize,
+                                   std::string& errString);
+
+    /**
+     * Evict the packages with the lowest descendant score, each with its
+     * descendants, until the pool's memory usage is at most sizelimit bytes,
+     * and raise the minimum fee to above theirs.
+     */
+    void TrimToSize(size_t sizelimit, std::list<CTransaction>* pvRemoved = NULL);
+    /**
+     * The minimum fee rate to get into a pool limited to sizelimit bytes:
+     * zero, or the rate of the last eviction, decaying as the pool drains.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
     unsigned long size()
     {
         LOCK(cs);
@@ -138,6 +291,8 @@ public:
         return totalTxSize;
     }
 
+    size_t DynamicMemoryUsage() const;
+
     bool exists(uint256 hash)
     {
         LOCK(cs);
@@ -7,6 +7,7 @@
 #include "wallet/wallet.h"
 
 #include "base58.h"
+#include "blockfilter.h"
 #include "checkpoints.h"
 #include "coincontrol.h"
 #include "consensus/consensus.h"
@@ -15,13 +16,16 @@
 #include "script/script.h"
 #include "script/sign.h"
 #include "timedata.h"
+#include "txdb.h"
 #include "util.h"
 #include "utilmoneystr.h"
  
 #include <assert.h>
+#include <deque>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -33,6 +37,8 @@ unsigned int nTxConfirmTarget = 1;
 bool bSpendZeroConfChange = true;
 bool fSendFreeTransactions = false;
 bool fPayAtLeastCustomFee = true;
+bool fCheckBalances = false;
+int nWalletKeyCheck = DEFAULT_WALLET_KEY_CHECK;
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 CFeeRate CWallet::minTxFee = CFeeRate(100000000);  // Override with -mintxfee
@@ -144,6 +150,80 @@ bool CWallet::LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &meta)
     return true;
 }
 
+namespace {
+
+/** Keys per batch a VerifyKeys thread takes at a time */
+static const size_t KEY_CHECK_BATCH = 256;
+
+/** One VerifyKeys call: the threads taking part claim batches of keys until none are left */
+class CKeyCheckRun
+{
+private:
+    const CKeyStore& keystore;
+    const std::vector<CPubKey>& vPubKeys;
+    boost::mutex mutex;
+    size_t nNext;
+    bool fQuit;
+
+public:
+    std::vector<CPubKey> vBad;
+
+    CKeyCheckRun(const CKeyStore& keystoreIn, const std::vector<CPubKey>& vPubKeysIn) : keystore(keystoreIn), vPubKeys(vPubKeysIn), nNext(0), fQuit(false) {}
+
+    void Run()
+    {
+        while (true) {
+            boost::this_thread::interruption_point();
+            size_t nBegin, nEnd;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (fQuit || nNext >= vPubKeys.size())
+                    return;
+                nBegin = nNext;
+                nEnd = std::min(vPubKeys.size(), nNext + KEY_CHECK_BATCH);
+                nNext = nEnd;
+            }
+            std::vector<CPubKey> vBadBatch;
+            for (size_t i = nBegin; i < nEnd; i++) {
+                CKey key;
+                if (!keystore.GetKey(vPubKeys[i].GetID(), key) || !key.VerifyPubKey(vPubKeys[i]))
+                    vBadBatch.push_back(vPubKeys[i]);
+            }
+            if (!vBadBatch.empty()) {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                vBad.insert(vBad.end(), vBadBatch.begin(), vBadBatch.end());
+            }
+        }
+    }
+
+    void Quit()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+    }
+};
+
+} // anon namespace
+
+void CWallet::VerifyKeys(const std::vector<CPubKey>& vPubKeys, std::vector<CPubKey>& vBad) const
+{
+    CKeyCheckRun run(*this, vPubKeys);
+    boost::thread_group threads;
+    // The calling thread is one of the -par threads, like the master of a
+    // script check; only start helpers for batches it won't get to first
+    for (int i = 1; i < nScriptCheckThreads && (size_t)i * KEY_CHECK_BATCH < vPubKeys.size(); i++)
+        threads.create_thread(boost::bind(&CKeyCheckRun::Run, &run));
+    try {
+        run.Run();
+    } catch (const boost::thread_interrupted&) {
+        run.Quit();
+        threads.join_all();
+        throw;
+    }
+    threads.join_all();
+    vBad = run.vBad;
+}
+
 bool CWallet::LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
     return CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret);
@@ -464,8 +544,16 @@ void CWallet::AddToSpends(const uint256& wtxid)
     if (thisTx.IsCoinBase()) // Coinbases don't spend anything!
         return;
 
+    set<uint256> setSpent;
     BOOST_FOREACH(const CTxIn& txin, thisTx.vin)
+    {
         AddToSpends(txin.prevout, wtxid);
+        setSpent.insert(txin.prevout.hash);
+    }
+
+    // The outputs may no longer count towards the balance
+    BOOST_FOREACH(const uint256& hash, setSpent)
+        UpdateBalance(hash);
 }
 
 bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
@@ -604,6 +692,7 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        fBalanceValid = false;
     }
 }
 
@@ -613,6 +702,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
 
     if (fFromLoadWallet)
     {
+        fBalanceValid = false;
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         AddToSpends(hash);
@@ -627,6 +717,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         bool fInsertedNew = ret.second;
         if (fInsertedNew)
         {
+            wtx.balanceCounted = CWalletBalance();
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext(pwalletdb);
             
@@ -710,6 +801,27 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        UpdateBalance(wtx);
+
+        // Wallet transactions spending it, added before it, may be trusted now
+        if (fInsertedNew)
+        {
+            set<uint256> setSpenders;
+            for (unsigned int i = 0; i < wtx.vout.size(); i++)
+            {
+                pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(COutPoint(hash, i));
+                for (TxSpends::const_iterator it = range.first; it != range.second; ++it)
+                    setSpenders.insert(it->second);
+            }
+            BOOST_FOREACH(const uint256& hashSpender, setSpenders)
+            {
+                map<uint256, CWalletTx>::iterator mi = mapWallet.find(hashSpender);
+                if (mi == mapWallet.end())
+                    continue;
+                mi->second.MarkDirty();
+                UpdateBalance(mi->second);
+            }
+        }
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -764,11 +876,17 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
     // If a transaction changes 'conflicted' state, that changes the balance
     // available of the outputs it spends. So force those to be
     // recomputed, also:
+    set<uint256> setSpent;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
         if (mapWallet.count(txin.prevout.hash))
+        {
             mapWallet[txin.prevout.hash].MarkDirty();
+            setSpent.insert(txin.prevout.hash);
+        }
     }
+    BOOST_FOREACH(const uint256& hash, setSpent)
+        UpdateBalance(hash);
 }
 
 void CWallet::EraseFromWallet(const uint256 &hash)
@@ -778,7 +896,10 @@ void CWallet::EraseFromWallet(const uint256 &hash)
     {
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
+        {
             CWalletDB(strWalletFile).EraseTx(hash);
+            fBalanceValid = false;
+        }
     }
     return;
 }
@@ -1045,46 +1166,314 @@ bool CWalletTx::WriteToDisk(CWalletDB *pwalletdb)
     return pwalletdb->WriteTx(GetHash(), *this);
 }
 
+void CWallet::GetFilterElements(const CKeyStoreSnapshot& keystore, CBlockFilter::ElementSet& elements)
+{
+    // The scripts IsMine() recognises. It also takes a bare multisig of only
+    // our keys for ours, which no list of scripts covers: the filter has the
+    // pay-to-pubkey script of each key of such an output for those.
+    std::set<CKeyID> setKeys;
+    keystore.GetKeys(setKeys);
+    BOOST_FOREACH(const CKeyID& keyid, setKeys) {
+        CScript script = GetScriptForDestination(keyid);
+        elements.insert(CBlockFilter::Element(script.begin(), script.end()));
+        CPubKey pubkey;
+        if (keystore.GetPubKey(keyid, pubkey)) {
+            script = CScript() << ToByteVector(pubkey) << OP_CHECKSIG;
+            elements.insert(CBlockFilter::Element(script.begin(), script.end()));
+        }
+    }
+
+    BOOST_FOREACH(const PAIRTYPE(const CScriptID, CScript)& item, keystore.GetScripts()) {
+        CScript script = GetScriptForDestination(item.first);
+        elements.insert(CBlockFilter::Element(script.begin(), script.end()));
+        elements.insert(CBlockFilter::Element(item.second.begin(), item.second.end()));
+    }
+    BOOST_FOREACH(const CScript& script, keystore.GetWatchOnly())
+        elements.insert(CBlockFilter::Element(script.begin(), script.end()));
+}
+
+namespace {
+
+/** A block on its way through a wallet rescan */
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    CBlock block; //! left empty if the block's filter showed nothing of ours in it
+    bool fMatched;
+    std::vector<char> vMine; //! per transaction: whether it pays to one of our keys or scripts
+
+    CRescanBlock(CBlockIndex* pindexIn) : pindex(pindexIn), fMatched(false) {}
+};
+
+/**
+ * Wallet rescan, split like CBlockImportPipeline: one thread walks the chain
+ * reading blocks, a few more match their outputs against a snapshot of the
+ * wallet's keys, and the thread that started the rescan takes the matched
+ * blocks in chain order and only then locks the wallet to add what was found.
+ * At most RESCAN_PIPELINE_BLOCKS blocks are read but not yet handed out at a
+ * time. With the block filter index, blocks whose filter matches none of the
+ * wallet's scripts are passed on without being read or matched.
+ */
+class CWalletRescanPipeline
+{
+private:
+    const CKeyStore& keystore;
+    const CBlockFilter::ElementSet* pelements; //! wallet scripts to test block filters with, or NULL
+    boost::mutex mutex;
+    boost::condition_variable condRead;  // reader waits for room
+    boost::condition_variable condMatch; // matchers wait for blocks
+    boost::condition_variable condScan;  // scanner waits for the next block to be matched
+    std::deque<boost::shared_ptr<CRescanBlock> > dequeBlocks; // in chain order
+    std::deque<boost::shared_ptr<CRescanBlock> > dequeToMatch;
+    bool fReadDone;
+    bool fQuit;
+    boost::thread_group threads;
+    int nMatchThreads;
+
+    // Stage counters, guarded by mutex
+    uint64_t nBlocksRead;
+    uint64_t nBlocksFiltered;
+    int64_t nFilterMicros;
+    int64_t nReadMicros;
+    int64_t nReadStallMicros;
+    uint64_t nBlocksMatched;
+    uint64_t nTxMatched;
+    int64_t nMatchMicros;
+    int64_t nScanStallMicros;
+
+    void ThreadRead(CBlockIndex* pindex)
+    {
+        RenameThread("lycancoin-rescanread");
+        int64_t nStart = GetTimeMicros();
+        while (pindex) {
+            boost::this_thread::interruption_point();
+            boost::shared_ptr<CRescanBlock> prescan(new CRescanBlock(pindex));
+            int64_t nFilterStart = GetTimeMicros();
+            CBlockFilter filter;
+            if (pelements && pblockfilterdb->ReadFilter(pindex->GetBlockHash(), filter) && !filter.MatchAny(*pelements))
+                prescan->fMatched = true;
+            int64_t nFilterTime = GetTimeMicros() - nFilterStart;
+            if (!prescan->fMatched)
+                ReadBlockFromDisk(prescan->block, pindex);
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                nFilterMicros += nFilterTime;
+                int64_t nStall = GetTimeMicros();
+                while (!fQuit && dequeBlocks.size() >= RESCAN_PIPELINE_BLOCKS)
+                    condRead.wait(lock);
+                nReadStallMicros += GetTimeMicros() - nStall;
+                if (fQuit)
+                    break;
+                dequeBlocks.push_back(prescan);
+                if (prescan->fMatched) {
+                    nBlocksFiltered++;
+                    if (prescan == dequeBlocks.front())
+                        condScan.notify_one();
+                } else {
+                    dequeToMatch.push_back(prescan);
+                    nBlocksRead++;
+                    condMatch.notify_one();
+                }
+            }
+            {
+                // Blocks connected meanwhile are scanned too; if a reorg took
+                // this one out of the chain, carry on from the fork
+                LOCK(cs_main);
+                CBlockIndex* pindexNext = chainActive.Next(pindex);
+                if (!pindexNext && !chainActive.Contains(pindex))
+                    pindexNext = chainActive.Next(chainActive.FindFork(pindex));
+                pindex = pindexNext;
+            }
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nReadMicros = GetTimeMicros() - nStart - nReadStallMicros - nFilterMicros;
+        fReadDone = true;
+        condMatch.notify_all();
+        condScan.notify_all();
+    }
+
+    void ThreadMatch()
+    {
+        RenameThread("lycancoin-rescanmatch");
+        while (true) {
+            boost::shared_ptr<CRescanBlock> prescan;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fQuit && !fReadDone && dequeToMatch.empty())
+                    condMatch.wait(lock);
+                if (fQuit || dequeToMatch.empty())
+                    return;
+                prescan = dequeToMatch.front();
+                dequeToMatch.pop_front();
+            }
+            int64_t nStart = GetTimeMicros();
+            unsigned int nMine = 0;
+            prescan->vMine.assign(prescan->block.vtx.size(), false);
+            for (unsigned int i = 0; i < prescan->block.vtx.size(); i++) {
+                BOOST_FOREACH(const CTxOut& txout, prescan->block.vtx[i].vout) {
+                    if (::IsMine(keystore, txout.scriptPubKey) != ISMINE_NO) {
+                        prescan->vMine[i] = true;
+                        nMine++;
+                        break;
+                    }
+                }
+            }
+            int64_t nTime = GetTimeMicros() - nStart;
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            prescan->fMatched = true;
+            nBlocksMatched++;
+            nTxMatched += nMine;
+            nMatchMicros += nTime;
+            if (prescan == dequeBlocks.front())
+                condScan.notify_one();
+        }
+    }
+
+public:
+    CWalletRescanPipeline(const CKeyStore& keystoreIn, const CBlockFilter::ElementSet* pelementsIn, CBlockIndex* pindexStart) :
+        keystore(keystoreIn), pelements(pelementsIn), fReadDone(false), fQuit(false),
+        nBlocksRead(0), nBlocksFiltered(0), nFilterMicros(0), nReadMicros(0), nReadStallMicros(0), nBlocksMatched(0), nTxMatched(0), nMatchMicros(0), nScanStallMicros(0)
+    {
+        nMatchThreads = std::max(1, nScriptCheckThreads - 1);
+        threads.create_thread(boost::bind(&CWalletRescanPipeline::ThreadRead, this, pindexStart));
+        for (int i = 0; i < nMatchThreads; i++)
+            threads.create_thread(boost::bind(&CWalletRescanPipeline::ThreadMatch, this));
+    }
+
+    ~CWalletRescanPipeline()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+            condRead.notify_all();
+            condMatch.notify_all();
+        }
+        threads.interrupt_all();
+        boost::this_thread::disable_interruption di;
+        threads.join_all();
+    }
+
+    /**
+     * Wait for the next block in chain order to be matched, then take it and
+     * every matched block right behind it. Returns false once the chain is
+     * exhausted.
+     */
+    bool Next(std::vector<boost::shared_ptr<CRescanBlock> >& vBatch)
+    {
+        vBatch.clear();
+        boost::unique_lock<boost::mutex> lock(mutex);
+        int64_t nStall = GetTimeMicros();
+        while (!(fReadDone && dequeBlocks.empty()) && (dequeBlocks.empty() || !dequeBlocks.front()->fMatched))
+            condScan.wait(lock);
+        nScanStallMicros += GetTimeMicros() - nStall;
+        while (!dequeBlocks.empty() && dequeBlocks.front()->fMatched) {
+            vBatch.push_back(dequeBlocks.front());
+            dequeBlocks.pop_front();
+        }
+        condRead.notify_one();
+        return !vBatch.empty();
+    }
+
+    void LogStats(int64_t nTotalMicros, uint64_t nBlocksScanned)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        LogPrintf("Rescan: %u blocks in %.2fs (%.0f blocks/s); %u passed over by their filter in %.2fs; read %u at %.0f blocks/s, %.2fs waiting for room; "
+                  "matched at %.0f blocks/s on %d threads, %u transactions ours; %.2fs waiting for matched blocks\n",
+            nBlocksScanned, nTotalMicros * 0.000001, nBlocksScanned * 1000000.0 / std::max(nTotalMicros, (int64_t)1),
+            nBlocksFiltered, nFilterMicros * 0.000001,
+            nBlocksRead, nBlocksRead * 1000000.0 / std::max(nReadMicros, (int64_t)1), nReadStallMicros * 0.000001,
+            nBlocksMatched * 1000000.0 * nMatchThreads / std::max(nMatchMicros, (int64_t)1), nMatchThreads, nTxMatched,
+            nScanStallMicros * 0.000001);
+    }
+};
+
+} // anon namespace
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
+    int64_t nStart = GetTimeMicros();
     int64_t nNow = GetTime();
+    uint64_t nBlocksScanned = 0;
 
     CBlockIndex* pindex = pindexStart;
+    double dProgressStart, dProgressTip;
     {
-        LOCK2(cs_main, cs_wallet);
-        
+        LOCK(cs_main);
+
         // no need to read and scan block, if block was created before
         // our wallet birthday (as adjusted for block time variability)
         while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex)
-        {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+        dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
+    }
+    if (!pindex)
+        return 0;
+    CBlockIndex* pindexFirst = pindex;
+
+    ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+    // Outputs are matched against the keys we have now; keys added during
+    // the rescan get their transactions through SyncTransaction instead
+    CKeyStoreSnapshot keystore(*this);
+    CBlockFilter::ElementSet elements;
+    if (pblockfilterdb)
+        GetFilterElements(keystore, elements);
+    {
+        CWalletRescanPipeline pipeline(keystore, pblockfilterdb ? &elements : NULL, pindex);
+        std::vector<boost::shared_ptr<CRescanBlock> > vBatch;
+        while (pipeline.Next(vBatch))
+        {
+            LOCK2(cs_main, cs_wallet);
+            BOOST_FOREACH(const boost::shared_ptr<CRescanBlock>& prescan, vBatch)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                // Reorganized away while in the pipeline; the reader has moved on to the new branch
+                if (!chainActive.Contains(prescan->pindex))
+                    continue;
+                const CBlock& block = prescan->block;
+                for (unsigned int i = 0; i < block.vtx.size(); i++)
+                {
+                    // Spends of our outputs need the wallet as it is at this
+                    // block, so only those are looked for here
+                    const CTransaction& tx = block.vtx[i];
+                    if (!prescan->vMine[i] && !mapWallet.count(tx.GetHash()) && !IsFromMe(tx))
+                        continue;
+                    if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                        ret++;
+                }
+                nBlocksScanned++;
+                pindex = prescan->pindex;
             }
-            pindex = chainActive.Next(pindex);
+
+            if (dProgressTip - dProgressStart > 0.0)
+                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+                LogPrintf("Still rescanning. At block %d. Progress=%f, %.0f blocks/s\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex),
+                    nBlocksScanned * 1000000.0 / std::max(GetTimeMicros() - nStart, (int64_t)1));
             }
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
-    }
+        pipeline.LogStats(GetTimeMicros() - nStart, nBlocksScanned);
+    }
+    if (pblockfilterdb && LogAcceptCategory("bench")) {
+        // What the filters saved: read and match the same blocks again without them
+        int64_t nFiltered = GetTimeMicros() - nStart;
+        int64_t nUnfilteredStart = GetTimeMicros();
+        uint64_t nBlocksUnfiltered = 0;
+        CWalletRescanPipeline pipeline(keystore, NULL, pindexFirst);
+        std::vector<boost::shared_ptr<CRescanBlock> > vBatch;
+        while (pipeline.Next(vBatch))
+            nBlocksUnfiltered += vBatch.size();
+        LogPrint("bench", "Rescan: %u blocks in %.2fms with the block filter index, %u blocks in %.2fms reading every block\n",
+            nBlocksScanned, 0.001 * nFiltered, nBlocksUnfiltered, 0.001 * (GetTimeMicros() - nUnfilteredStart));
+    }
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     return ret;
 }
 
@@ -1333,6 +1722,36 @@ bool CWalletTx::IsTrusted() const
     return true;
 }
 
+CWalletBalance CWalletTx::GetBalance() const
+{
+    CWalletBalance balance;
+    bool fTrusted = IsTrusted();
+    if (fTrusted)
+    {
+        balance.nTrusted = GetAvailableCredit(false);
+        balance.nWatchOnlyTrusted = GetAvailableWatchOnlyCredit(false);
+    }
+    if (!IsFinalTx(*this) || (!fTrusted && GetDepthInMainChain() == 0))
+    {
+        balance.nUntrustedPending = GetAvailableCredit(false);
+        balance.nWatchOnlyUntrustedPending = GetAvailableWatchOnlyCredit(false);
+    }
+    balance.nImmature = GetImmatureCredit(false);
+    balance.nWatchOnlyImmature = GetImmatureWatchOnlyCredit(false);
+    return balance;
+}
+
+bool CWalletTx::IsBalancePending() const
+{
+    // Confirmed and conflicted transactions only change through SyncTransaction,
+    // but mempool transactions can be evicted and coinbases mature silently
+    if (!IsFinalTx(*this))
+        return true;
+    if (IsCoinBase())
+        return GetBlocksToMaturity() > 0 && IsInMainChain();
+    return GetDepthInMainChain() == 0;
+}
+
 
 
 std::vector<uint256> CWallet::ResendWalletTransactionsBefore(int64_t nTime)
@@ -1393,94 +1812,176 @@ void CWallet::ResendWalletTransactions(int64_t nBestBlockTime)
 //
 
 
-CAmount CWallet::GetBalance() const
+void CWallet::UpdateBalance(const CWalletTx& wtx) const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
+    if (!fBalanceValid)
+        return;
+    AssertLockHeld(cs_wallet);
+
+    balanceTotal -= wtx.balanceCounted;
+    wtx.balanceCounted = wtx.GetBalance();
+    balanceTotal += wtx.balanceCounted;
+
+    const uint256& hash = wtx.GetHash();
+    if (wtx.IsBalancePending())
+        setBalancePending.insert(hash);
+    else
+        setBalancePending.erase(hash);
+
+    // Same rules as AvailableCoins used to apply to every output in mapWallet
+    int nDepth = wtx.GetDepthInMainChain();
+    bool fAvailable = nDepth >= 0 && IsFinalTx(wtx) && !(wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0);
+    bool fTrusted = fAvailable && wtx.IsTrusted();
+    int nHeight = nDepth > 0 ? chainActive.Height() - nDepth + 1 : -1;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        isminetype mine = fAvailable ? IsMine(wtx.vout[i]) : ISMINE_NO;
+        if (mine != ISMINE_NO && !IsSpent(hash, i))
+            mapUnspent[COutPoint(hash, i)] = CWalletUnspent(&wtx, nHeight, fTrusted, mine);
+        else
+            mapUnspent.erase(COutPoint(hash, i));
     }
+}
 
-    return nTotal;
+void CWallet::UpdateBalance(const uint256& hash) const
+{
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi != mapWallet.end())
+        UpdateBalance(mi->second);
 }
 
-CAmount CWallet::GetUnconfirmedBalance() const
+void CWallet::SyncBalances() const
 {
-    CAmount nTotal = 0;
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (!fBalanceValid)
     {
-        LOCK2(cs_main, cs_wallet);
+        int64_t nStart = GetTimeMillis();
+        balanceTotal = CWalletBalance();
+        setBalancePending.clear();
+        mapUnspent.clear();
+        fBalanceValid = true;
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
+            it->second.balanceCounted = CWalletBalance();
+            UpdateBalance(it->second);
         }
+        pindexBalanceTip = NULL;
+        LogPrint("bench", "%s: counted %u transactions, %u pending, %u unspent outputs: %dms\n", __func__,
+            mapWallet.size(), setBalancePending.size(), mapUnspent.size(), GetTimeMillis() - nStart);
     }
-    return nTotal;
-}
 
-CAmount CWallet::GetImmatureBalance() const
-{
-    CAmount nTotal = 0;
+    if (pindexBalanceTip != chainActive.Tip() || nBalanceMempoolUpdated != mempool.GetTransactionsUpdated() || fBalancePendingNonFinal)
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        pindexBalanceTip = chainActive.Tip();
+        nBalanceMempoolUpdated = mempool.GetTransactionsUpdated();
+        fBalancePendingNonFinal = false;
+
+        // Re-counting erases from setBalancePending, so walk a copy
+        std::vector<uint256> vPending(setBalancePending.begin(), setBalancePending.end());
+        BOOST_FOREACH(const uint256& hash, vPending)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+            if (mi == mapWallet.end())
+                continue;
+            const CWalletTx& wtx = mi->second;
+            UpdateBalance(wtx);
+            if (!IsFinalTx(wtx))
+                fBalancePendingNonFinal = true;
+
+            // Dropped out of the mempool: the outputs it spent are unspent again
+            if (!wtx.IsCoinBase() && wtx.GetDepthInMainChain() < 0)
+            {
+                set<uint256> setSpent;
+                BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+                    setSpent.insert(txin.prevout.hash);
+                BOOST_FOREACH(const uint256& hash, setSpent)
+                    UpdateBalance(hash);
+            }
         }
     }
-    return nTotal;
-}
 
-CAmount CWallet::GetWatchOnlyBalance() const
-{
-    CAmount nTotal = 0;
+    if (fCheckBalances)
     {
-        LOCK2(cs_main, cs_wallet);
+        CWalletBalance balanceScan;
+        unsigned int nUnspentScan = 0;
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
+            const CWalletTx& wtx = it->second;
+            balanceScan += wtx.GetBalance();
+
+            int nDepth = wtx.GetDepthInMainChain();
+            if (nDepth < 0 || !IsFinalTx(wtx) || (wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0))
+                continue;
+            for (unsigned int i = 0; i < wtx.vout.size(); i++)
+            {
+                isminetype mine = IsMine(wtx.vout[i]);
+                if (mine == ISMINE_NO || IsSpent(it->first, i))
+                    continue;
+                nUnspentScan++;
+                map<COutPoint, CWalletUnspent>::const_iterator mi = mapUnspent.find(COutPoint(it->first, i));
+                assert(mi != mapUnspent.end());
+                assert(mi->second.tx == &wtx);
+                assert(mi->second.mine == mine);
+                assert(mi->second.fTrusted == wtx.IsTrusted());
+                assert(mi->second.nHeight == (nDepth > 0 ? chainActive.Height() - nDepth + 1 : -1));
+            }
+        }
+        assert(nUnspentScan == mapUnspent.size());
+
+        if (balanceScan != balanceTotal)
+        {
+            LogPrintf("%s: running totals %s/%s/%s watch-only %s/%s/%s, full scan %s/%s/%s watch-only %s/%s/%s\n", __func__,
+                FormatMoney(balanceTotal.nTrusted), FormatMoney(balanceTotal.nUntrustedPending), FormatMoney(balanceTotal.nImmature),
+                FormatMoney(balanceTotal.nWatchOnlyTrusted), FormatMoney(balanceTotal.nWatchOnlyUntrustedPending), FormatMoney(balanceTotal.nWatchOnlyImmature),
+                FormatMoney(balanceScan.nTrusted), FormatMoney(balanceScan.nUntrustedPending), FormatMoney(balanceScan.nImmature),
+                FormatMoney(balanceScan.nWatchOnlyTrusted), FormatMoney(balanceScan.nWatchOnlyUntrustedPending), FormatMoney(balanceScan.nWatchOnlyImmature));
+            assert(balanceScan == balanceTotal);
         }
     }
+}
 
-    return nTotal;
+const CWalletBalance& CWallet::GetBalances() const
+{
+    SyncBalances();
+    return balanceTotal;
+}
+
+CAmount CWallet::GetBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nTrusted;
+}
+
+CAmount CWallet::GetUnconfirmedBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nUntrustedPending;
+}
+
+CAmount CWallet::GetImmatureBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nImmature;
+}
+
+CAmount CWallet::GetWatchOnlyBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchOnlyTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchOnlyUntrustedPending;
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchOnlyImmature;
 }
 
 // populate vCoins with vector of available COutputs.
@@ -1489,37 +1990,33 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
     vCoins.clear();
 
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        LOCK2(cs_main, cs_wallet);
+        SyncBalances();
+        int nHeight = chainActive.Height();
+        for (map<COutPoint, CWalletUnspent>::const_iterator it = mapUnspent.begin(); it != mapUnspent.end(); ++it)
         {
-        	   const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const COutPoint& outpoint = it->first;
+            const CWalletUnspent& unspent = it->second;
 
-            if (!IsFinalTx(*pcoin))
+            if (fOnlyConfirmed && !unspent.fTrusted)
                 continue;
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
+            if (unspent.tx->vout[outpoint.n].nValue <= 0 && !fIncludeZeroValue)
                 continue;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+            if (IsLockedCoin(outpoint.hash, outpoint.n))
                 continue;
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 0)
+            if (coinControl && coinControl->HasSelected() && !coinControl->IsSelected(outpoint.hash, outpoint.n))
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                        vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
-            }
+            int nDepth = unspent.nHeight < 0 ? 0 : nHeight - unspent.nHeight + 1;
+            vCoins.push_back(COutput(unspent.tx, outpoint.n, nDepth, (unspent.mine & ISMINE_SPENDABLE) != ISMINE_NO));
         }
     }
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+static void ApproximateBestSubset(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
                                   vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -1666,11 +2163,8 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
     return true;
 }
 
-bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl) const
+bool CWallet::SelectCoins(const vector<COutput>& vCoins, const CAmount& nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl) const
 {
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl);
-
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected())
     {
@@ -1743,9 +2237,18 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend,
     {
         LOCK2(cs_main, cs_wallet);
         {
+            // The candidates don't change between fee iterations
+            int64_t nStart = GetTimeMicros();
+            vector<COutput> vAvailableCoins;
+            AvailableCoins(vAvailableCoins, true, coinControl);
+            int64_t nTimeAvailable = GetTimeMicros() - nStart;
+            int64_t nTimeSelect = 0;
+            int nPasses = 0;
+
             nFeeRet = 0;
      			while (true)
             {
+                nPasses++;
                 txNew.vin.clear();
                 txNew.vout.clear();
                 wtxNew.fFromMe = true;
@@ -1792,7 +2295,10 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend,
                 // Choose coins to use
                 set<pair<const CWalletTx*,unsigned int> > setCoins;
                 CAmount nValueIn = 0;
-                if (!SelectCoins(nTotalValue, setCoins, nValueIn, coinControl))
+                int64_t nTimeSelectStart = GetTimeMicros();
+                bool fSelected = SelectCoins(vAvailableCoins, nTotalValue, setCoins, nValueIn, coinControl);
+                nTimeSelect += GetTimeMicros() - nTimeSelectStart;
+                if (!fSelected)
                 {
                     strFailReason = _("Insufficient funds");
                     return false;
@@ -1946,6 +2452,8 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend,
                 nFeeRet = nFeeNeeded;
                 continue;
             }
+            LogPrint("bench", "%s: %u available coins: %.2fms, coin selection (%d passes): %.2fms, total %.2fms\n", __func__,
+                vAvailableCoins.size(), nTimeAvailable * 0.001, nPasses, nTimeSelect * 0.001, (GetTimeMicros() - nStart) * 0.001);
         }
     }
 
@@ -2213,6 +2721,13 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
             throw runtime_error("ReserveKeyFromKeyPool() : read failed");
         if (!HaveKey(keypool.vchPubKey.GetID()))
             throw runtime_error("ReserveKeyFromKeyPool() : unknown key in key pool");
+        // Loaded without a checksum, and the background check hasn't got to it or failed it
+        std::map<CKeyID, CPubKey>::const_iterator mi = mapKeysUnverified.find(keypool.vchPubKey.GetID());
+        if (mi != mapKeysUnverified.end()) {
+            CKey key;
+            if (!GetKey(mi->first, key) || !key.VerifyPubKey(mi->second))
+                throw runtime_error("ReserveKeyFromKeyPool() : key in key pool fails verification");
+        }
         assert(keypool.vchPubKey.IsValid());
         LogPrintf("keypool reserve %d\n", nIndex);
     }
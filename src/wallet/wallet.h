@@ -7,6 +7,7 @@
 #define BITCOIN_WALLET_WALLET_H
 
 #include "amount.h"
+#include "blockfilter.h"
 #include "key.h"
 #include "keystore.h"
 #include "primitives/block.h"
@@ -35,6 +36,8 @@ extern unsigned int nTxConfirmTarget;
 extern bool bSpendZeroConfChange;
 extern bool fSendFreeTransactions;
 extern bool fPayAtLeastCustomFee;
+extern bool fCheckBalances;
+extern int nWalletKeyCheck;
 
 // -paytxfee default
 static const CAmount DEFAULT_TRANSACTION_FEE = 0;
@@ -46,6 +49,10 @@ static const CAmount DEFAULT_TRANSACTION_MAXFEE = 1000 * COIN;
 static const CAmount nHighTransactionMaxFeeWarning = 1000000 * nHighTransactionFeeWarning;
 // Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
+//! -walletkeycheck default: check keys stored without a checksum in the background
+static const int DEFAULT_WALLET_KEY_CHECK = 1;
+//! Maximum number of blocks read and matched ahead of the wallet during a rescan
+static const unsigned int RESCAN_PIPELINE_BLOCKS = 64;
 
 class CAccountingEntry;
 class CBlockIndex;
@@ -140,6 +147,54 @@ struct COutputEntry
     int vout;
 };
 
+/** The six balances reported by CWallet, or one transaction's share of them */
+struct CWalletBalance
+{
+    CAmount nTrusted;
+    CAmount nUntrustedPending;
+    CAmount nImmature;
+    CAmount nWatchOnlyTrusted;
+    CAmount nWatchOnlyUntrustedPending;
+    CAmount nWatchOnlyImmature;
+
+    CWalletBalance() : nTrusted(0), nUntrustedPending(0), nImmature(0),
+        nWatchOnlyTrusted(0), nWatchOnlyUntrustedPending(0), nWatchOnlyImmature(0) {}
+
+    CWalletBalance& operator+=(const CWalletBalance& b)
+    {
+        nTrusted += b.nTrusted;
+        nUntrustedPending += b.nUntrustedPending;
+        nImmature += b.nImmature;
+        nWatchOnlyTrusted += b.nWatchOnlyTrusted;
+        nWatchOnlyUntrustedPending += b.nWatchOnlyUntrustedPending;
+        nWatchOnlyImmature += b.nWatchOnlyImmature;
+        return *this;
+    }
+
+    CWalletBalance& operator-=(const CWalletBalance& b)
+    {
+        nTrusted -= b.nTrusted;
+        nUntrustedPending -= b.nUntrustedPending;
+        nImmature -= b.nImmature;
+        nWatchOnlyTrusted -= b.nWatchOnlyTrusted;
+        nWatchOnlyUntrustedPending -= b.nWatchOnlyUntrustedPending;
+        nWatchOnlyImmature -= b.nWatchOnlyImmature;
+        return *this;
+    }
+
+    friend bool operator==(const CWalletBalance& a, const CWalletBalance& b)
+    {
+        return a.nTrusted == b.nTrusted && a.nUntrustedPending == b.nUntrustedPending && a.nImmature == b.nImmature &&
+               a.nWatchOnlyTrusted == b.nWatchOnlyTrusted && a.nWatchOnlyUntrustedPending == b.nWatchOnlyUntrustedPending &&
+               a.nWatchOnlyImmature == b.nWatchOnlyImmature;
+    }
+
+    friend bool operator!=(const CWalletBalance& a, const CWalletBalance& b)
+    {
+        return !(a == b);
+    }
+};
+
 /** A transaction with a merkle branch linking it to the block chain. */
 class CMerkleTx : public CTransaction
 {
@@ -236,6 +291,7 @@ public:
     mutable CAmount nImmatureWatchCreditCached;
     mutable CAmount nAvailableWatchCreditCached;
     mutable CAmount nChangeCached;
+    mutable CWalletBalance balanceCounted; //! share of the wallet's running balance totals
 
     CWalletTx()
     {
@@ -284,6 +340,7 @@ public:
         nAvailableWatchCreditCached = 0;
         nImmatureWatchCreditCached = 0;
         nChangeCached = 0;
+        balanceCounted = CWalletBalance();
         nOrderPos = -1;
     }
 
@@ -372,6 +429,11 @@ public:
 
     bool IsTrusted() const;
 
+    //! this transaction's share of the wallet balances, from fresh available credit
+    CWalletBalance GetBalance() const;
+    //! whether GetBalance() can change without the wallet being told (mempool eviction, maturity, lock time)
+    bool IsBalancePending() const;
+
     bool WriteToDisk(CWalletDB *pwalletdb);
 
     int64_t GetTxTime() const;
@@ -385,6 +447,19 @@ public:
 
 
 
+/** An output of ours that nothing in the wallet spends, as indexed in CWallet::mapUnspent */
+struct CWalletUnspent
+{
+    const CWalletTx* tx;
+    int nHeight; //! height of the block containing tx, -1 while it is unconfirmed
+    bool fTrusted;
+    isminetype mine;
+
+    CWalletUnspent() : tx(NULL), nHeight(-1), fTrusted(false), mine(ISMINE_NO) {}
+    CWalletUnspent(const CWalletTx* txIn, int nHeightIn, bool fTrustedIn, isminetype mineIn) :
+        tx(txIn), nHeight(nHeightIn), fTrusted(fTrustedIn), mine(mineIn) {}
+};
+
 class COutput
 {
 public:
@@ -439,7 +514,7 @@ public:
 class CWallet : public CCryptoKeyStore, public CValidationInterface
 {
 private:
-    bool SelectCoins(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl *coinControl = NULL) const;
+    bool SelectCoins(const std::vector<COutput>& vCoins, const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl *coinControl = NULL) const;
 
     CWalletDB *pwalletdbEncryption;
 
@@ -465,6 +540,32 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Running totals of every transaction's GetBalance(), so the balance
+     * getters don't have to walk mapWallet. Each transaction remembers what
+     * it added in balanceCounted and is re-counted when it, or the spending
+     * state of its outputs, changes. Transactions whose share can change
+     * without notice are kept in setBalancePending and re-counted when the
+     * tip or the mempool moves. fBalanceValid is cleared whenever the totals
+     * have to be rebuilt from scratch (wallet load, key imports, erases).
+     *
+     * Re-counting a transaction also refreshes its outputs in mapUnspent,
+     * the outputs AvailableCoins may hand out, so that doesn't walk
+     * mapWallet either. Entries keep the confirming block height rather
+     * than the depth, which changes with every block.
+     */
+    mutable CWalletBalance balanceTotal;
+    mutable bool fBalanceValid;
+    mutable std::set<uint256> setBalancePending;
+    mutable std::map<COutPoint, CWalletUnspent> mapUnspent;
+    mutable const CBlockIndex* pindexBalanceTip;
+    mutable unsigned int nBalanceMempoolUpdated;
+    mutable bool fBalancePendingNonFinal;
+    void UpdateBalance(const CWalletTx& wtx) const;
+    void UpdateBalance(const uint256& hash) const;
+    void SyncBalances() const;
+    const CWalletBalance& GetBalances() const;
+
 public:
     /*
      * Main wallet lock.
@@ -480,6 +581,8 @@ public:
 
     std::set<int64_t> setKeyPool;
     std::map<CKeyID, CKeyMetadata> mapKeyMetadata;
+    //! Keys loaded without a checksum and not yet checked against their public key (-walletkeycheck=1)
+    std::map<CKeyID, CPubKey> mapKeysUnverified;
 
     typedef std::map<unsigned int, CMasterKey> MasterKeyMap;
     MasterKeyMap mapMasterKeys;
@@ -516,6 +619,10 @@ public:
         nLastResend = 0;
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
+        fBalanceValid = false;
+        pindexBalanceTip = NULL;
+        nBalanceMempoolUpdated = 0;
+        fBalancePendingNonFinal = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -556,6 +663,9 @@ public:
     bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
     // Load metadata (used by LoadWallet)
     bool LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &metadata);
+    // Check that our private keys for these public keys sign for them, on this thread and
+    // nScriptCheckThreads more, and return the ones that don't
+    void VerifyKeys(const std::vector<CPubKey>& vPubKeys, std::vector<CPubKey>& vBad) const;
 
     bool LoadMinVersion(int nVersion) { AssertLockHeld(cs_wallet); nWalletVersion = nVersion; nWalletMaxVersion = std::max(nWalletMaxVersion, nVersion); return true; }
 
@@ -606,6 +716,9 @@ public:
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256 &hash);
+    //! output scripts paying to the snapshot's keys and scripts, and its watch-only ones, for testing block filters
+    static void GetFilterElements(const CKeyStoreSnapshot& keystore, CBlockFilter::ElementSet& elements);
+    //! takes cs_main and cs_wallet itself, a batch of blocks at a time, so must not be called with cs_main held
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(int64_t nBestBlockTime);
@@ -73,13 +73,20 @@ bool CWalletDB::WriteKey(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey, c
                keyMeta, false))
         return false;
 
+    return WriteKeyChecksummed(vchPubKey, vchPrivKey, false);
+}
+
+bool CWalletDB::WriteKeyChecksummed(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey, bool fOverwrite)
+{
+    nWalletDBUpdated++;
+
     // hash pubkey/privkey to accelerate wallet load
     std::vector<unsigned char> vchKey;
     vchKey.reserve(vchPubKey.size() + vchPrivKey.size());
     vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
     vchKey.insert(vchKey.end(), vchPrivKey.begin(), vchPrivKey.end());
 
-    return Write(std::make_pair(std::string("key"), vchPubKey), std::make_pair(vchPrivKey, Hash(vchKey.begin(), vchKey.end())), false);
+    return Write(std::make_pair(std::string("key"), vchPubKey), std::make_pair(vchPrivKey, Hash(vchKey.begin(), vchKey.end())), fOverwrite);
 }
 
 bool CWalletDB::WriteCryptedKey(const CPubKey& vchPubKey, 
@@ -333,12 +340,19 @@ public:
     bool fAnyUnordered;
     int nFileVersion;
     vector<uint256> vWalletUpgrade;
+    // Leave checking plaintext keys against their public key to the caller,
+    // through vKeysToCheck: those without a checksum, or all if fCheckAllKeys
+    bool fDeferKeyCheck;
+    bool fCheckAllKeys;
+    vector<CPubKey> vKeysToCheck;
 
     CWalletScanState() {
         nKeys = nCKeys = nKeyMeta = 0;
         fIsEncrypted = false;
         fAnyUnordered = false;
         nFileVersion = 0;
+        fDeferKeyCheck = false;
+        fCheckAllKeys = false;
     }
 };
 
@@ -481,11 +495,13 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
                 fSkipCheck = true;
             }
 
-            if (!key.Load(pkey, vchPubKey, fSkipCheck))
+            if (!key.Load(pkey, vchPubKey, fSkipCheck || wss.fDeferKeyCheck))
             {
                 strErr = "Error reading wallet database: CPrivKey corrupt";
                 return false;
             }
+            if (wss.fDeferKeyCheck && (!fSkipCheck || wss.fCheckAllKeys))
+                wss.vKeysToCheck.push_back(vchPubKey);
             if (!pwallet->LoadKey(key, vchPubKey))
             {
                 strErr = "Error reading wallet database: LoadKey failed";
@@ -606,9 +622,16 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
     CWalletScanState wss;
+    wss.fDeferKeyCheck = true;
+    wss.fCheckAllKeys = nWalletKeyCheck >= 2;
     bool fNoncriticalErrors = false;
     DBErrors result = DB_LOAD_OK;
 
+    // Records and time spent per record type, and reading the database
+    map<string, pair<unsigned int, int64_t> > mapRecordStats;
+    int64_t nReadMicros = 0;
+    int64_t nLoadStart = GetTimeMicros();
+
     try {
         LOCK(pwallet->cs_wallet);
         int nMinVersion = 0;
@@ -632,7 +655,9 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             // Read next record
             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
             CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int64_t nTime = GetTimeMicros();
             int ret = ReadAtCursor(pcursor, ssKey, ssValue);
+            nReadMicros += GetTimeMicros() - nTime;
             if (ret == DB_NOTFOUND)
                 break;
             else if (ret != 0)
@@ -643,7 +668,12 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 
             // Try to be tolerant of single corrupt records:
             string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
+            nTime = GetTimeMicros();
+            bool fReadOK = ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr);
+            pair<unsigned int, int64_t>& stats = mapRecordStats[strType];
+            stats.first++;
+            stats.second += GetTimeMicros() - nTime;
+            if (!fReadOK)
             {
                 // losing keys is considered a catastrophic error, anything else
                 // we assume the user can live with:
@@ -662,6 +692,31 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 LogPrintf("%s\n", strErr);
         }
         pcursor->close();
+
+        std::string strStats;
+        for (map<string, pair<unsigned int, int64_t> >::const_iterator it = mapRecordStats.begin(); it != mapRecordStats.end(); it++)
+            strStats += strprintf(", %s %u in %.2fms", it->first, it->second.first, it->second.second * 0.001);
+        LogPrintf("Wallet records read in %.2fms: %.2fms in the database%s\n", (GetTimeMicros() - nLoadStart) * 0.001, nReadMicros * 0.001, strStats);
+
+        // Keys not checked on the way in: check them all now, leave them to
+        // ThreadVerifyWalletKeys (ReserveKeyFromKeyPool checks any it hands
+        // out before then), or trust them
+        if (!wss.vKeysToCheck.empty() && nWalletKeyCheck >= 2) {
+            int64_t nTime = GetTimeMicros();
+            vector<CPubKey> vBad;
+            pwallet->VerifyKeys(wss.vKeysToCheck, vBad);
+            LogPrintf("Checked %u wallet keys in %.2fms on %d threads\n", wss.vKeysToCheck.size(), (GetTimeMicros() - nTime) * 0.001, std::max(1, nScriptCheckThreads));
+            BOOST_FOREACH(const CPubKey& pubkey, vBad)
+                LogPrintf("Error reading wallet database: CPrivKey for %s corrupt\n", CBitcoinAddress(pubkey.GetID()).ToString());
+            if (!vBad.empty())
+                result = DB_CORRUPT;
+        } else if (!wss.vKeysToCheck.empty() && nWalletKeyCheck == 1) {
+            BOOST_FOREACH(const CPubKey& pubkey, wss.vKeysToCheck)
+                pwallet->mapKeysUnverified[pubkey.GetID()] = pubkey;
+            LogPrintf("%u wallet keys without a checksum, to be checked in the background\n", wss.vKeysToCheck.size());
+        } else if (!wss.vKeysToCheck.empty()) {
+            LogPrintf("%u wallet keys without a checksum, not checked (-walletkeycheck=0)\n", wss.vKeysToCheck.size());
+        }
     }
     catch (const boost::thread_interrupted&) {
         throw;
@@ -786,6 +841,57 @@ DBErrors CWalletDB::ZapWalletTx(CWallet* pwallet, vector<CWalletTx>& vWtx)
     return DB_LOAD_OK;
 }
 
+void ThreadVerifyWalletKeys(CWallet* pwallet)
+{
+    RenameThread("lycancoin-keycheck");
+
+    std::vector<CPubKey> vPubKeys;
+    {
+        LOCK(pwallet->cs_wallet);
+        // Plaintext keys in an encrypted wallet can't be looked up to check
+        if (pwallet->IsCrypted())
+            pwallet->mapKeysUnverified.clear();
+        for (map<CKeyID, CPubKey>::const_iterator it = pwallet->mapKeysUnverified.begin(); it != pwallet->mapKeysUnverified.end(); it++)
+            vPubKeys.push_back(it->second);
+    }
+    if (vPubKeys.empty())
+        return;
+
+    int64_t nStart = GetTimeMicros();
+    std::vector<CPubKey> vBad;
+    pwallet->VerifyKeys(vPubKeys, vBad);
+    std::set<CPubKey> setBad(vBad.begin(), vBad.end());
+
+    // Store the good ones with a checksum, so the next load can skip them.
+    // Failed keys stay in mapKeysUnverified, which keeps them out of the key pool.
+    unsigned int nRewritten = 0;
+    {
+        LOCK(pwallet->cs_wallet);
+        // Encrypted meanwhile: the plaintext records are gone and must stay so,
+        // and the keys that failed may only have failed for that
+        if (pwallet->IsCrypted()) {
+            pwallet->mapKeysUnverified.clear();
+            return;
+        }
+        CWalletDB walletdb(pwallet->strWalletFile);
+        BOOST_FOREACH(const CPubKey& pubkey, vPubKeys) {
+            if (setBad.count(pubkey) || !pwallet->mapKeysUnverified.erase(pubkey.GetID()))
+                continue;
+            CKey key;
+            if (pwallet->GetKey(pubkey.GetID(), key) && walletdb.WriteKeyChecksummed(pubkey, key.GetPrivKey(), true))
+                nRewritten++;
+        }
+    }
+
+    LogPrintf("Checked %u wallet keys in the background in %.2fms on %d threads, %u failed, %u stored with a checksum\n",
+        vPubKeys.size(), (GetTimeMicros() - nStart) * 0.001, std::max(1, nScriptCheckThreads), vBad.size(), nRewritten);
+    BOOST_FOREACH(const CPubKey& pubkey, vBad)
+        LogPrintf("Error reading wallet database: CPrivKey for %s corrupt\n", CBitcoinAddress(pubkey.GetID()).ToString());
+    if (!vBad.empty())
+        uiInterface.ThreadSafeMessageBox(strprintf(_("Error: %u keys in wallet.dat don't match their address, see debug.log. The wallet may be corrupt: restore it from a backup."), vBad.size()),
+            "", CClientUIInterface::MSG_ERROR);
+}
+
 void ThreadFlushWalletDB(const string& strFile)
 {
     // Make this thread recognisable as the wallet flushing thread
@@ -92,6 +92,8 @@ public:
     bool EraseTx(uint256 hash);
 
     bool WriteKey(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey, const CKeyMetadata &keyMeta);
+    // The key record alone, with the checksum that lets LoadWallet skip checking the key
+    bool WriteKeyChecksummed(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey, bool fOverwrite);
     bool WriteCryptedKey(const CPubKey& vchPubKey, const std::vector<unsigned char>& vchCryptedSecret, const CKeyMetadata &keyMeta);
     bool WriteMasterKey(unsigned int nID, const CMasterKey& kMasterKey);
 
@@ -141,5 +143,7 @@ private:
 
 bool BackupWallet(const CWallet& wallet, const std::string& strDest);
 void ThreadFlushWalletDB(const std::string& strFile);
+/** Check the keys LoadWallet left in mapKeysUnverified (-walletkeycheck=1) */
+void ThreadVerifyWalletKeys(CWallet* pwallet);
 
 #endif // BITCOIN_WALLET_WALLETDB_H
\ No newline at end of file